@@ -111,14 +111,13 @@ conf_blacklist_free (void)
     }
 }
 
-/* Expand path name. The returned string must be eventually
+/* Expand file name. The returned string must be eventually
  * released with mem_free()
  */
-static const char*
-conf_expand_path (const char *path)
+static char*
+conf_expand_file (const char *path)
 {
     const char *prefix = "";
-    char       *ret;
 
     if (path[0] == '~' && (path[1] == '\0' || path[1] == '/')) {
         const char *home = os_homedir();
@@ -130,8 +129,21 @@ conf_expand_path (const char *path)
         }
     }
 
-    ret = str_concat(prefix, path, NULL);
-    ret = str_terminate(ret, '/');
+    return str_concat(prefix, path, NULL);
+}
+
+/* Expand directory path name. Unlike conf_expand_file(), it
+ * appends trailing '/', if missed. The returned string must be
+ * eventually released with mem_free()
+ */
+static const char*
+conf_expand_path (const char *path)
+{
+    char *ret = conf_expand_file(path);
+
+    if (ret != NULL) {
+        ret = str_terminate(ret, '/');
+    }
 
     return ret;
 }
@@ -195,6 +207,24 @@ conf_load_bool (const inifile_record *rec, bool *out,
     }
 }
 
+/* Parse integer option within the [min...max] range
+ */
+static void
+conf_load_int (const inifile_record *rec, int *out, int min, int max)
+{
+    unsigned long l;
+    char          *end;
+
+    l = strtoul(rec->value, &end, 10);
+    if (end == rec->value || *end != '\0' || l < (unsigned long) min ||
+        l > (unsigned long) max) {
+        conf_perror(rec, "usage: %s = %d...%d", rec->variable, min, max);
+        return;
+    }
+
+    *out = (int) l;
+}
+
 /* Parse network address with mask
  */
 static void
@@ -255,6 +285,35 @@ conf_load_netaddr (const inifile_record *rec, ip_network *net)
     net->addr.af = af;
 }
 
+/* Parse network to sweep and add it to conf.sweep_nets
+ *
+ * Sweeping large networks makes no sense, so networks with more
+ * than 65536 addresses are rejected
+ */
+static void
+conf_load_sweep_net (const inifile_record *rec)
+{
+    ip_network net;
+    size_t     len;
+    int        bits;
+
+    conf_load_netaddr(rec, &net);
+    if (net.addr.af == AF_UNSPEC) {
+        return;
+    }
+
+    bits = net.addr.af == AF_INET ? 32 : 128;
+    if (bits - net.mask > 16) {
+        conf_perror(rec, "network too large to sweep, /%d is the minimum",
+            bits - 16);
+        return;
+    }
+
+    len = mem_len(conf.sweep_nets);
+    conf.sweep_nets = mem_resize(conf.sweep_nets, len + 1, 0);
+    conf.sweep_nets[len] = net;
+}
+
 /* Load configuration from opened inifile
  */
 static void
@@ -277,7 +336,22 @@ conf_load_from_ini (inifile *ini)
                     conf_load_bool(rec, &conf.model_is_netname,
                         "network", "hardware");
                 } else if (inifile_match_name(rec->variable, "protocol")) {
-                    conf_load_bool(rec, &conf.proto_auto, "auto", "manual");
+                    if (inifile_match_name(rec->value, "auto")) {
+                        conf.proto_auto = true;
+                        conf.proto_pin = ID_PROTO_UNKNOWN;
+                    } else if (inifile_match_name(rec->value, "manual")) {
+                        conf.proto_auto = false;
+                        conf.proto_pin = ID_PROTO_UNKNOWN;
+                    } else if (inifile_match_name(rec->value, "escl")) {
+                        conf.proto_auto = true;
+                        conf.proto_pin = ID_PROTO_ESCL;
+                    } else if (inifile_match_name(rec->value, "wsd")) {
+                        conf.proto_auto = true;
+                        conf.proto_pin = ID_PROTO_WSD;
+                    } else {
+                        conf_perror(rec, "usage: %s = auto | manual | escl | wsd",
+                            rec->variable);
+                    }
                 } else if (inifile_match_name(rec->variable, "ws-discovery")) {
                     if (inifile_match_name(rec->value, "fast")) {
                         conf.wsdd_mode = WSDD_FAST;
@@ -289,6 +363,9 @@ conf_load_from_ini (inifile *ini)
                         conf_perror(rec, "usage: %s = fast | full | off",
                             rec->variable);
                     }
+                } else if (inifile_match_name(rec->variable,
+                        "ws-discovery-parallel")) {
+                    conf_load_int(rec, &conf.wsdd_parallel, 1, 256);
                 } else if (inifile_match_name(rec->variable, "socket_dir")) {
                     mem_free((char*) conf.socket_dir);
                     conf.socket_dir = conf_expand_path(rec->value);
@@ -297,6 +374,46 @@ conf_load_from_ini (inifile *ini)
                     }
                 } else if (inifile_match_name(rec->variable, "pretend-local")) {
                     conf_load_bool(rec, &conf.pretend_local, "true", "false");
+                } else if (inifile_match_name(rec->variable, "format")) {
+                    if (inifile_match_name(rec->value, "auto")) {
+                        conf.format = ID_FORMAT_UNKNOWN;
+                    } else if (inifile_match_name(rec->value, "png")) {
+                        conf.format = ID_FORMAT_PNG;
+                    } else if (inifile_match_name(rec->value, "jpeg")) {
+                        conf.format = ID_FORMAT_JPEG;
+                    } else if (inifile_match_name(rec->value, "tiff")) {
+                        conf.format = ID_FORMAT_TIFF;
+                    } else if (inifile_match_name(rec->value, "bmp")) {
+                        conf.format = ID_FORMAT_BMP;
+                    } else {
+                        conf_perror(rec,
+                            "usage: %s = auto | png | jpeg | tiff | bmp",
+                            rec->variable);
+                    }
+                } else if (inifile_match_name(rec->variable, "stats_dir")) {
+                    mem_free((char*) conf.stats_dir);
+                    conf.stats_dir = conf_expand_path(rec->value);
+                    if (conf.stats_dir == NULL) {
+                        conf_perror(rec, "failed to expand stats_dir path");
+                    }
+                } else if (inifile_match_name(rec->variable, "metrics")) {
+                    mem_free((char*) conf.metrics_file);
+                    conf.metrics_file = conf_expand_file(rec->value);
+                    if (conf.metrics_file == NULL) {
+                        conf_perror(rec, "failed to expand metrics path");
+                    }
+                } else if (inifile_match_name(rec->variable, "read_buffer")) {
+                    conf_load_int(rec, &conf.read_buffer, 0, 65536);
+                } else if (inifile_match_name(rec->variable, "spool")) {
+                    conf_load_int(rec, &conf.spool, 0, 65536);
+                } else if (inifile_match_name(rec->variable, "spool_dir")) {
+                    mem_free((char*) conf.spool_dir);
+                    conf.spool_dir = conf_expand_path(rec->value);
+                    if (conf.spool_dir == NULL) {
+                        conf_perror(rec, "failed to expand spool_dir path");
+                    }
+                } else if (inifile_match_name(rec->variable, "wsd_events")) {
+                    conf_load_bool(rec, &conf.wsd_events, "enable", "disable");
                 }
             } else if (inifile_match_name(rec->section, "debug")) {
                 if (inifile_match_name(rec->variable, "trace")) {
@@ -309,6 +426,8 @@ conf_load_from_ini (inifile *ini)
                     conf_load_bool(rec, &conf.dbg_enabled, "true", "false");
                 } else if (inifile_match_name(rec->variable, "hexdump")) {
                     conf_load_bool(rec, &conf.dbg_hexdump, "true", "false");
+                } else if (inifile_match_name(rec->variable, "timeline")) {
+                    conf_load_bool(rec, &conf.dbg_timeline, "true", "false");
                 }
             } else if (inifile_match_name(rec->section, "blacklist")) {
                 conf_blacklist *ent = NULL;
@@ -333,6 +452,16 @@ conf_load_from_ini (inifile *ini)
                     ent->next = conf.blacklist;
                     conf.blacklist = ent;
                 }
+            } else if (inifile_match_name(rec->section, "sweep")) {
+                if (inifile_match_name(rec->variable, "ip")) {
+                    conf_load_sweep_net(rec);
+                } else if (inifile_match_name(rec->variable, "rate")) {
+                    conf_load_int(rec, &conf.sweep_rate, 1, 10000);
+                } else if (inifile_match_name(rec->variable, "parallel")) {
+                    conf_load_int(rec, &conf.sweep_parallel, 1, 256);
+                } else if (inifile_match_name(rec->variable, "timeout")) {
+                    conf_load_int(rec, &conf.sweep_timeout, 50, 10000);
+                }
             }
             break;
 
@@ -356,7 +485,8 @@ conf_load_from_file (const char *name)
     }
 }
 
-/* Load configuration from the specified directory
+/* Load configuration from the specified directory, using
+ * load_file callback for each configuration file
  *
  * This function uses its path parameter as its temporary
  * buffer and doesn't guarantee to preserve its content
@@ -365,14 +495,14 @@ conf_load_from_file (const char *name)
  * value is consumed and new is returned
  */
 static char*
-conf_load_from_dir (char *path)
+conf_load_from_dir (char *path, void (*load_file) (const char *name))
 {
     path = str_terminate(path, '/');
 
     /* Load from CONFIG_AIRSCAN_CONF file */
     size_t len = mem_len(path);
     path = str_append(path, CONFIG_AIRSCAN_CONF);
-    conf_load_from_file(path);
+    load_file(path);
 
     /* Scan CONFIG_AIRSCAN_D directory */
     path = str_resize(path, len);
@@ -386,7 +516,7 @@ conf_load_from_dir (char *path)
         while ((ent = readdir(dir)) != NULL) {
             path = str_resize(path, len);
             path = str_append(path, ent->d_name);
-            conf_load_from_file(path);
+            load_file(path);
         }
 
         closedir(dir);
@@ -395,6 +525,44 @@ conf_load_from_dir (char *path)
     return path;
 }
 
+/* Load configuration from all configuration directories, using
+ * load_file callback for each configuration file
+ */
+static void
+conf_load_from_dirs (void (*load_file) (const char *name))
+{
+    char    *dir_list = str_new();
+    char    *path = str_new();
+    char    *s;
+
+    /* Look to configuration path in environment */
+    s = getenv(CONFIG_PATH_ENV);
+    if (s != NULL) {
+        dir_list = str_assign(dir_list, s);
+    }
+
+    /* Append default directories */
+    dir_list = str_terminate(dir_list, ':');
+    dir_list = str_append(dir_list, CONFIG_SANE_CONFIG_DIR);
+
+    /* Iterate over the dir_list */
+    for (s = dir_list; ; s ++) {
+        if (*s == ':' || *s == '\0') {
+            path = conf_load_from_dir(path, load_file);
+            str_trunc(path);
+        } else {
+            path = str_append_c(path, *s);
+        }
+
+        if (*s == '\0') {
+            break;
+        }
+    }
+
+    mem_free(dir_list);
+    mem_free(path);
+}
+
 /* Load configuration from environment
  */
 static void
@@ -464,38 +632,13 @@ conf_load_from_env (void)
 void
 conf_load (void)
 {
-    char    *dir_list = str_new();
-    char    *path = str_new();
-    char    *s;
-
     /* Reset the configuration */
     conf = conf_init;
     conf.socket_dir = str_dup(CONFIG_DEFAULT_SOCKET_DIR);
     devid_init();
 
-    /* Look to configuration path in environment */
-    s = getenv(CONFIG_PATH_ENV);
-    if (s != NULL) {
-        dir_list = str_assign(dir_list, s);
-    }
-
-    /* Append default directories */
-    dir_list = str_terminate(dir_list, ':');
-    dir_list = str_append(dir_list, CONFIG_SANE_CONFIG_DIR);
-
-    /* Iterate over the dir_list */
-    for (s = dir_list; ; s ++) {
-        if (*s == ':' || *s == '\0') {
-            path = conf_load_from_dir(path);
-            str_trunc(path);
-        } else {
-            path = str_append_c(path, *s);
-        }
-
-        if (*s == '\0') {
-            break;
-        }
-    }
+    /* Load configuration files */
+    conf_load_from_dirs(conf_load_from_file);
 
     /* Load configuration from environment */
     conf_load_from_env();
@@ -503,9 +646,54 @@ conf_load (void)
     /* Cleanup and exit */
     conf_device_list_revert();
     conf_blacklist_revert();
+}
 
-    mem_free(dir_list);
-    mem_free(path);
+/* Path of metrics file, found by conf_metrics_file_lookup()
+ */
+static char *conf_metrics_file_found;
+
+/* Look for the metrics path in the particular configuration file
+ */
+static void
+conf_metrics_file_from_file (const char *name)
+{
+    inifile              *ini = inifile_open(name);
+    const inifile_record *rec;
+
+    if (ini == NULL) {
+        return;
+    }
+
+    while ((rec = inifile_read(ini)) != NULL) {
+        if (rec->type == INIFILE_VARIABLE &&
+            inifile_match_name(rec->section, "options") &&
+            inifile_match_name(rec->variable, "metrics")) {
+            mem_free(conf_metrics_file_found);
+            conf_metrics_file_found = conf_expand_file(rec->value);
+        }
+    }
+
+    inifile_close(ini);
+}
+
+/* Look for the metrics file path in the configuration files.
+ *
+ * Unlike conf_load(), it doesn't touch the global conf variable
+ * and doesn't have any other side effects
+ *
+ * Returns NULL, if metrics file is not configured. The returned
+ * string must be eventually released with mem_free()
+ */
+char*
+conf_metrics_file_lookup (void)
+{
+    char *path;
+
+    conf_load_from_dirs(conf_metrics_file_from_file);
+    path = conf_metrics_file_found;
+    conf_metrics_file_found = NULL;
+
+    return path;
 }
 
 /* Free resources, allocated by conf_load, and reset configuration
@@ -516,8 +704,12 @@ conf_unload (void)
 {
     conf_device_list_free();
     conf_blacklist_free();
+    mem_free(conf.sweep_nets);
     mem_free((char*) conf.dbg_trace);
     mem_free((char*) conf.socket_dir);
+    mem_free((char*) conf.stats_dir);
+    mem_free((char*) conf.metrics_file);
+    mem_free((char*) conf.spool_dir);
     conf = conf_init;
 }
 
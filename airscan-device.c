@@ -28,6 +28,23 @@
  */
 #define DEVICE_HTTP_TIMEOUT_CANCELED_OP 10000
 
+/* Max count of device endpoints, probed in parallel
+ */
+#define DEVICE_PROBE_PARALLEL           4
+
+/* If some endpoint has been successfully probed, while more
+ * preferred endpoints are still pending, we give them a chance
+ * to complete within this interval, in milliseconds
+ */
+#define DEVICE_PROBE_PREFERRED_WAIT     250
+
+/* Per-page time budget for the image format choice, in milliseconds.
+ * Lossy format is chosen, if lossless format is expected to take
+ * that much longer to transfer and decode, and JPEG quality is
+ * lowered, if even JPEG page is expected to take that long
+ */
+#define DEVICE_FORMAT_TIME_BUDGET       1000
+
 /******************** Device management ********************/
 /* Device flags
  */
@@ -93,6 +110,26 @@ typedef enum {
     DEVICE_STM_CLOSED
 } DEVICE_STM_STATE;
 
+/* Endpoint probe state
+ */
+typedef enum {
+    DEVICE_PROBE_PENDING,
+    DEVICE_PROBE_FAILED,
+    DEVICE_PROBE_OK
+} DEVICE_PROBE_STATE;
+
+/* device_probe represents a devcaps query to the single endpoint.
+ * While device is being opened, multiple endpoints are probed
+ * in parallel, and the first successful one wins
+ */
+typedef struct {
+    device             *dev;      /* Device that owns the probe */
+    zeroconf_endpoint  *endpoint; /* Endpoint being probed */
+    DEVICE_PROBE_STATE state;     /* Probe state */
+    proto_ctx          ctx;       /* Probe's own protocol context */
+    devcaps            caps;      /* Decoded device capabilities */
+} device_probe;
+
 /* Device descriptor
  */
 struct device {
@@ -105,23 +142,35 @@ struct device {
 
     /* State machinery */
     DEVICE_STM_STATE     stm_state;         /* Device state */
+    DEVICE_STM_STATE     stm_timeline;      /* State, as seen by timeline */
     pthread_cond_t       stm_cond;          /* Signalled when state changes */
     eloop_event          *stm_cancel_event; /* Signalled to initiate cancel */
     http_query           *stm_cancel_query; /* CANCEL query */
     bool                 stm_cancel_sent;   /* Cancel was sent to device */
     eloop_timer          *stm_timer;        /* Delay timer */
+    eloop_event          *stm_resume_event; /* Signalled to resume LOAD */
+    bool                 stm_load_paused;   /* LOAD paused by read_queue
+                                               memory budget */
+    wsde_subscription    *stm_events;       /* WSD events subscription */
     struct timespec      stm_last_fail_time;/* Last failed sane_start() time */
 
     /* Protocol handling */
     proto_ctx            proto_ctx;        /* Protocol handler context */
 
     /* I/O handling (AVAHI and HTTP) */
-    zeroconf_endpoint    *endpoint_current; /* Current endpoint to probe */
+    zeroconf_endpoint    *endpoint_current; /* Endpoint in use */
+    zeroconf_endpoint    *probe_next;       /* Next endpoint to probe */
+    device_probe         **probe_table;     /* Probes, in preference order */
+    eloop_timer          *probe_timer;      /* Preferred endpoint wait timer */
 
     /* Job status */
     SANE_Status          job_status;          /* Job completion status */
     SANE_Word            job_skip_x;          /* How much pixels to skip, */
     SANE_Word            job_skip_y;          /*    from left and top */
+    timestamp            job_page_time;       /* Job start or last page
+                                                 reception time */
+    timestamp            job_rxhdr_time;      /* Image response header
+                                                 reception time */
 
     /* Image decoders */
     image_decoder        *decoders[NUM_ID_FORMAT]; /* Decoders by format */
@@ -141,7 +190,14 @@ struct device {
     SANE_Int             read_skip_bytes;    /* How many bytes to skip at line
                                                 beginning */
     bool                 read_24_to_8;       /* Resample 24 to 8 bits */
+    uint64_t             read_decode_ns;     /* CPU time spent in decoder */
+    uint64_t             read_filter_ns;     /* CPU time spent in filters */
+    uint64_t             read_filter_sample; /* Filters time of one line */
+    int                  read_filter_lines;  /* Lines filtered by this read */
     filter               *read_filters;      /* Chain of image filters */
+
+    /* Performance counters */
+    metrics              *metrics;           /* Counters of this device */
 };
 
 /* Static variables
@@ -166,7 +222,10 @@ static void
 device_scanner_capabilities_callback (void *ptr, http_query *q);
 
 static void
-device_probe_endpoint (device *dev, zeroconf_endpoint *endpoint);
+device_probe_start (device *dev);
+
+static void
+device_probe_cancel (device *dev);
 
 static void
 device_job_set_status (device *dev, SANE_Status status);
@@ -177,6 +236,9 @@ device_stm_state_get (device *dev);
 static void
 device_stm_state_set (device *dev, DEVICE_STM_STATE state);
 
+static const char*
+device_stm_state_name (DEVICE_STM_STATE state);
+
 static bool
 device_stm_cancel_perform (device *dev, SANE_Status status);
 
@@ -186,6 +248,15 @@ device_stm_op_callback (void *ptr, http_query *q);
 static void
 device_stm_cancel_event_callback (void *data);
 
+static void
+device_stm_wsde_callback (void *data, const char *event);
+
+static void
+device_stm_load_resume (device *dev);
+
+static void
+device_stm_resume_event_callback (void *data);
+
 static void
 device_read_filters_setup (device *dev);
 
@@ -211,8 +282,11 @@ device_new (zeroconf_devinfo *devinfo)
 
     dev->devinfo = devinfo;
     dev->log = log_ctx_new(dev->devinfo->name, NULL);
+    dev->metrics = metrics_get(dev->devinfo->name);
 
     log_debug(dev->log, "device created");
+    trace_event_begin(log_ctx_trace(dev->log), "device",
+        device_stm_state_name(dev->stm_state), &dev->stm_state, NULL);
 
     dev->proto_ctx.log = dev->log;
     dev->proto_ctx.devinfo = dev->devinfo;
@@ -221,6 +295,7 @@ device_new (zeroconf_devinfo *devinfo)
     devopt_init(&dev->opt);
 
     dev->proto_ctx.http = http_client_new(dev->log, dev);
+    dev->probe_table = ptr_array_new(device_probe*);
 
     pthread_cond_init(&dev->stm_cond, NULL);
 
@@ -263,12 +338,21 @@ device_free (device *dev, const char *log_msg)
     ptr_array_del(device_table, ptr_array_find(device_table, dev));
 
     /* Stop all pending I/O activity */
+    device_probe_cancel(dev);
     device_http_cancel(dev);
 
+    if (dev->stm_events != NULL) {
+        wsde_unsubscribe(dev->stm_events);
+    }
+
     if (dev->stm_cancel_event != NULL) {
         eloop_event_free(dev->stm_cancel_event);
     }
 
+    if (dev->stm_resume_event != NULL) {
+        eloop_event_free(dev->stm_resume_event);
+    }
+
     if (dev->stm_timer != NULL) {
         eloop_timer_cancel(dev->stm_timer);
     }
@@ -279,6 +363,7 @@ device_free (device *dev, const char *log_msg)
     devopt_cleanup(&dev->opt);
 
     http_client_free(dev->proto_ctx.http);
+    mem_free(dev->probe_table);
     http_uri_free(dev->proto_ctx.base_uri);
     http_uri_free(dev->proto_ctx.base_uri_nozone);
     mem_free((char*) dev->proto_ctx.location);
@@ -294,6 +379,9 @@ device_free (device *dev, const char *log_msg)
         log_debug(dev->log, "%s", log_msg);
     }
 
+    trace_event_end(log_ctx_trace(dev->log), "device",
+        device_stm_state_name(dev->stm_timeline), &dev->stm_state, NULL);
+
     log_ctx_free(dev->log);
     zeroconf_devinfo_free(dev->devinfo);
     mem_free(dev);
@@ -306,7 +394,8 @@ device_start_probing (void *data)
 {
     device      *dev = data;
 
-    device_probe_endpoint(dev, dev->devinfo->endpoints);
+    dev->probe_next = dev->devinfo->endpoints;
+    device_probe_start(dev);
 }
 
 /* Start device I/O.
@@ -319,6 +408,12 @@ device_io_start (device *dev)
         return SANE_STATUS_NO_MEM;
     }
 
+    dev->stm_resume_event = eloop_event_new(device_stm_resume_event_callback,
+        dev);
+    if (dev->stm_resume_event == NULL) {
+        return SANE_STATUS_NO_MEM;
+    }
+
     device_stm_state_set(dev, DEVICE_STM_PROBING);
     eloop_call(device_start_probing, dev);
 
@@ -376,35 +471,14 @@ device_proto_set (device *dev, ID_PROTO proto)
 /* Set base URI. `uri' ownership is taken by this function
  */
 static void
-device_proto_set_base_uri (device *dev, http_uri *uri)
-{
-    http_uri_free(dev->proto_ctx.base_uri);
-    dev->proto_ctx.base_uri = uri;
-
-    http_uri_free(dev->proto_ctx.base_uri_nozone);
-    dev->proto_ctx.base_uri_nozone = http_uri_clone(uri);
-    http_uri_strip_zone_suffux(dev->proto_ctx.base_uri_nozone);
-}
-
-/* Query device capabilities
- */
-static void
-device_proto_devcaps_submit (device *dev, void (*callback) (void*, http_query*))
+device_proto_set_base_uri (proto_ctx *ctx, http_uri *uri)
 {
-    http_query *q;
-
-    q = dev->proto_ctx.proto->devcaps_query(&dev->proto_ctx);
-    http_query_timeout(q, DEVICE_HTTP_TIMEOUT_DEVCAPS);
-    http_query_submit(q, callback);
-    dev->proto_ctx.query = q;
-}
+    http_uri_free(ctx->base_uri);
+    ctx->base_uri = uri;
 
-/* Decode device capabilities
- */
-static error
-device_proto_devcaps_decode (device *dev, devcaps *caps)
-{
-    return dev->proto_ctx.proto->devcaps_decode(&dev->proto_ctx, caps);
+    http_uri_free(ctx->base_uri_nozone);
+    ctx->base_uri_nozone = http_uri_clone(uri);
+    http_uri_strip_zone_suffux(ctx->base_uri_nozone);
 }
 
 /* http_query_onrxhdr() callback
@@ -414,8 +488,11 @@ device_proto_op_onrxhdr (void *p, http_query *q)
 {
     device *dev = p;
 
-    if (dev->proto_ctx.op == PROTO_OP_LOAD && !dev->stm_cancel_sent) {
-        http_query_timeout(q, -1);
+    if (dev->proto_ctx.op == PROTO_OP_LOAD) {
+        dev->job_rxhdr_time = timestamp_now();
+        if (!dev->stm_cancel_sent) {
+            http_query_timeout(q, -1);
+        }
     }
 }
 
@@ -463,6 +540,10 @@ device_proto_op_submit (device *dev, PROTO_OP op,
 
     log_debug(dev->log, "%s: submitting: attempt=%d",
         proto_op_name(op), dev->proto_ctx.failed_attempt);
+    if (dev->proto_ctx.failed_attempt != 0 &&
+        op == dev->proto_ctx.failed_op && op != PROTO_OP_CHECK) {
+        metrics_retry(dev->metrics, op);
+    }
     dev->proto_ctx.op = op;
 
     q = func(&dev->proto_ctx);
@@ -553,6 +634,10 @@ device_http_onerror (void *ptr, error err)
     SANE_Status status;
 
     status = err == ERROR_ENOMEM ? SANE_STATUS_NO_MEM : SANE_STATUS_IO_ERROR;
+    if (err != ERROR_ENOMEM) {
+        epstat_failed(dev->endpoint_current->uri);
+    }
+    metrics_http_error(dev->metrics, dev->proto_ctx.op);
 
     log_debug(dev->log, "cancelling job due to error: %s", ESTRING(err));
 
@@ -567,25 +652,219 @@ device_http_onerror (void *ptr, error err)
 }
 
 /******************** Protocol initialization ********************/
-/* Probe next device address
+/* Create new probe for the endpoint and submit devcaps query
  */
 static void
-device_probe_endpoint (device *dev, zeroconf_endpoint *endpoint)
+device_probe_submit (device *dev, zeroconf_endpoint *endpoint)
 {
-    /* Switch endpoint */
+    device_probe *probe = mem_new(device_probe, 1);
+    http_query   *q;
+
     log_assert(dev->log, endpoint->proto != ID_PROTO_UNKNOWN);
 
-    if (dev->endpoint_current == NULL ||
-        dev->endpoint_current->proto != endpoint->proto) {
-        device_proto_set(dev, endpoint->proto);
+    probe->dev = dev;
+    probe->endpoint = endpoint;
+    probe->state = DEVICE_PROBE_PENDING;
+
+    devcaps_init(&probe->caps);
+
+    probe->ctx.log = dev->log;
+    probe->ctx.devinfo = dev->devinfo;
+    probe->ctx.devcaps = &probe->caps;
+    probe->ctx.proto = proto_handler_new(endpoint->proto);
+    log_assert(dev->log, probe->ctx.proto != NULL);
+    probe->ctx.http = http_client_new(dev->log, probe);
+    device_proto_set_base_uri(&probe->ctx, http_uri_clone(endpoint->uri));
+
+    dev->probe_table = ptr_array_append(dev->probe_table, probe);
+
+    log_debug(dev->log, "probing %s endpoint: %s",
+        probe->ctx.proto->name, http_uri_str(endpoint->uri));
+
+    q = probe->ctx.proto->devcaps_query(&probe->ctx);
+    http_query_timeout(q, DEVICE_HTTP_TIMEOUT_DEVCAPS);
+    http_query_submit(q, device_scanner_capabilities_callback);
+    probe->ctx.query = q;
+}
+
+/* Free the probe. Pending query, if any, is cancelled
+ */
+static void
+device_probe_free (device_probe *probe)
+{
+    http_client_cancel(probe->ctx.http);
+    http_client_free(probe->ctx.http);
+
+    if (probe->ctx.proto != NULL) {
+        proto_handler_free(probe->ctx.proto);
     }
 
-    dev->endpoint_current = endpoint;
+    http_uri_free(probe->ctx.base_uri);
+    http_uri_free(probe->ctx.base_uri_nozone);
+    devcaps_cleanup(&probe->caps);
+
+    mem_free(probe);
+}
+
+/* Cancel all probes in progress
+ */
+static void
+device_probe_cancel (device *dev)
+{
+    device_probe *probe;
 
-    device_proto_set_base_uri(dev, http_uri_clone(endpoint->uri));
+    while ((probe = ptr_array_del(dev->probe_table, 0)) != NULL) {
+        device_probe_free(probe);
+    }
 
-    /* Fetch device capabilities */
-    device_proto_devcaps_submit (dev, device_scanner_capabilities_callback);
+    if (dev->probe_timer != NULL) {
+        eloop_timer_cancel(dev->probe_timer);
+        dev->probe_timer = NULL;
+    }
+
+    dev->probe_next = NULL;
+}
+
+/* Settle on the successfully probed endpoint and finish probing
+ */
+static void
+device_probe_settle (device *dev, device_probe *winner)
+{
+    ptr_array_del(dev->probe_table, ptr_array_find(dev->probe_table, winner));
+    device_probe_cancel(dev);
+
+    log_debug(dev->log, "using endpoint: %s",
+        http_uri_str(winner->endpoint->uri));
+
+    /* Take protocol handler, base URI and capabilities from the probe */
+    device_proto_set(dev, ID_PROTO_UNKNOWN);
+    dev->proto_ctx.proto = winner->ctx.proto;
+    winner->ctx.proto = NULL;
+    log_debug(dev->log, "using protocol \"%s\"", dev->proto_ctx.proto->name);
+
+    device_proto_set_base_uri(&dev->proto_ctx, winner->ctx.base_uri);
+    winner->ctx.base_uri = NULL;
+
+    devcaps_cleanup(&dev->opt.caps);
+    dev->opt.caps = winner->caps;
+    memset(&winner->caps, 0, sizeof(winner->caps));
+
+    dev->endpoint_current = winner->endpoint;
+    device_probe_free(winner);
+
+    devcaps_dump(dev->log, &dev->opt.caps, true);
+    devopt_set_defaults(&dev->opt);
+
+    device_stm_state_set(dev, DEVICE_STM_IDLE);
+    http_client_onerror(dev->proto_ctx.http, device_http_onerror);
+
+    /* WSD devices may notify us about status changes, so we don't
+     * need to wait for the next retry to notice them
+     */
+    if (dev->endpoint_current->proto == ID_PROTO_WSD) {
+        dev->stm_events = wsde_subscribe(dev->log, dev->proto_ctx.base_uri,
+            device_stm_wsde_callback, dev);
+    }
+}
+
+/* probe_timer callback
+ */
+static void
+device_probe_timer_callback (void *data)
+{
+    device       *dev = data;
+    size_t       i, len = mem_len(dev->probe_table);
+
+    dev->probe_timer = NULL;
+
+    /* Settle on the most preferred of successful endpoints. More
+     * preferred endpoints, still pending, are counted as failed,
+     * so endpoint statistics will lower their preference next time
+     */
+    for (i = 0; i < len; i ++) {
+        device_probe *probe = dev->probe_table[i];
+        if (probe->state == DEVICE_PROBE_OK) {
+            log_debug(dev->log, "preferred endpoints didn't respond in time");
+            device_probe_settle(dev, probe);
+            return;
+        }
+
+        if (probe->state == DEVICE_PROBE_PENDING) {
+            epstat_failed(probe->endpoint->uri);
+        }
+    }
+
+    log_internal_error(dev->log);
+}
+
+/* Check probing progress and make a decision, what to do next:
+ *   - settle on successful endpoint, if no more preferred
+ *     endpoints remain pending
+ *   - wait a bit for more preferred endpoints, if some less
+ *     preferred endpoint already succeeded
+ *   - start more probes, if we have free slots
+ *   - fail probing, if nothing left to try
+ */
+static void
+device_probe_start (device *dev)
+{
+    size_t       i, len = mem_len(dev->probe_table);
+    device_probe *first = NULL;
+    bool         have_ok = false;
+    int          pending = 0;
+
+    for (i = 0; i < len; i ++) {
+        device_probe *probe = dev->probe_table[i];
+
+        switch (probe->state) {
+        case DEVICE_PROBE_PENDING:
+            pending ++;
+            break;
+
+        case DEVICE_PROBE_OK:
+            have_ok = true;
+            break;
+
+        case DEVICE_PROBE_FAILED:
+            continue;
+        }
+
+        if (first == NULL) {
+            first = probe;
+        }
+    }
+
+    /* The most preferred of remaining endpoints succeeded? Note,
+     * endpoints not probed yet are always less preferred that
+     * endpoints already in the probe_table
+     */
+    if (first != NULL && first->state == DEVICE_PROBE_OK) {
+        device_probe_settle(dev, first);
+        return;
+    }
+
+    /* Some less preferred endpoint succeeded? */
+    if (have_ok) {
+        if (dev->probe_timer == NULL) {
+            dev->probe_timer = eloop_timer_new(DEVICE_PROBE_PREFERRED_WAIT,
+                device_probe_timer_callback, dev);
+        }
+        return;
+    }
+
+    /* Start more probes */
+    while (pending < DEVICE_PROBE_PARALLEL && dev->probe_next != NULL) {
+        zeroconf_endpoint *endpoint = dev->probe_next;
+
+        dev->probe_next = endpoint->next;
+        device_probe_submit(dev, endpoint);
+        pending ++;
+    }
+
+    if (pending == 0) {
+        device_probe_cancel(dev);
+        device_stm_state_set(dev, DEVICE_STM_PROBING_FAILED);
+    }
 }
 
 /* Scanner capabilities fetch callback
@@ -594,9 +873,13 @@ static void
 device_scanner_capabilities_callback (void *ptr, http_query *q)
 {
     error        err   = NULL;
-    device       *dev = ptr;
+    device_probe *probe = ptr;
+    device       *dev = probe->dev;
+    proto_ctx    *ctx = &probe->ctx;
 
     /* Check request status */
+    epstat_update(probe->endpoint->uri, q);
+    metrics_http_query(dev->metrics, PROTO_OP_NONE, probe->endpoint->uri, q);
     err = http_query_error(q);
     if (err != NULL) {
         err = eloop_eprintf("scanner capabilities query: %s", ESTRING(err));
@@ -604,20 +887,18 @@ device_scanner_capabilities_callback (void *ptr, http_query *q)
     }
 
     /* Parse XML response */
-    err = device_proto_devcaps_decode (dev, &dev->opt.caps);
+    ctx->query = q;
+    err = ctx->proto->devcaps_decode(ctx, &probe->caps);
     if (err != NULL) {
         err = eloop_eprintf("scanner capabilities: %s", err);
         goto DONE;
     }
 
-    devcaps_dump(dev->log, &dev->opt.caps, true);
-    devopt_set_defaults(&dev->opt);
-
     /* Update endpoint address in case of HTTP redirection */
     if (!http_uri_equal(http_query_uri(q), http_query_real_uri(q))) {
         const char *uri_str = http_uri_str(http_query_uri(q));
         const char *real_uri_str = http_uri_str(http_query_real_uri(q));
-        const char *base_str = http_uri_str(dev->proto_ctx.base_uri);
+        const char *base_str = http_uri_str(ctx->base_uri);
 
         if (str_has_prefix(uri_str, base_str)) {
             const char *tail = uri_str + strlen(base_str);
@@ -637,26 +918,24 @@ device_scanner_capabilities_callback (void *ptr, http_query *q)
                 new_uri = http_uri_new(new_uri_str, true);
                 log_assert(dev->log, new_uri != NULL);
 
-                device_proto_set_base_uri(dev, new_uri);
+                device_proto_set_base_uri(ctx, new_uri);
             }
         }
     }
 
     /* Cleanup and exit */
 DONE:
-    if (err != NULL) {
-        log_debug(dev->log, ESTRING(err));
+    ctx->query = NULL;
 
-        if (dev->endpoint_current != NULL &&
-            dev->endpoint_current->next != NULL) {
-            device_probe_endpoint(dev, dev->endpoint_current->next);
-        } else {
-            device_stm_state_set(dev, DEVICE_STM_PROBING_FAILED);
-        }
+    if (err != NULL) {
+        log_debug(dev->log, "%s: %s",
+            http_uri_str(probe->endpoint->uri), ESTRING(err));
+        probe->state = DEVICE_PROBE_FAILED;
     } else {
-        device_stm_state_set(dev, DEVICE_STM_IDLE);
-        http_client_onerror(dev->proto_ctx.http, device_http_onerror);
+        probe->state = DEVICE_PROBE_OK;
     }
+
+    device_probe_start(dev);
 }
 
 /******************** Scan state machinery ********************/
@@ -709,8 +988,21 @@ device_stm_state_set (device *dev, DEVICE_STM_STATE state)
     DEVICE_STM_STATE old_state = device_stm_state_get(dev);
 
     if (old_state != state) {
+        trace *t = log_ctx_trace(dev->log);
+
         log_debug(dev->log, "%s->%s",
             device_stm_state_name(old_state), device_stm_state_name(state));
+        AIRSCAN_PROBE(device_state, dev->devinfo->name,
+            device_stm_state_name(old_state), device_stm_state_name(state));
+
+        /* Note, device_stm_cancel_req() changes state without
+         * us, so the timeline may lag behind the old_state
+         */
+        trace_event_end(t, "device", device_stm_state_name(dev->stm_timeline),
+            &dev->stm_state, NULL);
+        trace_event_begin(t, "device", device_stm_state_name(state),
+            &dev->stm_state, NULL);
+        dev->stm_timeline = state;
 
         __atomic_store_n(&dev->stm_state, state, __ATOMIC_SEQ_CST);
         pthread_cond_broadcast(&dev->stm_cond);
@@ -718,6 +1010,11 @@ device_stm_state_set (device *dev, DEVICE_STM_STATE state)
         if (!device_stm_state_working(dev)) {
             pollable_signal(dev->read_pollable);
         }
+
+        if (state == DEVICE_STM_DONE) {
+            metrics_job(dev->metrics, dev->job_status);
+            metrics_save();
+        }
     }
 }
 
@@ -775,6 +1072,7 @@ device_stm_cancel_perform (device *dev, SANE_Status status)
             http_query_submit(dev->stm_cancel_query, device_stm_cancel_callback);
 
             dev->stm_cancel_sent = true;
+            device_stm_load_resume(dev);
         }
         return true;
     }
@@ -815,6 +1113,69 @@ device_stm_cancel_req (device *dev, const char *reason)
     }
 }
 
+/* Check if PROTO_OP_LOAD must be paused, because read_queue
+ * exceeds its memory budget. Once cancel is sent, the job
+ * is never paused, so it can finish
+ */
+static bool
+device_stm_load_throttled (device *dev)
+{
+    uint64_t budget = (uint64_t) conf.read_buffer * 1024 * 1024;
+
+    return budget != 0 && !dev->stm_cancel_sent &&
+           (uint64_t) http_data_queue_bytes(dev->read_queue) >= budget;
+}
+
+/* Submit next operation of the job. PROTO_OP_LOAD is paused
+ * instead, if read_queue exceeds its memory budget, and resumed
+ * by device_stm_load_resume(), when reader catches up
+ */
+static void
+device_stm_op_next (device *dev, PROTO_OP op)
+{
+    if (op == PROTO_OP_LOAD && device_stm_load_throttled(dev)) {
+        log_debug(dev->log, "%s: paused: %zu bytes queued, budget %d MiB",
+            proto_op_name(op), http_data_queue_bytes(dev->read_queue),
+            conf.read_buffer);
+        trace_event_begin(log_ctx_trace(dev->log), "device", "paused",
+            &dev->stm_load_paused, NULL);
+        metrics_load_paused(dev->metrics);
+
+        dev->proto_ctx.op = op;
+        dev->stm_load_paused = true;
+        return;
+    }
+
+    device_proto_op_submit(dev, op, device_stm_op_callback);
+}
+
+/* Resume paused PROTO_OP_LOAD, if read_queue is within its
+ * memory budget
+ */
+static void
+device_stm_load_resume (device *dev)
+{
+    if (dev->stm_load_paused && !device_stm_load_throttled(dev)) {
+        log_debug(dev->log, "%s: resumed: %zu bytes queued",
+            proto_op_name(dev->proto_ctx.op),
+            http_data_queue_bytes(dev->read_queue));
+        trace_event_end(log_ctx_trace(dev->log), "device", "paused",
+            &dev->stm_load_paused, NULL);
+
+        dev->stm_load_paused = false;
+        device_proto_op_submit(dev, dev->proto_ctx.op, device_stm_op_callback);
+    }
+}
+
+/* stm_resume_event callback
+ */
+static void
+device_stm_resume_event_callback (void *data)
+{
+    device *dev = data;
+    device_stm_load_resume(dev);
+}
+
 /* stm_timer callback
  */
 static void
@@ -822,7 +1183,72 @@ device_stm_timer_callback (void *data)
 {
     device *dev = data;
     dev->stm_timer = NULL;
-    device_proto_op_submit(dev, dev->proto_ctx.op, device_stm_op_callback);
+    device_stm_op_next(dev, dev->proto_ctx.op);
+}
+
+/* WSD events callback
+ *
+ * If we are waiting for the retry, and device reports some
+ * change in its status, don't wait anymore and retry immediately
+ */
+static void
+device_stm_wsde_callback (void *data, const char *event)
+{
+    device *dev = data;
+
+    if (dev->stm_timer != NULL) {
+        log_debug(dev->log, "%s: retrying %s immediately", event,
+            proto_op_name(dev->proto_ctx.op));
+        eloop_timer_cancel(dev->stm_timer);
+        device_stm_timer_callback(dev);
+    }
+}
+
+/* Get count of pixels in the image, requested by the current job
+ */
+static uint64_t
+device_job_pixels (device *dev)
+{
+    proto_scan_params *params = &dev->proto_ctx.params;
+    SANE_Word         units = dev->opt.caps.units;
+    uint64_t          wid, hei;
+
+    wid = (uint64_t) math_muldiv(params->wid, params->x_res, units);
+    hei = (uint64_t) math_muldiv(params->hei, params->y_res, units);
+
+    return wid * hei;
+}
+
+/* Get count of samples (pixels * channels) in the image, requested
+ * by the current job
+ */
+static uint64_t
+device_job_samples (device *dev)
+{
+    uint64_t samples = device_job_pixels(dev);
+
+    if (dev->proto_ctx.params.colormode == ID_COLORMODE_COLOR) {
+        samples *= 3;
+    }
+
+    return samples;
+}
+
+/* Update protocol and endpoint statistics by the received page
+ */
+static void
+device_proto_stat_page (device *dev, http_query *q, http_data *image)
+{
+    timestamp now = timestamp_now();
+
+    epstat_proto_update(dev->devinfo->model, dev->endpoint_current->proto,
+        device_job_pixels(dev), image->size, now - dev->job_page_time,
+        now - http_query_timestamp(q));
+
+    epstat_bw_update(dev->endpoint_current->uri, image->size,
+        now - dev->job_rxhdr_time);
+
+    dev->job_page_time = now;
 }
 
 /* Operation callback
@@ -833,7 +1259,9 @@ device_stm_op_callback (void *ptr, http_query *q)
     device       *dev = ptr;
     proto_result result = device_proto_op_decode(dev, dev->proto_ctx.op);
 
-    (void) q;
+    epstat_update(dev->endpoint_current->uri, q);
+    metrics_http_query(dev->metrics, dev->proto_ctx.op,
+        dev->endpoint_current->uri, q);
 
     if (result.err != NULL) {
         log_debug(dev->log, "%s", ESTRING(result.err));
@@ -849,7 +1277,10 @@ device_stm_op_callback (void *ptr, http_query *q)
         }
     } else if (dev->proto_ctx.op == PROTO_OP_LOAD) {
         if (result.data.image != NULL) {
+            device_proto_stat_page(dev, q, result.data.image);
             http_data_queue_push(dev->read_queue, result.data.image);
+            metrics_queue_push(dev->metrics, result.data.image->size,
+                http_data_queue_len(dev->read_queue));
             dev->proto_ctx.images_received ++;
             pollable_signal(dev->read_pollable);
 
@@ -915,7 +1346,7 @@ device_stm_op_callback (void *ptr, http_query *q)
     }
 
     /* Submit next operation */
-    device_proto_op_submit(dev, result.next, device_stm_op_callback);
+    device_stm_op_next(dev, result.next);
 }
 
 /* Geometrical scan parameters
@@ -983,11 +1414,19 @@ device_geom_compute (SANE_Fixed tl, SANE_Fixed br,
 }
 
 /* Choose image format
+ *
+ * If format is configured and supported by device, it is used.
+ * Otherwise, if link bandwidth is known from the previous pages,
+ * time to transfer and decode the image is estimated for each format,
+ * and lossless format is preferred, unless lossy format saves
+ * a considerable amount of time. If bandwidth is not known yet,
+ * formats are chosen in the fixed order of preference
  */
 static ID_FORMAT
 device_choose_format (device *dev, devcaps_source *src)
 {
     unsigned int           formats = src->formats & DEVCAPS_FORMATS_SUPPORTED;
+    unsigned int           bw = epstat_bw(dev->endpoint_current->uri);
     size_t                 i;
     static const ID_FORMAT use[] = {
         ID_FORMAT_PNG,
@@ -996,6 +1435,45 @@ device_choose_format (device *dev, devcaps_source *src)
         ID_FORMAT_BMP
     };
 
+    if (conf.format != ID_FORMAT_UNKNOWN &&
+        (formats & (1 << conf.format)) != 0) {
+        return conf.format;
+    }
+
+    if (bw != 0) {
+        uint64_t  samples = device_job_samples(dev);
+        ID_FORMAT lossless = ID_FORMAT_UNKNOWN;
+        uint64_t  lossless_est = 0, lossy_est;
+
+        for (i = 0; i < sizeof(use)/sizeof(use[0]); i ++) {
+            ID_FORMAT fmt = use[i];
+            if (fmt != ID_FORMAT_JPEG && (formats & (1 << fmt)) != 0) {
+                uint64_t est = epstat_format_estimate(fmt, samples, bw);
+                if (lossless == ID_FORMAT_UNKNOWN || est < lossless_est) {
+                    lossless = fmt;
+                    lossless_est = est;
+                }
+            }
+        }
+
+        if (lossless != ID_FORMAT_UNKNOWN &&
+            (formats & (1 << ID_FORMAT_JPEG)) != 0) {
+            lossy_est = epstat_format_estimate(ID_FORMAT_JPEG, samples, bw);
+
+            log_debug(dev->log, "format choice: bandwidth=%u bytes/s, "
+                "%s=%d ms, JPEG=%d ms", bw, id_format_short_name(lossless),
+                (int) lossless_est, (int) lossy_est);
+
+            if (lossless_est > lossy_est + DEVICE_FORMAT_TIME_BUDGET) {
+                return ID_FORMAT_JPEG;
+            }
+        }
+
+        if (lossless != ID_FORMAT_UNKNOWN) {
+            return lossless;
+        }
+    }
+
     for (i = 0; i < sizeof(use)/sizeof(use[0]); i ++) {
         ID_FORMAT fmt = use[i];
         if ((formats & (1 << fmt)) != 0) {
@@ -1007,6 +1485,32 @@ device_choose_format (device *dev, devcaps_source *src)
     return ID_FORMAT_UNKNOWN;
 }
 
+/* Choose compression factor, for devices that support it
+ *
+ * If the format is JPEG or TIFF (which can have embedded JPEG),
+ * quality is prioritized over size, unless link is so slow, that
+ * page transfer is expected to exceed the time budget
+ */
+static int
+device_choose_compression (device *dev)
+{
+    const devcaps     *caps = &dev->opt.caps;
+    proto_scan_params *params = &dev->proto_ctx.params;
+    unsigned int      bw;
+
+    if (params->format != ID_FORMAT_JPEG && params->format != ID_FORMAT_TIFF) {
+        return caps->compression_norm;
+    }
+
+    bw = epstat_bw(dev->endpoint_current->uri);
+    if (bw != 0 && epstat_format_estimate(params->format,
+            device_job_samples(dev), bw) > DEVICE_FORMAT_TIME_BUDGET) {
+        return caps->compression_norm;
+    }
+
+    return caps->compression_range.min;
+}
+
 /* Request scan
  */
 static void
@@ -1042,6 +1546,9 @@ device_stm_start_scan (device *dev)
     params->colormode = dev->opt.colormode_real;
     params->scanintent = dev->opt.scanintent;
     params->format = device_choose_format(dev, src);
+    if (dev->opt.caps.compression_ok) {
+        params->compression = device_choose_compression(dev);
+    }
 
     /* Dump parameters */
     log_trace(dev->log, "==============================");
@@ -1069,9 +1576,13 @@ device_stm_start_scan (device *dev)
     log_trace(dev->log, "  y_resolution:   %d", params->y_res);
     log_trace(dev->log, "  format:         %s",
             id_format_short_name(params->format));
+    if (dev->opt.caps.compression_ok) {
+        log_trace(dev->log, "  compression:    %d", params->compression);
+    }
     log_trace(dev->log, "");
 
     /* Submit a request */
+    dev->job_page_time = timestamp_now();
     device_stm_state_set(dev, DEVICE_STM_SCANNING);
     if (dev->proto_ctx.proto->precheck_query != NULL) {
         device_proto_op_submit(dev, PROTO_OP_PRECHECK, device_stm_op_callback);
@@ -1130,6 +1641,8 @@ device_job_set_status (device *dev, SANE_Status status)
 
         if (status == SANE_STATUS_CANCELLED) {
             http_data_queue_purge(dev->read_queue);
+            metrics_queue_purge(dev->metrics);
+            device_stm_load_resume(dev);
         }
     }
 }
@@ -1211,6 +1724,7 @@ device_close (device *dev, const char *log_msg)
     /* Close the device */
     device_stm_state_set(dev, DEVICE_STM_CLOSED);
     device_free(dev, log_msg);
+    metrics_save();
 }
 
 /* Get option descriptor
@@ -1291,6 +1805,13 @@ device_start_wait (device *dev)
             break;
 
         case DEVICE_STM_DONE:
+            /* If job has finished before we had a chance to notice
+             * it has started, images, received so far, are still
+             * delivered; job status will be returned afterwards
+             */
+            if (http_data_queue_len(dev->read_queue) > 0) {
+                return SANE_STATUS_GOOD;
+            }
             return dev->job_status;
 
         default:
@@ -1337,6 +1858,7 @@ device_start_new_job (device *dev)
     device_start_retry_pause(dev);
 
     dev->stm_cancel_sent = false;
+    dev->stm_load_paused = false;
     dev->job_status = SANE_STATUS_GOOD;
     mem_free((char*) dev->proto_ctx.location);
     dev->proto_ctx.location = NULL;
@@ -1501,6 +2023,37 @@ device_read_filters_cleanup (device *dev)
     dev->read_filters = NULL;
 }
 
+/* Get CPU time, consumed by the calling thread, in nanoseconds
+ */
+static uint64_t
+device_read_cputime (void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return (uint64_t) t.tv_sec * 1000000000 + (uint64_t) t.tv_nsec;
+}
+
+/* Update image format statistics, when image is fully decoded
+ */
+static void
+device_read_stat_image (device *dev)
+{
+    uint64_t samples;
+
+    samples = (uint64_t) dev->read_line_end *
+              (uint64_t) dev->read_line_real_wid;
+
+    if (dev->read_24_to_8 || dev->opt.params.format == SANE_FRAME_RGB) {
+        samples *= 3;
+    }
+
+    epstat_format_update(dev->proto_ctx.format_detected, samples,
+        dev->read_image->size, dev->read_decode_ns);
+    metrics_image(dev->metrics, dev->proto_ctx.format_detected,
+        dev->read_image->size, dev->read_decode_ns, dev->read_filter_ns);
+}
+
 /* Pull next image from the read queue and start decoding
  */
 static SANE_Status
@@ -1519,6 +2072,13 @@ device_read_next (device *dev)
         return SANE_STATUS_EOF;
     }
 
+    metrics_queue_pull(dev->metrics, dev->read_image->size);
+    dev->read_filter_ns = 0;
+
+    if (dev->stm_load_paused) {
+        eloop_event_trigger(dev->stm_resume_event);
+    }
+
     /* Guess format and choose decoder */
     dev->proto_ctx.format_detected =
         image_format_detect(dev->read_image->bytes, dev->read_image->size);
@@ -1536,8 +2096,14 @@ device_read_next (device *dev)
     }
 
     /* Start new image decoding */
+    trace_event_begin(log_ctx_trace(dev->log), "image", "decode",
+        &dev->read_image,
+        id_format_short_name(dev->proto_ctx.format_detected));
+
+    dev->read_decode_ns = device_read_cputime();
     err = image_decoder_begin(decoder,
             dev->read_image->bytes, dev->read_image->size);
+    dev->read_decode_ns = device_read_cputime() - dev->read_decode_ns;
 
     if (err != NULL) {
         goto DONE;
@@ -1663,6 +2229,8 @@ device_read_next (device *dev)
 DONE:
     if (err != NULL) {
         log_debug(dev->log, ESTRING(err));
+        trace_event_end(log_ctx_trace(dev->log), "image", "decode",
+            &dev->read_image, ESTRING(err));
         http_data_unref(dev->read_image);
         dev->read_image = NULL;
         return SANE_STATUS_IO_ERROR;
@@ -1676,27 +2244,9 @@ DONE:
 static void
 device_read_24_to_8_resample (device *dev)
 {
-    int i, len = dev->read_line_real_wid;
-    uint8_t *in = dev->read_line_buf;
-    uint8_t *out = dev->read_line_buf;
+    int len = dev->read_line_real_wid;
 
-    for (i = 0; i < len; i ++) {
-        /* Y = R * 0.299 + G * 0.587 + B * 0.114
-         *
-         * 16777216 == 1 << 24
-         * 16777216 * 0.299 == 5016387.584 ~= 5016387
-         * 16777216 * 0.587 == 9848225.792 ~= 9848226
-         * 16777216 * 0.114 == 1912602.624 ~= 1912603
-         *
-         * 5016387 + 9848226 + 1912603 == 16777216
-         */
-        unsigned long Y;
-
-        Y = 5016387 * (unsigned long) *in ++;
-        Y += 9848226 * (unsigned long) *in ++;
-        Y += 1912603 * (unsigned long) *in ++;
-        *out ++ = (Y + (1 << 23)) >> 24;
-    }
+    image_resample_24_to_8(dev->read_line_buf, len);
 
     if (len < dev->opt.params.bytes_per_line) {
         memset(dev->read_line_buf + len, 0xff,
@@ -1734,7 +2284,11 @@ device_read_decode_line (device *dev)
         memset(dev->read_line_buf + dev->read_skip_bytes, 0xff,
             dev->opt.params.bytes_per_line);
     } else {
-        error err = image_decoder_read_line(decoder, dev->read_line_buf);
+        error err;
+
+        AIRSCAN_PROBE(decode_line_begin, dev->devinfo->name, n);
+        err = image_decoder_read_line(decoder, dev->read_line_buf);
+        AIRSCAN_PROBE(decode_line_end, dev->devinfo->name, n);
 
         if (err != NULL) {
             log_debug(dev->log, ESTRING(err));
@@ -1746,8 +2300,20 @@ device_read_decode_line (device *dev)
         }
     }
 
-    filter_chain_apply(dev->read_filters,
-            dev->read_line_buf, dev->opt.params.bytes_per_line);
+    /* Filters cost is the same for each line, so only the first
+     * line of each device_read() call is timed
+     */
+    if (dev->read_filters != NULL && dev->read_filter_lines ++ == 0) {
+        uint64_t t = device_read_cputime();
+
+        filter_chain_apply(dev->read_filters,
+                dev->read_line_buf, dev->opt.params.bytes_per_line);
+
+        dev->read_filter_sample = device_read_cputime() - t;
+    } else if (dev->read_filters != NULL) {
+        filter_chain_apply(dev->read_filters,
+                dev->read_line_buf, dev->opt.params.bytes_per_line);
+    }
 
     dev->read_line_off = 0;
     dev->read_line_num ++;
@@ -1763,6 +2329,8 @@ device_read (device *dev, SANE_Byte *data, SANE_Int max_len, SANE_Int *len_out)
     SANE_Int      len = 0;
     SANE_Status   status = SANE_STATUS_GOOD;
     image_decoder *decoder = dev->decoders[dev->proto_ctx.format_detected];
+    uint64_t      blocked_ns = 0;
+    uint64_t      cputime, filter_ns;
 
     if (len_out != NULL) {
         *len_out = 0; /* Must return 0, if status is not GOOD */
@@ -1791,7 +2359,13 @@ device_read (device *dev, SANE_Byte *data, SANE_Int max_len, SANE_Int *len_out)
                 return SANE_STATUS_GOOD;
             }
 
+            trace_event_begin(log_ctx_trace(dev->log), "read", "blocked",
+                &dev->read_pollable, NULL);
+            blocked_ns -= metrics_clock();
             eloop_cond_wait(&dev->stm_cond);
+            blocked_ns += metrics_clock();
+            trace_event_end(log_ctx_trace(dev->log), "read", "blocked",
+                &dev->read_pollable, NULL);
         }
 
         if (dev->job_status == SANE_STATUS_CANCELLED) {
@@ -1805,13 +2379,22 @@ device_read (device *dev, SANE_Byte *data, SANE_Int max_len, SANE_Int *len_out)
             goto DONE;
         }
 
+        AIRSCAN_PROBE(read_next_begin, dev->devinfo->name);
         status = device_read_next(dev);
+        AIRSCAN_PROBE(read_next_end, dev->devinfo->name, (int) status);
         if (status != SANE_STATUS_GOOD) {
             goto DONE;
         }
     }
 
-    /* Read line by line */
+    /* Read line by line. CPU time is measured once per call, not
+     * per line, as reading of the thread CPU clock is a system call.
+     * Time of filters, if any, is estimated from a single line and
+     * excluded from the decoding time
+     */
+    cputime = device_read_cputime();
+    dev->read_filter_lines = 0;
+
     for (len = 0; status == SANE_STATUS_GOOD && len < max_len; ) {
         if (dev->read_line_off == dev->opt.params.bytes_per_line) {
             status = device_read_decode_line(dev);
@@ -1828,6 +2411,15 @@ device_read (device *dev, SANE_Byte *data, SANE_Int max_len, SANE_Int *len_out)
         }
     }
 
+    cputime = device_read_cputime() - cputime;
+    filter_ns = dev->read_filter_sample * (uint64_t) dev->read_filter_lines;
+    if (filter_ns > cputime) {
+        filter_ns = cputime;
+    }
+
+    dev->read_filter_ns += filter_ns;
+    dev->read_decode_ns += cputime - filter_ns;
+
     if (status == SANE_STATUS_IO_ERROR) {
         device_job_set_status(dev, SANE_STATUS_IO_ERROR);
         device_stm_cancel_req(dev, "I/O error");
@@ -1839,6 +2431,9 @@ DONE:
         status = SANE_STATUS_GOOD;
     }
 
+    metrics_read(dev->metrics, status == SANE_STATUS_GOOD ? len : 0,
+        blocked_ns);
+
     if (status == SANE_STATUS_GOOD) {
         *len_out = len;
         return SANE_STATUS_GOOD;
@@ -1849,6 +2444,11 @@ DONE:
     image_decoder_reset(decoder);
 
     if (dev->read_image != NULL) {
+        if (status == SANE_STATUS_EOF) {
+            device_read_stat_image(dev);
+        }
+        trace_event_end(log_ctx_trace(dev->log), "image", "decode",
+            &dev->read_image, sane_strstatus(status));
         http_data_unref(dev->read_image);
         dev->read_image = NULL;
     }
@@ -134,8 +134,10 @@ eloop_poll_func (struct pollfd *ufds, unsigned int nfds, int timeout,
 
     eloop_poll_restart = false;
 
+    AIRSCAN_PROBE(eloop_sleep, nfds, timeout);
     pthread_mutex_unlock(&eloop_mutex);
     rc = poll(ufds, nfds, timeout);
+    AIRSCAN_PROBE(eloop_wakeup, rc);
     pthread_mutex_lock(&eloop_mutex);
 
     /* Avahi multithreading support is semi-broken. Though new
@@ -0,0 +1,848 @@
+/* AirScan (a.k.a. eSCL) backend for SANE
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * Performance statistics: endpoints, protocols and image formats
+ */
+
+#include "airscan.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Fixed-point scale of smoothed values
+ */
+#define EPSTAT_SCALE            1024
+
+/* Weight of the new sample in the smoothed value is 1/EPSTAT_SMOOTH
+ */
+#define EPSTAT_SMOOTH           4
+
+/* Assumed connect time of endpoint without statistics, in milliseconds.
+ * So endpoints we know nothing about are preferred over endpoints,
+ * known to be slow or unreliable, but not over known-good endpoints
+ */
+#define EPSTAT_RTT_UNKNOWN      50
+
+/* Endpoints with connect time below this value, in milliseconds,
+ * considered equally fast. Above this value, endpoints are ranked
+ * by powers of 2 of their scores, so small jitter doesn't reorder
+ * endpoints
+ */
+#define EPSTAT_RTT_FAST         10
+
+/* Penalty for failures, in milliseconds. Score of endpoint that
+ * always fails is its connect time plus this value
+ */
+#define EPSTAT_FAIL_PENALTY     5000
+
+/* Max number of endpoints we keep statistics for
+ */
+#define EPSTAT_MAX_ENTRIES      256
+
+/* Persisted statistics expire after this interval, in seconds
+ */
+#define EPSTAT_EXPIRE           (30 * 24 * 60 * 60)
+
+/* Names of files in the conf.stats_dir directory
+ */
+#define EPSTAT_FILE             "endpoints.stat"
+#define EPSTAT_PROTO_FILE       "protocols.stat"
+#define EPSTAT_DISCOVERY_FILE   "discovery.stat"
+
+/* Protocol statistics is trusted after that many pages received
+ */
+#define EPSTAT_PROTO_MIN_PAGES  2
+
+/* Protocols, which speed differs by less that this percentage,
+ * considered equally fast
+ */
+#define EPSTAT_PROTO_SIGNIFICANT 15
+
+/* epstat_entry represents statistics of a single endpoint
+ */
+typedef struct {
+    char         *uri;    /* Endpoint URI */
+    unsigned int rtt;     /* Smoothed connect time, ms * EPSTAT_SCALE */
+    unsigned int fail;    /* Smoothed failure rate, 0...EPSTAT_SCALE */
+    unsigned int ok;      /* Count of successful connections */
+    unsigned int failed;  /* Count of failed connections */
+    unsigned int bw;      /* Smoothed bandwidth, bytes per second */
+    time_t       updated; /* Time of last update */
+} epstat_entry;
+
+/* epstat_proto_entry represents statistics of protocol,
+ * used with particular device model
+ */
+typedef struct {
+    char         *model;  /* Device model */
+    ID_PROTO     proto;   /* Protocol */
+    unsigned int speed;   /* Smoothed speed, pixels per second */
+    unsigned int rate;    /* Smoothed image transfer rate, bytes per second */
+    unsigned int latency; /* Smoothed time per page, ms */
+    unsigned int pages;   /* Count of pages received */
+    time_t       updated; /* Time of last update */
+} epstat_proto_entry;
+
+/* epstat_format_entry represents statistics of image format.
+ * Sample here is a single color channel of a single pixel
+ */
+typedef struct {
+    unsigned int size;    /* Smoothed size, bytes per 1000 samples */
+    unsigned int decode;  /* Smoothed decode time, ns per 1000 samples */
+} epstat_format_entry;
+
+/* Initial image format statistics, used until measured. Image size
+ * reflects typical compression of scanned documents, decode time
+ * is a rough estimate for the modern CPU
+ */
+static const epstat_format_entry epstat_format_defaults[NUM_ID_FORMAT] = {
+    [ID_FORMAT_JPEG] = {.size = 100,  .decode = 3000},
+    [ID_FORMAT_TIFF] = {.size = 1000, .decode = 1000},
+    [ID_FORMAT_PNG]  = {.size = 500,  .decode = 4000},
+    [ID_FORMAT_PDF]  = {.size = 1000, .decode = 1000},
+    [ID_FORMAT_BMP]  = {.size = 1000, .decode = 500}
+};
+
+/* Minimal amount of data, required to measure bandwidth
+ */
+#define EPSTAT_BW_MIN_BYTES     65536
+
+/* Static variables
+ */
+static epstat_entry        **epstat_table;
+static epstat_proto_entry  **epstat_proto_table;
+static epstat_format_entry epstat_format_table[NUM_ID_FORMAT];
+static int                 epstat_discovery_gap = -1;
+static bool                epstat_dirty;
+
+/* Free epstat_entry
+ */
+static void
+epstat_entry_free (epstat_entry *ent)
+{
+    mem_free(ent->uri);
+    mem_free(ent);
+}
+
+/* Find entry by URI string. Returns NULL, if not found
+ */
+static epstat_entry*
+epstat_lookup (const char *uri)
+{
+    size_t i, len = mem_len(epstat_table);
+
+    for (i = 0; i < len; i ++) {
+        if (!strcmp(epstat_table[i]->uri, uri)) {
+            return epstat_table[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Find or create entry by URI string. If table is full, the least
+ * recently updated entry is dropped
+ */
+static epstat_entry*
+epstat_get (const char *uri)
+{
+    epstat_entry *ent = epstat_lookup(uri);
+
+    if (ent == NULL) {
+        if (mem_len(epstat_table) >= EPSTAT_MAX_ENTRIES) {
+            size_t i, oldest = 0, len = mem_len(epstat_table);
+
+            for (i = 1; i < len; i ++) {
+                if (epstat_table[i]->updated < epstat_table[oldest]->updated) {
+                    oldest = i;
+                }
+            }
+
+            epstat_entry_free(ptr_array_del(epstat_table, (int) oldest));
+        }
+
+        ent = mem_new(epstat_entry, 1);
+        ent->uri = str_dup(uri);
+        ent->rtt = EPSTAT_RTT_UNKNOWN * EPSTAT_SCALE;
+        epstat_table = ptr_array_append(epstat_table, ent);
+    }
+
+    return ent;
+}
+
+/* Smooth the value with the new sample
+ */
+static unsigned int
+epstat_smooth (unsigned int val, unsigned int sample)
+{
+    return (unsigned int) ((int) val +
+        ((int) sample - (int) val) / EPSTAT_SMOOTH);
+}
+
+/* Clamp 64-bit value into the range, safe for epstat_smooth()
+ */
+static unsigned int
+epstat_clamp (uint64_t v)
+{
+    return v < INT_MAX ? (unsigned int) v : INT_MAX;
+}
+
+/* Find protocol statistics entry. Returns NULL, if not found
+ */
+static epstat_proto_entry*
+epstat_proto_lookup (const char *model, ID_PROTO proto)
+{
+    size_t i, len = mem_len(epstat_proto_table);
+
+    for (i = 0; i < len; i ++) {
+        epstat_proto_entry *ent = epstat_proto_table[i];
+        if (ent->proto == proto && !strcmp(ent->model, model)) {
+            return ent;
+        }
+    }
+
+    return NULL;
+}
+
+/* Find or create protocol statistics entry. If table is full,
+ * the least recently updated entry is dropped
+ */
+static epstat_proto_entry*
+epstat_proto_get (const char *model, ID_PROTO proto)
+{
+    epstat_proto_entry *ent = epstat_proto_lookup(model, proto);
+
+    if (ent == NULL) {
+        if (mem_len(epstat_proto_table) >= EPSTAT_MAX_ENTRIES) {
+            size_t i, oldest = 0, len = mem_len(epstat_proto_table);
+
+            for (i = 1; i < len; i ++) {
+                if (epstat_proto_table[i]->updated <
+                    epstat_proto_table[oldest]->updated) {
+                    oldest = i;
+                }
+            }
+
+            ent = ptr_array_del(epstat_proto_table, (int) oldest);
+            mem_free(ent->model);
+            mem_free(ent);
+        }
+
+        ent = mem_new(epstat_proto_entry, 1);
+        ent->model = str_dup(model);
+        ent->proto = proto;
+        epstat_proto_table = ptr_array_append(epstat_proto_table, ent);
+    }
+
+    return ent;
+}
+
+/* Get endpoint score, in milliseconds. Lower is better
+ */
+static unsigned int
+epstat_score (http_uri *uri)
+{
+    epstat_entry *ent = epstat_lookup(http_uri_str(uri));
+    unsigned int score;
+
+    if (ent == NULL) {
+        return EPSTAT_RTT_UNKNOWN;
+    }
+
+    score = ent->rtt / EPSTAT_SCALE;
+    score += (unsigned int) ((uint64_t) ent->fail * EPSTAT_FAIL_PENALTY /
+        EPSTAT_SCALE);
+
+    return score;
+}
+
+/* Get endpoint rank. Endpoints of the same rank are considered
+ * equally good
+ */
+static int
+epstat_rank (http_uri *uri)
+{
+    unsigned int score = epstat_score(uri);
+    int          rank = 0;
+
+    while (score >= EPSTAT_RTT_FAST) {
+        score >>= 1;
+        rank ++;
+    }
+
+    return rank;
+}
+
+/* Open statistics file in the conf.stats_dir directory.
+ * Returns NULL, if persistence is not configured or on error
+ */
+static FILE*
+epstat_fopen (const char *name, const char *mode)
+{
+    char *path;
+    FILE *fp;
+
+    if (conf.stats_dir == NULL) {
+        return NULL;
+    }
+
+    path = str_concat(conf.stats_dir, name, NULL);
+    fp = fopen(path, mode);
+    mem_free(path);
+
+    return fp;
+}
+
+/* Load endpoint statistics
+ */
+static void
+epstat_load_endpoints (void)
+{
+    FILE   *fp = epstat_fopen(EPSTAT_FILE, "r");
+    char   line[4096];
+    time_t now = time(NULL);
+
+    if (fp == NULL) {
+        return;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char          uri[sizeof(line)];
+        unsigned int  rtt, fail, ok, failed, bw = 0;
+        long long     updated;
+        epstat_entry  *ent;
+
+        if (sscanf(line, "%s %u %u %u %u %lld %u",
+                uri, &rtt, &fail, &ok, &failed, &updated, &bw) < 6) {
+            continue;
+        }
+
+        if (fail > EPSTAT_SCALE || now - (time_t) updated > EPSTAT_EXPIRE) {
+            continue;
+        }
+
+        ent = epstat_get(uri);
+        ent->rtt = rtt;
+        ent->fail = fail;
+        ent->ok = ok;
+        ent->failed = failed;
+        ent->bw = bw;
+        ent->updated = (time_t) updated;
+    }
+
+    fclose(fp);
+
+    log_debug(NULL, "endpoint statistics: %d entries loaded",
+        (int) mem_len(epstat_table));
+}
+
+/* Load protocol statistics
+ */
+static void
+epstat_load_protos (void)
+{
+    FILE   *fp = epstat_fopen(EPSTAT_PROTO_FILE, "r");
+    char   line[4096];
+    time_t now = time(NULL);
+
+    if (fp == NULL) {
+        return;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char               name[16];
+        unsigned int       speed, rate, latency, pages;
+        long long          updated;
+        int                off = 0;
+        ID_PROTO           proto;
+        char               *model;
+        epstat_proto_entry *ent;
+
+        if (sscanf(line, "%15s %u %u %u %u %lld %n", name,
+                &speed, &rate, &latency, &pages, &updated, &off) != 6 ||
+            off == 0) {
+            continue;
+        }
+
+        model = str_trim(line + off);
+        proto = id_proto_by_name(name);
+
+        if (proto == ID_PROTO_UNKNOWN || model[0] == '\0' ||
+            now - (time_t) updated > EPSTAT_EXPIRE) {
+            continue;
+        }
+
+        ent = epstat_proto_get(model, proto);
+        ent->speed = speed;
+        ent->rate = rate;
+        ent->latency = latency;
+        ent->pages = pages;
+        ent->updated = (time_t) updated;
+    }
+
+    fclose(fp);
+
+    log_debug(NULL, "protocol statistics: %d entries loaded",
+        (int) mem_len(epstat_proto_table));
+}
+
+/* Load discovery statistics
+ */
+static void
+epstat_load_discovery (void)
+{
+    FILE      *fp = epstat_fopen(EPSTAT_DISCOVERY_FILE, "r");
+    int       gap;
+    long long updated;
+
+    if (fp == NULL) {
+        return;
+    }
+
+    if (fscanf(fp, "%d %lld", &gap, &updated) == 2 && gap >= 0 &&
+        time(NULL) - (time_t) updated <= EPSTAT_EXPIRE) {
+        epstat_discovery_gap = gap;
+        log_debug(NULL, "discovery statistics: answer gap=%d ms", gap);
+    }
+
+    fclose(fp);
+}
+
+/* Save statistics file. File is written atomically, via
+ * temporary file and rename()
+ */
+static bool
+epstat_save_file (const char *name, void (*write) (FILE *fp))
+{
+    char *path, *tmp;
+    FILE *fp;
+    bool ok = false;
+
+    path = str_concat(conf.stats_dir, name, NULL);
+    tmp = str_concat(path, ".tmp", NULL);
+
+    fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        log_debug(NULL, "statistics: %s: %s", tmp, strerror(errno));
+        goto DONE;
+    }
+
+    write(fp);
+
+    ok = fflush(fp) == 0;
+    ok = fclose(fp) == 0 && ok;
+    ok = ok && rename(tmp, path) == 0;
+
+    if (!ok) {
+        log_debug(NULL, "statistics: %s: %s", path, strerror(errno));
+        unlink(tmp);
+    }
+
+DONE:
+    mem_free(tmp);
+    mem_free(path);
+
+    return ok;
+}
+
+/* Write endpoint statistics
+ */
+static void
+epstat_write_endpoints (FILE *fp)
+{
+    size_t i, len = mem_len(epstat_table);
+
+    for (i = 0; i < len; i ++) {
+        epstat_entry *ent = epstat_table[i];
+        fprintf(fp, "%s %u %u %u %u %lld %u\n", ent->uri, ent->rtt,
+            ent->fail, ent->ok, ent->failed, (long long) ent->updated,
+            ent->bw);
+    }
+}
+
+/* Write protocol statistics
+ */
+static void
+epstat_write_protos (FILE *fp)
+{
+    size_t i, len = mem_len(epstat_proto_table);
+
+    for (i = 0; i < len; i ++) {
+        epstat_proto_entry *ent = epstat_proto_table[i];
+        fprintf(fp, "%s %u %u %u %u %lld %s\n", id_proto_name(ent->proto),
+            ent->speed, ent->rate, ent->latency, ent->pages,
+            (long long) ent->updated, ent->model);
+    }
+}
+
+/* Write discovery statistics
+ */
+static void
+epstat_write_discovery (FILE *fp)
+{
+    fprintf(fp, "%d %lld\n", epstat_discovery_gap, (long long) time(NULL));
+}
+
+/* Save statistics, if persistence is configured
+ */
+static void
+epstat_save (void)
+{
+    bool ok;
+
+    if (conf.stats_dir == NULL || !epstat_dirty) {
+        return;
+    }
+
+    (void) os_mkdir(conf.stats_dir, 0755);
+
+    ok = epstat_save_file(EPSTAT_FILE, epstat_write_endpoints);
+    ok = epstat_save_file(EPSTAT_PROTO_FILE, epstat_write_protos) && ok;
+    if (epstat_discovery_gap >= 0) {
+        ok = epstat_save_file(EPSTAT_DISCOVERY_FILE,
+            epstat_write_discovery) && ok;
+    }
+
+    if (ok) {
+        epstat_dirty = false;
+    }
+}
+
+/* Initialize endpoint statistics
+ */
+SANE_Status
+epstat_init (void)
+{
+    epstat_table = ptr_array_new(epstat_entry*);
+    epstat_proto_table = ptr_array_new(epstat_proto_entry*);
+    memcpy(epstat_format_table, epstat_format_defaults,
+        sizeof(epstat_format_table));
+    epstat_discovery_gap = -1;
+    epstat_dirty = false;
+
+    epstat_load_endpoints();
+    epstat_load_protos();
+    epstat_load_discovery();
+
+    return SANE_STATUS_GOOD;
+}
+
+/* Cleanup endpoint statistics. If persistence is configured,
+ * statistics is saved here
+ */
+void
+epstat_cleanup (void)
+{
+    epstat_entry       *ent;
+    epstat_proto_entry *pent;
+
+    if (epstat_table == NULL) {
+        return;
+    }
+
+    epstat_save();
+
+    while ((ent = ptr_array_del(epstat_table, 0)) != NULL) {
+        epstat_entry_free(ent);
+    }
+
+    while ((pent = ptr_array_del(epstat_proto_table, 0)) != NULL) {
+        mem_free(pent->model);
+        mem_free(pent);
+    }
+
+    mem_free(epstat_table);
+    mem_free(epstat_proto_table);
+    epstat_table = NULL;
+    epstat_proto_table = NULL;
+}
+
+/* Add sample to the endpoint statistics. Negative connect time
+ * means, connection was not established
+ */
+static void
+epstat_add_sample (http_uri *uri, timestamp t, bool failed)
+{
+    epstat_entry *ent;
+
+    if (epstat_table == NULL || (!failed && t < 0)) {
+        return;
+    }
+
+    ent = epstat_get(http_uri_str(uri));
+
+    if (t >= 0) {
+        unsigned int rtt = (unsigned int) t * EPSTAT_SCALE;
+        ent->rtt = ent->ok ? epstat_smooth(ent->rtt, rtt) : rtt;
+        ent->ok ++;
+    }
+
+    if (failed) {
+        ent->fail = epstat_smooth(ent->fail, EPSTAT_SCALE);
+        ent->failed ++;
+    } else {
+        ent->fail = epstat_smooth(ent->fail, 0);
+    }
+
+    ent->updated = time(NULL);
+    epstat_dirty = true;
+
+    log_debug(NULL, "endpoint statistics: %s: rtt=%ums fail=%u%% ok=%u failed=%u",
+        ent->uri, ent->rtt / EPSTAT_SCALE, ent->fail * 100 / EPSTAT_SCALE,
+        ent->ok, ent->failed);
+}
+
+/* Update endpoint statistics by the completed query.
+ *
+ * Query that failed at the transport level counts as endpoint
+ * failure. Query that has reached the server contributes its
+ * connect time to the smoothed endpoint latency
+ */
+void
+epstat_update (http_uri *uri, const http_query *q)
+{
+    epstat_add_sample(uri, http_query_connect_time(q),
+        http_query_transport_error(q) != NULL);
+}
+
+/* Count endpoint failure, reported by the http_client onerror
+ * callback, where query is not available
+ */
+void
+epstat_failed (http_uri *uri)
+{
+    epstat_add_sample(uri, -1, true);
+}
+
+/* Compare two endpoints by their statistics, for sorting.
+ * Endpoints, which are not significantly different, are
+ * considered equal
+ */
+int
+epstat_cmp (http_uri *uri1, http_uri *uri2)
+{
+    if (epstat_table == NULL || mem_len(epstat_table) == 0) {
+        return 0;
+    }
+
+    return epstat_rank(uri1) - epstat_rank(uri2);
+}
+
+/* Update protocol statistics by the received page.
+ *
+ * Page of `pixels' size and `bytes' length was received in
+ * `latency' milliseconds since the job start or the previous page,
+ * and its transfer took `xfer' milliseconds
+ */
+void
+epstat_proto_update (const char *model, ID_PROTO proto, uint64_t pixels,
+        size_t bytes, timestamp latency, timestamp xfer)
+{
+    epstat_proto_entry *ent;
+    unsigned int       speed, rate;
+
+    if (epstat_proto_table == NULL || model == NULL || model[0] == '\0') {
+        return;
+    }
+
+    latency = latency > 0 ? latency : 1;
+    latency = latency < INT_MAX ? latency : INT_MAX;
+    xfer = xfer > 0 ? xfer : 1;
+
+    speed = epstat_clamp(pixels * 1000 / (uint64_t) latency);
+    rate = epstat_clamp((uint64_t) bytes * 1000 / (uint64_t) xfer);
+
+    ent = epstat_proto_get(model, proto);
+    if (ent->pages == 0) {
+        ent->speed = speed;
+        ent->rate = rate;
+        ent->latency = (unsigned int) latency;
+    } else {
+        ent->speed = epstat_smooth(ent->speed, speed);
+        ent->rate = epstat_smooth(ent->rate, rate);
+        ent->latency = epstat_smooth(ent->latency, (unsigned int) latency);
+    }
+
+    ent->pages ++;
+    ent->updated = time(NULL);
+    epstat_dirty = true;
+
+    /* Protocol choice may change, so device list needs to be rebuilt */
+    zeroconf_device_list_invalidate();
+
+    log_debug(NULL, "protocol statistics: %s (%s): "
+        "speed=%u px/s rate=%u bytes/s latency=%ums pages=%u",
+        ent->model, id_proto_name(proto), ent->speed, ent->rate,
+        ent->latency, ent->pages);
+}
+
+/* Compare two protocols by speed, for the particular device model.
+ * Returns negative value, if proto1 is preferred, positive if proto2
+ * is preferred, 0 if there is no preference.
+ *
+ * If only one protocol has enough statistics, the other one is
+ * preferred, so both protocols will be measured
+ */
+int
+epstat_proto_cmp (const char *model, ID_PROTO proto1, ID_PROTO proto2)
+{
+    epstat_proto_entry *ent1, *ent2;
+    bool               known1, known2;
+    uint64_t           s1, s2;
+
+    if (epstat_proto_table == NULL || model == NULL) {
+        return 0;
+    }
+
+    ent1 = epstat_proto_lookup(model, proto1);
+    ent2 = epstat_proto_lookup(model, proto2);
+
+    known1 = ent1 != NULL && ent1->pages >= EPSTAT_PROTO_MIN_PAGES;
+    known2 = ent2 != NULL && ent2->pages >= EPSTAT_PROTO_MIN_PAGES;
+
+    if (!known1 && !known2) {
+        return 0;
+    }
+
+    if (known1 != known2) {
+        return known1 ? 1 : -1;
+    }
+
+    s1 = ent1->speed;
+    s2 = ent2->speed;
+
+    if (s1 * 100 > s2 * (100 + EPSTAT_PROTO_SIGNIFICANT)) {
+        return -1;
+    }
+
+    if (s2 * 100 > s1 * (100 + EPSTAT_PROTO_SIGNIFICANT)) {
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Update endpoint bandwidth by the received data. Received
+ * `bytes' took `t' milliseconds to transfer
+ */
+void
+epstat_bw_update (http_uri *uri, size_t bytes, timestamp t)
+{
+    epstat_entry *ent;
+    unsigned int bw;
+
+    if (epstat_table == NULL || bytes < EPSTAT_BW_MIN_BYTES) {
+        return;
+    }
+
+    t = t > 0 ? t : 1;
+    bw = epstat_clamp((uint64_t) bytes * 1000 / (uint64_t) t);
+
+    ent = epstat_get(http_uri_str(uri));
+    ent->bw = ent->bw ? epstat_smooth(ent->bw, bw) : bw;
+    ent->updated = time(NULL);
+    epstat_dirty = true;
+
+    log_debug(NULL, "endpoint statistics: %s: bandwidth=%u bytes/s",
+        ent->uri, ent->bw);
+}
+
+/* Get endpoint bandwidth, bytes per second. Returns 0, if unknown
+ */
+unsigned int
+epstat_bw (http_uri *uri)
+{
+    epstat_entry *ent;
+
+    if (epstat_table == NULL) {
+        return 0;
+    }
+
+    ent = epstat_lookup(http_uri_str(uri));
+    return ent != NULL ? ent->bw : 0;
+}
+
+/* Update image format statistics by the decoded image of `samples'
+ * size (pixels * channels) and `bytes' length, that took `ns'
+ * nanoseconds of CPU time to decode
+ */
+void
+epstat_format_update (ID_FORMAT fmt, uint64_t samples, size_t bytes,
+        uint64_t ns)
+{
+    epstat_format_entry *ent;
+
+    if (fmt < 0 || fmt >= NUM_ID_FORMAT || samples == 0) {
+        return;
+    }
+
+    ent = &epstat_format_table[fmt];
+    ent->size = epstat_smooth(ent->size,
+        epstat_clamp((uint64_t) bytes * 1000 / samples));
+    ent->decode = epstat_smooth(ent->decode,
+        epstat_clamp(ns * 1000 / samples));
+
+    log_debug(NULL, "format statistics: %s: size=%u decode=%u ns "
+        "per 1000 samples", id_format_short_name(fmt), ent->size, ent->decode);
+}
+
+/* Estimate time, in milliseconds, required to transfer image
+ * of `samples' size (pixels * channels) over the link with the
+ * bandwidth of `bw' bytes per second and to decode it locally
+ */
+uint64_t
+epstat_format_estimate (ID_FORMAT fmt, uint64_t samples, unsigned int bw)
+{
+    const epstat_format_entry *ent = &epstat_format_table[fmt];
+    uint64_t                  bytes, xfer, decode;
+
+    bytes = samples * ent->size / 1000;
+    xfer = bw ? bytes * 1000 / bw : 0;
+    decode = samples * ent->decode / 1000 / 1000000;
+
+    return xfer + decode;
+}
+
+/* Update discovery statistics by the largest interval, in
+ * milliseconds, between arrivals of new devices, observed during
+ * the initial discovery scan.
+ *
+ * Growth is taken immediately, so a slow device, once seen, is
+ * waited for next time, while decrease is smoothed
+ */
+void
+epstat_discovery_update (timestamp gap)
+{
+    int sample = (int) epstat_clamp(gap > 0 ? (uint64_t) gap : 0);
+
+    if (epstat_discovery_gap < 0 || sample > epstat_discovery_gap) {
+        epstat_discovery_gap = sample;
+    } else {
+        epstat_discovery_gap = (int) epstat_smooth(
+            (unsigned int) epstat_discovery_gap, (unsigned int) sample);
+    }
+
+    epstat_dirty = true;
+
+    log_debug(NULL, "discovery statistics: answer gap=%d ms (sample %d ms)",
+        epstat_discovery_gap, sample);
+}
+
+/* Get the learned interval between arrivals of new devices during
+ * the discovery, in milliseconds. Returns -1, if unknown
+ */
+timestamp
+epstat_discovery_gap_get (void)
+{
+    return epstat_discovery_gap;
+}
+
+/* vim:ts=8:sw=4:et
+ */
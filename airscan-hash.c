@@ -0,0 +1,211 @@
+/* AirScan (a.k.a. eSCL) backend for SANE
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * Hash tables
+ */
+
+#include "airscan.h"
+
+#include <string.h>
+
+/* Initial count of buckets. Must be power of 2
+ */
+#define HASHMAP_INITIAL_SIZE    16
+
+/* hashmap_node represents a single key/value pair. Key bytes
+ * follow the node
+ */
+typedef struct hashmap_node hashmap_node;
+struct hashmap_node {
+    hashmap_node *next;   /* Next node in the bucket */
+    uint32_t     hash;    /* Key hash */
+    size_t       len;     /* Key length */
+    void         *value;  /* Value */
+};
+
+/* hashmap represents a hash table
+ */
+struct hashmap {
+    hashmap_node **buckets; /* Buckets, power of 2 */
+    size_t       count;     /* Count of nodes */
+};
+
+/* Get node's key
+ */
+static inline const void*
+hashmap_node_key (const hashmap_node *node)
+{
+    return node + 1;
+}
+
+/* Compute hash of the byte string (32-bit FNV-1a)
+ */
+uint32_t
+hash_bytes (const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint32_t            hash = 2166136261u;
+    size_t              i;
+
+    for (i = 0; i < len; i ++) {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/* Create new hashmap
+ */
+hashmap*
+hashmap_new (void)
+{
+    hashmap *map = mem_new(hashmap, 1);
+    map->buckets = mem_new(hashmap_node*, HASHMAP_INITIAL_SIZE);
+    return map;
+}
+
+/* Free the hashmap. Values are not freed
+ */
+void
+hashmap_free (hashmap *map)
+{
+    size_t i, size;
+
+    if (map == NULL) {
+        return;
+    }
+
+    size = mem_len(map->buckets);
+    for (i = 0; i < size; i ++) {
+        hashmap_node *node = map->buckets[i];
+        while (node != NULL) {
+            hashmap_node *next = node->next;
+            mem_free(node);
+            node = next;
+        }
+    }
+
+    mem_free(map->buckets);
+    mem_free(map);
+}
+
+/* Find a place, where pointer to the node with the specified
+ * key is stored. If there is no such node, returned place
+ * contains NULL
+ */
+static hashmap_node**
+hashmap_lookup (const hashmap *map, const void *key, size_t len,
+        uint32_t hash)
+{
+    size_t       mask = mem_len(map->buckets) - 1;
+    hashmap_node **place = &map->buckets[hash & mask];
+
+    for (; *place != NULL; place = &(*place)->next) {
+        hashmap_node *node = *place;
+        if (node->hash == hash && node->len == len &&
+            !memcmp(hashmap_node_key(node), key, len)) {
+            break;
+        }
+    }
+
+    return place;
+}
+
+/* Double count of buckets
+ */
+static void
+hashmap_grow (hashmap *map)
+{
+    size_t       i, size = mem_len(map->buckets);
+    hashmap_node **buckets = mem_new(hashmap_node*, size * 2);
+
+    for (i = 0; i < size; i ++) {
+        hashmap_node *node = map->buckets[i];
+        while (node != NULL) {
+            hashmap_node *next = node->next;
+            size_t       n = node->hash & (size * 2 - 1);
+
+            node->next = buckets[n];
+            buckets[n] = node;
+            node = next;
+        }
+    }
+
+    mem_free(map->buckets);
+    map->buckets = buckets;
+}
+
+/* Get value by key. Returns NULL, if key is not in the table
+ */
+void*
+hashmap_get (const hashmap *map, const void *key, size_t len)
+{
+    hashmap_node *node;
+
+    node = *hashmap_lookup(map, key, len, hash_bytes(key, len));
+    return node ? node->value : NULL;
+}
+
+/* Set value by key. Existent value, if any, is replaced.
+ * Key is copied into the table
+ */
+void
+hashmap_set (hashmap *map, const void *key, size_t len, void *value)
+{
+    uint32_t     hash = hash_bytes(key, len);
+    hashmap_node **place = hashmap_lookup(map, key, len, hash);
+    hashmap_node *node = *place;
+
+    if (node != NULL) {
+        node->value = value;
+        return;
+    }
+
+    node = (hashmap_node*) mem_new(char, sizeof(hashmap_node) + len);
+    node->hash = hash;
+    node->len = len;
+    node->value = value;
+    memcpy(node + 1, key, len);
+    *place = node;
+
+    map->count ++;
+    if (map->count > mem_len(map->buckets)) {
+        hashmap_grow(map);
+    }
+}
+
+/* Delete key from the table. Returns deleted value or NULL,
+ * if key was not in the table
+ */
+void*
+hashmap_del (hashmap *map, const void *key, size_t len)
+{
+    hashmap_node **place = hashmap_lookup(map, key, len, hash_bytes(key, len));
+    hashmap_node *node = *place;
+    void         *value;
+
+    if (node == NULL) {
+        return NULL;
+    }
+
+    *place = node->next;
+    value = node->value;
+    mem_free(node);
+    map->count --;
+
+    return value;
+}
+
+/* Get count of keys in the table
+ */
+size_t
+hashmap_count (const hashmap *map)
+{
+    return map->count;
+}
+
+/* vim:ts=8:sw=4:et
+ */
@@ -17,6 +17,7 @@
 #include <errno.h>
 #include <netdb.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
@@ -41,6 +42,9 @@
 
 /******************** Static variables ********************/
 static gnutls_certificate_credentials_t gnutls_cred;
+static error (*http_test_transport) (void *ptr, http_query *q,
+        const void **data, size_t *size);
+static void *http_test_transport_ptr;
 
 /******************** Forward declarations ********************/
 typedef struct http_multipart http_multipart;
@@ -66,6 +70,9 @@ http_query_connect (http_query *q, error err);
 static void
 http_query_disconnect (http_query *q);
 
+static void
+http_query_test_exchange (http_query *q);
+
 static ssize_t
 http_query_sock_send (http_query *q, const void *data, size_t size);
 
@@ -75,9 +82,6 @@ http_query_sock_recv (http_query *q, void *data, size_t size);
 static error
 http_query_sock_err (http_query *q, int rc);
 
-static void
-http_query_cancel (http_query *q);
-
 /******************** HTTP URI ********************/
 /* Type http_uri represents HTTP URI
  */
@@ -1627,6 +1631,8 @@ http_multipart_free (http_multipart *mp)
         http_data_unref(mp->bodies[i]);
     }
 
+    mem_free(mp->bodies);
+    http_data_unref(mp->data);
     mem_free(mp);
 }
 
@@ -1737,12 +1743,22 @@ http_multipart_parse (http_multipart **out, log_ctx *log,
 }
 
 /******************** HTTP data ********************/
+/* Bodies larger than conf.spool MiB are moved into the anonymous
+ * temporary file and accessed via mmap(), so they don't occupy
+ * process memory. The file grows by at least HTTP_DATA_SPOOL_GROW
+ * bytes at once
+ */
+#define HTTP_DATA_SPOOL_GROW    (16 * 1024 * 1024)
+
 /* http_data + SoupBuffer
  */
 typedef struct {
-    http_data              data;    /* HTTP data */
-    volatile unsigned int  refcnt;  /* Reference counter */
-    http_data              *parent; /* Parent data buffer */
+    http_data              data;      /* HTTP data */
+    volatile unsigned int  refcnt;    /* Reference counter */
+    http_data              *parent;   /* Parent data buffer */
+    int                    spool_fd;  /* Spool file, -1 if none */
+    size_t                 spool_cap; /* Spool file size, mapped */
+    int                    spool_err; /* Spooling errno, 0 if none */
 } http_data_ex;
 
 
@@ -1769,6 +1785,7 @@ http_data_new(http_data *parent, const char *bytes, size_t size)
 
     data_ex->refcnt = 1;
     data_ex->parent = parent ? http_data_ref(parent) : NULL;
+    data_ex->spool_fd = -1;
 
     return &data_ex->data;
 }
@@ -1829,6 +1846,11 @@ http_data_unref (http_data *data)
         if (__sync_fetch_and_sub(&data_ex->refcnt, 1) == 1) {
             if (data_ex->parent != NULL) {
                 http_data_unref(data_ex->parent);
+            } else if (data_ex->spool_fd >= 0) {
+                if (data_ex->spool_cap != 0) {
+                    munmap((void*) data_ex->data.bytes, data_ex->spool_cap);
+                }
+                close(data_ex->spool_fd);
             } else {
                 mem_free((void*) data_ex->data.bytes);
             }
@@ -1839,10 +1861,139 @@ http_data_unref (http_data *data)
     }
 }
 
+/* Append bytes to the spooled data
+ *
+ * Returns true on success, false on error
+ */
+static bool
+http_data_spool_append (http_data_ex *data_ex, const char *bytes, size_t size)
+{
+    http_data *data = &data_ex->data;
+    size_t    need = data->size + size;
+
+    /* Grow the file and map it again */
+    if (need > data_ex->spool_cap) {
+        size_t cap = data_ex->spool_cap * 2;
+        void   *p;
+
+        if (cap < need + HTTP_DATA_SPOOL_GROW) {
+            cap = need + HTTP_DATA_SPOOL_GROW;
+        }
+
+        if (ftruncate(data_ex->spool_fd, (off_t) cap) < 0) {
+            return false;
+        }
+
+        p = mmap(NULL, cap, PROT_READ, MAP_SHARED, data_ex->spool_fd, 0);
+        if (p == MAP_FAILED) {
+            return false;
+        }
+
+        if (data_ex->spool_cap != 0) {
+            munmap((void*) data->bytes, data_ex->spool_cap);
+        }
+
+        data->bytes = p;
+        data_ex->spool_cap = cap;
+    }
+
+    /* Write the data. It becomes visible via mapping */
+    while (size != 0) {
+        ssize_t rc = pwrite(data_ex->spool_fd, bytes, size,
+            (off_t) data->size);
+
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+
+        bytes += rc;
+        size -= (size_t) rc;
+        data->size += (size_t) rc;
+    }
+
+    return true;
+}
+
+/* Move data into the spool file
+ *
+ * Returns true on success. On error, data remains in memory,
+ * the error is saved in data_ex->spool_err, and spooling is
+ * not attempted again for this data
+ */
+static bool
+http_data_spool_start (http_data_ex *data_ex)
+{
+    http_data  *data = &data_ex->data;
+    const char *dir = conf.spool_dir;
+    const void *bytes = data->bytes;
+    size_t     size = data->size;
+
+    if (dir == NULL) {
+        dir = getenv("TMPDIR");
+        if (dir == NULL || *dir == '\0') {
+            dir = "/var/tmp";
+        }
+    }
+
+    data_ex->spool_fd = os_tmpfile(dir);
+    if (data_ex->spool_fd < 0) {
+        data_ex->spool_err = errno ? errno : EIO;
+        return false;
+    }
+
+    data->bytes = NULL;
+    data->size = 0;
+
+    if (!http_data_spool_append(data_ex, bytes, size)) {
+        data_ex->spool_err = errno ? errno : EIO;
+
+        if (data_ex->spool_cap != 0) {
+            munmap((void*) data->bytes, data_ex->spool_cap);
+        }
+        close(data_ex->spool_fd);
+
+        data_ex->spool_fd = -1;
+        data_ex->spool_cap = 0;
+        data->bytes = bytes;
+        data->size = size;
+
+        return false;
+    }
+
+    mem_free((void*) bytes);
+
+    return true;
+}
+
+/* Check if data is spooled to file
+ */
+static bool
+http_data_spooled (http_data *data)
+{
+    http_data_ex *data_ex = OUTER_STRUCT(data, http_data_ex, data);
+    return data_ex->spool_fd >= 0;
+}
+
+/* Get errno of the failed attempt to spool data, 0 if none
+ */
+static int
+http_data_spool_error (http_data *data)
+{
+    http_data_ex *data_ex = OUTER_STRUCT(data, http_data_ex, data);
+    return data_ex->spool_err;
+}
+
 /* Append bytes to data. http_data must be owner of its
  * own buffer, i.e. it must have no parent
  *
- * Returns true on success, false on OOM
+ * If spooling is enabled, and data grows above conf.spool MiB,
+ * it is moved to the spool file
+ *
+ * Returns true on success, false on OOM or spool file write error.
+ * In the later case, errno is set, and data remains spooled
  */
 static bool
 http_data_append (http_data *data, const char *bytes, size_t size)
@@ -1852,6 +2003,16 @@ http_data_append (http_data *data, const char *bytes, size_t size)
 
     log_assert(NULL, data_ex->parent == NULL);
 
+    if (data_ex->spool_fd < 0 && data_ex->spool_err == 0 &&
+        conf.spool != 0 &&
+        (uint64_t) data->size + size > (uint64_t) conf.spool * 1024 * 1024) {
+        (void) http_data_spool_start(data_ex);
+    }
+
+    if (data_ex->spool_fd >= 0) {
+        return http_data_spool_append(data_ex, bytes, size);
+    }
+
     p = mem_try_resize((char*) data->bytes, data->size + size, 0);
     if (p == NULL) {
         return false;
@@ -1869,6 +2030,7 @@ http_data_append (http_data *data, const char *bytes, size_t size)
  */
 struct http_data_queue {
     http_data **items; /* Array of http_data items */
+    size_t    bytes;   /* Total size of queued data */
 };
 
 /* Create new http_data_queue
@@ -1897,6 +2059,7 @@ void
 http_data_queue_push (http_data_queue *queue, http_data *data)
 {
     queue->items = ptr_array_append(queue->items, data);
+    queue->bytes += data->size;
 }
 
 /* Pull an item from the http_data_queue. Returns NULL if queue is empty
@@ -1904,7 +2067,13 @@ http_data_queue_push (http_data_queue *queue, http_data *data)
 http_data*
 http_data_queue_pull (http_data_queue *queue)
 {
-    return ptr_array_del(queue->items, 0);
+    http_data *data = ptr_array_del(queue->items, 0);
+
+    if (data != NULL) {
+        queue->bytes -= data->size;
+    }
+
+    return data;
 }
 
 /* Get queue length
@@ -1915,6 +2084,14 @@ http_data_queue_len (const http_data_queue *queue)
     return (int) mem_len(queue->items);
 }
 
+/* Get total size of queued data, in bytes
+ */
+size_t
+http_data_queue_bytes (const http_data_queue *queue)
+{
+    return queue->bytes;
+}
+
 /* Purge the queue
  */
 void
@@ -2052,6 +2229,7 @@ struct http_query {
 
     char              *rq_buf;                  /* Formatted request */
     size_t            rq_off;                   /* send() offset in request */
+    const char        *phase;                   /* Timeline phase, or NULL */
 
     /* HTTP parser */
     http_parser       http_parser;              /* HTTP parser structure */
@@ -2065,6 +2243,9 @@ struct http_query {
 
     /* Callbacks and context */
     timestamp         timestamp;                /* Submission timestamp */
+    timestamp         connect_started;          /* connect() timestamp */
+    timestamp         connect_time;             /* Connection setup time,
+                                                   -1 if not connected yet */
     uintptr_t         uintptr;                  /* User-defined parameter */
     void              (*onerror) (void *ptr,    /* On-error callback */
                                 error err);
@@ -2090,11 +2271,37 @@ http_query_by_ll_node (ll_node *node)
      return OUTER_STRUCT(node, http_query, chain);
 }
 
+/* Switch query to the next timeline phase. The previous phase,
+ * if any, is ended. NULL phase means no phase
+ */
+static void
+http_query_phase (http_query *q, const char *phase)
+{
+    trace *t;
+
+    if (q->phase == phase ||
+        (q->phase != NULL && phase != NULL && !strcmp(q->phase, phase))) {
+        return;
+    }
+
+    t = log_ctx_trace(q->client->log);
+    if (q->phase != NULL) {
+        trace_event_end(t, "http", q->phase, q, NULL);
+    }
+
+    q->phase = phase;
+    if (phase != NULL) {
+        trace_event_begin(t, "http", phase, q, NULL);
+    }
+}
+
 /* Reset query into the state it had before http_query_submit()
  */
 static void
 http_query_reset (http_query *q)
 {
+    http_query_phase(q, NULL);
+
     if (q->host_inserted) {
         http_hdr_del(&q->request_header, "Host");
         q->host_inserted = false;
@@ -2114,6 +2321,7 @@ http_query_reset (http_query *q)
     }
 
     q->handshake = q->sending = false;
+    q->connect_time = -1;
 
     http_query_disconnect(q);
 
@@ -2238,6 +2446,7 @@ http_query_new_len (http_client *client, http_uri *uri, const char *method,
     http_hdr_init(&q->response_header);
 
     q->sock = -1;
+    q->connect_time = -1;
 
     q->rq_buf = str_new();
 
@@ -2505,6 +2714,7 @@ static void
 http_query_complete (http_query *q, error err)
 {
     http_client *client = q->client;
+    trace       *t;
 
     /* Make sure latest response header field is terminated */
     http_hdr_on_header_value(&q->http_parser, "", 0);
@@ -2531,6 +2741,11 @@ http_query_complete (http_query *q, error err)
     }
 
     trace_http_query_hook(log_ctx_trace(client->log), q);
+    AIRSCAN_PROBE(http_complete, q, err ? -1 : (int) q->http_parser.status_code,
+        http_query_get_response_data(q)->size);
+    trace_event_instant(log_ctx_trace(client->log), "http", "complete", q,
+        http_query_status_string(q));
+    metrics_http_complete(q);
 
     /* Handle redirection */
     if (err == NULL) {
@@ -2557,13 +2772,23 @@ http_query_complete (http_query *q, error err)
         q->orig_method = NULL;
     }
 
-    /* Call user callback */
+    /* Call user callback. Note, callback may destroy the client,
+     * so the trace is held by us until callback returns
+     */
+    t = trace_ref(log_ctx_trace(client->log));
+    http_query_phase(q, "callback");
+
     if (err != NULL && q->onerror != NULL) {
         q->onerror(client->ptr, err);
     } else if (q->callback != NULL) {
         q->callback(client->ptr, q);
     }
 
+    trace_event_end(t, "http", q->phase, q, NULL);
+    trace_event_end(t, "http", "query", q, NULL);
+    trace_unref(t);
+    q->phase = NULL;
+
     http_query_free(q);
 }
 
@@ -2574,17 +2799,37 @@ http_query_on_body_callback (http_parser *parser,
         const char *data, size_t size)
 {
     http_query *q = OUTER_STRUCT(parser, http_query, http_parser);
+    bool       spooled, spool_failed;
 
     if (size == 0) {
         return 0; /* Just in case */
     }
 
+    AIRSCAN_PROBE(http_body, q, size);
+
     if (q->response_data == NULL) {
         q->response_data = http_data_new(NULL, NULL, 0);
     }
 
+    spooled = http_data_spooled(q->response_data);
+    spool_failed = http_data_spool_error(q->response_data) != 0;
+
     if (!http_data_append(q->response_data, data, size)) {
-        q->err = ERROR_ENOMEM;
+        if (http_data_spooled(q->response_data)) {
+            q->err = ERROR(strerror(errno));
+            log_debug(q->client->log, "HTTP %s %s: can't spool body: %s",
+                    q->method, http_uri_str(q->uri), ESTRING(q->err));
+        } else {
+            q->err = ERROR_ENOMEM;
+        }
+    } else if (!spooled && http_data_spooled(q->response_data)) {
+        log_debug(q->client->log, "HTTP %s %s: body spooled to file",
+                q->method, http_uri_str(q->uri));
+    } else if (!spool_failed && http_data_spool_error(q->response_data)) {
+        log_debug(q->client->log, "HTTP %s %s: can't spool body, "
+                "keeping it in memory: %s",
+                q->method, http_uri_str(q->uri),
+                strerror(http_data_spool_error(q->response_data)));
     }
 
     return q->err ? 1 : 0;
@@ -2672,6 +2917,7 @@ http_query_fdpoll_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
     (void) mask;
 
     if (q->handshake) {
+        http_query_phase(q, "tls handshake");
         rc = gnutls_handshake(q->tls);
         if (rc < 0) {
             error err = http_query_sock_err(q, rc);
@@ -2682,6 +2928,7 @@ http_query_fdpoll_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
 
             log_debug(q->client->log, "HTTP %s: gnutls_handshake(): %s",
                 q->straddr.text, ESTRING(err));
+            metrics_tls_handshake(false);
 
             /* TLS handshake failed, try another address, if any */
             http_query_disconnect(q);
@@ -2692,10 +2939,13 @@ http_query_fdpoll_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
         }
 
         log_debug(q->client->log, "HTTP done TLS handshake");
+        AIRSCAN_PROBE(http_handshake, q);
+        metrics_tls_handshake(true);
 
         q->handshake = false;
         http_query_fdpoll_set_mask(q, ELOOP_FDPOLL_BOTH);
     } else if (q->sending) {
+        http_query_phase(q, "send");
         rc = http_query_sock_send(q, q->rq_buf + q->rq_off, len);
 
         if (rc > 0) {
@@ -2727,10 +2977,17 @@ http_query_fdpoll_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
             return;
         }
 
+        /* First bytes sent, so connection is fully established */
+        if (rc > 0 && q->rq_off == 0 && q->connect_time < 0) {
+            q->connect_time = timestamp_now() - q->connect_started;
+            AIRSCAN_PROBE(http_connect, q, q->straddr.text);
+        }
+
         q->rq_off += rc;
 
         if (q->rq_off == mem_len(q->rq_buf)) {
             log_debug(q->client->log, "HTTP done request sending");
+            http_query_phase(q, "first byte");
 
             q->sending = false;
             http_query_fdpoll_set_mask(q, ELOOP_FDPOLL_BOTH);
@@ -2744,6 +3001,7 @@ http_query_fdpoll_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
 
         rc = http_query_sock_recv(q, io_buf, sizeof(io_buf));
         if (rc > 0) {
+            http_query_phase(q, "receive");
             log_debug(q->client->log, "HTTP %d bytes received", (int) rc);
             trace_hexdump(log_ctx_trace(q->client->log), '<', io_buf, rc);
         }
@@ -2820,6 +3078,8 @@ AGAIN:
         goto AGAIN;
     }
 
+    http_query_phase(q, "connect");
+    q->connect_started = timestamp_now();
     do {
         rc = connect(q->sock, q->addr_next->ai_addr, q->addr_next->ai_addrlen);
     } while (rc < 0 && errno == EINTR);
@@ -3009,8 +3269,11 @@ http_query_start_processing (void *p)
     }
 
     /* Lookup target addresses */
-    if (q->uri->scheme != HTTP_SCHEME_UNIX) {
+    if (http_test_transport != NULL) {
+        /* Test transport doesn't connect anywhere */
+    } else if (q->uri->scheme != HTTP_SCHEME_UNIX) {
         log_debug(q->client->log, "HTTP resolving %s %s", host, port);
+        http_query_phase(q, "resolve");
         memset(&hints, 0, sizeof(hints));
         hints.ai_flags = AI_ADDRCONFIG;
         hints.ai_family = AF_UNSPEC;
@@ -3083,7 +3346,11 @@ http_query_start_processing (void *p)
     }
 
     /* Connect to the host */
-    http_query_connect(q, ERROR("no host addresses available"));
+    if (http_test_transport != NULL) {
+        http_query_test_exchange(q);
+    } else {
+        http_query_connect(q, ERROR("no host addresses available"));
+    }
 }
 
 /* Submit the query.
@@ -3098,11 +3365,20 @@ http_query_submit (http_query *q, void (*callback)(void *ptr, http_query *q))
 
     /* Issue log message, set timestamp and start timeout timer */
     log_debug(q->client->log, "HTTP %s %s", q->method, http_uri_str(q->uri));
+    AIRSCAN_PROBE(http_submit, q, q->method, http_uri_str(q->uri));
 
     if (!q->submitted) {
+        trace *t = log_ctx_trace(q->client->log);
+
         q->submitted = true;
         q->timestamp = timestamp_now();
 
+        if (t != NULL) {
+            char *s = str_printf("%s %s", q->method, http_uri_str(q->uri));
+            trace_event_begin(t, "http", "query", q, s);
+            mem_free(s);
+        }
+
         if (q->timeout_value >= 0) {
             http_query_timeout(q, q->timeout_value);
         }
@@ -3118,7 +3394,7 @@ http_query_submit (http_query *q, void (*callback)(void *ptr, http_query *q))
 /* Cancel unfinished http_query. Callback will not be called and
  * memory owned by the http_query will be released
  */
-static void
+void
 http_query_cancel (http_query *q)
 {
     log_debug(q->client->log, "HTTP %s %s: Cancelled", q->method,
@@ -3127,6 +3403,12 @@ http_query_cancel (http_query *q)
     ll_del(&q->chain);
     eloop_call_cancel(q->eloop_callid);
 
+    http_query_phase(q, NULL);
+    if (q->submitted) {
+        trace_event_end(log_ctx_trace(q->client->log), "http", "query", q,
+            "cancelled");
+    }
+
     http_query_free(q);
 }
 
@@ -3140,6 +3422,16 @@ http_query_timestamp (const http_query *q)
     return q->timestamp;
 }
 
+/* Get time, spent to establish connection to the server (including
+ * TLS handshake), in milliseconds. Returns -1 if connection was not
+ * established
+ */
+timestamp
+http_query_connect_time (const http_query *q)
+{
+    return q->connect_time;
+}
+
 /* Set uintptr_t parameter, associated with query.
  * Completion callback may later use http_query_get_uintptr()
  * to fetch this value
@@ -3368,6 +3660,65 @@ http_query_test_decode_response (http_query *q, const void *data, size_t size)
     return NULL;
 }
 
+/* Free http_query, that was never submitted.
+ * This function is intended for testing purposes, not for regular use
+ */
+void
+http_query_test_free (http_query *q)
+{
+    http_query_free(q);
+}
+
+/* Parse block of HTTP header fields, without status line, and
+ * discard the result.
+ * This function is intended for testing purposes, not for regular use
+ */
+error
+http_hdr_test_parse (const void *data, size_t size)
+{
+    http_hdr hdr;
+    error    err;
+
+    http_hdr_init(&hdr);
+    err = http_hdr_parse(&hdr, data, size, false);
+    http_hdr_cleanup(&hdr);
+
+    return err;
+}
+
+/* Replace network I/O of all HTTP queries with the test transport.
+ * This function is intended for testing purposes, not for regular use
+ */
+void
+http_test_transport_set (error (*transport) (void *ptr, http_query *q,
+        const void **data, size_t *size), void *ptr)
+{
+    http_test_transport = transport;
+    http_test_transport_ptr = ptr;
+}
+
+/* Perform query exchange via the test transport
+ */
+static void
+http_query_test_exchange (http_query *q)
+{
+    const void *data;
+    size_t     size;
+    error      err;
+
+    err = http_test_transport(http_test_transport_ptr, q, &data, &size);
+    if (err == NULL) {
+        q->connect_time = 0;
+
+        http_parser_init(&q->http_parser, HTTP_RESPONSE);
+        q->http_parser.data = &q->response_header;
+
+        err = http_query_test_decode_response(q, data, size);
+    }
+
+    http_query_complete(q, err);
+}
+
 /******************** HTTP initialization & cleanup ********************/
 /* Initialize HTTP client
  */
@@ -223,6 +223,7 @@ static id_name_table id_justification_sane_name_table[] = {
     {ID_JUSTIFICATION_RIGHT,    OPTVAL_JUSTIFICATION_RIGHT},
     {ID_JUSTIFICATION_TOP,      OPTVAL_JUSTIFICATION_TOP},
     {ID_JUSTIFICATION_BOTTOM,   OPTVAL_JUSTIFICATION_BOTTOM},
+    {-1, NULL}
 };
 
 /* id_justification_sane_name returns SANE name for the justification
@@ -74,5 +74,34 @@ image_format_detect (const void *data, size_t size)
     return ID_FORMAT_UNKNOWN;
 }
 
+/* Convert line of 24-bit RGB pixels into 8-bit grayscale, in place.
+ * The wid parameter is the line width, in pixels
+ */
+void
+image_resample_24_to_8 (uint8_t *line, int wid)
+{
+    const uint8_t *in = line;
+    uint8_t       *out = line;
+    int           i;
+
+    for (i = 0; i < wid; i ++) {
+        /* Y = R * 0.299 + G * 0.587 + B * 0.114
+         *
+         * 16777216 == 1 << 24
+         * 16777216 * 0.299 == 5016387.584 ~= 5016387
+         * 16777216 * 0.587 == 9848225.792 ~= 9848226
+         * 16777216 * 0.114 == 1912602.624 ~= 1912603
+         *
+         * 5016387 + 9848226 + 1912603 == 16777216
+         */
+        unsigned long Y;
+
+        Y = 5016387 * (unsigned long) *in ++;
+        Y += 9848226 * (unsigned long) *in ++;
+        Y += 1912603 * (unsigned long) *in ++;
+        *out ++ = (Y + (1 << 23)) >> 24;
+    }
+}
+
 /* vim:ts=8:sw=4:et
  */
@@ -43,6 +43,12 @@ airscan_init (AIRSCAN_INIT_FLAGS flags, const char *log_msg)
     if (status == SANE_STATUS_GOOD) {
         status = http_init();
     }
+    if (status == SANE_STATUS_GOOD) {
+        status = epstat_init();
+    }
+    if (status == SANE_STATUS_GOOD) {
+        status = metrics_init();
+    }
     if (status == SANE_STATUS_GOOD) {
         status = netif_init();
     }
@@ -55,6 +61,12 @@ airscan_init (AIRSCAN_INIT_FLAGS flags, const char *log_msg)
     if (status == SANE_STATUS_GOOD) {
         status = wsdd_init();
     }
+    if (status == SANE_STATUS_GOOD) {
+        status = sweep_init();
+    }
+    if (status == SANE_STATUS_GOOD) {
+        status = wsde_init();
+    }
 
     if (status != SANE_STATUS_GOOD) {
         airscan_cleanup(NULL);
@@ -73,8 +85,12 @@ airscan_cleanup (const char *log_msg)
 {
     mdns_cleanup();
     wsdd_cleanup();
+    sweep_cleanup();
+    wsde_cleanup();
     zeroconf_cleanup();
     netif_cleanup();
+    metrics_cleanup();
+    epstat_cleanup();
     http_cleanup();
     rand_cleanup();
     eloop_cleanup();
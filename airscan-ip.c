@@ -252,12 +252,92 @@ ip_network_contains (ip_network net, ip_addr addr)
     return false;
 }
 
+/* ip_addrset keeps small sets as a plain array and scans them
+ * linearly. Once set grows beyond this limit, open-addressing
+ * hash index is built on top of the array
+ */
+#define IP_ADDRSET_INLINE_MAX   8
+
 /* ip_addr_set represents a set of IP addresses
  */
 struct ip_addrset {
-    ip_addr *addrs;   /* Addresses in the set */
+    ip_addr  *addrs;  /* Addresses in the set, in order of addition */
+    uint32_t *index;  /* Hash index, NULL for small sets. Each slot
+                         contains position in addrs + 1, 0 if empty */
 };
 
+/* Compute hash of ip_addr, consistent with ip_addr_equal()
+ */
+static inline uint32_t
+ip_addrset_hash (ip_addr addr)
+{
+    uint32_t h = (uint32_t) addr.af * 0x9e3779b1u;
+    uint32_t w[4];
+    int      i;
+
+    switch (addr.af) {
+    case AF_INET:
+        h ^= addr.ip.v4.s_addr;
+        h *= 0x85ebca6bu;
+        break;
+
+    case AF_INET6:
+        memcpy(w, addr.ip.v6.s6_addr, 16);
+        h ^= (uint32_t) addr.ifindex;
+        for (i = 0; i < 4; i ++) {
+            h = (h ^ w[i]) * 0x85ebca6bu;
+            h ^= h >> 15;
+        }
+        break;
+    }
+
+    h ^= h >> 16;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 13;
+
+    return h;
+}
+
+/* Insert address at position pos in the addrs array into the index
+ */
+static void
+ip_addrset_index_insert (ip_addrset *addrset, size_t pos)
+{
+    size_t mask = mem_len(addrset->index) - 1;
+    size_t slot = ip_addrset_hash(addrset->addrs[pos]) & mask;
+
+    while (addrset->index[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+
+    addrset->index[slot] = (uint32_t) pos + 1;
+}
+
+/* Rebuild hash index from scratch. Drops index, if set
+ * became small enough to be scanned linearly
+ */
+static void
+ip_addrset_index_rebuild (ip_addrset *addrset)
+{
+    size_t i, size, len = mem_len(addrset->addrs);
+
+    mem_free(addrset->index);
+    addrset->index = NULL;
+
+    if (len <= IP_ADDRSET_INLINE_MAX) {
+        return;
+    }
+
+    /* Keep load factor below 1/2 */
+    for (size = 32; size < len * 2; size <<= 1)
+        ;
+
+    addrset->index = mem_new(uint32_t, size);
+    for (i = 0; i < len; i ++) {
+        ip_addrset_index_insert(addrset, i);
+    }
+}
+
 /* Create new ip_addrset
  */
 ip_addrset*
@@ -273,6 +353,7 @@ ip_addrset_new (void)
 void
 ip_addrset_free (ip_addrset *addrset)
 {
+    mem_free(addrset->index);
     mem_free(addrset->addrs);
     mem_free(addrset);
 }
@@ -282,15 +363,37 @@ ip_addrset_free (ip_addrset *addrset)
 static int
 ip_addrset_index (const ip_addrset *addrset, ip_addr addr)
 {
-    size_t i, len = mem_len(addrset->addrs);
-
-    for (i = 0; i < len; i ++) {
-        if (ip_addr_equal(addrset->addrs[i], addr)) {
-            return (int) i;
+    size_t i, len, mask, slot;
+
+    /* Small sets: linear scan */
+    if (addrset->index == NULL) {
+        len = mem_len(addrset->addrs);
+        for (i = 0; i < len; i ++) {
+            if (ip_addr_equal(addrset->addrs[i], addr)) {
+                return (int) i;
+            }
         }
+
+        return -1;
     }
 
-    return -1;
+    /* Large sets: hash lookup */
+    mask = mem_len(addrset->index) - 1;
+    slot = ip_addrset_hash(addr) & mask;
+
+    for (;;) {
+        uint32_t pos = addrset->index[slot];
+
+        if (pos == 0) {
+            return -1;
+        }
+
+        if (ip_addr_equal(addrset->addrs[pos - 1], addr)) {
+            return (int) pos - 1;
+        }
+
+        slot = (slot + 1) & mask;
+    }
 }
 
 /* Check if address is in set
@@ -324,6 +427,46 @@ ip_addrset_add_unsafe (ip_addrset *addrset, ip_addr addr)
 
     addrset->addrs = mem_resize(addrset->addrs, len + 1, 0);
     addrset->addrs[len] = addr;
+    len ++;
+
+    if (len > IP_ADDRSET_INLINE_MAX) {
+        if (addrset->index == NULL || len * 2 > mem_len(addrset->index)) {
+            ip_addrset_index_rebuild(addrset);
+        } else {
+            ip_addrset_index_insert(addrset, len - 1);
+        }
+    }
+}
+
+/* Remove address at position pos in the addrs array from the index.
+ * Uses backward shift deletion, so no tombstones are needed
+ */
+static void
+ip_addrset_index_remove (ip_addrset *addrset, size_t pos)
+{
+    size_t mask = mem_len(addrset->index) - 1;
+    size_t hole = ip_addrset_hash(addrset->addrs[pos]) & mask;
+    size_t slot;
+
+    while (addrset->index[hole] != pos + 1) {
+        hole = (hole + 1) & mask;
+    }
+
+    for (slot = (hole + 1) & mask; addrset->index[slot] != 0;
+         slot = (slot + 1) & mask) {
+        uint32_t pos2 = addrset->index[slot];
+        size_t   home = ip_addrset_hash(addrset->addrs[pos2 - 1]) & mask;
+
+        /* Entry may fill the hole only if its home slot is not
+         * cyclically within (hole, slot]
+         */
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            addrset->index[hole] = pos2;
+            hole = slot;
+        }
+    }
+
+    addrset->index[hole] = 0;
 }
 
 /* Del address from the set.
@@ -336,11 +479,35 @@ ip_addrset_del (ip_addrset *addrset, ip_addr addr)
     if (i >= 0) {
         size_t len = mem_len(addrset->addrs);
         size_t tail = len - (size_t) i - 1;
+
+        if (addrset->index != NULL) {
+            ip_addrset_index_remove(addrset, (size_t) i);
+        }
+
         if (tail != 0) {
             tail *= sizeof(*addrset->addrs);
             memmove(&addrset->addrs[i], &addrset->addrs[i + 1], tail);
         }
         mem_shrink(addrset->addrs, len - 1);
+
+        if (addrset->index == NULL) {
+            return;
+        }
+
+        /* Drop index, if set became small. Otherwise, fix
+         * positions of the shifted addresses. Like memmove above,
+         * it is O(n), unless the last address was deleted
+         */
+        if (len - 1 <= IP_ADDRSET_INLINE_MAX) {
+            ip_addrset_index_rebuild(addrset);
+        } else if ((size_t) i != len - 1) {
+            size_t j, size = mem_len(addrset->index);
+            for (j = 0; j < size; j ++) {
+                if (addrset->index[j] > (uint32_t) i + 1) {
+                    addrset->index[j] --;
+                }
+            }
+        }
     }
 }
 
@@ -350,6 +517,8 @@ void
 ip_addrset_purge (ip_addrset *addrset)
 {
     mem_shrink(addrset->addrs, 0);
+    mem_free(addrset->index);
+    addrset->index = NULL;
 }
 
 /* Merge two sets:
@@ -379,7 +548,18 @@ ip_addrset_addresses (const ip_addrset *addrset, size_t *count)
 bool
 ip_addrset_is_intersect (const ip_addrset *set, const ip_addrset *set2)
 {
-    size_t i, len = mem_len(set->addrs);
+    size_t i, len, len2;
+
+    /* Iterate over the smaller set, probing the larger one */
+    len = mem_len(set->addrs);
+    len2 = mem_len(set2->addrs);
+
+    if (len > len2) {
+        const ip_addrset *tmp = set;
+        set = set2;
+        set2 = tmp;
+        len = len2;
+    }
 
     for (i = 0; i < len; i ++) {
         if (ip_addrset_lookup(set2, set->addrs[i])) {
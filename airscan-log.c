@@ -12,14 +12,86 @@
 #include <time.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+/* log_debug() and log_trace() are defined here as functions
+ */
+#undef log_debug
+#undef log_trace
+
+/* Log messages are formatted by the calling thread into its own
+ * ring buffer, without any locking. The flusher thread collects
+ * messages from all buffers, merges them in timestamp order and
+ * writes them to stderr in large batches
+ *
+ * LOG_RING_SIZE is the per-thread buffer size, in bytes. It must
+ * be a power of 2. If message doesn't fit the buffer, buffers are
+ * flushed synchronously by the calling thread
+ *
+ * Messages are written synchronously, after all buffered messages,
+ * if flusher thread is not running, and by log_panic(). Buffered
+ * messages are also written at process exit, even if log_cleanup()
+ * was not called
+ *
+ * LOG_FLUSH_DELAY is how long flusher thread waits after wakeup,
+ * to collect more messages into the batch, in milliseconds
+ *
+ * LOG_OUT_SIZE is the size of output buffer of the flusher
+ */
+#define LOG_RING_SIZE           (64 * 1024)
+#define LOG_FLUSH_DELAY         5
+#define LOG_OUT_SIZE            (16 * 1024)
+
+/* log_record is the header of message in the ring buffer,
+ * followed by the message text
+ */
+typedef struct {
+    uint64_t time;                  /* Message time */
+    size_t   len;                   /* Text length, including '\n' */
+} log_record;
+
+/* log_ring is the per-thread ring buffer. head is owned by
+ * consumer, tail is owned by producer. Both are free-running
+ */
+typedef struct log_ring log_ring;
+struct log_ring {
+    char     buf[LOG_RING_SIZE];    /* Buffered messages */
+    size_t   head;                  /* Consumer position */
+    size_t   tail;                  /* Producer position */
+    bool     dead;                  /* Owner thread has exited */
+    log_ring *next;                 /* Next ring in the list */
+};
+
 /* Static variables */
 static char *log_buffer;
 static bool log_configured;
 static uint64_t log_start_time;
 static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* Per-thread ring buffers. The list of buffers and output are
+ * protected by log_drain_mutex. log_gen is incremented on each
+ * log_init(), so threads notice that their buffers are gone
+ */
+static log_ring *log_rings;
+static unsigned int log_gen;
+static pthread_key_t log_ring_key;
+static pthread_mutex_t log_drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char log_out[LOG_OUT_SIZE];
+static size_t log_out_len;
+static __thread log_ring *log_ring_self;
+static __thread unsigned int log_ring_gen;
+
+/* Flusher thread
+ */
+static bool log_atexit_installed;
+static pthread_t log_flusher_thread;
+static pthread_mutex_t log_flusher_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_flusher_cond = PTHREAD_COND_INITIALIZER;
+static bool log_flusher_started;
+static bool log_flusher_stop;
+static bool log_flusher_sleeping;
+
 /* Get time for logging purposes
  */
 static uint64_t
@@ -31,6 +103,289 @@ log_get_time (void)
     return ((uint64_t) tms.tv_nsec) + 1000000000 * (uint64_t) tms.tv_sec;
 }
 
+/******************** Per-thread buffers ********************/
+/* Called on exit of the thread, that owns the ring buffer.
+ * The buffer will be freed by log_drain(), when empty
+ */
+static void
+log_ring_destructor (void *p)
+{
+    log_ring *r = p;
+
+    __atomic_store_n(&r->dead, true, __ATOMIC_RELEASE);
+    log_ring_self = NULL;
+}
+
+/* Get ring buffer of the current thread, creating it if needed
+ */
+static log_ring*
+log_ring_get (void)
+{
+    log_ring *r = log_ring_self;
+
+    if (r != NULL && log_ring_gen == log_gen) {
+        return r;
+    }
+
+    r = mem_new(log_ring, 1);
+
+    pthread_mutex_lock(&log_drain_mutex);
+    r->next = log_rings;
+    log_rings = r;
+    pthread_mutex_unlock(&log_drain_mutex);
+
+    pthread_setspecific(log_ring_key, r);
+    log_ring_self = r;
+    log_ring_gen = log_gen;
+
+    return r;
+}
+
+/* Copy bytes into the ring buffer, at the given position
+ */
+static void
+log_ring_write (log_ring *r, size_t pos, const void *data, size_t len)
+{
+    size_t off = pos & (LOG_RING_SIZE - 1);
+    size_t sz = LOG_RING_SIZE - off;
+
+    if (sz > len) {
+        sz = len;
+    }
+
+    memcpy(r->buf + off, data, sz);
+    memcpy(r->buf, (const char*) data + sz, len - sz);
+}
+
+/* Copy bytes from the ring buffer, at the given position
+ */
+static void
+log_ring_read (log_ring *r, size_t pos, void *data, size_t len)
+{
+    size_t off = pos & (LOG_RING_SIZE - 1);
+    size_t sz = LOG_RING_SIZE - off;
+
+    if (sz > len) {
+        sz = len;
+    }
+
+    memcpy(data, r->buf + off, sz);
+    memcpy((char*) data + sz, r->buf, len - sz);
+}
+
+/* Put message into the ring buffer of the current thread.
+ * Returns false, if there is not enough space
+ */
+static bool
+log_ring_put (uint64_t time, const char *msg, size_t len)
+{
+    log_ring   *r = log_ring_get();
+    size_t     head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    log_record rec = {time, len};
+
+    if (LOG_RING_SIZE - (r->tail - head) < sizeof(rec) + len) {
+        return false;
+    }
+
+    log_ring_write(r, r->tail, &rec, sizeof(rec));
+    log_ring_write(r, r->tail + sizeof(rec), msg, len);
+    __atomic_store_n(&r->tail, r->tail + sizeof(rec) + len,
+        __ATOMIC_SEQ_CST);
+
+    return true;
+}
+
+/* Write output buffer to stderr. Called under log_drain_mutex
+ */
+static void
+log_out_flush (void)
+{
+    int rc = write(2, log_out, log_out_len);
+    (void) rc;
+    log_out_len = 0;
+}
+
+/* Append text to output buffer. Called under log_drain_mutex
+ */
+static void
+log_out_append (log_ring *r, size_t pos, size_t len)
+{
+    if (log_out_len + len > sizeof(log_out)) {
+        log_out_flush();
+    }
+
+    log_ring_read(r, pos, log_out + log_out_len, len);
+    log_out_len += len;
+}
+
+/* Write all buffered messages of all threads, in timestamp order.
+ * Called under log_drain_mutex
+ *
+ * Note, this function must not allocate memory, as it is
+ * used by log_panic()
+ */
+static void
+log_drain_locked (void)
+{
+    log_ring **prev, *r;
+
+    for (;;) {
+        log_ring   *next = NULL;
+        log_record rec, next_rec = {0, 0};
+
+        /* Choose the oldest message */
+        for (r = log_rings; r != NULL; r = r->next) {
+            size_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+            if (r->head != tail) {
+                log_ring_read(r, r->head, &rec, sizeof(rec));
+                if (next == NULL || rec.time < next_rec.time) {
+                    next = r;
+                    next_rec = rec;
+                }
+            }
+        }
+
+        if (next == NULL) {
+            break;
+        }
+
+        /* Move it to the output buffer */
+        log_out_append(next, next->head + sizeof(next_rec), next_rec.len);
+        __atomic_store_n(&next->head,
+            next->head + sizeof(next_rec) + next_rec.len, __ATOMIC_RELEASE);
+    }
+
+    if (log_out_len != 0) {
+        log_out_flush();
+    }
+
+    /* Free buffers of exited threads */
+    prev = &log_rings;
+    while ((r = *prev) != NULL) {
+        if (__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE) &&
+            r->head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) {
+            *prev = r->next;
+            mem_free(r);
+        } else {
+            prev = &r->next;
+        }
+    }
+}
+
+/* Write all buffered messages of all threads
+ */
+static void
+log_drain (void)
+{
+    pthread_mutex_lock(&log_drain_mutex);
+    log_drain_locked();
+    pthread_mutex_unlock(&log_drain_mutex);
+}
+
+/* Check if there are buffered messages
+ */
+static bool
+log_pending (void)
+{
+    log_ring *r;
+    bool     pending = false;
+
+    pthread_mutex_lock(&log_drain_mutex);
+    for (r = log_rings; r != NULL && !pending; r = r->next) {
+        pending = r->head != __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&log_drain_mutex);
+
+    return pending;
+}
+
+/******************** Flusher thread ********************/
+/* The flusher thread
+ */
+static void*
+log_flusher_thread_func (void *p)
+{
+    (void) p;
+
+    pthread_mutex_lock(&log_flusher_mutex);
+
+    while (!log_flusher_stop) {
+        struct timespec delay = {0, LOG_FLUSH_DELAY * 1000000};
+
+        __atomic_store_n(&log_flusher_sleeping, true, __ATOMIC_SEQ_CST);
+        if (!log_pending()) {
+            pthread_cond_wait(&log_flusher_cond, &log_flusher_mutex);
+        }
+        __atomic_store_n(&log_flusher_sleeping, false, __ATOMIC_SEQ_CST);
+
+        if (log_flusher_stop) {
+            break;
+        }
+
+        pthread_mutex_unlock(&log_flusher_mutex);
+        nanosleep(&delay, NULL);
+        log_drain();
+        pthread_mutex_lock(&log_flusher_mutex);
+    }
+
+    pthread_mutex_unlock(&log_flusher_mutex);
+
+    return NULL;
+}
+
+/* Wake up the flusher thread, if it sleeps
+ */
+static void
+log_flusher_wakeup (void)
+{
+    if (__atomic_load_n(&log_flusher_sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&log_flusher_mutex);
+        pthread_cond_signal(&log_flusher_cond);
+        pthread_mutex_unlock(&log_flusher_mutex);
+    }
+}
+
+/* Start the flusher thread
+ */
+static void
+log_flusher_start (void)
+{
+    int rc;
+
+    log_flusher_stop = false;
+    rc = pthread_create(&log_flusher_thread, NULL,
+        log_flusher_thread_func, NULL);
+    log_flusher_started = rc == 0;
+}
+
+/* Stop the flusher thread
+ */
+static void
+log_flusher_stop_and_join (void)
+{
+    if (!log_flusher_started) {
+        return;
+    }
+
+    pthread_mutex_lock(&log_flusher_mutex);
+    log_flusher_stop = true;
+    pthread_cond_signal(&log_flusher_cond);
+    pthread_mutex_unlock(&log_flusher_mutex);
+
+    pthread_join(log_flusher_thread, NULL);
+    log_flusher_started = false;
+}
+
+/******************** Initialization and configuration ********************/
+/* Called at process exit. Writes all buffered messages
+ */
+static void
+log_atexit (void)
+{
+    log_drain();
+}
+
 /* Initialize logging
  *
  * No log messages should be generated before this call
@@ -41,6 +396,13 @@ log_init (void)
     log_buffer = str_new();
     log_configured = false;
     log_start_time = log_get_time();
+
+    log_gen ++;
+    pthread_key_create(&log_ring_key, log_ring_destructor);
+
+    if (!log_atexit_installed) {
+        log_atexit_installed = atexit(log_atexit) == 0;
+    }
 }
 
 /* Cleanup logging
@@ -50,6 +412,23 @@ log_init (void)
 void
 log_cleanup (void)
 {
+    log_ring *r;
+
+    log_flusher_stop_and_join();
+
+    pthread_mutex_lock(&log_drain_mutex);
+    log_drain_locked();
+    while ((r = log_rings) != NULL) {
+        log_rings = r->next;
+        mem_free(r);
+    }
+    pthread_mutex_unlock(&log_drain_mutex);
+
+    /* Delete the key, so destructor will not be called after
+     * backend is unloaded
+     */
+    pthread_key_delete(log_ring_key);
+
     mem_free(log_buffer);
     log_buffer = NULL;
 }
@@ -75,20 +454,28 @@ log_flush (void)
 void
 log_configure (void)
 {
-    log_configured = true;
+    pthread_mutex_lock(&log_mutex);
+
     if (conf.dbg_enabled) {
         log_flush();
+        if (!log_flusher_started) {
+            log_flusher_start();
+        }
     } else {
         str_trunc(log_buffer);
     }
+
+    __atomic_store_n(&log_configured, true, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&log_mutex);
 }
 
 /* Format time elapsed since logging began
  */
 static void
-log_fmt_time (char *buf, size_t size)
+log_fmt_time (char *buf, size_t size, uint64_t now)
 {
-    uint64_t t = log_get_time() - log_start_time;
+    uint64_t t = now - log_start_time;
     int      hour, min, sec, msec;
 
     sec = (int) (t / 1000000000);
@@ -146,17 +533,71 @@ log_ctx_trace (log_ctx *log)
     return log->trace;
 }
 
+/* Check if message, written to the logging context, will go
+ * anywhere, either to the log or to the protocol trace
+ */
+bool
+log_enabled (log_ctx *log, bool trace_only)
+{
+    if (log != NULL && log->trace != NULL) {
+        return true;
+    }
+
+    return !trace_only &&
+           (!__atomic_load_n(&log_configured, __ATOMIC_ACQUIRE) ||
+            conf.dbg_enabled);
+}
+
+/* Write a message to the log
+ */
+static void
+log_write (uint64_t now, const char *msg, size_t len, bool force)
+{
+    int rc;
+
+    /* Before logger is configured, messages are buffered
+     * in the log_buffer, and it is protected by log_mutex
+     */
+    if (!__atomic_load_n(&log_configured, __ATOMIC_ACQUIRE) && !force) {
+        pthread_mutex_lock(&log_mutex);
+        if (!log_configured) {
+            log_buffer = str_append_mem(log_buffer, msg, len);
+            pthread_mutex_unlock(&log_mutex);
+            return;
+        }
+        pthread_mutex_unlock(&log_mutex);
+    }
+
+    /* Normally, message goes to the per-thread buffer. Without
+     * flusher thread, nobody will write it, so write synchronously
+     */
+    if (!force && log_flusher_started && log_ring_put(now, msg, len)) {
+        log_flusher_wakeup();
+        return;
+    }
+
+    /* Message doesn't fit the buffer or urgent. Write all
+     * buffered messages and then this message synchronously
+     */
+    pthread_mutex_lock(&log_drain_mutex);
+    log_drain_locked();
+    rc = write(2, msg, len);
+    (void) rc;
+    pthread_mutex_unlock(&log_drain_mutex);
+}
+
 /* Write a log message
  */
 static void
 log_message (log_ctx *log, bool trace_only, bool force,
         const char *fmt, va_list ap)
 {
-    trace *t = log ? log->trace : NULL;
-    char  msg[4096];
-    int   len = 0, namelen = 0, required_bytes = 0;
-    bool  dont_log = trace_only ||
-                     (log_configured && !conf.dbg_enabled && !force);
+    trace    *t = log ? log->trace : NULL;
+    char     msg[4096];
+    int      len = 0, namelen = 0, required_bytes = 0;
+    bool     dont_log = trace_only ||
+                        (log_configured && !conf.dbg_enabled && !force);
+    uint64_t now;
 
     /* If logs suppressed and trace not in use, we have nothing
      * to do */
@@ -164,6 +605,8 @@ log_message (log_ctx *log, bool trace_only, bool force,
         return;
     }
 
+    now = log_get_time();
+
     /* Format a log message */
     if (log != NULL) {
         len += sprintf(msg, "%.64s: ", log->name);
@@ -187,27 +630,19 @@ log_message (log_ctx *log, bool trace_only, bool force,
         len --;
     }
 
-    msg[len] = '\0';
-
     /* Write to log */
     if (!dont_log) {
-        pthread_mutex_lock(&log_mutex);
-
-        log_buffer = str_append(log_buffer, msg);
-        log_buffer = str_append_c(log_buffer, '\n');
-
-        if ((log_configured && conf.dbg_enabled) || force) {
-            log_flush();
-        }
-
-        pthread_mutex_unlock(&log_mutex);
+        msg[len] = '\n';
+        log_write(now, msg, len + 1, force);
     }
 
+    msg[len] = '\0';
+
     /* Write to trace */
     if (t != NULL) {
         if (len > namelen) {
             char prefix[64];
-            log_fmt_time(prefix, sizeof(prefix));
+            log_fmt_time(prefix, sizeof(prefix), now);
             trace_printf(t, "%s: %s", prefix, msg);
         } else {
             trace_printf(t, "");
@@ -253,6 +688,9 @@ log_trace_data (log_ctx *log, const char *content_type,
 }
 
 /* Write an error message and terminate a program.
+ *
+ * The message is written synchronously, after all buffered
+ * messages, so nothing is lost on abort()
  */
 void
 log_panic (log_ctx *log, const char *fmt, ...)
@@ -32,6 +32,11 @@
  */
 #define MDNS_READY_TIMEOUT                      5
 
+/* Max count of AVAHI service resolvers in flight. Excessive
+ * resolve requests are queued
+ */
+#define MDNS_RESOLVE_MAX                        32
+
 /* MDNS_SERVICE represents numerical identifiers for
  * DNS-SD service types we are interested in
  */
@@ -54,12 +59,19 @@ typedef enum {
 #define MDNS_ACTION_LOOKUP      "lookup"
 
 /******************** Local Types *********************/
+/* mdns_resolve represents a pending request to resolve
+ * a service instance of the mdns_finding
+ */
+typedef struct mdns_resolve mdns_resolve;
+
 /* mdns_finding represents zeroconf_finding for MDNS
  * device discovery
  */
 typedef struct {
     zeroconf_finding     finding;        /* Base class */
-    AvahiServiceResolver **resolvers;    /* Array of pending resolvers */
+    mdns_resolve         **resolves;     /* Array of pending resolves */
+    uint32_t             resolved;       /* Resolved services, bitmask of
+                                            mdns_resolve_bit() */
     eloop_timer          *publish_timer; /* ZEROCONF_PUBLISH_DELAY timer */
     ll_node              node_list;      /* In mdns_finding_list */
     bool                 should_publish; /* Should we publish this finding */
@@ -67,6 +79,16 @@ typedef struct {
     bool                 initscan;       /* Device discovered during initial scan */
 } mdns_finding;
 
+struct mdns_resolve {
+    mdns_finding         *mdns;      /* Finding this request belongs to */
+    MDNS_SERVICE         service;    /* Service type */
+    AvahiProtocol        protocol;   /* Protocol the service was found on */
+    AvahiProtocol        aprotocol;  /* Address family to resolve */
+    const char           *domain;    /* Service domain */
+    AvahiServiceResolver *resolver;  /* Active resolver, NULL if queued */
+    ll_node              node_queue; /* In mdns_resolve_queue, if queued */
+};
+
 /* Static variables
  */
 static log_ctx *mdns_log;
@@ -80,6 +102,8 @@ static bool mdns_avahi_browser_running;
 static AvahiServiceBrowser *mdns_avahi_browser[NUM_MDNS_SERVICE];
 static bool mdns_initscan[NUM_MDNS_SERVICE];
 static int mdns_initscan_count[NUM_ZEROCONF_METHOD];
+static ll_head mdns_resolve_queue;
+static int mdns_resolve_active;
 
 /* Forward declarations
  */
@@ -92,6 +116,14 @@ mdns_avahi_client_start (void);
 static void
 mdns_avahi_client_restart_defer (void);
 
+static void
+mdns_avahi_resolver_callback (AvahiServiceResolver *r,
+        AvahiIfIndex interface, AvahiProtocol protocol,
+        AvahiResolverEvent event, const char *name, const char *type,
+        const char *domain, const char *host_name, const AvahiAddress *addr,
+        uint16_t port, AvahiStringList *txt, AvahiLookupResultFlags flags,
+        void *userdata);
+
 /* Print debug message
  */
 static void
@@ -272,6 +304,138 @@ mdns_avahi_client_state_name (AvahiClientState s)
     return buf;
 }
 
+/******************** Coalesced service resolving *********************/
+/* Get bit in the mdns_finding::resolved mask for the service
+ * and address family
+ */
+static uint32_t
+mdns_resolve_bit (MDNS_SERVICE service, AvahiProtocol aprotocol)
+{
+    return 1u << (service * 2 + (aprotocol == AVAHI_PROTO_INET6 ? 1 : 0));
+}
+
+/* Free mdns_resolve. If resolver is active, it is canceled, if
+ * request is queued, it is removed from the queue. Caller is
+ * responsible for removing request from the mdns_finding::resolves
+ */
+static void
+mdns_resolve_free (mdns_resolve *req)
+{
+    if (req->resolver != NULL) {
+        avahi_service_resolver_free(req->resolver);
+        mdns_resolve_active --;
+    } else {
+        ll_del(&req->node_queue);
+    }
+
+    mem_free((char*) req->domain);
+    mem_free(req);
+}
+
+/* Find pending mdns_resolve of the finding by its AVAHI resolver
+ */
+static mdns_resolve*
+mdns_resolve_by_resolver (mdns_finding *mdns, AvahiServiceResolver *r)
+{
+    size_t i, len = mem_len(mdns->resolves);
+
+    for (i = 0; i < len; i ++) {
+        if (mdns->resolves[i]->resolver == r) {
+            return mdns->resolves[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Start queued resolve requests, while count of active
+ * AVAHI resolvers is below the MDNS_RESOLVE_MAX
+ *
+ * Returns false, if AVAHI client needs restart. In this case,
+ * all findings are already deleted
+ */
+static bool
+mdns_resolve_schedule (void)
+{
+    ll_node *node;
+
+    while (mdns_resolve_active < MDNS_RESOLVE_MAX &&
+           (node = ll_pop_beg(&mdns_resolve_queue)) != NULL) {
+        mdns_resolve *req = OUTER_STRUCT(node, mdns_resolve, node_queue);
+        mdns_finding *mdns = req->mdns;
+        const char   *type = mdns_service_name(req->service);
+
+        req->resolver = avahi_service_resolver_new(mdns_avahi_client,
+                mdns->finding.ifindex, req->protocol, mdns->finding.name,
+                type, req->domain, req->aprotocol, 0,
+                mdns_avahi_resolver_callback, mdns);
+
+        if (req->resolver == NULL) {
+            /* Keep it queued, so mdns_resolve_free() works */
+            ll_push_beg(&mdns_resolve_queue, &req->node_queue);
+            mdns_perror(MDNS_ACTION_RESOLVE, mdns->finding.ifindex,
+                    req->aprotocol, type, mdns->finding.name);
+            mdns_avahi_client_restart_defer();
+            return false;
+        }
+
+        mdns_resolve_active ++;
+    }
+
+    return true;
+}
+
+/* Request resolving of the finding's service instance for the
+ * specified address family
+ *
+ * The same service instance is usually reported by the browser
+ * twice, once per MDNS protocol (IPv4 and IPv6), and both resolvers
+ * would return the same answer. So the request is ignored, if the
+ * same service and address family of the finding is already being
+ * resolved or was resolved before.
+ *
+ * Requests are queued to limit count of AVAHI resolvers in flight,
+ * so when many devices appear at once, early requests complete
+ * faster and D-Bus traffic to avahi-daemon is reduced. Queued
+ * requests of the finding, published before they are started,
+ * are simply dropped.
+ *
+ * Returns false, if AVAHI client needs restart
+ */
+static bool
+mdns_resolve_submit (mdns_finding *mdns, MDNS_SERVICE service,
+        AvahiProtocol protocol, AvahiProtocol aprotocol, const char *domain)
+{
+    mdns_resolve *req;
+    size_t       i, len = mem_len(mdns->resolves);
+
+    if ((mdns->resolved & mdns_resolve_bit(service, aprotocol)) != 0) {
+        return true;
+    }
+
+    for (i = 0; i < len; i ++) {
+        req = mdns->resolves[i];
+        if (req->service == service && req->aprotocol == aprotocol) {
+            mdns_debug(MDNS_ACTION_RESOLVE, mdns->finding.ifindex,
+                aprotocol, 0, mdns_service_name(service), mdns->finding.name,
+                "already pending");
+            return true;
+        }
+    }
+
+    req = mem_new(mdns_resolve, 1);
+    req->mdns = mdns;
+    req->service = service;
+    req->protocol = protocol;
+    req->aprotocol = aprotocol;
+    req->domain = str_dup(domain);
+
+    mdns->resolves = ptr_array_append(mdns->resolves, req);
+    ll_push_end(&mdns_resolve_queue, &req->node_queue);
+
+    return mdns_resolve_schedule();
+}
+
 /* Increment count of initial scan tasks
  */
 static void
@@ -305,7 +469,7 @@ mdns_finding_new (ZEROCONF_METHOD method, int ifindex, const char *name,
     mdns->finding.name = str_dup(name);
     mdns->finding.addrs = ip_addrset_new();
 
-    mdns->resolvers = ptr_array_new(AvahiServiceResolver*);
+    mdns->resolves = ptr_array_new(mdns_resolve*);
 
     mdns->initscan = initscan;
     if (mdns->initscan) {
@@ -329,7 +493,7 @@ mdns_finding_free (mdns_finding *mdns)
         mdns_initscan_count_dec(mdns->finding.method);
     }
 
-    mem_free(mdns->resolvers);
+    mem_free(mdns->resolves);
     mem_free(mdns);
 }
 
@@ -376,20 +540,20 @@ mdns_finding_get (ZEROCONF_METHOD method, int ifindex, const char *name,
     return mdns;
 }
 
-/* Kill pending resolvers
+/* Kill pending resolvers, both active and queued
  *
  * It also cancels mdns->publish_timer, if it is active
  */
 static void
 mdns_finding_kill_resolvers (mdns_finding *mdns)
 {
-    size_t i, len = mem_len(mdns->resolvers);
+    size_t i, len = mem_len(mdns->resolves);
 
     for (i = 0; i < len; i ++) {
-        avahi_service_resolver_free(mdns->resolvers[i]);
+        mdns_resolve_free(mdns->resolves[i]);
     }
 
-    ptr_array_trunc(mdns->resolvers);
+    ptr_array_trunc(mdns->resolves);
 
     if (mdns->publish_timer != NULL) {
         eloop_timer_cancel(mdns->publish_timer);
@@ -480,14 +644,53 @@ mdns_finding_publish_delay_timer_callback (void *data)
 
     mdns->publish_timer = NULL;
     mdns_finding_publish(mdns);
+    mdns_resolve_schedule();
+}
+
+/* Check if mdns_finding has everything, expected from its DNS-SD
+ * records: it is known to be a scanner, has eSCL endpoint, if
+ * discovered via _uscan._tcp/_uscans._tcp, and has addresses of
+ * all address families, configured on its network interface
+ */
+static bool
+mdns_finding_is_complete (mdns_finding *mdns)
+{
+    static const int afs[] = {AF_INET, AF_INET6};
+    size_t           i;
+
+    if (!mdns->should_publish) {
+        return false;
+    }
+
+    if (mdns->finding.method != ZEROCONF_MDNS_HINT &&
+        mdns->finding.endpoints == NULL) {
+        return false;
+    }
+
+    for (i = 0; i < sizeof(afs) / sizeof(afs[0]); i ++) {
+        if (netif_has_non_link_local_addr(afs[i], mdns->finding.ifindex) &&
+            !ip_addrset_has_af(mdns->finding.addrs, afs[i])) {
+            return false;
+        }
+    }
+
+    return true;
 }
 
 /* Publish mdns_finding with optional delay
+ *
+ * If some resolvers are still pending, but the finding already
+ * has everything we expect from it, it is published immediately,
+ * and remaining resolvers are canceled
  */
 static void
 mdns_finding_publish_delay (mdns_finding *mdns)
 {
-    if (mdns->resolvers[0] == NULL) {
+    if (mdns->resolves[0] == NULL) {
+        mdns_finding_publish(mdns);
+    } else if (mdns_finding_is_complete(mdns)) {
+        log_debug(mdns_log, "\"%s\": all expected addresses resolved",
+                mdns->finding.name);
         mdns_finding_publish(mdns);
     } else if (mdns->publish_timer == NULL) {
         mdns->publish_timer = eloop_timer_new(ZEROCONF_PUBLISH_DELAY,
@@ -672,6 +875,8 @@ mdns_avahi_resolver_callback (AvahiServiceResolver *r,
 {
     mdns_finding      *mdns = userdata;
     MDNS_SERVICE      service = mdns_service_by_name(type);
+    mdns_resolve      *req;
+    uint32_t          bit;
 
     (void) domain;
     (void) host_name;
@@ -692,17 +897,21 @@ mdns_avahi_resolver_callback (AvahiServiceResolver *r,
     }
 
     /* Remove resolver from list of pending ones */
-    if (!ptr_array_del(mdns->resolvers, ptr_array_find(mdns->resolvers, r))) {
+    req = mdns_resolve_by_resolver(mdns, r);
+    if (req == NULL) {
         mdns_debug(MDNS_ACTION_RESOLVE, interface, protocol, flags, type, name,
             "spurious avahi callback");
         return;
     }
 
-    avahi_service_resolver_free(r);
+    bit = mdns_resolve_bit(req->service, req->aprotocol);
+    ptr_array_del(mdns->resolves, ptr_array_find(mdns->resolves, req));
+    mdns_resolve_free(req);
 
     /* Handle event */
     switch (event) {
     case AVAHI_RESOLVER_FOUND:
+        mdns->resolved |= bit;
         mdns_avahi_resolver_found(mdns, service, txt, addr, port, interface);
         break;
 
@@ -718,6 +927,9 @@ mdns_avahi_resolver_callback (AvahiServiceResolver *r,
         int af = addr->proto == AVAHI_PROTO_INET ? AF_INET : AF_INET6;
         wsdd_send_directed_probe(interface, af, &addr->data);
     }
+
+    /* Start queued resolvers, if any */
+    mdns_resolve_schedule();
 }
 
 /* AVAHI browser callback
@@ -760,42 +972,19 @@ mdns_avahi_browser_callback (AvahiServiceBrowser *b, AvahiIfIndex interface,
         /* Add a device (or lookup for already added) */
         mdns = mdns_finding_get(method, interface, name, initscan);
 
-        /* Initiate resolver -- look for IPv4 addresses */
-        AvahiServiceResolver *r;
-
-        r = avahi_service_resolver_new(mdns_avahi_client, interface,
-                protocol, name, type, domain, AVAHI_PROTO_INET, 0,
-                mdns_avahi_resolver_callback, mdns);
-
-        if (r == NULL) {
-            mdns_perror(MDNS_ACTION_RESOLVE, interface, AVAHI_PROTO_INET,
-                    type, name);
-            mdns_avahi_client_restart_defer();
-            break;
-        }
-
-        mdns->resolvers = ptr_array_append(mdns->resolvers, r);
-
-        /* Initiate resolver -- look for IPv6 addresses */
-        r = avahi_service_resolver_new(mdns_avahi_client, interface,
-                protocol, name, type, domain, AVAHI_PROTO_INET6, 0,
-                mdns_avahi_resolver_callback, mdns);
-
-        if (r == NULL) {
-            mdns_perror(MDNS_ACTION_RESOLVE, interface, AVAHI_PROTO_INET6,
-                    type, name);
-            mdns_avahi_client_restart_defer();
-            break;
+        /* Request resolving of IPv4 and IPv6 addresses */
+        if (mdns_resolve_submit(mdns, service, protocol,
+                AVAHI_PROTO_INET, domain)) {
+            mdns_resolve_submit(mdns, service, protocol,
+                AVAHI_PROTO_INET6, domain);
         }
-
-        /* Attach resolver to device state */
-        mdns->resolvers = ptr_array_append(mdns->resolvers, r);
         break;
 
     case AVAHI_BROWSER_REMOVE:
         mdns = mdns_finding_find(method, interface, name);
         if (mdns != NULL) {
             mdns_finding_del(mdns);
+            mdns_resolve_schedule();
         }
         break;
 
@@ -1392,6 +1581,7 @@ mdns_init (void)
     mdns_log = log_ctx_new("MDNS", zeroconf_log);
 
     ll_init(&mdns_finding_list);
+    ll_init(&mdns_resolve_queue);
 
     if (!conf.discovery) {
         log_debug(mdns_log, "devices discovery disabled");
@@ -0,0 +1,742 @@
+/* AirScan (a.k.a. eSCL) backend for SANE
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * Performance counters
+ */
+
+#include "airscan.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+/* Number of latency histogram buckets. Bucket N counts latencies
+ * up to 2^N milliseconds, the last bucket counts everything above
+ */
+#define METRICS_HIST_BUCKETS    16
+
+/* Version of the JSON output format. Incremented on incompatible
+ * changes only; new fields may be added without notice
+ */
+#define METRICS_JSON_VERSION    1
+
+/* metrics_hist represents latency histogram
+ */
+typedef struct {
+    uint64_t sum;                           /* Sum of latencies, ms */
+    uint64_t max;                           /* Max latency, ms */
+    uint64_t buckets[METRICS_HIST_BUCKETS]; /* Counts by bucket */
+} metrics_hist;
+
+/* metrics_op represents counters of HTTP queries of a single
+ * PROTO_OP. PROTO_OP_NONE is used for capabilities probes
+ */
+typedef struct {
+    uint64_t     requests;      /* Count of completed queries */
+    uint64_t     errors;        /* Count of transport errors */
+    uint64_t     http_4xx;      /* Count of 4xx responses */
+    uint64_t     http_5xx;      /* Count of 5xx responses */
+    uint64_t     http_503;      /* Count of 503 responses */
+    uint64_t     retries;       /* Count of retried queries */
+    metrics_hist latency;       /* Latency histogram */
+} metrics_op;
+
+/* metrics_endpoint represents per-endpoint counters
+ */
+typedef struct {
+    char     *uri;              /* Endpoint URI */
+    uint64_t requests;          /* Count of completed queries */
+    uint64_t bytes;             /* Bytes of response bodies received */
+} metrics_endpoint;
+
+/* metrics_format represents per image format decoding counters
+ */
+typedef struct {
+    uint64_t images;            /* Count of decoded images */
+    uint64_t bytes;             /* Bytes of compressed images */
+    uint64_t decode_ns;         /* CPU time spent in decoder */
+    uint64_t filter_ns;         /* CPU time spent in image filters */
+} metrics_format;
+
+/* metrics represents performance counters of a device
+ */
+struct metrics {
+    char             *name;                   /* Device name */
+    uint64_t         opens;                   /* Count of device opens */
+    uint64_t         jobs;                    /* Count of finished jobs */
+    uint64_t         jobs_failed;             /* Jobs finished with error */
+    uint64_t         pages;                   /* Count of received pages */
+    metrics_endpoint *endpoints;              /* Per-endpoint, mem array */
+    metrics_op       ops[PROTO_OP_FINISH];    /* Per-operation counters */
+    metrics_format   formats[NUM_ID_FORMAT];  /* Per-format counters */
+    uint64_t         read_calls;              /* Count of sane_read() */
+    uint64_t         read_bytes;              /* Bytes returned */
+    uint64_t         read_blocked_ns;         /* Time blocked in sane_read() */
+    uint64_t         queue_bytes;             /* Bytes in read_queue now */
+    uint64_t         queue_peak_depth;        /* Peak read_queue depth */
+    uint64_t         queue_peak_bytes;        /* Peak read_queue size */
+    uint64_t         loads_paused;            /* Loads paused by budget */
+};
+
+/* Global counters, not bound to any device
+ */
+static struct {
+    uint64_t http_requests;             /* Count of completed queries */
+    uint64_t http_errors;               /* Count of transport errors */
+    uint64_t http_bytes;                /* Bytes of response bodies */
+    uint64_t tls_handshakes;            /* Successful TLS handshakes */
+    uint64_t tls_failures;              /* Failed TLS handshakes */
+} metrics_global;
+
+/* Static variables
+ */
+static metrics   **metrics_table;
+static timestamp metrics_start_time;
+
+/* Short names of operations, for JSON
+ */
+static const char *metrics_op_names[PROTO_OP_FINISH] = {
+    [PROTO_OP_NONE]     = "devcaps",
+    [PROTO_OP_PRECHECK] = "precheck",
+    [PROTO_OP_SCAN]     = "scan",
+    [PROTO_OP_LOAD]     = "load",
+    [PROTO_OP_CHECK]    = "check",
+    [PROTO_OP_CLEANUP]  = "cleanup"
+};
+
+/* Forward declarations
+ */
+static void
+metrics_writer_stop_and_join (void);
+
+/* Get monotonic time in nanoseconds. timestamp_now() has only
+ * millisecond resolution, which is too coarse for short waits
+ */
+uint64_t
+metrics_clock (void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000 + (uint64_t) t.tv_nsec;
+}
+
+/* Initialize performance counters
+ */
+SANE_Status
+metrics_init (void)
+{
+    metrics_table = ptr_array_new(metrics*);
+    metrics_start_time = timestamp_now();
+    memset(&metrics_global, 0, sizeof(metrics_global));
+
+    return SANE_STATUS_GOOD;
+}
+
+/* Cleanup performance counters. The counters file, if configured,
+ * is written for the last time
+ */
+void
+metrics_cleanup (void)
+{
+    size_t i;
+
+    if (metrics_table == NULL) {
+        return;
+    }
+
+    metrics_save();
+    metrics_writer_stop_and_join();
+
+    for (i = 0; i < mem_len(metrics_table); i ++) {
+        metrics *m = metrics_table[i];
+        size_t  j;
+
+        for (j = 0; j < mem_len(m->endpoints); j ++) {
+            mem_free(m->endpoints[j].uri);
+        }
+
+        mem_free(m->endpoints);
+        mem_free(m->name);
+        mem_free(m);
+    }
+
+    mem_free(metrics_table);
+    metrics_table = NULL;
+}
+
+/* Get counters of the device, creating them if necessary, and count
+ * the device open
+ */
+metrics*
+metrics_get (const char *name)
+{
+    metrics *m = NULL;
+    size_t  i;
+
+    for (i = 0; m == NULL && i < mem_len(metrics_table); i ++) {
+        if (!strcmp(metrics_table[i]->name, name)) {
+            m = metrics_table[i];
+        }
+    }
+
+    if (m == NULL) {
+        m = mem_new(metrics, 1);
+        m->name = str_dup(name);
+        m->endpoints = mem_new(metrics_endpoint, 0);
+        metrics_table = ptr_array_append(metrics_table, m);
+    }
+
+    m->opens ++;
+    m->queue_bytes = 0;
+
+    return m;
+}
+
+/* Get per-endpoint counters, creating them if necessary
+ */
+static metrics_endpoint*
+metrics_endpoint_get (metrics *m, http_uri *uri)
+{
+    const char *s = http_uri_str(uri);
+    size_t     i, len = mem_len(m->endpoints);
+
+    for (i = 0; i < len; i ++) {
+        if (!strcmp(m->endpoints[i].uri, s)) {
+            return &m->endpoints[i];
+        }
+    }
+
+    m->endpoints = mem_resize(m->endpoints, len + 1, 0);
+    memset(&m->endpoints[len], 0, sizeof(m->endpoints[len]));
+    m->endpoints[len].uri = str_dup(s);
+
+    return &m->endpoints[len];
+}
+
+/* Add sample to the latency histogram
+ */
+static void
+metrics_hist_add (metrics_hist *hist, timestamp t)
+{
+    uint64_t     ms = t > 0 ? (uint64_t) t : 0;
+    unsigned int n = 0;
+
+    while (n < METRICS_HIST_BUCKETS - 1 && ms > ((uint64_t) 1 << n)) {
+        n ++;
+    }
+
+    hist->buckets[n] ++;
+    hist->sum += ms;
+    if (ms > hist->max) {
+        hist->max = ms;
+    }
+}
+
+/* Count completed HTTP query of the device, performed as a part
+ * of the operation op, against the endpoint
+ */
+void
+metrics_http_query (metrics *m, PROTO_OP op, http_uri *endpoint,
+        const http_query *q)
+{
+    metrics_op       *mop = &m->ops[op];
+    metrics_endpoint *ep = metrics_endpoint_get(m, endpoint);
+    int              status;
+
+    mop->requests ++;
+    metrics_hist_add(&mop->latency, timestamp_now() - http_query_timestamp(q));
+
+    ep->requests ++;
+    ep->bytes += http_query_get_response_data(q)->size;
+
+    if (http_query_transport_error(q) != NULL) {
+        mop->errors ++;
+        return;
+    }
+
+    status = http_query_status(q);
+    if (status >= 500) {
+        mop->http_5xx ++;
+        if (status == HTTP_STATUS_SERVICE_UNAVAILABLE) {
+            mop->http_503 ++;
+        }
+    } else if (status >= 400) {
+        mop->http_4xx ++;
+    }
+}
+
+/* Count HTTP transport error of the operation, that was reported
+ * without the query
+ */
+void
+metrics_http_error (metrics *m, PROTO_OP op)
+{
+    m->ops[op].errors ++;
+}
+
+/* Count retry of the operation
+ */
+void
+metrics_retry (metrics *m, PROTO_OP op)
+{
+    m->ops[op].retries ++;
+}
+
+/* Count finished scan job
+ */
+void
+metrics_job (metrics *m, SANE_Status status)
+{
+    m->jobs ++;
+    if (status != SANE_STATUS_GOOD && status != SANE_STATUS_NO_DOCS) {
+        m->jobs_failed ++;
+    }
+}
+
+/* Count fully decoded image
+ */
+void
+metrics_image (metrics *m, ID_FORMAT fmt, size_t bytes,
+        uint64_t decode_ns, uint64_t filter_ns)
+{
+    metrics_format *mf = &m->formats[fmt];
+
+    mf->images ++;
+    mf->bytes += bytes;
+    mf->decode_ns += decode_ns;
+    mf->filter_ns += filter_ns;
+}
+
+/* Count sane_read() call, that returned `bytes' bytes after
+ * being blocked for `blocked_ns' nanoseconds
+ */
+void
+metrics_read (metrics *m, size_t bytes, uint64_t blocked_ns)
+{
+    m->read_calls ++;
+    m->read_bytes += bytes;
+    m->read_blocked_ns += blocked_ns;
+}
+
+/* Count image, pushed into the read_queue
+ */
+void
+metrics_queue_push (metrics *m, size_t bytes, size_t depth)
+{
+    m->pages ++;
+    m->queue_bytes += bytes;
+    if (m->queue_bytes > m->queue_peak_bytes) {
+        m->queue_peak_bytes = m->queue_bytes;
+    }
+    if (depth > m->queue_peak_depth) {
+        m->queue_peak_depth = depth;
+    }
+}
+
+/* Count image, pulled from the read_queue
+ */
+void
+metrics_queue_pull (metrics *m, size_t bytes)
+{
+    m->queue_bytes -= bytes < m->queue_bytes ? bytes : m->queue_bytes;
+}
+
+/* Count the read_queue purge
+ */
+void
+metrics_queue_purge (metrics *m)
+{
+    m->queue_bytes = 0;
+}
+
+/* Count PROTO_OP_LOAD, paused because read_queue exceeds
+ * its memory budget
+ */
+void
+metrics_load_paused (metrics *m)
+{
+    m->loads_paused ++;
+}
+
+/* Count completed HTTP query, globally
+ */
+void
+metrics_http_complete (const http_query *q)
+{
+    metrics_global.http_requests ++;
+    metrics_global.http_bytes += http_query_get_response_data(q)->size;
+
+    if (http_query_transport_error(q) != NULL) {
+        metrics_global.http_errors ++;
+    }
+}
+
+/* Count TLS handshake
+ */
+void
+metrics_tls_handshake (bool ok)
+{
+    if (ok) {
+        metrics_global.tls_handshakes ++;
+    } else {
+        metrics_global.tls_failures ++;
+    }
+}
+
+/* Append JSON string to the output
+ */
+static char*
+metrics_json_str (char *out, const char *s)
+{
+    out = str_append_c(out, '"');
+    for (; *s != '\0'; s ++) {
+        unsigned char c = (unsigned char) *s;
+
+        if (c == '"' || c == '\\') {
+            out = str_append_c(out, '\\');
+            out = str_append_c(out, (char) c);
+        } else if (c < 0x20) {
+            out = str_append_printf(out, "\\u%4.4x", c);
+        } else {
+            out = str_append_c(out, (char) c);
+        }
+    }
+
+    return str_append_c(out, '"');
+}
+
+/* Format nanoseconds as milliseconds
+ */
+static char*
+metrics_json_ms (char *out, const char *name, uint64_t ns)
+{
+    return str_append_printf(out, "\"%s\": %.3f", name, ns / 1e6);
+}
+
+/* Append per-operation counters to the output
+ */
+static char*
+metrics_json_ops (char *out, const metrics *m)
+{
+    int i, n;
+
+    out = str_append(out, "      \"ops\": {");
+    for (i = 0; i < PROTO_OP_FINISH; i ++) {
+        const metrics_op *mop = &m->ops[i];
+
+        out = str_append_printf(out, "%s\n        \"%s\": {", i ? "," : "",
+            metrics_op_names[i]);
+        out = str_append_printf(out, "\"requests\": %llu, \"errors\": %llu, "
+            "\"http_4xx\": %llu, \"http_5xx\": %llu, \"http_503\": %llu, "
+            "\"retries\": %llu,\n",
+            (unsigned long long) mop->requests,
+            (unsigned long long) mop->errors,
+            (unsigned long long) mop->http_4xx,
+            (unsigned long long) mop->http_5xx,
+            (unsigned long long) mop->http_503,
+            (unsigned long long) mop->retries);
+        out = str_append_printf(out, "          \"latency_ms\": "
+            "{\"sum\": %llu, \"max\": %llu, \"buckets\": [",
+            (unsigned long long) mop->latency.sum,
+            (unsigned long long) mop->latency.max);
+
+        for (n = 0; n < METRICS_HIST_BUCKETS; n ++) {
+            out = str_append_printf(out, "%s%llu", n ? ", " : "",
+                (unsigned long long) mop->latency.buckets[n]);
+        }
+
+        out = str_append(out, "]}}");
+    }
+
+    return str_append(out, "\n      },\n");
+}
+
+/* Append per-device counters to the output
+ */
+static char*
+metrics_json_device (char *out, const metrics *m)
+{
+    size_t i;
+    bool   first = true;
+
+    out = str_append(out, "    {\n      \"name\": ");
+    out = metrics_json_str(out, m->name);
+    out = str_append_printf(out, ",\n      \"opens\": %llu, \"jobs\": %llu, "
+        "\"jobs_failed\": %llu, \"pages\": %llu,\n",
+        (unsigned long long) m->opens, (unsigned long long) m->jobs,
+        (unsigned long long) m->jobs_failed, (unsigned long long) m->pages);
+
+    /* Endpoints */
+    out = str_append(out, "      \"endpoints\": [");
+    for (i = 0; i < mem_len(m->endpoints); i ++) {
+        const metrics_endpoint *ep = &m->endpoints[i];
+
+        out = str_append(out, i ? ",\n" : "\n");
+        out = str_append(out, "        {\"uri\": ");
+        out = metrics_json_str(out, ep->uri);
+        out = str_append_printf(out,
+            ", \"requests\": %llu, \"bytes_received\": %llu}",
+            (unsigned long long) ep->requests, (unsigned long long) ep->bytes);
+    }
+    out = str_append(out, i ? "\n      ],\n" : "],\n");
+
+    /* Operations */
+    out = metrics_json_ops(out, m);
+
+    /* Image formats */
+    out = str_append(out, "      \"formats\": {");
+    for (i = 0; i < NUM_ID_FORMAT; i ++) {
+        const metrics_format *mf = &m->formats[i];
+
+        if (mf->images == 0) {
+            continue;
+        }
+
+        out = str_append_printf(out, "%s\n        \"%s\": {\"images\": %llu, "
+            "\"bytes\": %llu, ", first ? "" : ",",
+            id_format_short_name((ID_FORMAT) i),
+            (unsigned long long) mf->images, (unsigned long long) mf->bytes);
+        out = metrics_json_ms(out, "decode_cpu_ms", mf->decode_ns);
+        out = str_append(out, ", ");
+        out = metrics_json_ms(out, "filter_cpu_ms", mf->filter_ns);
+        out = str_append(out, "}");
+        first = false;
+    }
+    out = str_append(out, first ? "},\n" : "\n      },\n");
+
+    /* Reading */
+    out = str_append_printf(out, "      \"read\": {\"calls\": %llu, "
+        "\"bytes\": %llu, ",
+        (unsigned long long) m->read_calls,
+        (unsigned long long) m->read_bytes);
+    out = metrics_json_ms(out, "blocked_ms", m->read_blocked_ns);
+    out = str_append(out, "},\n");
+
+    out = str_append_printf(out, "      \"read_queue\": "
+        "{\"peak_depth\": %llu, \"peak_bytes\": %llu, "
+        "\"loads_paused\": %llu}\n    }",
+        (unsigned long long) m->queue_peak_depth,
+        (unsigned long long) m->queue_peak_bytes,
+        (unsigned long long) m->loads_paused);
+
+    return out;
+}
+
+/* Format all counters as JSON and append to the string
+ */
+char*
+metrics_json (char *out)
+{
+    size_t i;
+    int    n;
+
+    out = str_append_printf(out, "{\n  \"version\": %d,\n  \"program\": ",
+        METRICS_JSON_VERSION);
+    out = metrics_json_str(out, os_progname() ? os_progname() : "unknown");
+    out = str_append_printf(out, ",\n  \"pid\": %d,\n  \"time\": %lld,\n"
+        "  \"uptime_ms\": %lld",
+        (int) getpid(), (long long) time(NULL),
+        (long long) (timestamp_now() - metrics_start_time));
+
+    out = str_append(out, ",\n  \"latency_buckets_ms\": [");
+    for (n = 0; n < METRICS_HIST_BUCKETS - 1; n ++) {
+        out = str_append_printf(out, "%s%llu", n ? ", " : "",
+            (unsigned long long) 1 << n);
+    }
+    out = str_append(out, ", null],\n");
+
+    out = str_append_printf(out, "  \"global\": {\"http_requests\": %llu, "
+        "\"http_errors\": %llu, \"http_bytes_received\": %llu, "
+        "\"tls_handshakes\": %llu, \"tls_handshake_failures\": %llu},\n",
+        (unsigned long long) metrics_global.http_requests,
+        (unsigned long long) metrics_global.http_errors,
+        (unsigned long long) metrics_global.http_bytes,
+        (unsigned long long) metrics_global.tls_handshakes,
+        (unsigned long long) metrics_global.tls_failures);
+
+    out = str_append(out, "  \"devices\": [");
+    for (i = 0; i < mem_len(metrics_table); i ++) {
+        out = str_append(out, i ? ",\n" : "\n");
+        out = metrics_json_device(out, metrics_table[i]);
+    }
+    out = str_append(out, i ? "\n  ]\n}\n" : "]\n}\n");
+
+    return out;
+}
+
+/******************** Writer thread ********************/
+/* Counters are formatted under the eloop mutex, but written into
+ * the file by the dedicated writer thread, so slow disk doesn't
+ * stall the event loop. Only the latest snapshot is kept pending:
+ * older one, not written yet, is simply replaced
+ */
+static pthread_mutex_t metrics_writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  metrics_writer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t       metrics_writer_thread;
+static bool            metrics_writer_started;
+static bool            metrics_writer_stop;
+static char            *metrics_writer_path;  /* Pending file path */
+static char            *metrics_writer_json;  /* Pending counters */
+
+/* Write counters into the file.
+ *
+ * File is written atomically, via uniquely named temporary file
+ * in the same directory and rename(), so concurrent processes
+ * don't corrupt it
+ */
+static void
+metrics_writer_write (const char *path, const char *json)
+{
+    char *tmp = str_concat(path, ".XXXXXX", NULL);
+    FILE *fp = NULL;
+    int  fd;
+    bool ok;
+
+    /* mkstemp() creates file with 0600 mode. Make it readable,
+     * like regular files, so airscan-discover(1) running under
+     * other user can print it
+     */
+    fd = mkstemp(tmp);
+    if (fd >= 0) {
+        if (fchmod(fd, 0644) == 0) {
+            fp = fdopen(fd, "w");
+        }
+
+        if (fp == NULL) {
+            int err = errno;
+            close(fd);
+            unlink(tmp);
+            errno = err;
+        }
+    }
+
+    if (fp == NULL) {
+        log_debug(NULL, "metrics: %s: %s", path, strerror(errno));
+        goto DONE;
+    }
+
+    ok = fwrite(json, str_len(json), 1, fp) == 1;
+    ok = fclose(fp) == 0 && ok;
+    ok = ok && rename(tmp, path) == 0;
+
+    if (!ok) {
+        log_debug(NULL, "metrics: %s: %s", path, strerror(errno));
+        unlink(tmp);
+    }
+
+DONE:
+    mem_free(tmp);
+}
+
+/* The writer thread
+ */
+static void*
+metrics_writer_thread_func (void *p)
+{
+    (void) p;
+
+    pthread_mutex_lock(&metrics_writer_mutex);
+
+    for (;;) {
+        char *path = metrics_writer_path, *json = metrics_writer_json;
+
+        if (json == NULL) {
+            if (metrics_writer_stop) {
+                break;
+            }
+
+            pthread_cond_wait(&metrics_writer_cond, &metrics_writer_mutex);
+            continue;
+        }
+
+        metrics_writer_path = metrics_writer_json = NULL;
+        pthread_mutex_unlock(&metrics_writer_mutex);
+
+        metrics_writer_write(path, json);
+        mem_free(path);
+        mem_free(json);
+
+        pthread_mutex_lock(&metrics_writer_mutex);
+    }
+
+    pthread_mutex_unlock(&metrics_writer_mutex);
+
+    return NULL;
+}
+
+/* Submit counters for writing, starting the writer thread,
+ * if not started yet. Takes ownership of path and json
+ */
+static void
+metrics_writer_submit (char *path, char *json)
+{
+    int rc = 0;
+
+    pthread_mutex_lock(&metrics_writer_mutex);
+
+    mem_free(metrics_writer_path);
+    mem_free(metrics_writer_json);
+    metrics_writer_path = path;
+    metrics_writer_json = json;
+
+    if (!metrics_writer_started) {
+        metrics_writer_stop = false;
+        rc = pthread_create(&metrics_writer_thread, NULL,
+            metrics_writer_thread_func, NULL);
+        metrics_writer_started = rc == 0;
+    }
+
+    pthread_cond_signal(&metrics_writer_cond);
+    pthread_mutex_unlock(&metrics_writer_mutex);
+
+    if (rc != 0) {
+        log_panic(NULL, "pthread_create: %s", strerror(rc));
+    }
+}
+
+/* Stop the writer thread, after pending counters are written
+ */
+static void
+metrics_writer_stop_and_join (void)
+{
+    pthread_mutex_lock(&metrics_writer_mutex);
+    if (!metrics_writer_started) {
+        pthread_mutex_unlock(&metrics_writer_mutex);
+        return;
+    }
+
+    metrics_writer_stop = true;
+    pthread_cond_signal(&metrics_writer_cond);
+    pthread_mutex_unlock(&metrics_writer_mutex);
+
+    pthread_join(metrics_writer_thread, NULL);
+    metrics_writer_started = false;
+}
+
+/* Save counters into the conf.metrics_file, if configured.
+ *
+ * Counters are formatted by the caller, and written in background
+ * by the writer thread. Counters are not merged: the file contains
+ * counters of the process that saved it last
+ */
+void
+metrics_save (void)
+{
+    if (conf.metrics_file == NULL || metrics_table == NULL) {
+        return;
+    }
+
+    metrics_writer_submit(str_dup(conf.metrics_file),
+        metrics_json(str_new()));
+}
+
+/* vim:ts=8:sw=4:et
+ */
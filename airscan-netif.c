@@ -24,74 +24,157 @@
 #include <net/if.h>
 #include <sys/socket.h>
 
+/* netif_entry represents a single network interface address
+ */
+typedef struct {
+    int           ifindex;   /* Interface index */
+    netif_name    ifname;    /* Interface name */
+    bool          loopback;  /* Loopback interface */
+    int           af;        /* AF_INET or AF_INET6 */
+    uint8_t       ip[16];    /* Address bytes */
+    int           prefixlen; /* Network prefix length, -1 if unknown */
+} netif_entry;
+
+/* netif_trie_node represents a node of the binary prefix trie,
+ * used for longest-prefix match of addresses against local networks
+ */
+typedef struct {
+    uint32_t      child[2];  /* Children indices, 0 if none */
+    uint8_t       flags;     /* NETIF_TRIE_xxx */
+} netif_trie_node;
+
+#define NETIF_TRIE_DIRECT       0x01    /* Local network prefix ends here */
+#define NETIF_TRIE_LOCAL        0x02    /* Host's own address ends here */
+
+/* Roots of the prefix trie, per address family
+ */
+#define NETIF_TRIE_ROOT_IPV4    0
+#define NETIF_TRIE_ROOT_IPV6    1
+
 /* Static variables */
 static int netif_rtnetlink_sock = -1;
 static eloop_fdpoll *netif_rtnetlink_fdpoll;
 static ll_head netif_notifier_list;
-static struct ifaddrs *netif_ifaddrs;
+static netif_entry *netif_entries;
+static netif_trie_node *netif_trie;
 
 /* Forward declarations */
 static netif_addr*
 netif_addr_list_sort (netif_addr *list);
 
-/* Get distance to the target address
+/* Get address length in bits
  */
-NETIF_DISTANCE
-netif_distance_get (const struct sockaddr *addr)
+static int
+netif_af_bits (int af)
 {
-    struct ifaddrs         *ifa;
-    struct in_addr         addr4, ifaddr4, ifmask4;
-    struct in6_addr        addr6, ifaddr6, ifmask6;
-    static struct in6_addr zero6;
-    size_t                 i;
-    NETIF_DISTANCE         distance = NETIF_DISTANCE_ROUTED;
-
-    for (ifa = netif_ifaddrs; ifa != NULL; ifa = ifa->ifa_next) {
-        /* Skip interface without address or netmask */
-        if (ifa->ifa_addr == NULL || ifa->ifa_netmask == NULL) {
-            continue;
-        }
+    return af == AF_INET ? 32 : 128;
+}
 
-        /* Compare address family */
-        if (addr->sa_family != ifa->ifa_addr->sa_family) {
-            continue;
+/* Get address bit
+ */
+static int
+netif_ip_bit (const uint8_t *ip, int bit)
+{
+    return (ip[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+/* Insert address prefix into the trie
+ */
+static void
+netif_trie_insert (int af, const uint8_t *ip, int prefixlen, uint8_t flags)
+{
+    uint32_t node = af == AF_INET ? NETIF_TRIE_ROOT_IPV4 : NETIF_TRIE_ROOT_IPV6;
+    int      i;
+
+    for (i = 0; i < prefixlen; i ++) {
+        int bit = netif_ip_bit(ip, i);
+
+        if (netif_trie[node].child[bit] == 0) {
+            size_t len = mem_len(netif_trie);
+
+            netif_trie = mem_resize(netif_trie, len + 1, 0);
+            memset(&netif_trie[len], 0, sizeof(netif_trie[len]));
+            netif_trie[node].child[bit] = (uint32_t) len;
         }
 
-        /* Check direct reachability */
-        switch (addr->sa_family) {
-        case AF_INET:
-            addr4 = ((struct sockaddr_in*) addr)->sin_addr;
-            ifaddr4 = ((struct sockaddr_in*) ifa->ifa_addr)->sin_addr;
-            ifmask4 = ((struct sockaddr_in*) ifa->ifa_netmask)->sin_addr;
+        node = netif_trie[node].child[bit];
+    }
 
-            if (addr4.s_addr == ifaddr4.s_addr) {
-                return NETIF_DISTANCE_LOOPBACK;
-            }
+    netif_trie[node].flags |= flags;
+}
 
-            if (((addr4.s_addr ^ ifaddr4.s_addr) & ifmask4.s_addr) == 0) {
-                distance = NETIF_DISTANCE_DIRECT;
-            }
-            break;
+/* Rebuild the prefix trie from netif_entries
+ */
+static void
+netif_trie_rebuild (void)
+{
+    size_t i, len = mem_len(netif_entries);
 
-        case AF_INET6:
-            addr6 = ((struct sockaddr_in6*) addr)->sin6_addr;
-            ifaddr6 = ((struct sockaddr_in6*) ifa->ifa_addr)->sin6_addr;
-            ifmask6 = ((struct sockaddr_in6*) ifa->ifa_netmask)->sin6_addr;
+    netif_trie = mem_resize(netif_trie, 2, 0);
+    memset(netif_trie, 0, 2 * sizeof(*netif_trie));
 
-            if (!memcmp(&addr6, &ifaddr6, sizeof(struct in6_addr))) {
-                return NETIF_DISTANCE_LOOPBACK;
-            }
+    for (i = 0; i < len; i ++) {
+        const netif_entry *ent = &netif_entries[i];
 
-            for (i = 0; i < sizeof(struct in6_addr); i ++) {
-                addr6.s6_addr[i] ^= ifaddr6.s6_addr[i];
-                addr6.s6_addr[i] &= ifmask6.s6_addr[i];
-            }
+        if (ent->prefixlen >= 0) {
+            netif_trie_insert(ent->af, ent->ip, ent->prefixlen,
+                NETIF_TRIE_DIRECT);
+            netif_trie_insert(ent->af, ent->ip, netif_af_bits(ent->af),
+                NETIF_TRIE_LOCAL);
+        }
+    }
+}
+
+/* Get distance to the target address
+ *
+ * The target is looked up in the prefix trie: if the walk reaches
+ * the host's own address, it is LOOPBACK, if any local network
+ * prefix is passed on the way, it is DIRECT, otherwise ROUTED
+ */
+NETIF_DISTANCE
+netif_distance_get (const struct sockaddr *addr)
+{
+    const uint8_t  *ip;
+    uint32_t       node;
+    int            i, bits;
+    NETIF_DISTANCE distance = NETIF_DISTANCE_ROUTED;
+
+    switch (addr->sa_family) {
+    case AF_INET:
+        ip = (const uint8_t*) &((struct sockaddr_in*) addr)->sin_addr;
+        node = NETIF_TRIE_ROOT_IPV4;
+        break;
+
+    case AF_INET6:
+        ip = (const uint8_t*) &((struct sockaddr_in6*) addr)->sin6_addr;
+        node = NETIF_TRIE_ROOT_IPV6;
+        break;
+
+    default:
+        return distance;
+    }
 
-            if (!memcmp(&addr6, &zero6, sizeof(struct in6_addr))) {
-                distance = NETIF_DISTANCE_DIRECT;
+    if (netif_trie == NULL) {
+        return distance;
+    }
+
+    bits = netif_af_bits(addr->sa_family);
+    for (i = 0; ; i ++) {
+        if ((netif_trie[node].flags & NETIF_TRIE_DIRECT) != 0) {
+            distance = NETIF_DISTANCE_DIRECT;
+        }
+
+        if (i == bits) {
+            if ((netif_trie[node].flags & NETIF_TRIE_LOCAL) != 0) {
+                distance = NETIF_DISTANCE_LOOPBACK;
             }
             break;
         }
+
+        node = netif_trie[node].child[netif_ip_bit(ip, i)];
+        if (node == 0) {
+            break;
+        }
     }
 
     return distance;
@@ -103,33 +186,52 @@ netif_distance_get (const struct sockaddr *addr)
 bool
 netif_has_non_link_local_addr (int af, int ifindex)
 {
-    struct ifaddrs *ifa;
+    size_t i, len = mem_len(netif_entries);
 
-    for (ifa = netif_ifaddrs; ifa != NULL; ifa = ifa->ifa_next) {
-        struct sockaddr *addr;
+    for (i = 0; i < len; i ++) {
+        const netif_entry *ent = &netif_entries[i];
 
-        /* Skip interface without address */
-        if ((addr = ifa->ifa_addr) == NULL) {
-            continue;
+        if (ent->af == af && ent->ifindex == ifindex &&
+            !ip_is_linklocal(af, ent->ip)) {
+            return true;
         }
+    }
+
+    return false;
+}
+
+/* Choose network interface to reach the target address
+ */
+int
+netif_ifindex_for_addr (int af, const void *addr)
+{
+    size_t i, len = mem_len(netif_entries);
+    int    ifindex = 0;
 
-        /* Check address family against requested */
-        if (addr->sa_family != af) {
+    for (i = 0; i < len; i ++) {
+        const netif_entry *ent = &netif_entries[i];
+        int               bit;
+
+        if (ent->af != af || ent->loopback) {
             continue;
         }
 
-        /* Skip link-local addresses */
-        if (ip_sockaddr_is_linklocal(addr)) {
-            continue;
+        if (ifindex == 0) {
+            ifindex = ent->ifindex;
         }
 
-        /* Check interface index */
-        if (ifindex == (int) if_nametoindex(ifa->ifa_name)) {
-            return true;
+        for (bit = 0; bit < ent->prefixlen; bit ++) {
+            if (netif_ip_bit(ent->ip, bit) != netif_ip_bit(addr, bit)) {
+                break;
+            }
+        }
+
+        if (ent->prefixlen >= 0 && bit == ent->prefixlen) {
+            return ent->ifindex;
         }
     }
 
-    return false;
+    return ifindex;
 }
 
 /* Get list of network interfaces addresses
@@ -140,58 +242,33 @@ netif_has_non_link_local_addr (int af, int ifindex)
 netif_addr*
 netif_addr_list_get (void)
 {
-    struct ifaddrs *ifa;
-    netif_addr     *list = NULL, *addr;
+    netif_addr *list = NULL, *addr;
+    size_t     i, len = mem_len(netif_entries);
 
-    for (ifa = netif_ifaddrs; ifa != NULL; ifa = ifa->ifa_next) {
-        /* Skip interface without address */
-        if (ifa->ifa_addr == NULL) {
-            continue;
-        }
+    for (i = 0; i < len; i ++) {
+        const netif_entry *ent = &netif_entries[i];
 
         /* Skip loopback interface */
-        if ((ifa->ifa_flags & IFF_LOOPBACK) != 0) {
-            continue;
-        }
-
-        /* Obtain interface index. Skip address, if it failed */
-        int idx = if_nametoindex(ifa->ifa_name);
-        if (idx <= 0) {
+        if (ent->loopback) {
             continue;
         }
 
-        /* Translate struct ifaddrs to netif_addr */
+        /* Translate netif_entry to netif_addr */
         addr = mem_new(netif_addr, 1);
-        addr->next = list;
-        addr->ifindex = idx;
-        strncpy(addr->ifname.text, ifa->ifa_name,
-            sizeof(addr->ifname.text) - 1);
-
-        switch (ifa->ifa_addr->sa_family) {
-        case AF_INET:
-            addr->ip.v4 = ((struct sockaddr_in*) ifa->ifa_addr)->sin_addr;
-            inet_ntop(AF_INET, &addr->ip.v4,
-                addr->straddr, sizeof(addr->straddr));
-            break;
-
-        case AF_INET6:
-            addr->ipv6 = true;
-            addr->ip.v6 = ((struct sockaddr_in6*) ifa->ifa_addr)->sin6_addr;
-            inet_ntop(AF_INET6, &addr->ip.v6,
-                addr->straddr, sizeof(addr->straddr));
-            break;
+        addr->ifindex = ent->ifindex;
+        addr->ifname = ent->ifname;
+        addr->ipv6 = ent->af == AF_INET6;
 
-        default:
-            /* Paranoia; should not actually happen */
-            mem_free(addr);
-            addr = NULL;
-            break;
+        if (addr->ipv6) {
+            memcpy(&addr->ip.v6, ent->ip, sizeof(addr->ip.v6));
+        } else {
+            memcpy(&addr->ip.v4, ent->ip, sizeof(addr->ip.v4));
         }
 
-        if (addr != NULL) {
-            addr->next = list;
-            list = addr;
-        }
+        inet_ntop(ent->af, &addr->ip, addr->straddr, sizeof(addr->straddr));
+
+        addr->next = list;
+        list = addr;
     }
 
     return netif_addr_list_sort(list);
@@ -415,6 +492,239 @@ netif_addr_list_merge (netif_addr *list1, netif_addr *list2)
     return netif_addr_list_revert(list);
 }
 
+/* Get prefix length of the network mask
+ */
+static int
+netif_mask_prefixlen (const struct sockaddr *mask)
+{
+    const uint8_t *p;
+    int           i, bits;
+
+    if (mask->sa_family == AF_INET) {
+        p = (const uint8_t*) &((struct sockaddr_in*) mask)->sin_addr;
+        bits = 32;
+    } else {
+        p = (const uint8_t*) &((struct sockaddr_in6*) mask)->sin6_addr;
+        bits = 128;
+    }
+
+    for (i = 0; i < bits && netif_ip_bit(p, i); i ++)
+        ;
+
+    return i;
+}
+
+/* Load netif_entries from the getifaddrs()
+ *
+ * Returns 1 if entries has changed, 0 if not, -1 on error
+ */
+static int
+netif_entries_load (void)
+{
+    struct ifaddrs *ifaddrs, *ifa;
+    netif_entry    *entries;
+    size_t         len;
+    int            changed;
+
+    if (getifaddrs(&ifaddrs) < 0) {
+        log_debug(NULL, "getifaddrs(): %s", strerror(errno));
+        return -1;
+    }
+
+    entries = mem_new(netif_entry, 0);
+    for (ifa = ifaddrs; ifa != NULL; ifa = ifa->ifa_next) {
+        netif_entry ent;
+        int         af;
+
+        /* Skip interface without address */
+        if (ifa->ifa_addr == NULL) {
+            continue;
+        }
+
+        af = ifa->ifa_addr->sa_family;
+        if (af != AF_INET && af != AF_INET6) {
+            continue;
+        }
+
+        /* Translate struct ifaddrs to netif_entry */
+        memset(&ent, 0, sizeof(ent));
+        ent.ifindex = (int) if_nametoindex(ifa->ifa_name);
+        if (ent.ifindex <= 0) {
+            continue;
+        }
+
+        strncpy(ent.ifname.text, ifa->ifa_name, sizeof(ent.ifname.text) - 1);
+        ent.loopback = (ifa->ifa_flags & IFF_LOOPBACK) != 0;
+        ent.af = af;
+
+        if (af == AF_INET) {
+            memcpy(ent.ip, &((struct sockaddr_in*) ifa->ifa_addr)->sin_addr, 4);
+        } else {
+            memcpy(ent.ip, &((struct sockaddr_in6*) ifa->ifa_addr)->sin6_addr,
+                16);
+        }
+
+        ent.prefixlen = -1;
+        if (ifa->ifa_netmask != NULL) {
+            ent.prefixlen = netif_mask_prefixlen(ifa->ifa_netmask);
+        }
+
+        len = mem_len(entries);
+        entries = mem_resize(entries, len + 1, 0);
+        memcpy(&entries[len], &ent, sizeof(ent));
+    }
+
+    freeifaddrs(ifaddrs);
+
+    /* Replace entries */
+    len = mem_len(entries);
+    changed = len != mem_len(netif_entries) ||
+              memcmp(entries, netif_entries, len * sizeof(*entries));
+
+    mem_free(netif_entries);
+    netif_entries = entries;
+
+    return changed;
+}
+
+#if defined(OS_HAVE_RTNETLINK)
+/* Apply RTM_NEWADDR/RTM_DELADDR message to the netif_entries
+ *
+ * Returns 1 if entries has changed, 0 if not, and -1 if message
+ * cannot be applied incrementally (address added to the interface
+ * we don't know yet), so entries need to be reloaded
+ */
+static int
+netif_rtnetlink_apply (struct nlmsghdr *p)
+{
+    struct ifaddrmsg *ifa = NLMSG_DATA(p);
+    struct rtattr    *rta;
+    int              rtalen = IFA_PAYLOAD(p);
+    const void       *ip = NULL, *local = NULL;
+    size_t           iplen, i, len = mem_len(netif_entries);
+    netif_entry      ent;
+    bool             known = false;
+
+    if (p->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa))) {
+        return 0;
+    }
+
+    switch (ifa->ifa_family) {
+    case AF_INET:  iplen = 4; break;
+    case AF_INET6: iplen = 16; break;
+    default:       return 0;
+    }
+
+    /* Fetch address. Note, for point-to-point interfaces, IFA_ADDRESS
+     * is the peer address, while IFA_LOCAL is our own
+     */
+    for (rta = IFA_RTA(ifa); RTA_OK(rta, rtalen); rta = RTA_NEXT(rta, rtalen)) {
+        if (RTA_PAYLOAD(rta) < iplen) {
+            continue;
+        }
+
+        switch (rta->rta_type) {
+        case IFA_ADDRESS: ip = RTA_DATA(rta); break;
+        case IFA_LOCAL:   local = RTA_DATA(rta); break;
+        }
+    }
+
+    if (local != NULL) {
+        ip = local;
+    }
+
+    if (ip == NULL) {
+        return 0;
+    }
+
+    /* Lookup the address */
+    for (i = 0; i < len; i ++) {
+        if (netif_entries[i].ifindex == (int) ifa->ifa_index) {
+            ent = netif_entries[i];
+            known = true;
+            if (netif_entries[i].af == ifa->ifa_family &&
+                !memcmp(netif_entries[i].ip, ip, iplen)) {
+                break;
+            }
+        }
+    }
+
+    /* Delete the address */
+    if (p->nlmsg_type == RTM_DELADDR) {
+        if (i == len) {
+            return 0;
+        }
+
+        memmove(&netif_entries[i], &netif_entries[i + 1],
+            (len - i - 1) * sizeof(*netif_entries));
+        mem_shrink(netif_entries, len - 1);
+
+        return 1;
+    }
+
+    /* Update existent address. Note, RTM_NEWADDR is also sent when
+     * only address lifetime is updated, which happens periodically
+     * with IPv6 autoconfiguration
+     */
+    if (i < len) {
+        if (netif_entries[i].prefixlen == ifa->ifa_prefixlen) {
+            return 0;
+        }
+
+        netif_entries[i].prefixlen = ifa->ifa_prefixlen;
+        return 1;
+    }
+
+    /* Add new address. Interface name and flags are taken from
+     * other address of the same interface
+     */
+    if (!known) {
+        return -1;
+    }
+
+    memset(ent.ip, 0, sizeof(ent.ip));
+    memcpy(ent.ip, ip, iplen);
+    ent.af = ifa->ifa_family;
+    ent.prefixlen = ifa->ifa_prefixlen;
+
+    netif_entries = mem_resize(netif_entries, len + 1, 0);
+    memcpy(&netif_entries[len], &ent, sizeof(ent));
+
+    return 1;
+}
+
+/* Apply block of rtnetlink messages to the netif_entries. We are
+ * only interested in RTM_NEWADDR/RTM_DELADDR notifications
+ *
+ * Returns false, if entries need to be reloaded. If entries were
+ * changed before that, *changed is set anyway
+ */
+static bool
+netif_rtnetlink_apply_all (void *buf, size_t sz, bool *changed)
+{
+    struct nlmsghdr *p;
+
+    for (p = buf; sz >= sizeof(struct nlmsghdr); p = NLMSG_NEXT(p, sz)) {
+        if (!NLMSG_OK(p, sz) || sz < p->nlmsg_len) {
+            break;
+        }
+
+        if (p->nlmsg_type == NLMSG_DONE) {
+            break;
+        }
+
+        if (p->nlmsg_type == RTM_NEWADDR || p->nlmsg_type == RTM_DELADDR) {
+            switch (netif_rtnetlink_apply(p)) {
+            case -1: return false;
+            case 1:  *changed = true; break;
+            }
+        }
+    }
+
+    return true;
+}
+#endif
+
 /* Network interfaces addresses change notifier
  */
 struct netif_notifier {
@@ -423,25 +733,13 @@ struct netif_notifier {
     ll_node      list_node;          /* in the netif_notifier_list */
 };
 
-/* Get a new list of network interfaces and notify the callbacks
+/* Notify the callbacks about network interfaces addresses change
  */
 static void
-netif_refresh_ifaddrs (void)
+netif_notify (void)
 {
-    struct ifaddrs  *new_ifaddrs;
-    ll_node         *node;
-    int              rc;
+    ll_node *node;
 
-    rc = getifaddrs(&new_ifaddrs);
-    if (rc >= 0) {
-        if (netif_ifaddrs != NULL) {
-            freeifaddrs(netif_ifaddrs);
-        }
-
-        netif_ifaddrs = new_ifaddrs;
-    }
-
-    /* Call all registered callbacks */
     for (LL_FOR_EACH(node, &netif_notifier_list)) {
         netif_notifier *notifier;
         notifier = OUTER_STRUCT(node, netif_notifier, list_node);
@@ -450,12 +748,20 @@ netif_refresh_ifaddrs (void)
 }
 
 /* netif_notifier read callback
+ *
+ * Network interfaces addresses are maintained incrementally from
+ * the rtnetlink messages, when possible. Full reload with getifaddrs()
+ * is performed when messages were lost, when address appears on
+ * a new interface, or when routing socket doesn't carry enough
+ * information (AF_ROUTE). Callbacks are notified only if something
+ * has actually changed
  */
 static void
 netif_notifier_read_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
 {
     static uint8_t  buf[16384];
     int             rc;
+    bool            changed = false, reload = false;
 
     (void) fd;
     (void) data;
@@ -464,51 +770,46 @@ netif_notifier_read_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
     /* Get rtnetlink message */
     rc = read(netif_rtnetlink_sock, buf, sizeof(buf));
     if (rc < 0) {
-        return;
-    }
-
-#if defined(OS_HAVE_RTNETLINK)
-    struct nlmsghdr *p;
-    size_t          sz;
-
-    /* Parse rtnetlink message, to suppress unneeded (and relatively
-     * expensive) netif_refresh_ifaddrs() calls. We are only interested
-     * in RTM_NEWADDR/RTM_DELADDR notifications
-     */
-    sz = (size_t) rc;
-    for (p = (struct nlmsghdr*) buf;
-        sz >= sizeof(struct nlmsghdr); p = NLMSG_NEXT(p, sz)) {
-
-        if (!NLMSG_OK(p, sz) || sz < p->nlmsg_len) {
+        /* ENOBUFS means that socket buffer was overflowed
+         * and some messages were lost
+         */
+        if (errno != ENOBUFS) {
             return;
         }
 
-        switch (p->nlmsg_type) {
-        case NLMSG_DONE:
-            return;
+        reload = true;
+        rc = 0;
+    }
 
-        case RTM_NEWADDR:
-        case RTM_DELADDR:
-            netif_refresh_ifaddrs();
-            return;
-        }
+#if defined(OS_HAVE_RTNETLINK)
+    /* Parse rtnetlink messages */
+    if (!reload && !netif_rtnetlink_apply_all(buf, (size_t) rc, &changed)) {
+        reload = true;
     }
 #elif defined(OS_HAVE_AF_ROUTE)
     /* Note, on OpenBSD we have ROUTE_MSGFILTER, but FreeBSD lacks
      * this feature, so we have to filter received routing messages
-     * manually, to avoid relatively expensive netif_refresh_ifaddrs()
-     * calls
+     * manually, to avoid relatively expensive reloads
      */
     struct rt_msghdr *rtm = (struct rt_msghdr*) buf;
     if (rc >= (int) sizeof(struct rt_msghdr)) {
         switch (rtm->rtm_type) {
         case RTM_NEWADDR:
         case RTM_DELADDR:
-            netif_refresh_ifaddrs();
+            reload = true;
             break;
         }
     }
 #endif
+
+    if (reload && netif_entries_load() > 0) {
+        changed = true;
+    }
+
+    if (changed) {
+        netif_trie_rebuild();
+        netif_notify();
+    }
 }
 
 /* Create netif_notifier
@@ -535,6 +836,68 @@ netif_notifier_free (netif_notifier *notifier)
     mem_free(notifier);
 }
 
+/* Forget all network interfaces addresses.
+ * This function is intended for testing purposes, not for regular use
+ */
+void
+netif_test_reset (void)
+{
+    mem_free(netif_entries);
+    netif_entries = mem_new(netif_entry, 0);
+    netif_trie_rebuild();
+}
+
+/* Add network interface address, as if it was loaded from the system.
+ * This function is intended for testing purposes, not for regular use
+ */
+void
+netif_test_add (int ifindex, const char *ifname, int af, const void *ip,
+        int prefixlen)
+{
+    netif_entry ent;
+    size_t      len = mem_len(netif_entries);
+
+    memset(&ent, 0, sizeof(ent));
+    ent.ifindex = ifindex;
+    strncpy(ent.ifname.text, ifname, sizeof(ent.ifname.text) - 1);
+    ent.af = af;
+    memcpy(ent.ip, ip, af == AF_INET ? 4 : 16);
+    ent.prefixlen = prefixlen;
+
+    netif_entries = mem_resize(netif_entries, len + 1, 0);
+    memcpy(&netif_entries[len], &ent, sizeof(ent));
+
+    netif_trie_rebuild();
+}
+
+/* Apply block of rtnetlink messages, as if it was received from the
+ * kernel. Returns 1 if addresses has changed, 0 if not, and -1 if
+ * full reload is required (reload is not performed)
+ * This function is intended for testing purposes, not for regular use
+ */
+int
+netif_test_rtnetlink (void *data, size_t size)
+{
+#if defined(OS_HAVE_RTNETLINK)
+    bool changed = false, ok;
+
+    ok = netif_rtnetlink_apply_all(data, size, &changed);
+    if (changed) {
+        netif_trie_rebuild();
+    }
+
+    if (!ok) {
+        return -1;
+    }
+
+    return changed ? 1 : 0;
+#else
+    (void) data;
+    (void) size;
+    return -1;
+#endif
+}
+
 /* Start/stop callback
  */
 static void
@@ -604,13 +967,14 @@ netif_init (void)
 #endif
 #endif
 
-    /* Initialize netif_ifaddrs */
-    if (getifaddrs(&netif_ifaddrs) < 0) {
-        log_debug(NULL, "getifaddrs(): %s", strerror(errno));
+    /* Load network interfaces addresses */
+    if (netif_entries_load() < 0) {
         close(netif_rtnetlink_sock);
         return SANE_STATUS_IO_ERROR;
     }
 
+    netif_trie_rebuild();
+
     /* Register start/stop callback */
     eloop_add_start_stop_callback(netif_start_stop_callback);
 
@@ -622,10 +986,10 @@ netif_init (void)
 void
 netif_cleanup (void)
 {
-    if (netif_ifaddrs != NULL) {
-        freeifaddrs(netif_ifaddrs);
-        netif_ifaddrs = NULL;
-    }
+    mem_free(netif_entries);
+    netif_entries = NULL;
+    mem_free(netif_trie);
+    netif_trie = NULL;
 
     if (netif_rtnetlink_sock >= 0) {
         close(netif_rtnetlink_sock);
@@ -5,10 +5,12 @@
  *
  * OS Facilities
  */
+#define _GNU_SOURCE
 
 #include "airscan.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <pthread.h>
 #include <pwd.h>
@@ -156,5 +158,33 @@ os_mkdir (const char *path, mode_t mode)
     return mkdir(p, mode);
 }
 
+/* Create anonymous temporary file in the directory
+ */
+int
+os_tmpfile (const char *dir)
+{
+    char *path;
+    int  fd;
+
+#ifdef OS_HAVE_O_TMPFILE
+    fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR)) {
+        return fd;
+    }
+
+    /* Filesystem doesn't support O_TMPFILE, fall back to mkstemp() */
+#endif
+
+    path = str_printf("%s/airscan-XXXXXX", dir);
+    fd = mkstemp(path);
+    if (fd >= 0) {
+        unlink(path);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    mem_free(path);
+
+    return fd;
+}
+
 /* vim:ts=8:sw=4:et
  */
@@ -0,0 +1,702 @@
+/* AirScan (a.k.a. eSCL) backend for SANE
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * Unicast subnet sweep
+ *
+ * In networks where multicasts are filtered (i.e., separate VLANs
+ * for printers and workstations), neither DNS-SD nor WS-Discovery
+ * can find anything. For these cases, user may configure a list
+ * of networks to sweep. Each address of these networks is probed
+ * with unicast eSCL ScannerCapabilities request (HTTP and HTTPS)
+ * and with WS-Discovery directed probe, but only if address accepts
+ * TCP connection on the appropriate port.
+ *
+ * Sweep is rate-limited (addresses per second) and the number
+ * of addresses probed in parallel is limited as well, so sweeping
+ * thousands of addresses takes seconds, without flooding the network
+ */
+
+#include "airscan.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Sweep pacing: how often sweep timer ticks, in milliseconds
+ */
+#define SWEEP_TICK              20
+
+/* Timeout of protocol queries, sent to addresses that
+ * accepted TCP connection, in milliseconds
+ */
+#define SWEEP_QUERY_TIMEOUT     5000
+
+/* Ports, probed on each address, and eSCL URL scheme for each port
+ */
+static const struct {
+    const char *scheme;
+    int        port;
+} sweep_ports[] = {
+    {"http",  80},
+    {"https", 443}
+};
+
+#define SWEEP_NUM_PORTS         (sizeof(sweep_ports) / sizeof(sweep_ports[0]))
+
+/* XML namespace translation for eSCL ScannerCapabilities
+ */
+static const xml_ns sweep_escl_ns_rules[] = {
+    {"scan", "http*://schemas.hp.com/imaging/escl/2011/05/03"},
+    {"pwg",  "http*://www.pwg.org/schemas/2010/12/sm"},
+    {NULL, NULL}
+};
+
+/* sweep_port represents a single port being probed
+ */
+typedef struct sweep_target sweep_target;
+typedef struct {
+    sweep_target *target;   /* Target this port belongs to */
+    int          fd;        /* Connection probe socket, -1 if none */
+    eloop_fdpoll *fdpoll;   /* Connection probe fdpoll */
+    bool         open;      /* Port accepted connection */
+    http_query   *query;    /* Pending eSCL query */
+} sweep_port;
+
+/* sweep_target represents a single address being probed
+ * and, if something was found there, the finding
+ */
+struct sweep_target {
+    zeroconf_finding finding;                 /* Base class */
+    sweep_port       ports[SWEEP_NUM_PORTS];  /* Probed ports */
+    eloop_timer      *timer;                  /* Connection probe timer */
+    int              pending;                 /* Pending probes */
+    ll_node          list_node;               /* In sweep_active or
+                                                 sweep_found */
+};
+
+/* Static variables
+ */
+static log_ctx *sweep_log;
+static http_client *sweep_http_client;
+static eloop_timer *sweep_timer;
+static ll_head sweep_active;
+static ll_head sweep_found;
+static int sweep_active_count;
+static size_t sweep_net_idx;
+static uint32_t sweep_net_off;
+static int sweep_credit;
+static bool sweep_done;
+static timestamp sweep_started;
+static unsigned int sweep_probed;
+
+/* Forward declarations
+ */
+static void
+sweep_check_done (void);
+
+static void
+sweep_tick (void);
+
+/******************** Address enumeration ********************/
+/* Get N-th address of the network
+ */
+static ip_addr
+sweep_net_addr (ip_network net, uint32_t n)
+{
+    ip_addr addr = net.addr;
+    uint8_t *ip = (uint8_t*) &addr.ip;
+    int     bits = addr.af == AF_INET ? 32 : 128;
+    int     i;
+
+    for (i = net.mask; i < bits; i ++) {
+        ip[i / 8] &= ~(0x80 >> (i % 8));
+    }
+
+    ip[bits / 8 - 1] |= (uint8_t) n;
+    ip[bits / 8 - 2] |= (uint8_t) (n >> 8);
+
+    return addr;
+}
+
+/* Check if address must be skipped
+ */
+static bool
+sweep_addr_skip (ip_network net, uint32_t n, ip_addr addr)
+{
+    struct sockaddr_storage sa;
+    conf_blacklist          *ent;
+
+    /* Skip IPv4 network and broadcast addresses */
+    if (addr.af == AF_INET && net.mask <= 30) {
+        uint32_t last = (1u << (32 - net.mask)) - 1;
+        if (n == 0 || n == last) {
+            return true;
+        }
+    }
+
+    /* Skip our own and loopback addresses */
+    if (ip_is_loopback(addr.af, &addr.ip)) {
+        return true;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    if (addr.af == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in*) &sa;
+        sin->sin_family = AF_INET;
+        sin->sin_addr = addr.ip.v4;
+    } else {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6*) &sa;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_addr = addr.ip.v6;
+    }
+
+    if (netif_distance_get((struct sockaddr*) &sa) ==
+        NETIF_DISTANCE_LOOPBACK) {
+        return true;
+    }
+
+    /* Skip blacklisted addresses */
+    for (ent = conf.blacklist; ent != NULL; ent = ent->next) {
+        if (ent->net.addr.af != AF_UNSPEC &&
+            ip_network_contains(ent->net, addr)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Get next address to probe. Returns false, if sweep is done
+ */
+static bool
+sweep_next_addr (ip_addr *addr)
+{
+    while (sweep_net_idx < mem_len(conf.sweep_nets)) {
+        ip_network net = conf.sweep_nets[sweep_net_idx];
+        int        bits = net.addr.af == AF_INET ? 32 : 128;
+        uint32_t   count = 1u << (bits - net.mask);
+
+        while (sweep_net_off < count) {
+            uint32_t n = sweep_net_off ++;
+
+            *addr = sweep_net_addr(net, n);
+            if (!sweep_addr_skip(net, n, *addr)) {
+                return true;
+            }
+        }
+
+        sweep_net_idx ++;
+        sweep_net_off = 0;
+    }
+
+    return false;
+}
+
+/******************** Targets ********************/
+/* Free the sweep_target
+ */
+static void
+sweep_target_free (sweep_target *target)
+{
+    size_t i;
+
+    if (target->timer != NULL) {
+        eloop_timer_cancel(target->timer);
+    }
+
+    for (i = 0; i < SWEEP_NUM_PORTS; i ++) {
+        sweep_port *port = &target->ports[i];
+
+        if (port->fdpoll != NULL) {
+            eloop_fdpoll_free(port->fdpoll);
+        }
+
+        if (port->fd >= 0) {
+            close(port->fd);
+        }
+
+        if (port->query != NULL) {
+            http_query_cancel(port->query);
+        }
+    }
+
+    mem_free((char*) target->finding.model);
+    ip_addrset_free(target->finding.addrs);
+    zeroconf_endpoint_list_free(target->finding.endpoints);
+    mem_free(target);
+}
+
+/* Get target address
+ */
+static ip_addr
+sweep_target_addr (const sweep_target *target)
+{
+    size_t count;
+    return *ip_addrset_addresses(target->finding.addrs, &count);
+}
+
+/* Parse eSCL ScannerCapabilities. Fills finding model and uuid,
+ * if not filled yet. Returns false, if response doesn't look
+ * like the eSCL ScannerCapabilities
+ */
+static bool
+sweep_target_parse_caps (sweep_target *target, const http_data *data)
+{
+    xml_rd     *xml;
+    error      err;
+    const char *prefix = "scan:ScannerCapabilities/";
+    size_t     prefixlen = strlen(prefix);
+
+    err = xml_rd_begin(&xml, data->bytes, data->size, sweep_escl_ns_rules);
+    if (err != NULL) {
+        return false;
+    }
+
+    if (!xml_rd_node_name_match(xml, "scan:ScannerCapabilities")) {
+        xml_rd_finish(&xml);
+        return false;
+    }
+
+    while (!xml_rd_end(xml)) {
+        const char *path = xml_rd_node_path(xml);
+
+        if (!strncmp(path, prefix, prefixlen)) {
+            path += prefixlen;
+
+            if (!strcmp(path, "pwg:MakeAndModel") &&
+                target->finding.model == NULL) {
+                target->finding.model = str_dup(xml_rd_node_value(xml));
+            } else if (!strcmp(path, "scan:UUID") &&
+                !uuid_valid(target->finding.uuid)) {
+                target->finding.uuid = uuid_parse(xml_rd_node_value(xml));
+            }
+        }
+
+        xml_rd_deep_next(xml, 0);
+    }
+
+    xml_rd_finish(&xml);
+    return true;
+}
+
+/* Called when all target probes are finished
+ */
+static void
+sweep_target_done (sweep_target *target)
+{
+    ip_straddr straddr = ip_addr_to_straddr(sweep_target_addr(target), true);
+
+    ll_del(&target->list_node);
+    sweep_active_count --;
+
+    if (target->finding.endpoints == NULL) {
+        sweep_target_free(target);
+    } else {
+        if (!uuid_valid(target->finding.uuid)) {
+            char *s = str_printf("sweep:%s", straddr.text);
+            target->finding.uuid = uuid_hash(s);
+            mem_free(s);
+        }
+
+        if (target->finding.model == NULL) {
+            target->finding.model = str_dup(straddr.text);
+        }
+
+        log_debug(sweep_log, "%s: found \"%s\"", straddr.text,
+            target->finding.model);
+
+        target->finding.endpoints = zeroconf_endpoint_list_sort_dedup(
+            target->finding.endpoints);
+        ll_push_end(&sweep_found, &target->list_node);
+        zeroconf_finding_publish(&target->finding);
+    }
+
+    sweep_check_done();
+}
+
+/* eSCL ScannerCapabilities query callback
+ */
+static void
+sweep_target_query_callback (void *ptr, http_query *q)
+{
+    sweep_port   *port = (sweep_port*) http_query_get_uintptr(q);
+    sweep_target *target = port->target;
+    error        err = http_query_error(q);
+
+    (void) ptr;
+
+    port->query = NULL;
+    target->pending --;
+
+    if (err != NULL) {
+        log_debug(sweep_log, "%s: %s", http_uri_str(http_query_uri(q)),
+            ESTRING(err));
+    } else if (!sweep_target_parse_caps(target,
+            http_query_get_response_data(q))) {
+        log_debug(sweep_log, "%s: not a ScannerCapabilities",
+            http_uri_str(http_query_uri(q)));
+    } else {
+        http_uri          *uri;
+        zeroconf_endpoint *endpoint;
+
+        uri = http_uri_new_relative(http_query_uri(q), "/eSCL/", true, false);
+        endpoint = zeroconf_endpoint_new(ID_PROTO_ESCL, uri);
+        endpoint->next = target->finding.endpoints;
+        target->finding.endpoints = endpoint;
+    }
+
+    if (target->pending == 0) {
+        sweep_target_done(target);
+    }
+}
+
+/* Second stage of the target probing: for all ports that
+ * accepted connection, send protocol requests
+ */
+static void
+sweep_target_query (sweep_target *target)
+{
+    ip_addr    addr = sweep_target_addr(target);
+    ip_straddr straddr = ip_straddr_from_ip(addr.af, &addr.ip);
+    char       host[128];
+    size_t     i;
+
+    if (addr.af == AF_INET) {
+        strcpy(host, straddr.text);
+    } else if (!ip_is_linklocal(addr.af, &addr.ip)) {
+        sprintf(host, "[%s]", straddr.text);
+    } else {
+        sprintf(host, "[%s%%25%d]", straddr.text, target->finding.ifindex);
+    }
+
+    for (i = 0; i < SWEEP_NUM_PORTS; i ++) {
+        sweep_port *port = &target->ports[i];
+        char       *s;
+        http_uri   *uri;
+
+        if (!port->open) {
+            continue;
+        }
+
+        log_debug(sweep_log, "%s: port %d is open", straddr.text,
+            sweep_ports[i].port);
+
+        /* WS-Discovery stable endpoint lives on the HTTP port. Its
+         * answer, if any, will be handled by WS-Discovery as usual
+         */
+        if (sweep_ports[i].port == 80 && conf.wsdd_mode != WSDD_OFF &&
+            target->finding.ifindex != 0) {
+            wsdd_send_directed_probe_timeout(target->finding.ifindex,
+                addr.af, &addr.ip, SWEEP_QUERY_TIMEOUT);
+        }
+
+        /* Probe eSCL */
+        s = str_printf("%s://%s/eSCL/ScannerCapabilities",
+            sweep_ports[i].scheme, host);
+        uri = http_uri_new(s, true);
+        mem_free(s);
+        log_assert(sweep_log, uri != NULL);
+
+        port->query = http_query_new(sweep_http_client, uri, "GET", NULL, NULL);
+        http_query_set_uintptr(port->query, (uintptr_t) port);
+        http_query_timeout(port->query, SWEEP_QUERY_TIMEOUT);
+
+        target->pending ++;
+        http_query_submit(port->query, sweep_target_query_callback);
+    }
+
+    if (target->pending == 0) {
+        sweep_target_done(target);
+    }
+}
+
+/* Close connection probe socket
+ */
+static void
+sweep_port_close (sweep_port *port)
+{
+    eloop_fdpoll_free(port->fdpoll);
+    close(port->fd);
+    port->fdpoll = NULL;
+    port->fd = -1;
+    port->target->pending --;
+}
+
+/* Connection probe fdpoll callback
+ */
+static void
+sweep_port_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
+{
+    sweep_port   *port = data;
+    sweep_target *target = port->target;
+    int          err = 0;
+    socklen_t    len = sizeof(err);
+
+    (void) mask;
+
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    port->open = err == 0;
+    sweep_port_close(port);
+
+    if (target->pending == 0) {
+        eloop_timer_cancel(target->timer);
+        target->timer = NULL;
+        sweep_target_query(target);
+    }
+}
+
+/* Connection probe timer callback
+ */
+static void
+sweep_target_timer_callback (void *data)
+{
+    sweep_target *target = data;
+    size_t       i;
+
+    target->timer = NULL;
+
+    for (i = 0; i < SWEEP_NUM_PORTS; i ++) {
+        if (target->ports[i].fd >= 0) {
+            sweep_port_close(&target->ports[i]);
+        }
+    }
+
+    sweep_target_query(target);
+}
+
+/* Start connection probe for the single port
+ */
+static void
+sweep_port_connect (sweep_port *port, ip_addr addr, int portnum)
+{
+    struct sockaddr_storage sa;
+    socklen_t               salen;
+    int                     rc;
+
+    memset(&sa, 0, sizeof(sa));
+    if (addr.af == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in*) &sa;
+        sin->sin_family = AF_INET;
+        sin->sin_addr = addr.ip.v4;
+        sin->sin_port = htons(portnum);
+        salen = sizeof(*sin);
+    } else {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6*) &sa;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_addr = addr.ip.v6;
+        sin6->sin6_port = htons(portnum);
+        sin6->sin6_scope_id = addr.ifindex;
+        salen = sizeof(*sin6);
+    }
+
+    port->fd = socket(addr.af, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (port->fd < 0) {
+        log_debug(sweep_log, "socket(): %s", strerror(errno));
+        return;
+    }
+
+    rc = connect(port->fd, (struct sockaddr*) &sa, salen);
+    if (rc < 0 && errno != EINPROGRESS) {
+        close(port->fd);
+        port->fd = -1;
+        return;
+    }
+
+    port->fdpoll = eloop_fdpoll_new(port->fd, sweep_port_callback, port);
+    eloop_fdpoll_set_mask(port->fdpoll, ELOOP_FDPOLL_WRITE);
+    port->target->pending ++;
+}
+
+/* Start probing of the address
+ *
+ * Probing is done in two stages. First, TCP connection is attempted
+ * to all ports in parallel, using short timeout. Most of swept
+ * addresses are silent, and this is the cheap way to skip them.
+ * Then, HTTP requests are sent to the ports, that accepted connection
+ */
+static void
+sweep_target_start (ip_addr addr)
+{
+    sweep_target *target = mem_new(sweep_target, 1);
+    int          ifindex = netif_ifindex_for_addr(addr.af, &addr.ip);
+    size_t       i;
+
+    if (ip_is_linklocal(addr.af, &addr.ip)) {
+        addr.ifindex = ifindex;
+    }
+
+    target->finding.method = ZEROCONF_SWEEP;
+    target->finding.ifindex = ifindex;
+    target->finding.addrs = ip_addrset_new();
+    ip_addrset_add(target->finding.addrs, addr);
+
+    ll_push_end(&sweep_active, &target->list_node);
+    sweep_active_count ++;
+    sweep_probed ++;
+
+    for (i = 0; i < SWEEP_NUM_PORTS; i ++) {
+        sweep_port *port = &target->ports[i];
+
+        port->target = target;
+        port->fd = -1;
+        sweep_port_connect(port, addr, sweep_ports[i].port);
+    }
+
+    if (target->pending == 0) {
+        sweep_target_done(target);
+        return;
+    }
+
+    target->timer = eloop_timer_new(conf.sweep_timeout,
+        sweep_target_timer_callback, target);
+}
+
+/******************** Sweep pacing ********************/
+/* Check if the entire sweep is done, and notify zeroconf
+ * when it happens for the first time
+ */
+static void
+sweep_check_done (void)
+{
+    if (sweep_done || sweep_timer != NULL || sweep_active_count != 0 ||
+        sweep_net_idx < mem_len(conf.sweep_nets)) {
+        return;
+    }
+
+    log_debug(sweep_log, "sweep finished: %u addresses in %d ms",
+        sweep_probed, (int) (timestamp_now() - sweep_started));
+
+    sweep_done = true;
+    zeroconf_finding_done(ZEROCONF_SWEEP);
+}
+
+/* Sweep timer callback
+ */
+static void
+sweep_timer_callback (void *unused)
+{
+    (void) unused;
+
+    sweep_timer = NULL;
+    sweep_tick();
+}
+
+/* Launch as many probes, as rate and parallelism limits allow.
+ *
+ * Rate is controlled by the token bucket: each SWEEP_TICK adds
+ * rate * SWEEP_TICK / 1000 addresses to the budget, and budget
+ * is capped, so stalls due to the parallelism limit don't cause
+ * bursts later
+ */
+static void
+sweep_tick (void)
+{
+    int     burst = conf.sweep_rate * SWEEP_TICK + 1000;
+    ip_addr addr;
+    bool    more = true;
+
+    sweep_credit += conf.sweep_rate * SWEEP_TICK;
+    if (sweep_credit > burst) {
+        sweep_credit = burst;
+    }
+
+    while (sweep_credit >= 1000 && sweep_active_count < conf.sweep_parallel) {
+        more = sweep_next_addr(&addr);
+        if (!more) {
+            break;
+        }
+
+        sweep_credit -= 1000;
+        sweep_target_start(addr);
+    }
+
+    if (more) {
+        sweep_timer = eloop_timer_new(SWEEP_TICK, sweep_timer_callback, NULL);
+    } else {
+        sweep_check_done();
+    }
+}
+
+/******************** Initialization and cleanup ********************/
+/* Sweep start/stop callback
+ */
+static void
+sweep_start_stop_callback (bool start)
+{
+    if (start) {
+        sweep_http_client = http_client_new(sweep_log, NULL);
+        sweep_net_idx = 0;
+        sweep_net_off = 0;
+        sweep_credit = 0;
+        sweep_probed = 0;
+        sweep_started = timestamp_now();
+        sweep_done = false;
+
+        sweep_tick();
+    } else {
+        ll_node *node;
+
+        if (sweep_timer != NULL) {
+            eloop_timer_cancel(sweep_timer);
+            sweep_timer = NULL;
+        }
+
+        while ((node = ll_pop_beg(&sweep_active)) != NULL) {
+            sweep_target_free(OUTER_STRUCT(node, sweep_target, list_node));
+        }
+
+        while ((node = ll_pop_beg(&sweep_found)) != NULL) {
+            sweep_target *target;
+
+            target = OUTER_STRUCT(node, sweep_target, list_node);
+            zeroconf_finding_withdraw(&target->finding);
+            sweep_target_free(target);
+        }
+
+        sweep_active_count = 0;
+
+        http_client_free(sweep_http_client);
+        sweep_http_client = NULL;
+    }
+}
+
+/* Initialize subnet sweep
+ */
+SANE_Status
+sweep_init (void)
+{
+    sweep_log = log_ctx_new("sweep", zeroconf_log);
+
+    ll_init(&sweep_active);
+    ll_init(&sweep_found);
+
+    if (!conf.discovery || conf.sweep_nets == NULL) {
+        log_debug(sweep_log, "subnet sweep disabled");
+        zeroconf_finding_done(ZEROCONF_SWEEP);
+        return SANE_STATUS_GOOD;
+    }
+
+    eloop_add_start_stop_callback(sweep_start_stop_callback);
+
+    return SANE_STATUS_GOOD;
+}
+
+/* Cleanup subnet sweep
+ */
+void
+sweep_cleanup (void)
+{
+    sweep_done = false;
+
+    if (sweep_log != NULL) {
+        log_ctx_free(sweep_log);
+        sweep_log = NULL;
+    }
+}
+
+/* vim:ts=8:sw=4:et
+ */
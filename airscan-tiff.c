@@ -205,6 +205,7 @@ image_decoder_tiff_begin (image_decoder *decoder, const void *data,
     tiff->mem_file = (unsigned char*)data;
     tiff->offset_file = 0;
     tiff->size_file = size;
+    tiff->current_line = 0;
 
     tiff->tif = TIFFClientOpen("airscan TIFF Interface", 
          "r", (image_decoder_tiff*)(tiff),
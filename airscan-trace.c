@@ -8,18 +8,38 @@
 
 #include "airscan.h"
 
+#include <errno.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdarg.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+/* Trace output is formatted into memory by the calling thread and
+ * handed to the dedicated writer thread via the bounded lock-free
+ * queue. All file I/O, including formatting of XML bodies and
+ * writing of binary bodies into the .tar file, is done by the
+ * writer thread, so tracing doesn't stall the event loop
+ *
+ * TRACE_QUEUE_SIZE is the queue capacity, in items. It must be a
+ * power of 2. If queue is full, producer waits
+ *
+ * TRACE_FILE_BUFSIZE is the stdio buffer size of trace files. Files
+ * are flushed when writer becomes idle
+ */
+#define TRACE_QUEUE_SIZE        4096
+#define TRACE_FILE_BUFSIZE      (256 * 1024)
+
 /* Trace file handle
  */
 struct  trace {
-    volatile unsigned int refcnt;  /* Reference count */
-    FILE                  *log;    /* Log file */
-    FILE                  *data;   /* Data file */
-    unsigned int          index;   /* Message index */
+    volatile unsigned int refcnt;    /* Reference count */
+    FILE                  *log;      /* Log file */
+    FILE                  *data;     /* Data file */
+    FILE                  *timeline; /* Timeline file, NULL if disabled */
+    unsigned int          index;     /* Message index */
+    bool                  dirty;     /* Has unflushed output */
 };
 
 /* TAR file hader
@@ -44,6 +64,34 @@ typedef struct {
     char pad[12];
 } tar_header;
 
+/* Kinds of the queued items
+ */
+typedef enum {
+    TRACE_ITEM_LOG,          /* Text for the log file */
+    TRACE_ITEM_TEXT,         /* Textual body, may be XML */
+    TRACE_ITEM_XML,          /* XML body, falls back to text */
+    TRACE_ITEM_DATA,         /* Binary body, goes to the .tar file */
+    TRACE_ITEM_TIMELINE,     /* Text for the timeline file */
+    TRACE_ITEM_CLOSE         /* Close the trace */
+} TRACE_ITEM;
+
+/* trace_item represents a queued piece of output
+ */
+typedef struct {
+    trace      *t;           /* Destination trace */
+    TRACE_ITEM kind;         /* Item kind */
+    char       *text;        /* Text, for LOG and TIMELINE */
+    http_data  *data;        /* Body, for TEXT, XML and DATA */
+} trace_item;
+
+/* trace_cell is the queue cell. The seq field implements the
+ * bounded MPMC queue algorithm by Dmitry Vyukov
+ */
+typedef struct {
+    size_t     seq;          /* Cell sequence number */
+    trace_item item;         /* Queued item */
+} trace_cell;
+
 /* Name of the process' executable
  */
 static const char *trace_program;
@@ -52,6 +100,47 @@ static const char *trace_program;
  */
 static const char trace_zero_block[512];
 
+/* Timeline thread IDs. Chrome trace-event format wants small
+ * integers here, so threads are numbered in order of appearance
+ */
+static __thread int trace_timeline_tid;
+static int          trace_timeline_tid_last;
+
+/* Hexdump formatting table and maximal length of the hexdump line
+ */
+static const char trace_hex_digits[] = "0123456789abcdef";
+
+#define TRACE_HEXDUMP_LINE      84
+
+/* The queue and the writer thread. Mutex and conditions are used
+ * only to sleep and wake up, while queue itself is lock-free
+ */
+static trace_cell      trace_queue[TRACE_QUEUE_SIZE];
+static size_t          trace_queue_head;
+static size_t          trace_queue_tail;
+static pthread_mutex_t trace_writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  trace_writer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  trace_space_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t       trace_writer_thread;
+static bool            trace_writer_started;
+static bool            trace_writer_stop;
+static bool            trace_writer_sleeping;
+static int             trace_space_waiting;
+
+/* Forward declarations
+ */
+static void
+trace_timeline_open (trace *t, const char *device_name);
+
+static void
+trace_writer_start (void);
+
+static void
+trace_writer_stop_and_join (void);
+
+static void
+trace_item_put (trace *t, TRACE_ITEM kind, char *text, http_data *data);
+
 /* Initialize protocol trace. Called at backend initialization
  */
 SANE_Status
@@ -66,10 +155,13 @@ trace_init (void)
 }
 
 /* Cleanup protocol trace. Called at backend unload
+ *
+ * All pending output is written before return
  */
 void
 trace_cleanup ()
 {
+    trace_writer_stop_and_join();
 }
 
 /* Open protocol trace
@@ -114,13 +206,37 @@ trace_open (const char *device_name)
     path = str_append(path, ".tar");
     t->data = fopen(path, "wb");
 
+    if (conf.dbg_timeline) {
+        path = str_resize(path, str_len(path) - 4);
+        path = str_append(path, ".json");
+        t->timeline = fopen(path, "w");
+    }
+
     mem_free(path);
 
     if (t->log != NULL && t->data != NULL) {
+        setvbuf(t->log, NULL, _IOFBF, TRACE_FILE_BUFSIZE);
+        setvbuf(t->data, NULL, _IOFBF, TRACE_FILE_BUFSIZE);
+        if (t->timeline != NULL) {
+            setvbuf(t->timeline, NULL, _IOFBF, TRACE_FILE_BUFSIZE);
+        }
+
+        trace_writer_start();
+        trace_timeline_open(t, device_name);
         return t;
     }
 
-    trace_unref(t);
+    if (t->log != NULL) {
+        fclose(t->log);
+    }
+    if (t->data != NULL) {
+        fclose(t->data);
+    }
+    if (t->timeline != NULL) {
+        fclose(t->timeline);
+    }
+    mem_free(t);
+
     return NULL;
 }
 
@@ -136,42 +252,173 @@ trace_ref (trace *t)
 }
 
 /* Unref the trace. When trace is not longer in use, it will be closed
+ *
+ * Actual closing is done by the writer thread, after all output,
+ * queued before, is written
  */
 void
 trace_unref (trace *t)
 {
     if (t != NULL && (__sync_fetch_and_sub(&t->refcnt, 1) == 1)) {
-        if (t->log != NULL) {
-            fclose(t->log);
-        }
-        if (t->data != NULL) {
-            if (t->log != NULL) {
-                /* Normal close - write tar footer */
-                fwrite(trace_zero_block, sizeof(trace_zero_block), 1, t->data);
-                fwrite(trace_zero_block, sizeof(trace_zero_block), 1, t->data);
+        trace_item_put(t, TRACE_ITEM_CLOSE, NULL, NULL);
+    }
+}
+
+/******************** Queue and writer thread ********************/
+/* Try to push item into the queue. Returns false, if queue is full
+ */
+static bool
+trace_queue_try_push (const trace_item *item)
+{
+    size_t     pos = __atomic_load_n(&trace_queue_tail, __ATOMIC_SEQ_CST);
+    trace_cell *cell;
+
+    for (;;) {
+        size_t   seq;
+        intptr_t diff;
+
+        cell = &trace_queue[pos & (TRACE_QUEUE_SIZE - 1)];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_SEQ_CST);
+        diff = (intptr_t) seq - (intptr_t) pos;
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&trace_queue_tail, &pos, pos + 1,
+                    true, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+                break;
             }
-            fclose(t->data);
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = __atomic_load_n(&trace_queue_tail, __ATOMIC_SEQ_CST);
         }
-        mem_free(t);
     }
+
+    cell->item = *item;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_SEQ_CST);
+
+    return true;
 }
 
-/* http_query_foreach_request_header()/http_query_foreach_response_header()
- * callback
+/* Check that queue head is ready to be pulled. Writer thread only
+ */
+static bool
+trace_queue_ready (void)
+{
+    size_t     pos = trace_queue_head;
+    trace_cell *cell = &trace_queue[pos & (TRACE_QUEUE_SIZE - 1)];
+
+    return __atomic_load_n(&cell->seq, __ATOMIC_SEQ_CST) == pos + 1;
+}
+
+/* Try to pull item from the queue. Writer thread only
+ */
+static bool
+trace_queue_try_pull (trace_item *item)
+{
+    size_t     pos = trace_queue_head;
+    trace_cell *cell = &trace_queue[pos & (TRACE_QUEUE_SIZE - 1)];
+
+    if (!trace_queue_ready()) {
+        return false;
+    }
+
+    *item = cell->item;
+    trace_queue_head = pos + 1;
+    __atomic_store_n(&cell->seq, pos + TRACE_QUEUE_SIZE, __ATOMIC_SEQ_CST);
+
+    return true;
+}
+
+/* Push item into the queue, waiting for free space if necessary,
+ * and wake up the writer thread
  */
 static void
-trace_message_headers_foreach_callback (const char *name, const char *value,
-        void *ptr)
+trace_queue_push (const trace_item *item)
+{
+    while (!trace_queue_try_push(item)) {
+        bool ok;
+
+        pthread_mutex_lock(&trace_writer_mutex);
+        __atomic_add_fetch(&trace_space_waiting, 1, __ATOMIC_SEQ_CST);
+        ok = trace_queue_try_push(item);
+        if (!ok) {
+            pthread_cond_wait(&trace_space_cond, &trace_writer_mutex);
+        }
+        __atomic_sub_fetch(&trace_space_waiting, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&trace_writer_mutex);
+
+        if (ok) {
+            break;
+        }
+    }
+
+    if (__atomic_load_n(&trace_writer_sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&trace_writer_mutex);
+        pthread_cond_signal(&trace_writer_cond);
+        pthread_mutex_unlock(&trace_writer_mutex);
+    }
+}
+
+/* Queue the item. Takes ownership of text and data
+ */
+static void
+trace_item_put (trace *t, TRACE_ITEM kind, char *text, http_data *data)
+{
+    trace_item item = {t, kind, text, data};
+    trace_queue_push(&item);
+}
+
+/* Flush all dirty traces. Writer thread only
+ */
+static void
+trace_writer_flush (trace ***dirty)
+{
+    size_t i, len = mem_len(*dirty);
+
+    for (i = 0; i < len; i ++) {
+        trace *t = (*dirty)[i];
+
+        fflush(t->log);
+        fflush(t->data);
+        if (t->timeline != NULL) {
+            fflush(t->timeline);
+        }
+        t->dirty = false;
+    }
+
+    ptr_array_trunc(*dirty);
+}
+
+/* Write text body, skipping CRs
+ */
+static void
+trace_writer_text (trace *t, http_data *data)
 {
-    trace *t = ptr;
-    fprintf(t->log, "%s: %s\n", name, value);
+    const char *d, *end = (char*) data->bytes + data->size;
+    const char *chunk = data->bytes;
+    int        last = -1;
+
+    for (d = data->bytes; d < end; d ++) {
+        if (*d == '\r') {
+            fwrite(chunk, d - chunk, 1, t->log);
+            chunk = d + 1;
+        } else {
+            last = *d;
+        }
+    }
+
+    fwrite(chunk, end - chunk, 1, t->log);
+
+    if (last != '\n') {
+        putc('\n', t->log);
+    }
 }
 
-/* Dump binary data. The data saved as a file into a .TAR archive.
- * Returns name of file, where data was saved
+/* Write binary body. The data saved as a file into a .TAR archive,
+ * and the note is written into the log
  */
 static void
-trace_dump_data (trace *t, http_data *data)
+trace_writer_data (trace *t, http_data *data)
 {
     tar_header hdr;
     uint32_t   chsum;
@@ -234,41 +481,208 @@ trace_dump_data (trace *t, http_data *data)
             (unsigned long) data->size, hdr.name);
 }
 
-/* Dump text data. The data will be saved directly to the log file
+/* Close the trace. Writer thread only
  */
 static void
-trace_dump_text (trace *t, http_data *data, bool xml)
+trace_writer_close (trace *t)
 {
-    const char *d, *end = (char*) data->bytes + data->size;
-    int last = -1;
+    fclose(t->log);
 
-    if (xml && xml_format(t->log, data->bytes, data->size)) {
+    /* Normal close - write tar footer */
+    fwrite(trace_zero_block, sizeof(trace_zero_block), 1, t->data);
+    fwrite(trace_zero_block, sizeof(trace_zero_block), 1, t->data);
+    fclose(t->data);
+
+    if (t->timeline != NULL) {
+        fprintf(t->timeline, "\n]\n");
+        fclose(t->timeline);
+    }
+
+    mem_free(t);
+}
+
+/* Handle the queued item. Writer thread only
+ */
+static void
+trace_writer_item (trace_item *item, trace ***dirty)
+{
+    trace *t = item->t;
+
+    if (item->kind == TRACE_ITEM_CLOSE) {
+        if (t->dirty) {
+            ptr_array_del(*dirty, ptr_array_find(*dirty, t));
+        }
+        trace_writer_close(t);
         return;
     }
 
-    for (d = data->bytes; d < end; d ++) {
-        if (*d != '\r') {
-            last = *d;
-            putc(last, t->log);
+    if (!t->dirty) {
+        t->dirty = true;
+        *dirty = ptr_array_append(*dirty, t);
+    }
+
+    switch (item->kind) {
+    case TRACE_ITEM_LOG:
+        fwrite(item->text, str_len(item->text), 1, t->log);
+        break;
+
+    case TRACE_ITEM_XML:
+        if (xml_format(t->log, item->data->bytes, item->data->size)) {
+            break;
         }
+        /* Fall through */
+
+    case TRACE_ITEM_TEXT:
+        trace_writer_text(t, item->data);
+        break;
+
+    case TRACE_ITEM_DATA:
+        trace_writer_data(t, item->data);
+        break;
+
+    case TRACE_ITEM_TIMELINE:
+        if (t->timeline != NULL) {
+            fwrite(item->text, str_len(item->text), 1, t->timeline);
+        }
+        break;
+
+    case TRACE_ITEM_CLOSE:
+        break;
     }
 
-    if (last != '\n') {
-        putc('\n', t->log);
+    mem_free(item->text);
+    http_data_unref(item->data);
+}
+
+/* The writer thread
+ */
+static void*
+trace_writer_thread_func (void *p)
+{
+    trace      **dirty = ptr_array_new(trace*);
+    trace_item item;
+
+    (void) p;
+
+    for (;;) {
+        bool stop;
+
+        /* Handle all pending items */
+        while (trace_queue_try_pull(&item)) {
+            trace_writer_item(&item, &dirty);
+
+            if (__atomic_load_n(&trace_space_waiting, __ATOMIC_SEQ_CST)) {
+                pthread_mutex_lock(&trace_writer_mutex);
+                pthread_cond_broadcast(&trace_space_cond);
+                pthread_mutex_unlock(&trace_writer_mutex);
+            }
+        }
+
+        /* Queue is empty. Flush output and sleep */
+        trace_writer_flush(&dirty);
+
+        pthread_mutex_lock(&trace_writer_mutex);
+        __atomic_store_n(&trace_writer_sleeping, true, __ATOMIC_SEQ_CST);
+        stop = trace_writer_stop;
+        if (!stop && !trace_queue_ready()) {
+            pthread_cond_wait(&trace_writer_cond, &trace_writer_mutex);
+        }
+        __atomic_store_n(&trace_writer_sleeping, false, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&trace_writer_mutex);
+
+        if (stop && !trace_queue_ready()) {
+            break;
+        }
     }
+
+    mem_free(dirty);
+
+    return NULL;
 }
 
-/* Dump message body
+/* Start the writer thread, if not started yet
  */
-void
-trace_dump_body (trace *t, http_data *data)
+static void
+trace_writer_start (void)
 {
-    if (t == NULL) {
+    int rc = 0;
+    int i;
+
+    pthread_mutex_lock(&trace_writer_mutex);
+
+    if (!trace_writer_started) {
+        for (i = 0; i < TRACE_QUEUE_SIZE; i ++) {
+            trace_queue[i].seq = i;
+        }
+        trace_queue_head = trace_queue_tail = 0;
+        trace_writer_stop = false;
+
+        rc = pthread_create(&trace_writer_thread, NULL,
+            trace_writer_thread_func, NULL);
+        trace_writer_started = rc == 0;
+    }
+
+    pthread_mutex_unlock(&trace_writer_mutex);
+
+    if (rc != 0) {
+        log_panic(NULL, "pthread_create: %s", strerror(rc));
+    }
+}
+
+/* Stop the writer thread, after all queued items are written
+ */
+static void
+trace_writer_stop_and_join (void)
+{
+    pthread_mutex_lock(&trace_writer_mutex);
+    if (!trace_writer_started) {
+        pthread_mutex_unlock(&trace_writer_mutex);
         return;
     }
 
+    trace_writer_stop = true;
+    pthread_cond_signal(&trace_writer_cond);
+    pthread_mutex_unlock(&trace_writer_mutex);
+
+    pthread_join(trace_writer_thread, NULL);
+    trace_writer_started = false;
+}
+
+/******************** Formatting ********************/
+/* http_query_foreach_request_header()/http_query_foreach_response_header()
+ * callback
+ */
+static void
+trace_message_headers_foreach_callback (const char *name, const char *value,
+        void *ptr)
+{
+    char **buf = ptr;
+    *buf = str_append_printf(*buf, "%s: %s\n", name, value);
+}
+
+/* Queue the log text, accumulated so far, and start the new one
+ */
+static char*
+trace_log_flush (trace *t, char *buf)
+{
+    if (buf[0] != '\0') {
+        trace_item_put(t, TRACE_ITEM_LOG, buf, NULL);
+        buf = str_new();
+    }
+
+    return buf;
+}
+
+/* Dump message body. The buf contains the log text, accumulated
+ * so far; it is queued before the body
+ */
+static char*
+trace_dump_body_buf (trace *t, char *buf, http_data *data)
+{
+    TRACE_ITEM kind;
+
     if (data->size == 0) {
-        return;
+        return buf;
     }
 
     if (str_has_prefix(data->content_type, "text/") ||
@@ -276,12 +690,88 @@ trace_dump_body (trace *t, http_data *data)
         str_has_prefix(data->content_type, "application/soap+xml") ||
         str_has_prefix(data->content_type, "application/xop+xml"))
     {
-        trace_dump_text(t, data, strstr(data->content_type, "xml") != NULL);
+        kind = strstr(data->content_type, "xml") != NULL ?
+            TRACE_ITEM_XML : TRACE_ITEM_TEXT;
     } else {
-        trace_dump_data(t, data);
+        kind = TRACE_ITEM_DATA;
     }
 
-    putc('\n', t->log);
+    buf = trace_log_flush(t, buf);
+    trace_item_put(t, kind, NULL, http_data_ref(data));
+
+    return str_append_c(buf, '\n');
+}
+
+/* Dump message body
+ */
+void
+trace_dump_body (trace *t, http_data *data)
+{
+    if (t != NULL) {
+        char *buf = trace_dump_body_buf(t, str_new(), data);
+
+        if (buf[0] != '\0') {
+            trace_item_put(t, TRACE_ITEM_LOG, buf, NULL);
+        } else {
+            mem_free(buf);
+        }
+    }
+}
+
+/* Format single line of hex dump, up to 16 bytes. Returns pointer
+ * to the end of line. Line takes at most TRACE_HEXDUMP_LINE bytes,
+ * including terminating '\n'
+ */
+static char*
+trace_hexdump_line (char *out, char prefix, unsigned int off,
+        const uint8_t *dp, size_t av)
+{
+    unsigned int i;
+
+    if (off > 0xffff) {
+        out += sprintf(out, "%c %4.4x: ", prefix, off);
+    } else {
+        *out ++ = prefix;
+        *out ++ = ' ';
+        *out ++ = trace_hex_digits[(off >> 12) & 0xf];
+        *out ++ = trace_hex_digits[(off >> 8) & 0xf];
+        *out ++ = trace_hex_digits[(off >> 4) & 0xf];
+        *out ++ = trace_hex_digits[off & 0xf];
+        *out ++ = ':';
+        *out ++ = ' ';
+    }
+
+    for (i = 0; i < 16; i ++) {
+        if (i < av) {
+            *out ++ = trace_hex_digits[dp[i] >> 4];
+            *out ++ = trace_hex_digits[dp[i] & 0xf];
+        } else {
+            *out ++ = ' ';
+            *out ++ = ' ';
+        }
+
+        switch (i) {
+        case 3: case 11:
+            *out ++ = i < av ? ':' : ' ';
+            break;
+        case 7:
+            *out ++ = i < av ? '-' : ' ';
+            break;
+        default:
+            *out ++ = ' ';
+        }
+    }
+
+    *out ++ = ' ';
+    *out ++ = ' ';
+
+    for (i = 0; i < av; i ++) {
+        *out ++ = safe_isprint(dp[i]) ? (char) dp[i] : '.';
+    }
+
+    *out ++ = '\n';
+
+    return out;
 }
 
 /* Dump binary data (as hex dump)
@@ -292,51 +782,29 @@ trace_hexdump (trace *t, char prefix, const void *data, size_t size)
 {
     const uint8_t *dp = data;
     unsigned int  off = 0;
-    char          *buf;
+    char          *buf, *out;
 
     if (t == NULL || !conf.dbg_hexdump) {
         return;
     }
 
-    buf = str_new();
-    while (size != 0) {
-        size_t       av = size > 16 ? 16 : size;
-        unsigned int i;
-
-        str_trunc(buf);
-        buf = str_append_printf(buf, "%c %4.4x: ", prefix, off);
+    buf = mem_new(char, ((size + 15) / 16) * TRACE_HEXDUMP_LINE + 1);
+    out = buf;
 
-        for(i = 0; i < 16; i ++) {
-            buf = str_append_printf(buf, i < av ? "%2.2x" : "  ", dp[ i ]);
-
-            switch(i) {
-            case 3: case 11:
-                buf = str_append_c(buf, i < av ? ':' : ' ');
-                break;
-            case 7:
-                buf = str_append_c(buf, i < av ? '-' : ' ');
-                break;
-            default:
-                buf = str_append_c(buf, ' ');
-            }
-        }
+    while (size != 0) {
+        size_t av = size > 16 ? 16 : size;
 
-        buf = str_append(buf,  "  ");
-        for( i = 0; i < av; i ++ )
-        {
-            unsigned char c = dp[ i ];
-            buf = str_append_c(buf, safe_isprint( c ) ? c : '.' );
-        }
-
-        buf = str_append_c(buf, '\n');
-        fwrite(buf, str_len(buf), 1, t->log);
+        out = trace_hexdump_line(out, prefix, off, dp, av);
 
         off += av;
         dp += av;
         size -= av;
     }
 
-    mem_free(buf);
+    *out = '\0';
+    mem_shrink(buf, out - buf);
+
+    trace_item_put(t, TRACE_ITEM_LOG, buf, NULL);
 }
 
 /* This hook is called on every http_query completion
@@ -345,50 +813,54 @@ void
 trace_http_query_hook (trace *t, http_query *q)
 {
     error err;
+    char  *buf;
 
-    if (t != NULL) {
-        fprintf(t->log, "==============================\n");
-
-        /* Dump request */
-        fprintf(t->log, "%s %s\n", http_query_method(q),
-                http_uri_str(http_query_uri(q)));
-        http_query_foreach_request_header(q,
-                trace_message_headers_foreach_callback, t);
-        fprintf(t->log, "\n");
-        trace_dump_body(t, http_query_get_request_data(q));
-
-        /* Dump response */
-        err = http_query_transport_error(q);
-        if (err != NULL) {
-            fprintf(t->log, "Error: %s\n", ESTRING(err));
-        } else {
-            int mp_count;
+    if (t == NULL) {
+        return;
+    }
 
-            fprintf(t->log, "Status: %d %s\n", http_query_status(q),
-                    http_query_status_string(q));
+    buf = str_new();
+    buf = str_append(buf, "==============================\n");
+
+    /* Dump request */
+    buf = str_append_printf(buf, "%s %s\n", http_query_method(q),
+            http_uri_str(http_query_uri(q)));
+    http_query_foreach_request_header(q,
+            trace_message_headers_foreach_callback, &buf);
+    buf = str_append_c(buf, '\n');
+    buf = trace_dump_body_buf(t, buf, http_query_get_request_data(q));
+
+    /* Dump response */
+    err = http_query_transport_error(q);
+    if (err != NULL) {
+        buf = str_append_printf(buf, "Error: %s\n", ESTRING(err));
+    } else {
+        int mp_count;
 
-            http_query_foreach_response_header(q,
-                trace_message_headers_foreach_callback, t);
-            fprintf(t->log, "\n");
+        buf = str_append_printf(buf, "Status: %d %s\n", http_query_status(q),
+                http_query_status_string(q));
+
+        http_query_foreach_response_header(q,
+            trace_message_headers_foreach_callback, &buf);
+        buf = str_append_c(buf, '\n');
 
-            trace_dump_body(t, http_query_get_response_data(q));
+        buf = trace_dump_body_buf(t, buf, http_query_get_response_data(q));
 
-            mp_count = http_query_get_mp_response_count(q);
-            if (mp_count != 0) {
-                int i;
+        mp_count = http_query_get_mp_response_count(q);
+        if (mp_count != 0) {
+            int i;
 
-                for (i = 0; i < mp_count; i ++) {
-                    http_data *part = http_query_get_mp_response_data(q, i);
-                    fprintf(t->log, "===== Part %d =====\n", i);
-                    fprintf(t->log, "Content-Type: %s\n", part->content_type);
-                    trace_dump_body(t, part);
-                }
+            for (i = 0; i < mp_count; i ++) {
+                http_data *part = http_query_get_mp_response_data(q, i);
+                buf = str_append_printf(buf, "===== Part %d =====\n", i);
+                buf = str_append_printf(buf, "Content-Type: %s\n",
+                        part->content_type);
+                buf = trace_dump_body_buf(t, buf, part);
             }
         }
-
-        fflush(t->log);
-        fflush(t->data);
     }
+
+    trace_item_put(t, TRACE_ITEM_LOG, buf, NULL);
 }
 
 /* Printf to the trace log
@@ -398,11 +870,14 @@ trace_printf (trace *t, const char *fmt, ...)
 {
     if (t != NULL) {
         va_list ap;
+        char    *buf;
+
         va_start(ap, fmt);
-        vfprintf(t->log, fmt, ap);
-        putc('\n', t->log);
-        fflush(t->log);
+        buf = str_vprintf(fmt, ap);
+        buf = str_append_c(buf, '\n');
         va_end(ap);
+
+        trace_item_put(t, TRACE_ITEM_LOG, buf, NULL);
     }
 }
 
@@ -411,9 +886,118 @@ trace_printf (trace *t, const char *fmt, ...)
 void
 trace_error (trace *t, error err)
 {
-    trace_printf(t, "---");
-    trace_printf(t, "%s", ESTRING(err));
-    trace_printf(t, "");
+    trace_printf(t, "---\n%s", ESTRING(err));
+}
+
+/******************** Timeline ********************/
+/* Append JSON string to the timeline text
+ */
+static char*
+trace_timeline_str (char *buf, const char *s)
+{
+    buf = str_append_c(buf, '"');
+    for (; *s != '\0'; s ++) {
+        unsigned char c = (unsigned char) *s;
+
+        if (c == '"' || c == '\\') {
+            buf = str_append_c(buf, '\\');
+            buf = str_append_c(buf, (char) c);
+        } else if (c < 0x20) {
+            buf = str_append_printf(buf, "\\u%4.4x", c);
+        } else {
+            buf = str_append_c(buf, (char) c);
+        }
+    }
+
+    return str_append_c(buf, '"');
+}
+
+/* Start timeline file. The file is a JSON array of events, in
+ * the Chrome trace-event format, understood by Perfetto and
+ * chrome://tracing
+ */
+static void
+trace_timeline_open (trace *t, const char *device_name)
+{
+    char *buf;
+
+    if (t->timeline == NULL) {
+        return;
+    }
+
+    buf = str_printf("[\n{\"ph\": \"M\", \"name\": \"process_name\", "
+        "\"pid\": %d, \"args\": {\"name\": ", (int) getpid());
+    buf = trace_timeline_str(buf, device_name);
+    buf = str_append(buf, "}}");
+
+    trace_item_put(t, TRACE_ITEM_TIMELINE, buf, NULL);
+}
+
+/* Write timeline event
+ */
+static void
+trace_timeline_event (trace *t, char ph, const char *cat, const char *name,
+        const void *id, const char *detail)
+{
+    struct timespec ts;
+    uint64_t        us;
+    char            *buf;
+
+    if (t == NULL || t->timeline == NULL) {
+        return;
+    }
+
+    if (trace_timeline_tid == 0) {
+        trace_timeline_tid = __sync_add_and_fetch(&trace_timeline_tid_last, 1);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    us = (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+
+    buf = str_printf(",\n{\"ph\": \"%c\", \"cat\": \"%s\", \"name\": ",
+        ph, cat);
+    buf = trace_timeline_str(buf, name);
+    buf = str_append_printf(buf, ", \"id\": \"0x%" PRIxPTR "\", "
+        "\"ts\": %" PRIu64 ".%3.3u, \"pid\": %d, \"tid\": %d",
+        (uintptr_t) id, us, (unsigned int) (ts.tv_nsec % 1000),
+        (int) getpid(), trace_timeline_tid);
+
+    if (detail != NULL) {
+        buf = str_append(buf, ", \"args\": {\"detail\": ");
+        buf = trace_timeline_str(buf, detail);
+        buf = str_append_c(buf, '}');
+    }
+
+    buf = str_append_c(buf, '}');
+
+    trace_item_put(t, TRACE_ITEM_TIMELINE, buf, NULL);
+}
+
+/* Write timeline begin event
+ */
+void
+trace_event_begin (trace *t, const char *cat, const char *name,
+        const void *id, const char *detail)
+{
+    trace_timeline_event(t, 'b', cat, name, id, detail);
+}
+
+/* Write timeline end event
+ */
+void
+trace_event_end (trace *t, const char *cat, const char *name,
+        const void *id, const char *detail)
+{
+    trace_timeline_event(t, 'e', cat, name, id, detail);
+}
+
+/* Write timeline instant event
+ */
+void
+trace_event_instant (trace *t, const char *cat, const char *name,
+        const void *id, const char *detail)
+{
+    trace_timeline_event(t, 'n', cat, name, id, detail);
 }
 
 /* vim:ts=8:sw=4:et
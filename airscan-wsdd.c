@@ -33,6 +33,36 @@
 #define WSDD_DISCOVERY_TIME     2500    /* Standard discovery time */
 #define WSDD_DISCOVERY_TIME_EX  5000    /* Extended discovery time */
 
+/* Initial scan is considered complete, if no new devices has
+ * answered for the "quiet" interval, which is learned from the
+ * previous scans. WSDD_QUIET_DEFAULT is used until learned and
+ * slightly exceeds the WS-Discovery APP_MAX_DELAY (500 ms)
+ */
+#define WSDD_QUIET_DEFAULT      600
+#define WSDD_QUIET_MIN          300
+
+/* Receive batching: packets per recvmmsg() call and max
+ * packets handled per wakeup
+ */
+#ifdef  OS_HAVE_RECVMMSG
+#   define WSDD_RECV_BATCH      8
+#else
+#   define WSDD_RECV_BATCH      1
+#endif
+#define WSDD_RECV_MAX           64
+
+/* Metadata query timeout, in milliseconds. Queries run with limited
+ * parallelism, so the unreachable address must not hold its slot
+ * for the whole TCP connect timeout
+ */
+#define WSDD_FETCH_TIMEOUT      5000
+
+/* Pre-parse filtering: size of the message prefix, scanned for
+ * the message header, and size of the duplicate suppression cache
+ */
+#define WSDD_PREFILTER_SCAN     4096
+#define WSDD_DEDUP_SIZE         256
+
 /* WS-Discovery stable endpoint path
  */
 #define WSDD_STABLE_ENDPOINT    \
@@ -72,6 +102,16 @@ typedef struct {
     bool              published;             /* This finding is published */
 } wsdd_finding;
 
+/* wsdd_fetch represents a metadata query, either queued or active
+ */
+typedef struct {
+    wsdd_finding  *wsdd;     /* Finding that requested the metadata */
+    http_uri      *uri;      /* Metadata URI */
+    ip_addr       host;      /* Host address, for per-host fairness */
+    http_query    *q;        /* Active query, NULL while queued */
+    ll_node       list_node; /* In wsdd_fetch_queue or wsdd_fetch_active */
+} wsdd_fetch;
+
 /* wsdd_xaddr represents device transport address
  */
 typedef struct {
@@ -98,13 +138,54 @@ typedef struct {
     bool         is_printer; /* Device is printer */
 } wsdd_message;
 
+/* wsdd_recv_slot represents a receive buffer with its
+ * associated peer address and auxiliary data
+ */
+typedef struct {
+    char                    buf[65536];  /* Packet data */
+    struct sockaddr_storage from;        /* Sender address */
+    uint8_t                 aux[512];    /* Auxiliary data */
+    struct iovec            vec;         /* I/O vector for buf */
+} wsdd_recv_slot;
+
+/* wsdd_recv_stat contains UDP receive statistics
+ */
+typedef struct {
+    unsigned int  wakeups;  /* Wakeups with packets received */
+    unsigned int  packets;  /* Total packets received */
+    unsigned int  max;      /* Max packets per wakeup */
+    unsigned int  dups;     /* Duplicates dropped before parsing */
+    unsigned int  ignored;  /* Irrelevant messages dropped before parsing */
+} wsdd_recv_stat_t;
+
+/* wsdd_dedup_entry represents a recently seen message in the
+ * duplicate suppression cache
+ */
+typedef struct {
+    char          *key;     /* Key bytes, see wsdd_prefilter() */
+    size_t        len;      /* Key length */
+    ll_node       lru_node; /* In wsdd_dedup_lru */
+} wsdd_dedup_entry;
+
 /* Forward declarations
  */
 static void
 wsdd_finding_add_xaddr (wsdd_finding *wsdd, wsdd_xaddr *xaddr);
 
 static void
-wsdd_finding_get_metadata (wsdd_finding *wsdd, int ifindex, wsdd_xaddr *xaddr);
+wsdd_finding_get_metadata (wsdd_finding *wsdd, wsdd_xaddr *xaddr);
+
+static bool
+wsdd_fetch_has_pending (const wsdd_finding *wsdd);
+
+static void
+wsdd_fetch_cancel (wsdd_finding *wsdd, int af);
+
+static void
+wsdd_fetch_schedule (void);
+
+static void
+wsdd_fetch_done (wsdd_fetch *fetch);
 
 static void
 wsdd_message_free(wsdd_message *msg);
@@ -125,10 +206,22 @@ static int                 wsdd_mcsock_ipv6 = -1;
 static eloop_fdpoll        *wsdd_fdpoll_ipv4;
 static eloop_fdpoll        *wsdd_fdpoll_ipv6;
 static char                wsdd_buf[65536];
+static wsdd_recv_slot      *wsdd_recv_pool;
+static wsdd_recv_stat_t    wsdd_recv_stat;
+static hashmap             *wsdd_dedup_map;
+static ll_head             wsdd_dedup_lru;
 static struct sockaddr_in  wsdd_mcast_ipv4;
 static struct sockaddr_in6 wsdd_mcast_ipv6;
 static ll_head             wsdd_finding_list;
+static ll_head             wsdd_fetch_queue;
+static ll_head             wsdd_fetch_active;
+static int                 wsdd_fetch_active_count;
 static int                 wsdd_initscan_count;
+static eloop_timer         *wsdd_initscan_quiet_timer;
+static bool                wsdd_initscan_quiet;
+static bool                wsdd_initscan_learning;
+static timestamp           wsdd_initscan_last;
+static timestamp           wsdd_initscan_gap;
 static http_client         *wsdd_http_client;
 static ip_addrset          *wsdd_addrs_probing;
 
@@ -255,6 +348,157 @@ wsdd_initscan_count_dec (void)
     }
 }
 
+/******************** Initial scan completion ********************/
+/* Get the "quiet" interval: if no new devices has answered
+ * during this interval, initial scan is considered complete
+ */
+static timestamp
+wsdd_initscan_quiet_interval (void)
+{
+    timestamp gap = epstat_discovery_gap_get();
+    timestamp t;
+
+    if (gap < 0) {
+        return WSDD_QUIET_DEFAULT;
+    }
+
+    t = gap + gap / 4 + WSDD_RETRANSMIT_MIN;
+    if (t < WSDD_QUIET_MIN) {
+        t = WSDD_QUIET_MIN;
+    } else if (t > WSDD_DISCOVERY_TIME) {
+        t = WSDD_DISCOVERY_TIME;
+    }
+
+    return t;
+}
+
+/* Finish initial scan early, if answers are quiet and all
+ * findings are published. Resolvers continue to run up to their
+ * time limits, so late devices will be discovered anyway
+ */
+static void
+wsdd_initscan_try_finish (void)
+{
+    ll_node    *node;
+    netif_addr *addr;
+
+    if (!wsdd_initscan_quiet || wsdd_initscan_count == 0) {
+        return;
+    }
+
+    /* Wait for pending metadata queries */
+    for (LL_FOR_EACH(node, &wsdd_finding_list)) {
+        wsdd_finding *wsdd = OUTER_STRUCT(node, wsdd_finding, list_node);
+        if (!wsdd->published) {
+            log_debug(wsdd_log, "initial scan: waiting for %s",
+                wsdd->address);
+            return;
+        }
+    }
+
+    log_debug(wsdd_log, "initial scan: finished early");
+
+    wsdd_initscan_count_inc();
+    for (addr = wsdd_netif_addr_list; addr != NULL; addr = addr->next) {
+        wsdd_resolver *resolver = addr->data;
+        if (resolver != NULL && resolver->initscan) {
+            resolver->initscan = false;
+            wsdd_initscan_count_dec();
+        }
+    }
+    wsdd_initscan_count_dec();
+}
+
+/* wsdd_initscan_quiet_timer callback
+ */
+static void
+wsdd_initscan_quiet_timer_callback (void *unused)
+{
+    (void) unused;
+
+    wsdd_initscan_quiet_timer = NULL;
+    wsdd_initscan_quiet = true;
+
+    log_debug(wsdd_log, "initial scan: no new answers for %d ms",
+        (int) (timestamp_now() - wsdd_initscan_last));
+
+    wsdd_initscan_try_finish();
+}
+
+/* (Re)start wsdd_initscan_quiet_timer
+ */
+static void
+wsdd_initscan_quiet_timer_start (void)
+{
+    if (wsdd_initscan_quiet_timer != NULL) {
+        eloop_timer_cancel(wsdd_initscan_quiet_timer);
+    }
+
+    wsdd_initscan_quiet_timer = eloop_timer_new(
+        (int) wsdd_initscan_quiet_interval(),
+        wsdd_initscan_quiet_timer_callback, NULL);
+}
+
+/* Finish learning of the interval between answers. Called when
+ * the first resolver has reached its time limit, or when WSDD
+ * is stopped
+ */
+static void
+wsdd_initscan_learn_done (void)
+{
+    if (wsdd_initscan_learning) {
+        wsdd_initscan_learning = false;
+        if (wsdd_initscan_gap >= 0) {
+            epstat_discovery_update(wsdd_initscan_gap);
+        }
+    }
+}
+
+/* Notify initial scan tracking that new device has answered
+ */
+static void
+wsdd_initscan_answer (void)
+{
+    timestamp now = timestamp_now();
+
+    if (wsdd_initscan_learning &&
+        now - wsdd_initscan_last > wsdd_initscan_gap) {
+        wsdd_initscan_gap = now - wsdd_initscan_last;
+    }
+
+    wsdd_initscan_last = now;
+
+    if (wsdd_initscan_count != 0 && !wsdd_initscan_quiet) {
+        wsdd_initscan_quiet_timer_start();
+    }
+}
+
+/* Start tracking of the initial scan
+ */
+static void
+wsdd_initscan_start (void)
+{
+    wsdd_initscan_quiet = false;
+    wsdd_initscan_learning = true;
+    wsdd_initscan_last = timestamp_now();
+    wsdd_initscan_gap = -1;
+
+    wsdd_initscan_quiet_timer_start();
+}
+
+/* Stop tracking of the initial scan
+ */
+static void
+wsdd_initscan_stop (void)
+{
+    if (wsdd_initscan_quiet_timer != NULL) {
+        eloop_timer_cancel(wsdd_initscan_quiet_timer);
+        wsdd_initscan_quiet_timer = NULL;
+    }
+
+    wsdd_initscan_learn_done();
+}
+
 /******************** wsdd_finding operations ********************/
 /* Create new wsdd_finding
  */
@@ -293,7 +537,7 @@ wsdd_finding_free (wsdd_finding *wsdd)
     mdns_resolver_cancel(wsdd->mdns_resolver);
     mdns_resolver_free(wsdd->mdns_resolver);
 
-    http_client_cancel(wsdd->http_client);
+    wsdd_fetch_cancel(wsdd, AF_UNSPEC);
     http_client_free(wsdd->http_client);
 
     if (wsdd->publish_timer != NULL) {
@@ -333,16 +577,18 @@ wsdd_finding_publish (wsdd_finding *wsdd)
     }
 
     zeroconf_finding_publish(&wsdd->finding);
+    wsdd_initscan_try_finish();
 }
 
 /* wsdd_finding_has_pending_queries checks if wsdd_finding
- * has pending MDNS or HTTP queries
+ * has pending MDNS or HTTP queries, including queued ones
  */
 static bool
 wsdd_finding_has_pending_queries (wsdd_finding *wsdd)
 {
     return mdns_resolver_has_pending(wsdd->mdns_resolver) ||
-           http_client_has_pending(wsdd->http_client);
+           http_client_has_pending(wsdd->http_client) ||
+           wsdd_fetch_has_pending(wsdd);
 }
 
 /* ZEROCONF_PUBLISH_DELAY timer callback
@@ -436,6 +682,7 @@ wsdd_finding_get (int ifindex, const char *address)
     /* Add new finding */
     wsdd = wsdd_finding_new(ifindex, address);
     ll_push_end(&wsdd_finding_list, &wsdd->list_node);
+    wsdd_initscan_answer();
 
     return wsdd;
 }
@@ -579,7 +826,7 @@ wsdd_finding_add_xaddr (wsdd_finding *wsdd, wsdd_xaddr *xaddr)
     if (http_uri_is_literal(xaddr->uri)) {
         ll_push_end(&wsdd->xaddrs, &xaddr->list_node);
         if (wsdd->is_scanner) {
-            wsdd_finding_get_metadata(wsdd, wsdd->finding.ifindex, xaddr);
+            wsdd_finding_get_metadata(wsdd, xaddr);
         }
     } else {
         ll_push_end(&wsdd->xaddrs_unresolved, &xaddr->list_node);
@@ -605,6 +852,7 @@ wsdd_finding_del (const char *address)
         if (!strcmp(wsdd->address, address)) {
             ll_del(&wsdd->list_node);
             wsdd_finding_free(wsdd);
+            wsdd_initscan_try_finish();
             return;
         }
     }
@@ -715,6 +963,10 @@ wsdd_finding_get_metadata_callback (void *ptr, http_query *q)
     http_data    *data;
     wsdd_finding *wsdd = ptr;
     char         *model = NULL, *manufacturer = NULL;
+    wsdd_fetch   *fetch = (wsdd_fetch*) http_query_get_uintptr(q);
+
+    /* Release the slot, so the next queued query can start */
+    wsdd_fetch_done(fetch);
 
     /* Check query status */
     err = http_query_error(q);
@@ -784,13 +1036,16 @@ wsdd_finding_get_metadata_callback (void *ptr, http_query *q)
      * endpoints, or metadata request sent to IPv4 address may return
      * only IPv4 endpoints and visa versa
      *
-     * But if we have both IPv4/IPv6 endpoints, seems waiting for completion
-     * of more metadata requests is not unnecessary. So lets cancel them,
-     * if any.
+     * So once we have endpoints of some address family, metadata
+     * requests sent to other addresses of the same family are not
+     * necessary. So lets cancel them, if any, both queued and active.
      */
-    if (ip_addrset_has_af(wsdd->finding.addrs, AF_INET) &&
-        ip_addrset_has_af(wsdd->finding.addrs, AF_INET6)) {
-        http_client_cancel(wsdd->http_client);
+    if (ip_addrset_has_af(wsdd->finding.addrs, AF_INET)) {
+        wsdd_fetch_cancel(wsdd, AF_INET);
+    }
+
+    if (ip_addrset_has_af(wsdd->finding.addrs, AF_INET6)) {
+        wsdd_fetch_cancel(wsdd, AF_INET6);
     }
 
     /* Cleanup and exit */
@@ -805,21 +1060,213 @@ DONE:
 }
 
 /* Query device metadata
+ *
+ * The query is not submitted immediately, but queued to the
+ * metadata fetch scheduler (see wsdd_fetch_schedule())
  */
 static void
-wsdd_finding_get_metadata (wsdd_finding *wsdd, int ifindex, wsdd_xaddr *xaddr)
+wsdd_finding_get_metadata (wsdd_finding *wsdd, wsdd_xaddr *xaddr)
 {
-    uuid       u = uuid_rand();
-    http_query *q;
+    wsdd_fetch *fetch = mem_new(wsdd_fetch, 1);
 
-    log_trace(wsdd_log, "querying metadata from %s", http_uri_str(xaddr->uri));
+    log_trace(wsdd_log, "metadata query queued: %s", http_uri_str(xaddr->uri));
 
-    sprintf(wsdd_buf, wsdd_get_metadata_template, u.text, wsdd->address);
-    q = http_query_new(wsdd->http_client, http_uri_clone(xaddr->uri),
-        "POST", str_dup(wsdd_buf), "application/soap+xml; charset=utf-8");
+    fetch->wsdd = wsdd;
+    fetch->uri = http_uri_clone(xaddr->uri);
+    fetch->host = ip_addr_from_sockaddr(http_uri_addr(xaddr->uri));
 
-    http_query_set_uintptr(q, ifindex);
-    http_query_submit(q, wsdd_finding_get_metadata_callback);
+    ll_push_end(&wsdd_fetch_queue, &fetch->list_node);
+    wsdd_fetch_schedule();
+}
+
+/******************** Metadata fetch scheduling ********************/
+/* Free wsdd_fetch. It must be already unlinked
+ */
+static void
+wsdd_fetch_free (wsdd_fetch *fetch)
+{
+    http_uri_free(fetch->uri);
+    mem_free(fetch);
+}
+
+/* Check if host has an active metadata query
+ */
+static bool
+wsdd_fetch_host_busy (ip_addr host)
+{
+    ll_node *node;
+
+    for (LL_FOR_EACH(node, &wsdd_fetch_active)) {
+        wsdd_fetch *fetch = OUTER_STRUCT(node, wsdd_fetch, list_node);
+        if (ip_addr_equal(fetch->host, host)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Count active metadata queries of the finding
+ */
+static int
+wsdd_fetch_count_active (const wsdd_finding *wsdd)
+{
+    ll_node *node;
+    int     count = 0;
+
+    for (LL_FOR_EACH(node, &wsdd_fetch_active)) {
+        wsdd_fetch *fetch = OUTER_STRUCT(node, wsdd_fetch, list_node);
+        if (fetch->wsdd == wsdd) {
+            count ++;
+        }
+    }
+
+    return count;
+}
+
+/* Choose the next queued metadata query to start. Hosts that already
+ * have an active query are skipped and, among the remaining queries,
+ * the one of the finding with the least active queries wins, so
+ * devices with many addresses don't delay other devices. Ties are
+ * broken in the queue order. Returns NULL, if nothing can be started
+ */
+static wsdd_fetch*
+wsdd_fetch_choose (void)
+{
+    ll_node    *node;
+    wsdd_fetch *best = NULL;
+    int        best_count = 0;
+
+    for (LL_FOR_EACH(node, &wsdd_fetch_queue)) {
+        wsdd_fetch *fetch = OUTER_STRUCT(node, wsdd_fetch, list_node);
+        int        count;
+
+        if (wsdd_fetch_host_busy(fetch->host)) {
+            continue;
+        }
+
+        count = wsdd_fetch_count_active(fetch->wsdd);
+        if (best == NULL || count < best_count) {
+            best = fetch;
+            best_count = count;
+            if (count == 0) {
+                break;
+            }
+        }
+    }
+
+    return best;
+}
+
+/* Start queued metadata queries, while below the parallelism limit.
+ *
+ * With many WSD devices appearing at once, submitting all metadata
+ * queries at once makes them compete for the network and the event
+ * loop, and unreachable addresses pile up timeouts. Limiting the
+ * parallelism (conf.wsdd_parallel) and per-host fairness makes the
+ * discovery time proportional to the slowest device rather than
+ * to the sum of them
+ */
+static void
+wsdd_fetch_schedule (void)
+{
+    while (wsdd_fetch_active_count < conf.wsdd_parallel) {
+        wsdd_fetch   *fetch = wsdd_fetch_choose();
+        wsdd_finding *wsdd;
+        uuid         u;
+
+        if (fetch == NULL) {
+            return;
+        }
+
+        wsdd = fetch->wsdd;
+        u = uuid_rand();
+
+        log_trace(wsdd_log, "querying metadata from %s",
+            http_uri_str(fetch->uri));
+
+        sprintf(wsdd_buf, wsdd_get_metadata_template, u.text, wsdd->address);
+        fetch->q = http_query_new(wsdd->http_client,
+            http_uri_clone(fetch->uri), "POST", str_dup(wsdd_buf),
+            "application/soap+xml; charset=utf-8");
+
+        ll_del(&fetch->list_node);
+        ll_push_end(&wsdd_fetch_active, &fetch->list_node);
+        wsdd_fetch_active_count ++;
+
+        http_query_set_uintptr(fetch->q, (uintptr_t) fetch);
+        http_query_timeout(fetch->q, WSDD_FETCH_TIMEOUT);
+        http_query_submit(fetch->q, wsdd_finding_get_metadata_callback);
+    }
+}
+
+/* Called when active metadata query is completed. Releases
+ * the wsdd_fetch and starts the next queued query, if any
+ */
+static void
+wsdd_fetch_done (wsdd_fetch *fetch)
+{
+    ll_del(&fetch->list_node);
+    wsdd_fetch_active_count --;
+    wsdd_fetch_free(fetch);
+
+    wsdd_fetch_schedule();
+}
+
+/* Check if finding has queued metadata queries
+ */
+static bool
+wsdd_fetch_has_pending (const wsdd_finding *wsdd)
+{
+    ll_node *node;
+
+    for (LL_FOR_EACH(node, &wsdd_fetch_queue)) {
+        wsdd_fetch *fetch = OUTER_STRUCT(node, wsdd_fetch, list_node);
+        if (fetch->wsdd == wsdd) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Cancel metadata queries of the finding, both queued and active,
+ * sent to the addresses of the specified address family, or all
+ * queries, if af is AF_UNSPEC
+ */
+static void
+wsdd_fetch_cancel (wsdd_finding *wsdd, int af)
+{
+    ll_head *lists[] = {&wsdd_fetch_queue, &wsdd_fetch_active};
+    size_t  i;
+    bool    cancelled = false;
+
+    for (i = 0; i < sizeof(lists) / sizeof(lists[0]); i ++) {
+        ll_node *node = ll_first(lists[i]);
+
+        while (node != NULL) {
+            wsdd_fetch *fetch = OUTER_STRUCT(node, wsdd_fetch, list_node);
+
+            node = ll_next(lists[i], node);
+            if (fetch->wsdd != wsdd ||
+                (af != AF_UNSPEC && fetch->host.af != af)) {
+                continue;
+            }
+
+            ll_del(&fetch->list_node);
+            if (fetch->q != NULL) {
+                http_query_cancel(fetch->q);
+                wsdd_fetch_active_count --;
+            }
+
+            wsdd_fetch_free(fetch);
+            cancelled = true;
+        }
+    }
+
+    if (cancelled) {
+        wsdd_fetch_schedule();
+    }
 }
 
 /******************** wsdd_message operations ********************/
@@ -956,6 +1403,264 @@ wsdd_message_action_name (const wsdd_message *msg)
     return "UNKNOWN";
 }
 
+/******************** Pre-parse filtering ********************/
+/* Find the next element with the specified local name (namespace
+ * prefix is ignored) within data, starting at *off. On success,
+ * element's text (up to the first nested tag, if any) is returned
+ * via val/vlen, and *off is moved past it
+ */
+static bool
+wsdd_prefilter_find (const char *data, size_t len, const char *name,
+        size_t *off, const char **val, size_t *vlen)
+{
+    size_t     namelen = strlen(name);
+    const char *end = data + len;
+
+    while (*off < len) {
+        const char *p = memmem(data + *off, len - *off, name, namelen);
+        const char *q, *v;
+
+        if (p == NULL) {
+            return false;
+        }
+
+        *off = p - data + namelen;
+
+        /* Skip namespace prefix, if any, and check that the name
+         * opens a tag: "<name" or "<prefix:name"
+         */
+        q = p;
+        if (q > data && q[-1] == ':') {
+            for (q --; q > data && q[-1] != '<' && q[-1] != '>' &&
+                       q[-1] != '/' && !safe_isspace(q[-1]); q --)
+                ;
+        }
+
+        if (q == data || q[-1] != '<') {
+            continue;
+        }
+
+        if (p + namelen == end ||
+            (p[namelen] != '>' && !safe_isspace(p[namelen]))) {
+            continue;
+        }
+
+        /* Locate the element's text */
+        v = memchr(p + namelen, '>', end - (p + namelen));
+        if (v == NULL) {
+            return false;
+        }
+        v ++;
+
+        q = memchr(v, '<', end - v);
+        if (q == NULL) {
+            return false;
+        }
+
+        *val = v;
+        *vlen = q - v;
+        *off = q - data;
+
+        return true;
+    }
+
+    return false;
+}
+
+/* Check if data contains the specified substring
+ */
+static bool
+wsdd_prefilter_contains (const char *data, size_t len, const char *str)
+{
+    return memmem(data, len, str, strlen(str)) != NULL;
+}
+
+/* Check the duplicate suppression cache for the key. Returns true,
+ * if key was recently seen; otherwise the key is added to the cache,
+ * evicting the least recently seen one, if cache is full
+ */
+static bool
+wsdd_dedup_check (const void *key, size_t len)
+{
+    wsdd_dedup_entry *ent = hashmap_get(wsdd_dedup_map, key, len);
+
+    if (ent != NULL) {
+        ll_del(&ent->lru_node);
+        ll_push_end(&wsdd_dedup_lru, &ent->lru_node);
+        return true;
+    }
+
+    if (hashmap_count(wsdd_dedup_map) >= WSDD_DEDUP_SIZE) {
+        ll_node *node = ll_pop_beg(&wsdd_dedup_lru);
+
+        ent = OUTER_STRUCT(node, wsdd_dedup_entry, lru_node);
+        hashmap_del(wsdd_dedup_map, ent->key, ent->len);
+        mem_free(ent->key);
+        mem_free(ent);
+    }
+
+    ent = mem_new(wsdd_dedup_entry, 1);
+    ent->key = mem_new(char, len);
+    ent->len = len;
+    memcpy(ent->key, key, len);
+
+    hashmap_set(wsdd_dedup_map, ent->key, len, ent);
+    ll_push_end(&wsdd_dedup_lru, &ent->lru_node);
+
+    return false;
+}
+
+/* Purge the duplicate suppression cache
+ */
+static void
+wsdd_dedup_purge (void)
+{
+    ll_node *node;
+
+    while ((node = ll_pop_beg(&wsdd_dedup_lru)) != NULL) {
+        wsdd_dedup_entry *ent;
+
+        ent = OUTER_STRUCT(node, wsdd_dedup_entry, lru_node);
+        hashmap_del(wsdd_dedup_map, ent->key, ent->len);
+        mem_free(ent->key);
+        mem_free(ent);
+    }
+}
+
+/* Make duplicate suppression key. Messages, received from different
+ * interfaces, are never considered duplicates, as findings are
+ * per-interface
+ */
+static size_t
+wsdd_dedup_key (char *key, size_t size, char kind, int ifindex,
+        const void *data, size_t len)
+{
+    size_t n = 1 + sizeof(ifindex);
+
+    key[0] = kind;
+    memcpy(key + 1, &ifindex, sizeof(ifindex));
+
+    if (len > size - n) {
+        len = size - n;
+    }
+
+    memcpy(key + n, data, len);
+
+    return n + len;
+}
+
+/* Check the received message before it goes to the XML parser.
+ *
+ * Action, MessageID and device types are extracted by a bounded
+ * byte scan, without a full parse. The message is dropped, if:
+ *   - action is recognized, but it is not Hello, Bye or ProbeMatches
+ *     (i.e., Probe and Resolve, sent by other clients)
+ *   - it is Hello or ProbeMatches from device, which is neither
+ *     scanner nor printer
+ *   - it is a retransmission of the recently seen message (same
+ *     MessageID) or repeats the recently seen Hello or ProbeMatches
+ *     word by word (except the header), which happens when device
+ *     answers each of our probes
+ *
+ * If something cannot be found by scan, message is passed to the
+ * parser, which has the final say.
+ *
+ * Returns NULL, if message needs to be parsed, or the reason why
+ * it was dropped
+ */
+static const char*
+wsdd_prefilter (const char *data, size_t len, int ifindex)
+{
+    size_t      scan = len < WSDD_PREFILTER_SCAN ? len : WSDD_PREFILTER_SCAN;
+    size_t      off = 0;
+    const char  *val, *body;
+    size_t      vlen;
+    WSDD_ACTION action;
+    char        key[256];
+    size_t      keylen;
+    uint32_t    hash[2];
+
+    /* Check action. Note, the order of checks matches
+     * wsdd_message_parse()
+     */
+    if (!wsdd_prefilter_find(data, scan, "Action", &off, &val, &vlen)) {
+        return NULL;
+    }
+
+    if (wsdd_prefilter_contains(val, vlen, "Hello")) {
+        action = WSDD_ACTION_HELLO;
+    } else if (wsdd_prefilter_contains(val, vlen, "Bye")) {
+        action = WSDD_ACTION_BYE;
+    } else if (wsdd_prefilter_contains(val, vlen, "ProbeMatches")) {
+        action = WSDD_ACTION_PROBEMATCHES;
+    } else {
+        wsdd_recv_stat.ignored ++;
+        return "irrelevant action";
+    }
+
+    /* Check device types. The whole message is scanned here */
+    if (action != WSDD_ACTION_BYE) {
+        bool relevant = false;
+
+        off = 0;
+        while (!relevant &&
+               wsdd_prefilter_find(data, len, "Types", &off, &val, &vlen)) {
+            relevant =
+                wsdd_prefilter_contains(val, vlen, "ScanDeviceType") ||
+                wsdd_prefilter_contains(val, vlen, "PrintDeviceType");
+        }
+
+        if (!relevant) {
+            wsdd_recv_stat.ignored ++;
+            return "neither scanner nor printer";
+        }
+    }
+
+    /* Check MessageID */
+    off = 0;
+    keylen = 0;
+    if (wsdd_prefilter_find(data, scan, "MessageID", &off, &val, &vlen)) {
+        keylen = wsdd_dedup_key(key, sizeof(key), 'M', ifindex, val, vlen);
+        if (wsdd_dedup_check(key, keylen)) {
+            wsdd_recv_stat.dups ++;
+            return "duplicate MessageID";
+        }
+    }
+
+    /* Bye invalidates everything we know about the device, so
+     * subsequent Hello must not be suppressed. Only Bye's own
+     * MessageID is remembered, to suppress its retransmissions
+     */
+    if (action == WSDD_ACTION_BYE) {
+        wsdd_dedup_purge();
+        if (keylen != 0) {
+            wsdd_dedup_check(key, keylen);
+        }
+        return NULL;
+    }
+
+    /* Check message body. Body is remembered by its hash and
+     * length, that makes false matches practically impossible
+     */
+
+    off = 0;
+    if (!wsdd_prefilter_find(data, scan, "Body", &off, &val, &vlen)) {
+        return NULL;
+    }
+
+    body = val;
+    hash[0] = hash_bytes(body, data + len - body);
+    hash[1] = (uint32_t) (data + len - body);
+
+    keylen = wsdd_dedup_key(key, sizeof(key), 'B', ifindex, hash, sizeof(hash));
+    if (wsdd_dedup_check(key, keylen)) {
+        wsdd_recv_stat.dups ++;
+        return "repeated message body";
+    }
+
+    return NULL;
+}
+
 /******************** Advanced socket options ********************/
 /* Setup IP_PKTINFO/IP_RECVIF reception for IPv6 sockets
  */
@@ -1098,42 +1803,41 @@ DONE:
 }
 
 
-/* Resolver read callback
+/* Prepare msghdr for receiving into the wsdd_recv_slot
  */
 static void
-wsdd_resolver_read_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
+wsdd_recv_slot_prepare (wsdd_recv_slot *slot, struct msghdr *msghdr)
+{
+    slot->vec.iov_base = slot->buf;
+    slot->vec.iov_len = sizeof(slot->buf);
+
+    memset(msghdr, 0, sizeof(*msghdr));
+    msghdr->msg_name = &slot->from;
+    msghdr->msg_namelen = sizeof(slot->from);
+    msghdr->msg_iov = &slot->vec;
+    msghdr->msg_iovlen = 1;
+    msghdr->msg_control = slot->aux;
+    msghdr->msg_controllen = sizeof(slot->aux);
+}
+
+/* Handle a single received packet
+ */
+static void
+wsdd_resolver_read_packet (int fd, struct msghdr *msghdr, const char *data,
+        int len)
 {
-    struct sockaddr_storage from, to;
+    struct sockaddr_storage to;
     socklen_t               tolen = sizeof(to);
     ip_straddr              str_from, str_to;
-    int                     rc;
     wsdd_message            *msg;
-    struct iovec            vec = {wsdd_buf, sizeof(wsdd_buf)};
-    uint8_t                 aux[8192];
     struct cmsghdr          *cmsg;
     int                     ifindex = 0;
     wsdd_resolver           *resolver;
-    struct msghdr           msghdr = {
-        .msg_name = &from,
-        .msg_namelen = sizeof(from),
-        .msg_iov = &vec,
-        .msg_iovlen = 1,
-        .msg_control = aux,
-        .msg_controllen = sizeof(aux)
-    };
-
-    (void) mask;
-    (void) data;
-
-    /* Receive a packet */
-    rc = recvmsg(fd, &msghdr, 0);
-    if (rc <= 0) {
-        return;
-    }
+    const char              *reason;
 
     /* Fetch interface index from auxiliary data */
-    for (cmsg = CMSG_FIRSTHDR(&msghdr); cmsg != NULL;
-         cmsg = CMSG_NXTHDR(&msghdr, cmsg)) {
+    for (cmsg = CMSG_FIRSTHDR(msghdr); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(msghdr, cmsg)) {
         if (cmsg->cmsg_level == IPPROTO_IPV6 &&
             cmsg->cmsg_type == IPV6_PKTINFO) {
             struct in6_pktinfo *pkt = (struct in6_pktinfo*) CMSG_DATA(cmsg);
@@ -1158,13 +1862,13 @@ wsdd_resolver_read_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
 #endif
     }
 
-    str_from = ip_straddr_from_sockaddr((struct sockaddr*) &from, true);
+    str_from = ip_straddr_from_sockaddr(msghdr->msg_name, true);
     (void) getsockname(fd, (struct sockaddr*) &to, &tolen);
     str_to = ip_straddr_from_sockaddr((struct sockaddr*) &to, true);
 
-    log_trace(wsdd_log, "%d bytes received: %s->%s", rc,
+    log_trace(wsdd_log, "%d bytes received: %s->%s", len,
         str_from.text, str_to.text);
-    log_trace_data(wsdd_log, "application/xml", wsdd_buf, rc);
+    log_trace_data(wsdd_log, "application/xml", data, len);
 
     /* Lookup resolver by interface index */
     resolver = wsdd_netif_resolver_by_ifindex(ifindex);
@@ -1172,13 +1876,75 @@ wsdd_resolver_read_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
         return;
     }
 
+    /* Drop duplicates and irrelevant messages before parsing */
+    reason = wsdd_prefilter(data, len, ifindex);
+    if (reason != NULL) {
+        log_trace(wsdd_log, "message dropped: %s", reason);
+        return;
+    }
+
     /* Parse and dispatch the message */
-    msg = wsdd_message_parse(wsdd_buf, rc);
+    msg = wsdd_message_parse(data, len);
     if (msg != NULL) {
         wsdd_resolver_message_dispatch(resolver, msg, "UDP");
     }
 }
 
+/* Resolver read callback
+ *
+ * Socket is drained in batches of up to WSDD_RECV_BATCH packets,
+ * using recvmmsg(), if available, but no more that WSDD_RECV_MAX
+ * packets are handled per wakeup, so other events are not starved
+ */
+static void
+wsdd_resolver_read_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
+{
+    wsdd_recv_slot *slots = wsdd_recv_pool;
+    unsigned int   count = 0;
+    int            i, rc;
+
+    (void) mask;
+    (void) data;
+
+    do {
+#ifdef  OS_HAVE_RECVMMSG
+        struct mmsghdr msgs[WSDD_RECV_BATCH];
+
+        for (i = 0; i < WSDD_RECV_BATCH; i ++) {
+            wsdd_recv_slot_prepare(&slots[i], &msgs[i].msg_hdr);
+        }
+
+        rc = recvmmsg(fd, msgs, WSDD_RECV_BATCH, MSG_DONTWAIT, NULL);
+        for (i = 0; i < rc; i ++) {
+            wsdd_resolver_read_packet(fd, &msgs[i].msg_hdr,
+                slots[i].buf, (int) msgs[i].msg_len);
+        }
+#else
+        struct msghdr msghdr;
+
+        wsdd_recv_slot_prepare(&slots[0], &msghdr);
+        rc = recvmsg(fd, &msghdr, MSG_DONTWAIT);
+        if (rc > 0) {
+            wsdd_resolver_read_packet(fd, &msghdr, slots[0].buf, rc);
+            rc = 1;
+        }
+#endif
+
+        if (rc > 0) {
+            count += (unsigned int) rc;
+        }
+    } while (rc == WSDD_RECV_BATCH && count < WSDD_RECV_MAX);
+
+    /* Update statistics */
+    if (count != 0) {
+        wsdd_recv_stat.wakeups ++;
+        wsdd_recv_stat.packets += count;
+        if (count > wsdd_recv_stat.max) {
+            wsdd_recv_stat.max = count;
+        }
+    }
+}
+
 /* Count discovered devices with model names matching the specified parent.
  *
  * Pattern is the glob-style expression, applied to the model name
@@ -1252,6 +2018,7 @@ wsdd_resolver_timer_callback (void *data)
     resolver->fdpoll = NULL;
     resolver->fd = -1;
     log_debug(wsdd_log, "%s: done discovery", resolver->str_ifaddr.text);
+    wsdd_initscan_learn_done();
 
     if (resolver->initscan) {
         resolver->initscan = false;
@@ -1492,7 +2259,7 @@ wsdd_initscan_timer_expired (void)
     for (LL_FOR_EACH(node, &wsdd_finding_list)) {
         wsdd = OUTER_STRUCT(node, wsdd_finding, list_node);
         if (!wsdd->published && wsdd->finding.endpoints != NULL) {
-            http_client_cancel(wsdd->http_client);
+            wsdd_fetch_cancel(wsdd, AF_UNSPEC);
             wsdd_finding_publish(wsdd);
         }
     }
@@ -1563,6 +2330,15 @@ wsdd_send_directed_probe_callback (void *ptr, http_query *q)
  */
 void
 wsdd_send_directed_probe (int ifindex, int af, const void *addr)
+{
+    wsdd_send_directed_probe_timeout(ifindex, af, addr, -1);
+}
+
+/* Send WD-Discovery directed probe with limited timeout
+ */
+void
+wsdd_send_directed_probe_timeout (int ifindex, int af, const void *addr,
+        int timeout)
 {
     char          ifname[IF_NAMESIZE] = "?";
     ip_straddr    straddr = ip_straddr_from_ip(af, addr);
@@ -1627,6 +2403,7 @@ wsdd_send_directed_probe (int ifindex, int af, const void *addr)
     q = http_query_new(wsdd_http_client, uri,
         "POST", str_dup(wsdd_buf), "application/soap+xml; charset=utf-8");
     http_query_set_uintptr(q, ifindex);
+    http_query_timeout(q, timeout);
     http_query_submit(q, wsdd_send_directed_probe_callback);
 }
 
@@ -1842,6 +2619,12 @@ wsdd_start_stop_callback (bool start)
     if (start) {
         /* Setup WS-Discovery stable endpoint handling */
         wsdd_addrs_probing = ip_addrset_new();
+
+        /* Setup UDP receive buffers */
+        wsdd_recv_pool = mem_new(wsdd_recv_slot, WSDD_RECV_BATCH);
+        memset(&wsdd_recv_stat, 0, sizeof(wsdd_recv_stat));
+        wsdd_dedup_map = hashmap_new();
+        ll_init(&wsdd_dedup_lru);
         wsdd_http_client = http_client_new(wsdd_log, NULL);
 
         /* Setup WSDD multicast reception */
@@ -1862,6 +2645,7 @@ wsdd_start_stop_callback (bool start)
          * decremented to ensure that initial scan completion notification
          * will be raised even if there are no network interfaces.
          */
+        wsdd_initscan_start();
         wsdd_initscan_count_inc();
         wsdd_netif_update_addresses(true);
         wsdd_initscan_count_dec();
@@ -1874,6 +2658,23 @@ wsdd_start_stop_callback (bool start)
         wsdd_addrs_probing = NULL;
         wsdd_http_client = NULL;
 
+        wsdd_initscan_stop();
+
+        /* Dump UDP receive statistics and release buffers */
+        log_debug(wsdd_log, "UDP: %u packets in %u wakeups, max %u per wakeup",
+            wsdd_recv_stat.packets, wsdd_recv_stat.wakeups,
+            wsdd_recv_stat.max);
+        log_debug(wsdd_log, "UDP: %u duplicates and %u irrelevant "
+            "messages dropped before parsing",
+            wsdd_recv_stat.dups, wsdd_recv_stat.ignored);
+
+        wsdd_dedup_purge();
+        hashmap_free(wsdd_dedup_map);
+        wsdd_dedup_map = NULL;
+
+        mem_free(wsdd_recv_pool);
+        wsdd_recv_pool = NULL;
+
         /* Stop multicast reception */
         if (wsdd_fdpoll_ipv4 != NULL) {
             eloop_fdpoll_free(wsdd_fdpoll_ipv4);
@@ -1897,8 +2698,10 @@ wsdd_init (void)
     /* Initialize logging */
     wsdd_log = log_ctx_new("WSDD", zeroconf_log);
 
-    /* Initialize wsdd_finding_list */
+    /* Initialize wsdd_finding_list and metadata fetch queues */
     ll_init(&wsdd_finding_list);
+    ll_init(&wsdd_fetch_queue);
+    ll_init(&wsdd_fetch_active);
 
     /* All for now, if WS-Discovery is disabled */
     if (!conf.discovery || conf.wsdd_mode == WSDD_OFF) {
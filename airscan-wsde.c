@@ -0,0 +1,834 @@
+/* AirScan (a.k.a. eSCL) backend for SANE
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * WSD eventing (WS-Eventing subscriptions and notifications listener)
+ */
+
+#define _GNU_SOURCE
+#include <string.h>
+
+#define NO_HTTP_STATUS
+
+#include "airscan.h"
+#include "http_parser.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* Protocol constants
+ */
+#define WSDE_ADDR_ANONYMOUS             \
+        "http://schemas.xmlsoap.org/ws/2004/08/addressing/role/anonymous"
+
+#define WSDE_ACTION_SUBSCRIBE           \
+        "http://schemas.xmlsoap.org/ws/2004/08/eventing/Subscribe"
+
+#define WSDE_ACTION_UNSUBSCRIBE         \
+        "http://schemas.xmlsoap.org/ws/2004/08/eventing/Unsubscribe"
+
+#define WSDE_DELIVERY_PUSH              \
+        "http://schemas.xmlsoap.org/ws/2004/08/eventing/DeliveryModes/Push"
+
+#define WSDE_FILTER_DIALECT_ACTION      \
+        "http://schemas.xmlsoap.org/ws/2006/02/devprof/Action"
+
+#define WSDE_EVENT_PREFIX               \
+        "http://schemas.microsoft.com/windows/2006/08/wdp/scan/"
+
+/* Events we are subscribing to
+ *
+ * Note, ScanAvailableEvent is not here: it is used by devices
+ * to notify scan destinations about scan, initiated from the
+ * device front panel, and requires scan destinations registration,
+ * which is out of scope of the SANE backend
+ */
+static const char *wsde_events =
+    WSDE_EVENT_PREFIX "ScannerStatusSummaryEvent "
+    WSDE_EVENT_PREFIX "ScannerStatusConditionEvent "
+    WSDE_EVENT_PREFIX "ScannerStatusConditionClearedEvent "
+    WSDE_EVENT_PREFIX "JobStatusEvent "
+    WSDE_EVENT_PREFIX "JobEndStateEvent";
+
+/* Subscription lifetime, requested from device. Scan sessions
+ * are relatively short, so subscription is not renewed. If it
+ * expires, we simply fall back to polling
+ */
+#define WSDE_EXPIRES                    "PT1H"
+
+/* Limits for incoming connections:
+ *   WSDE_CONN_MAX      - max count of simultaneous connections
+ *   WSDE_CONN_TIMEOUT  - connection timeout, in milliseconds
+ *   WSDE_MESSAGE_MAX   - max size of notification message
+ */
+#define WSDE_CONN_MAX                   16
+#define WSDE_CONN_TIMEOUT               5000
+#define WSDE_MESSAGE_MAX                65536
+
+/* XML namespace translation for XML reader
+ */
+static const xml_ns wsde_ns_rd[] = {
+    {"s",    "http*://schemas.xmlsoap.org/soap/envelope"}, /* SOAP 1.1 */
+    {"s",    "http*://www.w3.org/2003/05/soap-envelope"},  /* SOAP 1.2 */
+    {"a",    "http*://schemas.xmlsoap.org/ws/2004/08/addressing"},
+    {"e",    "http*://schemas.xmlsoap.org/ws/2004/08/eventing"},
+    {"scan", "http*://schemas.microsoft.com/windows/2006/08/wdp/scan"},
+    {NULL, NULL}
+};
+
+/* XML namespace definitions for XML writer
+ */
+static const xml_ns wsde_ns_wr[] = {
+    {"soap", "http://www.w3.org/2003/05/soap-envelope"},  /* SOAP 1.2 */
+    {"wsa",  "http://schemas.xmlsoap.org/ws/2004/08/addressing"},
+    {"wse",  "http://schemas.xmlsoap.org/ws/2004/08/eventing"},
+    {NULL, NULL}
+};
+
+/* wsde_subscription represents a single event subscription
+ */
+struct wsde_subscription {
+    log_ctx       *log;                /* Logging context */
+    http_client   *http_client;        /* HTTP client for Subscribe */
+    http_uri      *uri;                /* Device endpoint URI */
+    char          *path;               /* Our NotifyTo path */
+    char          *manager;            /* SubscriptionManager address */
+    char          *identifier;         /* Subscription identifier */
+    void          (*callback) (void *data, const char *event); /* Callback */
+    void          *data;               /* Callback's data */
+    ll_node       list_node;           /* In wsde_subscription_list */
+};
+
+/* wsde_conn represents incoming HTTP connection
+ */
+typedef struct {
+    int           fd;                  /* Connection socket */
+    eloop_fdpoll  *fdpoll;             /* Socket fdpoll */
+    eloop_timer   *timer;              /* Connection timeout timer */
+    http_parser   parser;              /* HTTP request parser */
+    char          *url;                /* Request URL */
+    char          *body;               /* Request body */
+    bool          done;                /* Request is received */
+    ll_node       list_node;           /* In wsde_conn_list */
+} wsde_conn;
+
+/* Static variables
+ */
+static log_ctx      *wsde_log;
+static int          wsde_sock = -1;
+static int          wsde_sock_af;
+static uint16_t     wsde_port;
+static eloop_fdpoll *wsde_fdpoll;
+static http_client  *wsde_http_client;
+static ll_head      wsde_subscription_list;
+static ll_head      wsde_conn_list;
+static int          wsde_conn_count;
+
+/* Forward declarations
+ */
+static bool
+wsde_listen_start (void);
+
+/******************** Subscriptions ********************/
+/* Make NotifyTo address for the subscription
+ *
+ * Local address is chosen the same way as kernel chooses
+ * source address for connection to the device
+ */
+static char*
+wsde_notify_to (const http_uri *uri, const char *path)
+{
+    const struct sockaddr   *addr = http_uri_addr(uri);
+    struct sockaddr_storage local;
+    socklen_t               len = sizeof(local);
+    socklen_t               addrlen;
+    ip_straddr              straddr;
+    int                     fd, rc;
+
+    if (addr == NULL) {
+        return NULL;
+    }
+
+    switch (addr->sa_family) {
+    case AF_INET:
+        addrlen = sizeof(struct sockaddr_in);
+        break;
+
+    case AF_INET6:
+        if (wsde_sock_af != AF_INET6) {
+            return NULL;
+        }
+        addrlen = sizeof(struct sockaddr_in6);
+        break;
+
+    default:
+        return NULL;
+    }
+
+    fd = socket(addr->sa_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    rc = connect(fd, addr, addrlen);
+    if (rc == 0) {
+        rc = getsockname(fd, (struct sockaddr*) &local, &len);
+    }
+    close(fd);
+
+    if (rc < 0) {
+        return NULL;
+    }
+
+    if (local.ss_family == AF_INET) {
+        ((struct sockaddr_in*) &local)->sin_port = htons(wsde_port);
+    } else {
+        ((struct sockaddr_in6*) &local)->sin6_port = htons(wsde_port);
+    }
+
+    straddr = ip_straddr_from_sockaddr((struct sockaddr*) &local, false);
+
+    return str_printf("http://%s%s", straddr.text, path);
+}
+
+/* Create a SOAP POST request
+ */
+static http_query*
+wsde_http_post (http_client *client, http_uri *uri, char *body)
+{
+    http_query *q;
+
+    q = http_query_new(client, uri, "POST", body, "application/soap+xml");
+
+    http_query_set_request_header(q, "Cache-Control", "no-cache");
+    http_query_set_request_header(q, "Pragma", "no-cache");
+    http_query_set_request_header(q, "User-Agent", "WSDAPI");
+
+    return q;
+}
+
+/* Make SOAP header for outgoing request. The soap:Header element
+ * is left open, so caller may add more header fields
+ */
+static void
+wsde_make_request_header (xml_wr *xml, const char *to, const char *action)
+{
+    uuid u = uuid_rand();
+
+    xml_wr_enter(xml, "soap:Header");
+    xml_wr_add_text(xml, "wsa:MessageID", u.text);
+    xml_wr_add_text(xml, "wsa:To", to);
+    xml_wr_enter(xml, "wsa:ReplyTo");
+    xml_wr_add_text(xml, "wsa:Address", WSDE_ADDR_ANONYMOUS);
+    xml_wr_leave(xml);
+    xml_wr_add_text(xml, "wsa:Action", action);
+}
+
+/* Subscribe request callback
+ */
+static void
+wsde_subscribe_callback (void *ptr, http_query *q)
+{
+    wsde_subscription *sub = ptr;
+    error             err;
+    xml_rd            *xml;
+    http_data         *data;
+
+    err = http_query_error(q);
+    if (err != NULL) {
+        goto DONE;
+    }
+
+    data = http_query_get_response_data(q);
+    err = xml_rd_begin(&xml, data->bytes, data->size, wsde_ns_rd);
+    if (err != NULL) {
+        goto DONE;
+    }
+
+    while (!xml_rd_end(xml)) {
+        const char *path = xml_rd_node_path(xml);
+
+        if (!strcmp(path, "s:Envelope/s:Body/e:SubscribeResponse/"
+                "e:SubscriptionManager/a:Address")) {
+            mem_free(sub->manager);
+            sub->manager = str_dup(xml_rd_node_value(xml));
+        } else if (!strcmp(path, "s:Envelope/s:Body/e:SubscribeResponse/"
+                "e:SubscriptionManager/a:ReferenceParameters/e:Identifier")) {
+            mem_free(sub->identifier);
+            sub->identifier = str_dup(xml_rd_node_value(xml));
+        }
+
+        xml_rd_deep_next(xml, 0);
+    }
+
+    xml_rd_finish(&xml);
+
+    if (sub->manager == NULL) {
+        err = ERROR("missed SubscriptionManager");
+    }
+
+DONE:
+    if (err != NULL) {
+        log_debug(sub->log, "WSD events: subscribe: %s", ESTRING(err));
+    } else {
+        log_debug(sub->log, "WSD events: subscribed, manager: %s",
+            sub->manager);
+    }
+}
+
+/* Unsubscribe request callback
+ */
+static void
+wsde_unsubscribe_callback (void *ptr, http_query *q)
+{
+    error err = http_query_error(q);
+
+    (void) ptr;
+
+    if (err != NULL) {
+        log_debug(wsde_log, "unsubscribe: %s", ESTRING(err));
+    }
+}
+
+/* Subscribe to device events.
+ *
+ * Returns NULL, if events are disabled by configuration or cannot
+ * be delivered to us (no listener, device address unreachable or
+ * not literal)
+ */
+wsde_subscription*
+wsde_subscribe (log_ctx *log, const http_uri *uri,
+        void (*callback) (void *data, const char *event), void *data)
+{
+    wsde_subscription *sub;
+    uuid              u = uuid_rand();
+    char              *path, *notify_to;
+    http_uri          *to;
+    xml_wr            *xml;
+    static const xml_attr delivery_attrs[] = {
+        {"Mode", WSDE_DELIVERY_PUSH},
+        {NULL, NULL}
+    };
+    static const xml_attr filter_attrs[] = {
+        {"Dialect", WSDE_FILTER_DIALECT_ACTION},
+        {NULL, NULL}
+    };
+
+    if (!conf.wsd_events || !wsde_listen_start()) {
+        return NULL;
+    }
+
+    path = str_printf("/%s", u.text + strlen("urn:uuid:"));
+    notify_to = wsde_notify_to(uri, path);
+    if (notify_to == NULL) {
+        log_debug(log, "WSD events: can't choose local address");
+        mem_free(path);
+        return NULL;
+    }
+
+    /* Create subscription */
+    sub = mem_new(wsde_subscription, 1);
+    sub->log = log;
+    sub->http_client = http_client_new(log, sub);
+    sub->uri = http_uri_clone(uri);
+    sub->path = path;
+    sub->callback = callback;
+    sub->data = data;
+    ll_push_end(&wsde_subscription_list, &sub->list_node);
+
+    /* Build Subscribe request */
+    to = http_uri_clone(uri);
+    http_uri_strip_zone_suffux(to);
+
+    xml = xml_wr_begin("soap:Envelope", wsde_ns_wr);
+    wsde_make_request_header(xml, http_uri_str(to), WSDE_ACTION_SUBSCRIBE);
+    xml_wr_leave(xml);
+
+    xml_wr_enter(xml, "soap:Body");
+    xml_wr_enter(xml, "wse:Subscribe");
+    xml_wr_enter_attr(xml, "wse:Delivery", delivery_attrs);
+    xml_wr_enter(xml, "wse:NotifyTo");
+    xml_wr_add_text(xml, "wsa:Address", notify_to);
+    xml_wr_leave(xml);
+    xml_wr_leave(xml);
+    xml_wr_add_text(xml, "wse:Expires", WSDE_EXPIRES);
+    xml_wr_add_text_attr(xml, "wse:Filter", wsde_events, filter_attrs);
+    xml_wr_leave(xml);
+    xml_wr_leave(xml);
+
+    http_uri_free(to);
+
+    log_debug(log, "WSD events: subscribing, NotifyTo: %s", notify_to);
+    mem_free(notify_to);
+
+    /* Submit the request */
+    http_query_submit(wsde_http_post(sub->http_client,
+        http_uri_clone(sub->uri), xml_wr_finish_compact(xml)),
+        wsde_subscribe_callback);
+
+    return sub;
+}
+
+/* Cancel the subscription
+ */
+void
+wsde_unsubscribe (wsde_subscription *sub)
+{
+    http_uri *manager = NULL;
+
+    ll_del(&sub->list_node);
+    http_client_cancel(sub->http_client);
+    http_client_free(sub->http_client);
+
+    if (sub->manager != NULL) {
+        manager = http_uri_new(sub->manager, true);
+    }
+
+    if (manager != NULL) {
+        xml_wr *xml = xml_wr_begin("soap:Envelope", wsde_ns_wr);
+
+        wsde_make_request_header(xml, sub->manager, WSDE_ACTION_UNSUBSCRIBE);
+        if (sub->identifier != NULL) {
+            xml_wr_add_text(xml, "wse:Identifier", sub->identifier);
+        }
+        xml_wr_leave(xml);
+
+        xml_wr_enter(xml, "soap:Body");
+        xml_wr_enter(xml, "wse:Unsubscribe");
+        xml_wr_leave(xml);
+        xml_wr_leave(xml);
+
+        log_debug(sub->log, "WSD events: unsubscribing");
+        http_query_submit(wsde_http_post(wsde_http_client, manager,
+            xml_wr_finish_compact(xml)), wsde_unsubscribe_callback);
+    }
+
+    http_uri_free(sub->uri);
+    mem_free(sub->path);
+    mem_free(sub->manager);
+    mem_free(sub->identifier);
+    mem_free(sub);
+}
+
+/* Find subscription by notification path
+ */
+static wsde_subscription*
+wsde_subscription_by_path (const char *path)
+{
+    ll_node *node;
+
+    for (LL_FOR_EACH(node, &wsde_subscription_list)) {
+        wsde_subscription *sub;
+
+        sub = OUTER_STRUCT(node, wsde_subscription, list_node);
+        if (!strcmp(sub->path, path)) {
+            return sub;
+        }
+    }
+
+    return NULL;
+}
+
+/* Dispatch received notification. Returns HTTP status for reply
+ */
+static enum http_status
+wsde_dispatch (const char *path, const char *body)
+{
+    wsde_subscription *sub = wsde_subscription_by_path(path);
+    xml_rd            *xml;
+    error             err;
+    const char        *event;
+    char              *action = NULL;
+    char              *job_state = NULL;
+
+    if (sub == NULL) {
+        log_debug(wsde_log, "notification to unknown path: %s", path);
+        return HTTP_STATUS_NOT_FOUND;
+    }
+
+    err = xml_rd_begin(&xml, body, strlen(body), wsde_ns_rd);
+    if (err != NULL) {
+        log_debug(sub->log, "WSD events: %s", ESTRING(err));
+        return HTTP_STATUS_BAD_REQUEST;
+    }
+
+    while (!xml_rd_end(xml)) {
+        const char *path = xml_rd_node_path(xml);
+
+        if (!strcmp(path, "s:Envelope/s:Header/a:Action")) {
+            mem_free(action);
+            action = str_dup(xml_rd_node_value(xml));
+        } else if (!strcmp(path, "s:Envelope/s:Body/scan:JobStatusEvent/"
+                "scan:JobStatus/scan:JobState")) {
+            mem_free(job_state);
+            job_state = str_dup(xml_rd_node_value(xml));
+        }
+
+        xml_rd_deep_next(xml, 0);
+    }
+
+    xml_rd_finish(&xml);
+
+    if (action == NULL) {
+        log_debug(sub->log, "WSD events: missed Action");
+        mem_free(job_state);
+        return HTTP_STATUS_BAD_REQUEST;
+    }
+
+    event = strrchr(action, '/');
+    event = event ? event + 1 : action;
+
+    if (job_state != NULL) {
+        log_debug(sub->log, "WSD events: %s, JobState: %s", event, job_state);
+    } else {
+        log_debug(sub->log, "WSD events: %s", event);
+    }
+
+    sub->callback(sub->data, event);
+
+    mem_free(action);
+    mem_free(job_state);
+
+    return HTTP_STATUS_ACCEPTED;
+}
+
+/******************** Incoming connections ********************/
+/* Close the connection
+ */
+static void
+wsde_conn_close (wsde_conn *conn)
+{
+    ll_del(&conn->list_node);
+    wsde_conn_count --;
+
+    eloop_fdpoll_free(conn->fdpoll);
+    if (conn->timer != NULL) {
+        eloop_timer_cancel(conn->timer);
+    }
+    close(conn->fd);
+
+    mem_free(conn->url);
+    mem_free(conn->body);
+    mem_free(conn);
+}
+
+/* Connection timeout callback
+ */
+static void
+wsde_conn_timer_callback (void *data)
+{
+    wsde_conn *conn = data;
+
+    conn->timer = NULL;
+    log_debug(wsde_log, "connection timeout");
+    wsde_conn_close(conn);
+}
+
+/* HTTP parser callbacks
+ */
+static int
+wsde_conn_on_url (http_parser *parser, const char *data, size_t size)
+{
+    wsde_conn *conn = parser->data;
+
+    conn->url = str_append_mem(conn->url, data, size);
+    return mem_len(conn->url) > WSDE_MESSAGE_MAX;
+}
+
+static int
+wsde_conn_on_body (http_parser *parser, const char *data, size_t size)
+{
+    wsde_conn *conn = parser->data;
+
+    conn->body = str_append_mem(conn->body, data, size);
+    return mem_len(conn->body) > WSDE_MESSAGE_MAX;
+}
+
+static int
+wsde_conn_on_message_complete (http_parser *parser)
+{
+    wsde_conn *conn = parser->data;
+
+    conn->done = true;
+    http_parser_pause(parser, 1);
+
+    return 0;
+}
+
+static http_parser_settings
+wsde_conn_callbacks = {
+    .on_url              = wsde_conn_on_url,
+    .on_body             = wsde_conn_on_body,
+    .on_message_complete = wsde_conn_on_message_complete
+};
+
+/* Send reply and close the connection
+ */
+static void
+wsde_conn_reply (wsde_conn *conn, enum http_status status)
+{
+    char       *reply;
+    ssize_t    rc;
+
+    /* Reply is small enough to fit into the socket buffer, so
+     * just write it at once and don't care about partial write
+     */
+    reply = str_printf("HTTP/1.1 %d %s\r\n"
+                       "Content-Length: 0\r\n"
+                       "Connection: close\r\n"
+                       "\r\n", status, http_status_str(status));
+    rc = send(conn->fd, reply, mem_len(reply), MSG_NOSIGNAL);
+    (void) rc;
+    mem_free(reply);
+
+    wsde_conn_close(conn);
+}
+
+/* Connection fdpoll callback
+ */
+static void
+wsde_conn_fdpoll_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
+{
+    wsde_conn *conn = data;
+    char      buf[4096];
+    ssize_t   rc;
+
+    (void) mask;
+
+    rc = recv(fd, buf, sizeof(buf), 0);
+    if (rc < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+
+    http_parser_execute(&conn->parser, &wsde_conn_callbacks, buf,
+        rc > 0 ? (size_t) rc : 0);
+
+    if (conn->done) {
+        wsde_conn_reply(conn, wsde_dispatch(conn->url, conn->body));
+    } else if (rc <= 0 || HTTP_PARSER_ERRNO(&conn->parser) != HPE_OK) {
+        wsde_conn_reply(conn, HTTP_STATUS_BAD_REQUEST);
+    }
+}
+
+/* Listening socket fdpoll callback
+ */
+static void
+wsde_listen_fdpoll_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
+{
+    wsde_conn *conn;
+    int       conn_fd;
+
+    (void) data;
+    (void) mask;
+
+    conn_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (conn_fd < 0) {
+        return;
+    }
+
+    if (wsde_conn_count >= WSDE_CONN_MAX) {
+        log_debug(wsde_log, "too many connections");
+        close(conn_fd);
+        return;
+    }
+
+    conn = mem_new(wsde_conn, 1);
+    conn->fd = conn_fd;
+    conn->url = str_new();
+    conn->body = str_new();
+
+    http_parser_init(&conn->parser, HTTP_REQUEST);
+    conn->parser.data = conn;
+
+    conn->fdpoll = eloop_fdpoll_new(conn_fd, wsde_conn_fdpoll_callback, conn);
+    eloop_fdpoll_set_mask(conn->fdpoll, ELOOP_FDPOLL_READ);
+    conn->timer = eloop_timer_new(WSDE_CONN_TIMEOUT,
+        wsde_conn_timer_callback, conn);
+
+    ll_push_end(&wsde_conn_list, &conn->list_node);
+    wsde_conn_count ++;
+}
+
+/* Open listening socket. Dual-stack IPv6 socket is preferred,
+ * with fallback to IPv4
+ */
+static int
+wsde_sock_open (int af)
+{
+    struct sockaddr_storage addr;
+    socklen_t               len;
+    int                     fd, rc;
+    static int              no = 0;
+
+    fd = socket(af, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.ss_family = af;
+
+    if (af == AF_INET6) {
+        rc = setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof(no));
+        if (rc < 0) {
+            goto FAIL;
+        }
+        len = sizeof(struct sockaddr_in6);
+    } else {
+        len = sizeof(struct sockaddr_in);
+    }
+
+    rc = bind(fd, (struct sockaddr*) &addr, len);
+    if (rc == 0) {
+        rc = listen(fd, WSDE_CONN_MAX);
+    }
+    if (rc == 0) {
+        len = sizeof(addr);
+        rc = getsockname(fd, (struct sockaddr*) &addr, &len);
+    }
+    if (rc < 0) {
+        goto FAIL;
+    }
+
+    if (af == AF_INET6) {
+        wsde_port = ntohs(((struct sockaddr_in6*) &addr)->sin6_port);
+    } else {
+        wsde_port = ntohs(((struct sockaddr_in*) &addr)->sin_port);
+    }
+
+    wsde_sock_af = af;
+    return fd;
+
+    /* Error: cleanup and exit */
+FAIL:
+    rc = errno;
+    close(fd);
+    errno = rc;
+
+    return -1;
+}
+
+/* Start listening for notifications, if not started yet.
+ *
+ * Listener is started on demand, when first subscription is
+ * made, so nobody listens when no WSD devices are in use.
+ * Note, listener accepts connections on all interfaces, this
+ * is why it is enabled only by the wsd_events option.
+ * Failure to start listener is not fatal: we will rely on
+ * polling only.
+ */
+static bool
+wsde_listen_start (void)
+{
+    if (wsde_sock >= 0) {
+        return true;
+    }
+
+    wsde_sock = wsde_sock_open(AF_INET6);
+    if (wsde_sock < 0) {
+        wsde_sock = wsde_sock_open(AF_INET);
+    }
+
+    if (wsde_sock < 0) {
+        log_debug(wsde_log, "listen: %s", strerror(errno));
+        return false;
+    }
+
+    log_debug(wsde_log, "listening at port %d", wsde_port);
+
+    wsde_fdpoll = eloop_fdpoll_new(wsde_sock,
+        wsde_listen_fdpoll_callback, NULL);
+    eloop_fdpoll_set_mask(wsde_fdpoll, ELOOP_FDPOLL_READ);
+
+    return true;
+}
+
+/* Stop listening and close all incoming connections
+ */
+static void
+wsde_listen_stop (void)
+{
+    ll_node *node;
+
+    while ((node = ll_first(&wsde_conn_list)) != NULL) {
+        wsde_conn_close(OUTER_STRUCT(node, wsde_conn, list_node));
+    }
+
+    if (wsde_fdpoll != NULL) {
+        eloop_fdpoll_free(wsde_fdpoll);
+        wsde_fdpoll = NULL;
+    }
+
+    if (wsde_sock >= 0) {
+        close(wsde_sock);
+        wsde_sock = -1;
+    }
+}
+
+/******************** Initialization and cleanup ********************/
+/* Start/stop WSD eventing
+ */
+static void
+wsde_start_stop_callback (bool start)
+{
+    ll_node *node;
+
+    if (start) {
+        return;
+    }
+
+    wsde_listen_stop();
+
+    for (LL_FOR_EACH(node, &wsde_subscription_list)) {
+        wsde_subscription *sub;
+        sub = OUTER_STRUCT(node, wsde_subscription, list_node);
+        http_client_cancel(sub->http_client);
+    }
+
+    http_client_cancel(wsde_http_client);
+}
+
+/* Initialize WSD eventing
+ */
+SANE_Status
+wsde_init (void)
+{
+    wsde_log = log_ctx_new("WSDE", NULL);
+    ll_init(&wsde_subscription_list);
+    ll_init(&wsde_conn_list);
+
+    wsde_http_client = http_client_new(wsde_log, NULL);
+
+    eloop_add_start_stop_callback(wsde_start_stop_callback);
+
+    return SANE_STATUS_GOOD;
+}
+
+/* Cleanup WSD eventing
+ */
+void
+wsde_cleanup (void)
+{
+    if (wsde_log == NULL) {
+        return; /* WSDE not initialized */
+    }
+
+    log_assert(wsde_log, ll_empty(&wsde_subscription_list));
+
+    wsde_listen_stop();
+
+    /* Unsubscribe requests, still pending at this point, are dropped */
+    http_client_cancel(wsde_http_client);
+    http_client_free(wsde_http_client);
+    wsde_http_client = NULL;
+
+    log_ctx_free(wsde_log);
+    wsde_log = NULL;
+}
+
+/* vim:ts=8:sw=4:et
+ */
@@ -32,11 +32,30 @@ struct zeroconf_device {
     unsigned int    protocols;  /* Supported protocols, set of 1<<ID_PROTO */
     unsigned int    methods;    /* How device was discovered, set of
                                     1 << ZEROCONF_METHOD */
+    uint64_t        seq;        /* Position in zeroconf_device_list */
+    char            *key;       /* Key in zeroconf_device_by_key */
     ll_node         node_list;  /* In zeroconf_device_list */
     ll_head         findings;   /* zeroconf_finding, by method */
     zeroconf_device *buddy;     /* "Buddy" device, MDNS vs WSDD */
 };
 
+/* zeroconf_devlist represents a snapshot of the SANE device list,
+ * as returned by zeroconf_device_list_get(). Snapshot is immutable
+ * and shared between callers; it is rebuilt only when something
+ * it depends on has changed
+ *
+ * Reference count is atomic, as references may be released
+ * without holding the eloop mutex
+ */
+typedef struct {
+    volatile unsigned int refcnt;        /* Reference count */
+    uint64_t           generation;       /* zeroconf_device_generation */
+    bool               proto_auto;       /* conf.proto_auto */
+    ID_PROTO           proto_pin;        /* conf.proto_pin */
+    bool               model_is_netname; /* conf.model_is_netname */
+    const SANE_Device  *devices[];       /* NULL-terminated list */
+} zeroconf_devlist;
+
 /* Global variables
  */
 log_ctx *zeroconf_log;
@@ -44,6 +63,12 @@ log_ctx *zeroconf_log;
 /* Static variables
  */
 static ll_head zeroconf_device_list;
+static uint64_t zeroconf_device_seq;
+static hashmap *zeroconf_device_by_key;
+static hashmap *zeroconf_device_by_devid;
+static hashmap *zeroconf_device_by_addr;
+static uint64_t zeroconf_device_generation;
+static zeroconf_devlist *zeroconf_devlist_current;
 static pthread_cond_t zeroconf_initscan_cond;
 static int zeroconf_initscan_bits;
 static eloop_timer *zeroconf_initscan_timer;
@@ -67,6 +92,7 @@ zeroconf_method_to_proto (ZEROCONF_METHOD method)
 
     case ZEROCONF_USCAN_TCP:
     case ZEROCONF_USCANS_TCP:
+    case ZEROCONF_SWEEP:
         return ID_PROTO_ESCL;
 
     case ZEROCONF_WSD:
@@ -89,6 +115,7 @@ zeroconf_method_name (ZEROCONF_METHOD method)
     case ZEROCONF_USCAN_TCP:  return "ZEROCONF_USCAN_TCP";
     case ZEROCONF_USCANS_TCP: return "ZEROCONF_USCANS_TCP";
     case ZEROCONF_WSD:        return "ZEROCONF_WSD";
+    case ZEROCONF_SWEEP:      return "ZEROCONF_SWEEP";
 
     case NUM_ZEROCONF_METHOD:
         break;
@@ -97,7 +124,108 @@ zeroconf_method_name (ZEROCONF_METHOD method)
     return NULL;
 }
 
+/******************** Devices index *********************/
+/* Devices are indexed by:
+ *   - merge key (UUID and MDNS name), see zeroconf_merge_find()
+ *   - devid, see zeroconf_device_find_by_ident()
+ *   - IP address, to maintain device->buddy incrementally
+ *
+ * Each address maps to array of devices, having that address.
+ */
+
+/* Make merge key of the device or finding. MDNS names are compared
+ * case-insensitively, hence the key contains lowercase name
+ */
+static char*
+zeroconf_device_key (uuid uuid, const char *mdns_name)
+{
+    char *key = str_dup(uuid.text);
+
+    if (mdns_name != NULL) {
+        char *name = str_dup_tolower(mdns_name);
+        key = str_append_c(key, '/');
+        key = str_append(key, name);
+        mem_free(name);
+    }
+
+    return key;
+}
+
+/* Make address key. Only the fields, compared by ip_addr_equal(),
+ * go into the key
+ */
+static ip_addr
+zeroconf_device_addr_key (ip_addr addr)
+{
+    ip_addr key;
+
+    memset(&key, 0, sizeof(key));
+    key.af = addr.af;
+
+    switch (addr.af) {
+    case AF_INET:
+        key.ip.v4 = addr.ip.v4;
+        break;
+
+    case AF_INET6:
+        key.ifindex = addr.ifindex;
+        key.ip.v6 = addr.ip.v6;
+        break;
+    }
+
+    return key;
+}
+
+/* Get array of devices, having the specified address
+ */
+static zeroconf_device**
+zeroconf_device_by_addr_get (ip_addr addr)
+{
+    ip_addr key = zeroconf_device_addr_key(addr);
+    return hashmap_get(zeroconf_device_by_addr, &key, sizeof(key));
+}
+
+/* Add device to the address index
+ */
+static void
+zeroconf_device_by_addr_add (zeroconf_device *device, ip_addr addr)
+{
+    ip_addr         key = zeroconf_device_addr_key(addr);
+    zeroconf_device **devices;
+
+    devices = hashmap_get(zeroconf_device_by_addr, &key, sizeof(key));
+    if (devices == NULL) {
+        devices = ptr_array_new(zeroconf_device*);
+    }
+
+    devices = ptr_array_append(devices, device);
+    hashmap_set(zeroconf_device_by_addr, &key, sizeof(key), devices);
+}
+
+/* Delete device from the address index
+ */
+static void
+zeroconf_device_by_addr_del (zeroconf_device *device, ip_addr addr)
+{
+    ip_addr         key = zeroconf_device_addr_key(addr);
+    zeroconf_device **devices;
+
+    devices = hashmap_get(zeroconf_device_by_addr, &key, sizeof(key));
+    log_assert(zeroconf_log, devices != NULL);
+
+    ptr_array_del(devices, ptr_array_find(devices, device));
+    if (mem_len(devices) == 0) {
+        hashmap_del(zeroconf_device_by_addr, &key, sizeof(key));
+        mem_free(devices);
+    }
+}
+
 /******************** Devices *********************/
+/* Forward declarations
+ */
+static void
+zeroconf_merge_update_buddies (zeroconf_device *device);
+
 /* Add new zeroconf_device
  */
 static zeroconf_device*
@@ -112,10 +240,17 @@ zeroconf_device_add (zeroconf_finding *finding)
         device->mdns_name = str_dup(finding->name);
     }
     device->model = finding->model;
+    device->seq = zeroconf_device_seq ++;
+    device->key = zeroconf_device_key(device->uuid, device->mdns_name);
 
     ll_init(&device->findings);
     ll_push_end(&zeroconf_device_list, &device->node_list);
 
+    hashmap_set(zeroconf_device_by_key, device->key, mem_len(device->key),
+        device);
+    hashmap_set(zeroconf_device_by_devid, &device->devid,
+        sizeof(device->devid), device);
+
     return device;
 }
 
@@ -124,9 +259,28 @@ zeroconf_device_add (zeroconf_finding *finding)
 static void
 zeroconf_device_del (zeroconf_device *device)
 {
+    const ip_addr *addrs;
+    size_t        i, count;
+
     ll_del(&device->node_list);
+
+    hashmap_del(zeroconf_device_by_key, device->key, mem_len(device->key));
+    hashmap_del(zeroconf_device_by_devid, &device->devid,
+        sizeof(device->devid));
+
+    /* Drop device from the address index, then update buddies
+     * of devices that shared addresses with it
+     */
+    addrs = ip_addrset_addresses(device->addrs, &count);
+    for (i = 0; i < count; i ++) {
+        zeroconf_device_by_addr_del(device, addrs[i]);
+    }
+
+    zeroconf_merge_update_buddies(device);
+
     ip_addrset_free(device->addrs);
     mem_free((char*) device->mdns_name);
+    mem_free(device->key);
     devid_free(device->devid);
     mem_free(device);
 }
@@ -178,6 +332,7 @@ zeroconf_device_update_model (zeroconf_device *device)
         switch (finding->method) {
             case ZEROCONF_USCAN_TCP:
             case ZEROCONF_USCANS_TCP:
+            case ZEROCONF_SWEEP:
                 device->model = finding->model;
                 return;
 
@@ -207,12 +362,23 @@ static void
 zeroconf_device_add_finding (zeroconf_device *device,
     zeroconf_finding *finding)
 {
+    const ip_addr *addrs;
+    size_t        i, count;
+
     log_assert(zeroconf_log, finding->device == NULL);
 
     finding->device = device;
 
     ll_push_end(&device->findings, &finding->list_node);
-    ip_addrset_merge(device->addrs, finding->addrs);
+
+    addrs = ip_addrset_addresses(finding->addrs, &count);
+    for (i = 0; i < count; i ++) {
+        if (ip_addrset_add(device->addrs, addrs[i])) {
+            zeroconf_device_by_addr_add(device, addrs[i]);
+        }
+    }
+
+    zeroconf_merge_update_buddies(device);
 
     if (finding->endpoints != NULL) {
         ID_PROTO proto = zeroconf_method_to_proto(finding->method);
@@ -273,26 +439,68 @@ zeroconf_device_name (zeroconf_device *device)
     return zeroconf_device_model(device);
 }
 
+/* Choose the preferred protocol out of the set of protocols,
+ * supported by device.
+ *
+ * If both eSCL and WSD are available, pinned protocol wins, if
+ * configured. Otherwise, protocol that was measured to be faster
+ * with this device model is chosen, and eSCL is the default.
+ *
+ * Returns ID_PROTO_UNKNOWN, if set is empty
+ */
+static ID_PROTO
+zeroconf_device_proto_choose (zeroconf_device *device, unsigned int protocols)
+{
+    bool escl = (protocols & (1 << ID_PROTO_ESCL)) != 0;
+    bool wsd = (protocols & (1 << ID_PROTO_WSD)) != 0;
+
+    if (escl && wsd) {
+        if (conf.proto_pin != ID_PROTO_UNKNOWN) {
+            return conf.proto_pin;
+        }
+
+        if (epstat_proto_cmp(device->model, ID_PROTO_WSD, ID_PROTO_ESCL) < 0) {
+            return ID_PROTO_WSD;
+        }
+    }
+
+    if (escl) {
+        return ID_PROTO_ESCL;
+    }
+
+    if (wsd) {
+        return ID_PROTO_WSD;
+    }
+
+    return ID_PROTO_UNKNOWN;
+}
+
 /* Get protocols, exposed by device
+ *
+ * In the automatic protocol selection mode, device and its buddy
+ * are considered together, and only the preferred protocol is
+ * returned. Endpoints of this protocol may belong to the buddy
  */
 static unsigned int
 zeroconf_device_protocols (zeroconf_device *device)
 {
     unsigned int protocols = device->protocols;
+    ID_PROTO     proto;
 
     if (!conf.proto_auto) {
         return protocols;
     }
 
-    if ((protocols & (1 << ID_PROTO_ESCL)) != 0) {
-        return 1 << ID_PROTO_ESCL;
+    if (device->buddy != NULL) {
+        protocols |= device->buddy->protocols;
     }
 
-    if ((protocols & (1 << ID_PROTO_WSD)) != 0) {
-        return 1 << ID_PROTO_WSD;
+    proto = zeroconf_device_proto_choose(device, protocols);
+    if (proto == ID_PROTO_UNKNOWN) {
+        return 0;
     }
 
-    return 0;
+    return 1 << proto;
 }
 
 /* Get device endpoints.
@@ -322,6 +530,28 @@ zeroconf_device_endpoints (zeroconf_device *device, ID_PROTO proto)
     return zeroconf_endpoint_list_sort_dedup(endpoints);
 }
 
+/* Get device, that exposes the protocol. In the automatic protocol
+ * selection mode, it may be the device's buddy.
+ *
+ * Returns NULL, if protocol is not supported
+ */
+static zeroconf_device*
+zeroconf_device_proto_owner (zeroconf_device *device, ID_PROTO proto)
+{
+    zeroconf_device *buddy = device->buddy;
+
+    if ((device->protocols & (1 << proto)) != 0) {
+        return device;
+    }
+
+    if (conf.proto_auto && buddy != NULL &&
+        (buddy->protocols & (1 << proto)) != 0) {
+        return buddy;
+    }
+
+    return NULL;
+}
+
 /* Find zeroconf_device by ident
  * Protocol, encoded into ident, returned via second parameter
  */
@@ -330,8 +560,7 @@ zeroconf_device_find_by_ident (const char *ident, ID_PROTO *proto)
 {
     unsigned int    devid;
     const char      *name;
-    ll_node         *node;
-    zeroconf_device *device = NULL;
+    zeroconf_device *device;
 
     name = zeroconf_ident_split(ident, &devid, proto);
     if (name == NULL) {
@@ -339,19 +568,13 @@ zeroconf_device_find_by_ident (const char *ident, ID_PROTO *proto)
     }
 
     /* Lookup device */
-    for (LL_FOR_EACH(node, &zeroconf_device_list)) {
-        device = OUTER_STRUCT(node, zeroconf_device, node_list);
-        if (device->devid == devid &&
-            !strcmp(name, zeroconf_device_name(device))) {
-            break;
-        }
-    }
-
-    if (device == NULL)
+    device = hashmap_get(zeroconf_device_by_devid, &devid, sizeof(devid));
+    if (device == NULL || strcmp(name, zeroconf_device_name(device))) {
         return NULL;
+    }
 
     /* Check that device supports requested protocol */
-    if ((device->protocols & (1 << *proto)) != 0) {
+    if (zeroconf_device_proto_owner(device, *proto) != NULL) {
         return device;
     }
 
@@ -394,57 +617,67 @@ zeroconf_device_is_blacklisted (zeroconf_device *device)
 }
 
 /******************** Merging devices *********************/
-/* Recompute device->buddy for all devices
+/* Recompute device->buddy
+ *
+ * Buddies are MDNS and WSDD devices with intersecting sets of
+ * addresses. If there are many candidates, the latest discovered
+ * device after this one wins, and if there are no such devices,
+ * the latest discovered device before this one
  */
 static void
-zeroconf_merge_recompute_buddies (void)
+zeroconf_merge_compute_buddy (zeroconf_device *device)
 {
-    ll_node         *node, *node2;
-    zeroconf_device *device, *device2;
-
-    for (LL_FOR_EACH(node, &zeroconf_device_list)) {
-        device = OUTER_STRUCT(node, zeroconf_device, node_list);
-        device->buddy = NULL;
-    }
+    zeroconf_device *before = NULL, *after = NULL;
+    const ip_addr   *addrs;
+    size_t          i, j, count;
 
-    for (LL_FOR_EACH(node, &zeroconf_device_list)) {
-        device = OUTER_STRUCT(node, zeroconf_device, node_list);
-
-        for (node2 = ll_next(&zeroconf_device_list, node); node2 != NULL;
-             node2 = ll_next(&zeroconf_device_list, node2)) {
+    addrs = ip_addrset_addresses(device->addrs, &count);
+    for (i = 0; i < count; i ++) {
+        zeroconf_device **devices = zeroconf_device_by_addr_get(addrs[i]);
 
-            device2 = OUTER_STRUCT(node2, zeroconf_device, node_list);
+        for (j = 0; devices != NULL && j < mem_len(devices); j ++) {
+            zeroconf_device *device2 = devices[j];
 
-            if (zeroconf_device_is_mdns(device) !=
+            if (zeroconf_device_is_mdns(device) ==
                 zeroconf_device_is_mdns(device2)) {
-                if (ip_addrset_is_intersect(device->addrs, device2->addrs)) {
-                    device->buddy = device2;
-                    device2->buddy = device;
+                continue;
+            }
+
+            if (device2->seq > device->seq) {
+                if (after == NULL || device2->seq > after->seq) {
+                    after = device2;
                 }
+            } else if (before == NULL || device2->seq > before->seq) {
+                before = device2;
             }
         }
     }
+
+    device->buddy = after ? after : before;
 }
 
-/* Check that new finding should me merged with existent device
+/* Update device->buddy for the device and for all devices,
+ * sharing addresses with it. Called when device's set of
+ * addresses changes or device is removed from the address index
  */
-static bool
-zeroconf_merge_check (zeroconf_device *device, zeroconf_finding *finding)
+static void
+zeroconf_merge_update_buddies (zeroconf_device *device)
 {
-    if ((device->mdns_name == NULL) != (finding->name == NULL)) {
-        return false;
-    }
+    const ip_addr *addrs;
+    size_t        i, j, count;
 
-    if (device->mdns_name != NULL &&
-        strcasecmp(device->mdns_name, finding->name)) {
-        return false;
-    }
+    zeroconf_merge_compute_buddy(device);
 
-    if (uuid_equal(device->uuid, finding->uuid)) {
-        return true;
-    }
+    addrs = ip_addrset_addresses(device->addrs, &count);
+    for (i = 0; i < count; i ++) {
+        zeroconf_device **devices = zeroconf_device_by_addr_get(addrs[i]);
 
-    return false;
+        for (j = 0; devices != NULL && j < mem_len(devices); j ++) {
+            if (devices[j] != device) {
+                zeroconf_merge_compute_buddy(devices[j]);
+            }
+        }
+    }
 }
 
 /* Find device, suitable for merging with specified finding
@@ -452,18 +685,13 @@ zeroconf_merge_check (zeroconf_device *device, zeroconf_finding *finding)
 static zeroconf_device*
 zeroconf_merge_find (zeroconf_finding *finding)
 {
-    ll_node *node;
-
-    for (LL_FOR_EACH(node, &zeroconf_device_list)) {
-        zeroconf_device *device;
-        device = OUTER_STRUCT(node, zeroconf_device, node_list);
+    char            *key = zeroconf_device_key(finding->uuid, finding->name);
+    zeroconf_device *device;
 
-        if (zeroconf_merge_check(device, finding)) {
-            return device;
-        }
-    }
+    device = hashmap_get(zeroconf_device_by_key, key, mem_len(key));
+    mem_free(key);
 
-    return NULL;
+    return device;
 }
 
 /******************** Ident Strings *********************/
@@ -635,6 +863,12 @@ zeroconf_endpoint_cmp (const zeroconf_endpoint *e1, const zeroconf_endpoint *e2)
             return cmp;
         }
 
+        /* Prefer endpoints with better connection history */
+        cmp = epstat_cmp(e1->uri, e2->uri);
+        if (cmp != 0) {
+            return cmp;
+        }
+
         /* Prefer normal addresses, rather that link-local */
         if (ll1 != ll2) {
             return ll1 ? 1 : -1;
@@ -902,7 +1136,7 @@ zeroconf_finding_publish (zeroconf_finding *finding)
     }
 
     zeroconf_device_add_finding(device, finding);
-    zeroconf_merge_recompute_buddies();
+    zeroconf_device_list_invalidate();
     pthread_cond_broadcast(&zeroconf_initscan_cond);
 }
 
@@ -920,7 +1154,7 @@ zeroconf_finding_withdraw (zeroconf_finding *finding)
     log_debug(zeroconf_log, "  interface: %d (%s)", finding->ifindex, ifname);
 
     zeroconf_device_del_finding(finding);
-    zeroconf_merge_recompute_buddies();
+    zeroconf_device_list_invalidate();
     pthread_cond_broadcast(&zeroconf_initscan_cond);
 }
 
@@ -967,6 +1201,12 @@ zeroconf_initscan_done (void)
         return true;
     }
 
+    /* Subnet sweep, if configured, must be done */
+    if ((zeroconf_initscan_bits & (1 << ZEROCONF_SWEEP)) != 0) {
+        log_debug(zeroconf_log, "device_list wait: sweep not finished...");
+        return false;
+    }
+
     /* Regardless of options, all DNS-SD methods must be done */
     if ((zeroconf_initscan_bits & ~(1 << ZEROCONF_WSD)) != 0) {
         log_debug(zeroconf_log, "device_list wait: DNS-SD not finished...");
@@ -1090,21 +1330,17 @@ zeroconf_device_list_log (zeroconf_device *device, const char *name,
         can, use);
 }
 
-/* Get list of devices, in SANE format
+/* Build new snapshot of the device list
  */
-const SANE_Device**
-zeroconf_device_list_get (void)
+static zeroconf_devlist*
+zeroconf_devlist_build (void)
 {
     size_t      dev_count = 0, dev_count_static = 0;
     conf_device *dev_conf;
     const SANE_Device **dev_list = sane_device_array_new();
     ll_node     *node;
     int         i;
-
-    log_debug(zeroconf_log, "zeroconf_device_list_get: requested");
-
-    /* Wait until device table is ready */
-    zeroconf_initscan_wait();
+    zeroconf_devlist *devlist;
 
     /* Build list of devices */
     log_debug(zeroconf_log, "zeroconf_device_list_get: building list of devices");
@@ -1221,27 +1457,106 @@ zeroconf_device_list_get (void)
             "  %-4s  \"%s\"", dev_list[i]->vendor, dev_list[i]->name);
     }
 
-    return dev_list;
+    /* Make a snapshot */
+    devlist = (zeroconf_devlist*) mem_new(char, sizeof(zeroconf_devlist) +
+        sizeof(*dev_list) * (dev_count + 1));
+
+    devlist->refcnt = 1;
+    devlist->generation = zeroconf_device_generation;
+    devlist->proto_auto = conf.proto_auto;
+    devlist->proto_pin = conf.proto_pin;
+    devlist->model_is_netname = conf.model_is_netname;
+    memcpy(devlist->devices, dev_list, sizeof(*dev_list) * dev_count);
+
+    sane_device_array_free(dev_list);
+
+    return devlist;
+}
+
+/* Release reference to the device list snapshot. Snapshot
+ * is freed, when its last reference has gone
+ */
+static void
+zeroconf_devlist_unref (zeroconf_devlist *devlist)
+{
+    unsigned int       i;
+    const SANE_Device *info;
+
+    if (devlist == NULL || __sync_sub_and_fetch(&devlist->refcnt, 1) != 0) {
+        return;
+    }
+
+    for (i = 0; (info = devlist->devices[i]) != NULL; i ++) {
+        mem_free((void*) info->name);
+        mem_free((void*) info->vendor);
+        mem_free((void*) info->model);
+        mem_free((void*) info->type);
+        mem_free((void*) info);
+    }
+
+    mem_free(devlist);
+}
+
+/* Check if device list snapshot is still up to date
+ */
+static bool
+zeroconf_devlist_valid (const zeroconf_devlist *devlist)
+{
+    return devlist != NULL &&
+           devlist->generation == zeroconf_device_generation &&
+           devlist->proto_auto == conf.proto_auto &&
+           devlist->proto_pin == conf.proto_pin &&
+           devlist->model_is_netname == conf.model_is_netname;
+}
+
+/* Get list of devices, in SANE format.
+ *
+ * The returned list is shared and must not be modified. Use
+ * zeroconf_device_list_free() to release it
+ *
+ * Must be called under the eloop mutex
+ */
+const SANE_Device**
+zeroconf_device_list_get (void)
+{
+    log_debug(zeroconf_log, "zeroconf_device_list_get: requested");
+
+    /* Wait until device table is ready */
+    zeroconf_initscan_wait();
+
+    /* Rebuild the list, if something has changed */
+    if (zeroconf_devlist_valid(zeroconf_devlist_current)) {
+        log_debug(zeroconf_log, "zeroconf_device_list_get: using cached list");
+    } else {
+        zeroconf_devlist_unref(zeroconf_devlist_current);
+        zeroconf_devlist_current = zeroconf_devlist_build();
+    }
+
+    __sync_fetch_and_add(&zeroconf_devlist_current->refcnt, 1);
+
+    return zeroconf_devlist_current->devices;
+}
+
+/* Invalidate cached device list, so the next zeroconf_device_list_get()
+ * will rebuild it
+ */
+void
+zeroconf_device_list_invalidate (void)
+{
+    zeroconf_device_generation ++;
 }
 
 /* Free list of devices, returned by zeroconf_device_list_get()
+ *
+ * This function is thread-safe and may be called without
+ * holding the eloop mutex
  */
 void
 zeroconf_device_list_free (const SANE_Device **dev_list)
 {
     if (dev_list != NULL) {
-        unsigned int       i;
-        const SANE_Device *info;
-
-        for (i = 0; (info = dev_list[i]) != NULL; i ++) {
-            mem_free((void*) info->name);
-            mem_free((void*) info->vendor);
-            mem_free((void*) info->model);
-            mem_free((void*) info->type);
-            mem_free((void*) info);
-        }
-
-        sane_device_array_free(dev_list);
+        zeroconf_devlist_unref(OUTER_STRUCT(dev_list, zeroconf_devlist,
+            devices));
     }
 }
 
@@ -1356,7 +1671,8 @@ zeroconf_devinfo_lookup (const char *ident)
     } else {
         devinfo->name = str_dup(zeroconf_device_name(device));
         devinfo->model = str_dup(device->model ? device->model : "");
-        devinfo->endpoints = zeroconf_device_endpoints(device, proto);
+        devinfo->endpoints = zeroconf_device_endpoints(
+            zeroconf_device_proto_owner(device, proto), proto);
     }
 
     return devinfo;
@@ -1405,6 +1721,9 @@ zeroconf_init (void)
     zeroconf_log = log_ctx_new("zeroconf", NULL);
 
     ll_init(&zeroconf_device_list);
+    zeroconf_device_by_key = hashmap_new();
+    zeroconf_device_by_devid = hashmap_new();
+    zeroconf_device_by_addr = hashmap_new();
 
     pthread_cond_init(&zeroconf_initscan_cond, NULL);
 
@@ -1412,7 +1731,8 @@ zeroconf_init (void)
         zeroconf_initscan_bits = (1 << ZEROCONF_MDNS_HINT) |
                                  (1 << ZEROCONF_USCAN_TCP) |
                                  (1 << ZEROCONF_USCANS_TCP) |
-                                 (1 << ZEROCONF_WSD);
+                                 (1 << ZEROCONF_WSD) |
+                                 (1 << ZEROCONF_SWEEP);
     }
 
     eloop_add_start_stop_callback(zeroconf_start_stop_callback);
@@ -1427,6 +1747,9 @@ zeroconf_init (void)
     log_trace(zeroconf_log, "  model        = %s", s);
 
     s = conf.proto_auto ? "auto" : "manual";
+    if (conf.proto_auto && conf.proto_pin != ID_PROTO_UNKNOWN) {
+        s = conf.proto_pin == ID_PROTO_ESCL ? "escl" : "wsd";
+    }
     log_trace(zeroconf_log, "  protocol     = %s", s);
 
     s = "?";
@@ -1452,6 +1775,20 @@ zeroconf_init (void)
         }
     }
 
+    if (conf.sweep_nets != NULL) {
+        size_t i;
+
+        log_trace(zeroconf_log, "subnet sweep:");
+        for (i = 0; i < mem_len(conf.sweep_nets); i ++) {
+            ip_straddr straddr = ip_network_to_straddr(conf.sweep_nets[i]);
+            log_trace(zeroconf_log, "  ip = %s", straddr.text);
+        }
+
+        log_trace(zeroconf_log, "  rate = %d", conf.sweep_rate);
+        log_trace(zeroconf_log, "  parallel = %d", conf.sweep_parallel);
+        log_trace(zeroconf_log, "  timeout = %d", conf.sweep_timeout);
+    }
+
     if (conf.blacklist != NULL) {
         conf_blacklist *ent;
 
@@ -1481,6 +1818,16 @@ void
 zeroconf_cleanup (void)
 {
     if (zeroconf_log != NULL) {
+        hashmap_free(zeroconf_device_by_key);
+        hashmap_free(zeroconf_device_by_devid);
+        hashmap_free(zeroconf_device_by_addr);
+        zeroconf_device_by_key = NULL;
+        zeroconf_device_by_devid = NULL;
+        zeroconf_device_by_addr = NULL;
+
+        zeroconf_devlist_unref(zeroconf_devlist_current);
+        zeroconf_devlist_current = NULL;
+
         log_ctx_free(zeroconf_log);
         zeroconf_log = NULL;
         pthread_cond_destroy(&zeroconf_initscan_cond);
@@ -100,17 +100,18 @@ sane_open (SANE_String_Const name, SANE_Handle *handle)
 
     dev = device_open(name, &status);
 
+    log_debug(device_log_ctx(dev), "API: sane_open(\"%s\"): %s",
+        name ? name : "", sane_strstatus(status));
+
+    /* Note, name may point into dev_list, so release it last */
+    zeroconf_device_list_free(dev_list);
+
     eloop_mutex_unlock();
 
     if (dev != NULL) {
         *handle = (SANE_Handle) dev;
     }
 
-    log_debug(device_log_ctx(dev), "API: sane_open(\"%s\"): %s",
-        name ? name : "", sane_strstatus(status));
-
-    zeroconf_device_list_free(dev_list);
-
     return status;
 }
 
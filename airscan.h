@@ -28,6 +28,10 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#ifdef CONFIG_USDT
+#include <sys/sdt.h>
+#endif
+
 #ifdef  __cplusplus
 extern "C" {
 #endif
@@ -88,6 +92,19 @@ typedef struct http_uri http_uri;
 #define OUTER_STRUCT(member_p,struct_t,field)                            \
     ((struct_t*)((char*)(member_p) - ((ptrdiff_t) &(((struct_t*) 0)->field))))
 
+/* Define SystemTap SDT (USDT) probe point airscan:name, usable with
+ * bpftrace, perf and SystemTap:
+ *   AIRSCAN_PROBE(name, arg1, arg2, ...)
+ *
+ * Probes are compiled in only when CONFIG_USDT is defined (make USDT=yes
+ * or meson -Dusdt=true). Otherwise, arguments are not even evaluated
+ */
+#ifdef CONFIG_USDT
+#   define AIRSCAN_PROBE(...)   STAP_PROBEV(airscan, __VA_ARGS__)
+#else
+#   define AIRSCAN_PROBE(...)   do {} while (0)
+#endif
+
 /******************** Circular Linked Lists ********************/
 /* ll_node represents a linked data node.
  * Data nodes are embedded into the corresponding data structures:
@@ -590,6 +607,48 @@ __ptr_array_del (void **a, int i)
     return p;
 }
 
+/******************** Hash tables ********************/
+/* hashmap maps keys (arbitrary byte strings) to pointers
+ */
+typedef struct hashmap hashmap;
+
+/* Compute hash of the byte string
+ */
+uint32_t
+hash_bytes (const void *data, size_t len);
+
+/* Create new hashmap
+ */
+hashmap*
+hashmap_new (void);
+
+/* Free the hashmap. Values are not freed
+ */
+void
+hashmap_free (hashmap *map);
+
+/* Get value by key. Returns NULL, if key is not in the table
+ */
+void*
+hashmap_get (const hashmap *map, const void *key, size_t len);
+
+/* Set value by key. Existent value, if any, is replaced.
+ * Key is copied into the table
+ */
+void
+hashmap_set (hashmap *map, const void *key, size_t len, void *value);
+
+/* Delete key from the table. Returns deleted value or NULL,
+ * if key was not in the table
+ */
+void*
+hashmap_del (hashmap *map, const void *key, size_t len);
+
+/* Get count of keys in the table
+ */
+size_t
+hashmap_count (const hashmap *map);
+
 /******************** Safe ctype macros ********************/
 #define safe_isspace(c)         isspace((unsigned char) c)
 #define safe_isxdigit(c)        isxdigit((unsigned char) c)
@@ -609,6 +668,8 @@ __ptr_array_del (void **a, int i)
  *   OS_HAVE_IP_MREQN     - OS defines struct ip_mreqn
  *   OS_HAVE_ENDIAN_H     - #include <endian.h> works
  *   OS_HAVE_SYS_ENDIAN_H - #include <sys/endian.h> works
+ *   OS_HAVE_RECVMMSG     - OS has recvmmsg (2)
+ *   OS_HAVE_O_TMPFILE    - Linux-like open (2) with O_TMPFILE
  */
 #ifdef  __linux__
 #   define OS_HAVE_EVENTFD              1
@@ -616,6 +677,8 @@ __ptr_array_del (void **a, int i)
 #   define OS_HAVE_LINUX_PROCFS         1
 #   define OS_HAVE_IP_MREQN             1
 #   define OS_HAVE_ENDIAN_H             1
+#   define OS_HAVE_RECVMMSG             1
+#   define OS_HAVE_O_TMPFILE            1
 #endif
 
 #ifdef BSD
@@ -648,6 +711,15 @@ os_progname (void);
 int
 os_mkdir (const char *path, mode_t mode);
 
+/* Create anonymous temporary file in the directory. The file
+ * has no name and is removed, when the returned file descriptor
+ * is closed
+ *
+ * Returns file descriptor or -1 in a case of error
+ */
+int
+os_tmpfile (const char *dir);
+
 /******************** Error handling ********************/
 /* Type error represents an error. Its value either NULL,
  * which indicates "no error" condition, or some opaque
@@ -1274,6 +1346,16 @@ netif_distance_get (const struct sockaddr *addr);
 bool
 netif_has_non_link_local_addr (int af, int ifindex);
 
+/* Choose network interface to reach the target address
+ *
+ * Returns index of interface, which network contains the address,
+ * or the first non-loopback interface with address of the same
+ * family, if target is behind a router. Returns 0 if there is no
+ * suitable interface at all
+ */
+int
+netif_ifindex_for_addr (int af, const void *addr);
+
 /* Compare addresses by distance. Returns:
  *   <0, if addr1 is closer that addr2
  *   >0, if addr2 is farther that addr2
@@ -1358,6 +1440,29 @@ netif_init (void);
 void
 netif_cleanup (void);
 
+/* Forget all network interfaces addresses.
+ * This function is intended for testing purposes, not for regular use
+ */
+void
+netif_test_reset (void);
+
+/* Add network interface address, as if it was loaded from the system.
+ * ip points to 4 or 16 bytes of address, depending on af
+ * This function is intended for testing purposes, not for regular use
+ */
+void
+netif_test_add (int ifindex, const char *ifname, int af, const void *ip,
+        int prefixlen);
+
+/* Apply block of rtnetlink messages (RTM_NEWADDR/RTM_DELADDR),
+ * as if it was received from the kernel. Returns 1 if addresses
+ * has changed, 0 if not, and -1 if full reload is required (reload
+ * is not performed) or rtnetlink is not supported
+ * This function is intended for testing purposes, not for regular use
+ */
+int
+netif_test_rtnetlink (void *data, size_t size);
+
 /******************** Configuration file loader ********************/
 /* Device URI for manually disabled device
  */
@@ -1398,27 +1503,60 @@ typedef struct {
     bool           dbg_enabled;      /* Debugging enabled */
     const char     *dbg_trace;       /* Trace directory */
     bool           dbg_hexdump;      /* Hexdump all traffic to the trace */
+    bool           dbg_timeline;     /* Write timeline next to the trace */
     conf_device    *devices;         /* Manually configured devices */
     bool           discovery;        /* Scanners discovery enabled */
     bool           model_is_netname; /* Use network name instead of model */
     bool           proto_auto;       /* Auto protocol selection */
+    ID_PROTO       proto_pin;        /* Protocol pinned for auto selection,
+                                        ID_PROTO_UNKNOWN if not pinned */
     WSDD_MODE      wsdd_mode;        /* WS-Discovery mode */
+    int            wsdd_parallel;    /* Max parallel WSD metadata queries */
+    ip_network     *sweep_nets;      /* Networks to sweep, mem array */
+    int            sweep_rate;       /* Sweep rate, addresses per second */
+    int            sweep_parallel;   /* Max addresses swept in parallel */
+    int            sweep_timeout;    /* Sweep connect timeout, milliseconds */
     const char     *socket_dir;      /* Directory for AF_UNIX sockets */
     conf_blacklist *blacklist;       /* Devices blacklisted for discovery */
     bool           pretend_local;    /* Pretend devices are local */
+    const char     *stats_dir;       /* Endpoint statistics directory */
+    const char     *metrics_file;    /* Performance counters JSON file */
+    int            read_buffer;      /* Memory budget of received pages,
+                                        per device, MiB, 0 if unlimited */
+    int            spool;            /* Spool HTTP bodies above this size
+                                        to file, MiB, 0 if disabled */
+    const char     *spool_dir;       /* Directory for spool files,
+                                        NULL for default */
+    bool           wsd_events;       /* Listen for WSD device events */
+    ID_FORMAT      format;           /* Image format to prefer,
+                                        ID_FORMAT_UNKNOWN for auto */
 } conf_data;
 
 #define CONF_INIT {                     \
         .dbg_enabled = false,           \
         .dbg_trace = NULL,              \
         .dbg_hexdump = false,           \
+        .dbg_timeline = false,          \
         .devices = NULL,                \
         .discovery = true,              \
         .model_is_netname = true,       \
         .proto_auto = true,             \
+        .proto_pin = ID_PROTO_UNKNOWN,  \
         .wsdd_mode = WSDD_FAST,         \
+        .wsdd_parallel = 8,             \
+        .sweep_nets = NULL,             \
+        .sweep_rate = 500,              \
+        .sweep_parallel = 128,          \
+        .sweep_timeout = 500,           \
         .socket_dir = NULL,             \
-        .pretend_local = false          \
+        .pretend_local = false,         \
+        .stats_dir = NULL,              \
+        .metrics_file = NULL,           \
+        .read_buffer = 0,               \
+        .spool = 0,                     \
+        .spool_dir = NULL,              \
+        .wsd_events = false,            \
+        .format = ID_FORMAT_UNKNOWN     \
     }
 
 extern conf_data conf;
@@ -1434,6 +1572,14 @@ conf_load (void);
 void
 conf_unload (void);
 
+/* Look for the metrics file path in the configuration files,
+ * without loading the whole configuration. Returns NULL, if
+ * metrics file is not configured. The returned string must
+ * be eventually released with mem_free()
+ */
+char*
+conf_metrics_file_lookup (void);
+
 /******************** Pollable events ********************/
 /* The pollable event
  *
@@ -1869,6 +2015,11 @@ http_data_queue_pull (http_data_queue *queue);
 int
 http_data_queue_len (const http_data_queue *queue);
 
+/* Get total size of queued data, in bytes
+ */
+size_t
+http_data_queue_bytes (const http_data_queue *queue);
+
 /* Check if queue is empty
  */
 static inline bool
@@ -2009,6 +2160,12 @@ http_query_onrxhdr (http_query *q, void (*onrxhdr)(void *ptr, http_query *q));
 void
 http_query_submit (http_query *q, void (*callback)(void *ptr, http_query *q));
 
+/* Cancel unfinished http_query. Callback will not be called and
+ * memory owned by the http_query will be released
+ */
+void
+http_query_cancel (http_query *q);
+
 /* Get http_query timestamp. Timestamp is set when query is
  * submitted. And this function should not be called before
  * http_query_submit()
@@ -2016,6 +2173,13 @@ http_query_submit (http_query *q, void (*callback)(void *ptr, http_query *q));
 timestamp
 http_query_timestamp (const http_query *q);
 
+/* Get time, spent to establish connection to the server (including
+ * TLS handshake), in milliseconds. Returns -1 if connection was not
+ * established
+ */
+timestamp
+http_query_connect_time (const http_query *q);
+
 /* Set uintptr_t parameter, associated with query.
  * Completion callback may later use http_query_get_uintptr()
  * to fetch this value
@@ -2147,6 +2311,37 @@ http_query_foreach_response_header (const http_query *q,
 error
 http_query_test_decode_response (http_query *q, const void *data, size_t size);
 
+/* Free http_query, that was never submitted.
+ * This function is intended for testing purposes, not for regular use
+ */
+void
+http_query_test_free (http_query *q);
+
+/* Parse block of HTTP header fields, without status line, and
+ * discard the result.
+ * This function is intended for testing purposes, not for regular use
+ */
+error
+http_hdr_test_parse (const void *data, size_t size);
+
+/* Replace network I/O of all HTTP queries with the test transport.
+ *
+ * When transport is set, submitted queries don't resolve addresses
+ * and don't connect anywhere. Instead, the transport callback is
+ * called with the formatted query, and either returns a transport
+ * error, or the raw HTTP response bytes (status line, header and
+ * body), which are then processed by the regular response parser.
+ * The returned data must remain valid until the next call.
+ *
+ * The callback is called from the event loop thread. Pass NULL
+ * transport to restore normal operations.
+ *
+ * This function is intended for testing purposes, not for regular use
+ */
+void
+http_test_transport_set (error (*transport) (void *ptr, http_query *q,
+        const void **data, size_t *size), void *ptr);
+
 /* HTTP schemes
  */
 typedef enum {
@@ -2178,6 +2373,99 @@ http_init (void);
 void
 http_cleanup (void);
 
+/******************** Performance statistics ********************/
+/* Initialize endpoint statistics
+ */
+SANE_Status
+epstat_init (void);
+
+/* Cleanup endpoint statistics. If persistence is configured,
+ * statistics is saved here
+ */
+void
+epstat_cleanup (void);
+
+/* Update endpoint statistics by the completed query.
+ *
+ * Query that failed at the transport level counts as endpoint
+ * failure. Query that has reached the server contributes its
+ * connect time to the smoothed endpoint latency
+ */
+void
+epstat_update (http_uri *uri, const http_query *q);
+
+/* Count endpoint failure, reported by the http_client onerror
+ * callback, where query is not available
+ */
+void
+epstat_failed (http_uri *uri);
+
+/* Compare two endpoints by their statistics, for sorting.
+ * Endpoints, which are not significantly different, are
+ * considered equal
+ */
+int
+epstat_cmp (http_uri *uri1, http_uri *uri2);
+
+/* Update protocol statistics by the received page.
+ *
+ * Page of `pixels' size and `bytes' length was received in
+ * `latency' milliseconds since the job start or the previous page,
+ * and its transfer took `xfer' milliseconds
+ */
+void
+epstat_proto_update (const char *model, ID_PROTO proto, uint64_t pixels,
+        size_t bytes, timestamp latency, timestamp xfer);
+
+/* Compare two protocols by speed, for the particular device model.
+ * Returns negative value, if proto1 is preferred, positive if proto2
+ * is preferred, 0 if there is no preference.
+ *
+ * If only one protocol has enough statistics, the other one is
+ * preferred, so both protocols will be measured
+ */
+int
+epstat_proto_cmp (const char *model, ID_PROTO proto1, ID_PROTO proto2);
+
+/* Update endpoint bandwidth by the received data. Received
+ * `bytes' took `t' milliseconds to transfer
+ */
+void
+epstat_bw_update (http_uri *uri, size_t bytes, timestamp t);
+
+/* Get endpoint bandwidth, bytes per second. Returns 0, if unknown
+ */
+unsigned int
+epstat_bw (http_uri *uri);
+
+/* Update image format statistics by the decoded image of `samples'
+ * size (pixels * channels) and `bytes' length, that took `ns'
+ * nanoseconds of CPU time to decode
+ */
+void
+epstat_format_update (ID_FORMAT fmt, uint64_t samples, size_t bytes,
+        uint64_t ns);
+
+/* Estimate time, in milliseconds, required to transfer image
+ * of `samples' size (pixels * channels) over the link with the
+ * bandwidth of `bw' bytes per second and to decode it locally
+ */
+uint64_t
+epstat_format_estimate (ID_FORMAT fmt, uint64_t samples, unsigned int bw);
+
+/* Update discovery statistics by the largest interval, in
+ * milliseconds, between arrivals of new devices, observed during
+ * the initial discovery scan
+ */
+void
+epstat_discovery_update (timestamp gap);
+
+/* Get the learned interval between arrivals of new devices during
+ * the discovery, in milliseconds. Returns -1, if unknown
+ */
+timestamp
+epstat_discovery_gap_get (void);
+
 /******************** Protocol trace ********************/
 /* Type trace represents an opaque handle of trace
  * file
@@ -2235,6 +2523,30 @@ trace_dump_body (trace *t, http_data *data);
 void
 trace_hexdump (trace *t, char prefix, const void *data, size_t size);
 
+/* Write timeline begin event. Timeline is written next to the
+ * trace log, in Chrome trace-event format, if conf.dbg_timeline
+ * is set
+ *
+ * Events are asynchronous: begin and end events of the same
+ * cat and id are matched with each other and may nest, but
+ * different ids don't need to nest. detail may be NULL
+ */
+void
+trace_event_begin (trace *t, const char *cat, const char *name,
+        const void *id, const char *detail);
+
+/* Write timeline end event
+ */
+void
+trace_event_end (trace *t, const char *cat, const char *name,
+        const void *id, const char *detail);
+
+/* Write timeline instant event
+ */
+void
+trace_event_instant (trace *t, const char *cat, const char *name,
+        const void *id, const char *detail);
+
 /******************** SANE_Word/SANE_String arrays ********************/
 /* Create array of SANE_Word
  */
@@ -2889,6 +3201,7 @@ typedef enum {
     ZEROCONF_USCAN_TCP,   /* _uscan._tcp */
     ZEROCONF_USCANS_TCP,  /* _uscans._tcp */
     ZEROCONF_WSD,         /* WS-Discovery */
+    ZEROCONF_SWEEP,       /* eSCL, found by unicast subnet sweep */
 
     NUM_ZEROCONF_METHOD
 } ZEROCONF_METHOD;
@@ -2969,12 +3282,24 @@ zeroconf_init (void);
 void
 zeroconf_cleanup (void);
 
-/* Get list of devices, in SANE format
+/* Get list of devices, in SANE format.
+ *
+ * The returned list is shared and must not be modified. Use
+ * zeroconf_device_list_free() to release it
+ *
+ * Must be called under the eloop mutex
  */
 const SANE_Device**
 zeroconf_device_list_get (void);
 
+/* Invalidate cached device list, so the next zeroconf_device_list_get()
+ * will rebuild it
+ */
+void
+zeroconf_device_list_invalidate (void);
+
 /* Free list of devices, returned by zeroconf_device_list_get()
+ * May be called without holding the eloop mutex
  */
 void
 zeroconf_device_list_free (const SANE_Device **dev_list);
@@ -3164,6 +3489,16 @@ wsdd_initscan_timer_expired (void);
 void
 wsdd_send_directed_probe (int ifindex, int af, const void *addr);
 
+/* Send WD-Discovery directed probe with limited timeout
+ *
+ * It works like wsdd_send_directed_probe(), but HTTP query
+ * is aborted after timeout, in milliseconds. Used by the
+ * subnet sweep, where most of probed addresses don't answer
+ */
+void
+wsdd_send_directed_probe_timeout (int ifindex, int af, const void *addr,
+        int timeout);
+
 /* Initialize WS-Discovery
  */
 SANE_Status
@@ -3174,6 +3509,51 @@ wsdd_init (void);
 void
 wsdd_cleanup (void);
 
+/******************** Unicast subnet sweep ********************/
+/* Initialize subnet sweep
+ */
+SANE_Status
+sweep_init (void);
+
+/* Cleanup subnet sweep
+ */
+void
+sweep_cleanup (void);
+
+/******************** WSD eventing ********************/
+/* wsde_subscription represents subscription to WSD device events
+ */
+typedef struct wsde_subscription wsde_subscription;
+
+/* Subscribe to device events (job status and scanner status changes).
+ *
+ * When event notification comes, callback is called from the
+ * event loop thread, with the short event name (i.e., "JobStatusEvent")
+ * as a parameter.
+ *
+ * Returns NULL, if events cannot be delivered to us. In this
+ * case, the caller should rely on polling only.
+ */
+wsde_subscription*
+wsde_subscribe (log_ctx *log, const http_uri *uri,
+        void (*callback) (void *data, const char *event), void *data);
+
+/* Cancel the subscription. Unsubscribe request is sent to device
+ * in background, and subscription callback will not be called anymore
+ */
+void
+wsde_unsubscribe (wsde_subscription *sub);
+
+/* Initialize WSD eventing
+ */
+SANE_Status
+wsde_init (void);
+
+/* Cleanup WSD eventing
+ */
+void
+wsde_cleanup (void);
+
 /******************** Device Management ********************/
 /* Type device represents a scanner device
  */
@@ -3315,6 +3695,7 @@ typedef struct {
     ID_COLORMODE  colormode;    /* Desired color mode */
     ID_SCANINTENT scanintent;   /* Desired scan intent */
     ID_FORMAT     format;       /* Desired image format */
+    int           compression;  /* Compression factor, if supported */
 } proto_scan_params;
 
 /* proto_ctx represents request context
@@ -3448,6 +3829,117 @@ proto_handler_free (proto_handler *proto)
     proto->free(proto);
 }
 
+/******************** Performance counters ********************/
+/* metrics represents performance counters of a device. Counters
+ * are kept by device name and survive device close and reopen
+ */
+typedef struct metrics metrics;
+
+/* Initialize performance counters
+ */
+SANE_Status
+metrics_init (void);
+
+/* Cleanup performance counters. If conf.metrics_file is set,
+ * counters are saved here
+ */
+void
+metrics_cleanup (void);
+
+/* Get counters of the device, creating them if necessary, and count
+ * the device open
+ */
+metrics*
+metrics_get (const char *name);
+
+/* Get monotonic time in nanoseconds
+ */
+uint64_t
+metrics_clock (void);
+
+/* Count completed HTTP query of the device, performed as a part
+ * of the operation op, against the endpoint. PROTO_OP_NONE is used
+ * for device capabilities queries
+ */
+void
+metrics_http_query (metrics *m, PROTO_OP op, http_uri *endpoint,
+        const http_query *q);
+
+/* Count HTTP transport error of the operation, that was reported
+ * without the query
+ */
+void
+metrics_http_error (metrics *m, PROTO_OP op);
+
+/* Count retry of the operation
+ */
+void
+metrics_retry (metrics *m, PROTO_OP op);
+
+/* Count finished scan job
+ */
+void
+metrics_job (metrics *m, SANE_Status status);
+
+/* Count fully decoded image
+ */
+void
+metrics_image (metrics *m, ID_FORMAT fmt, size_t bytes,
+        uint64_t decode_ns, uint64_t filter_ns);
+
+/* Count sane_read() call, that returned `bytes' bytes after
+ * being blocked for `blocked_ns' nanoseconds
+ */
+void
+metrics_read (metrics *m, size_t bytes, uint64_t blocked_ns);
+
+/* Count image, pushed into the read_queue. Depth is the queue
+ * length after push
+ */
+void
+metrics_queue_push (metrics *m, size_t bytes, size_t depth);
+
+/* Count image, pulled from the read_queue
+ */
+void
+metrics_queue_pull (metrics *m, size_t bytes);
+
+/* Count the read_queue purge
+ */
+void
+metrics_queue_purge (metrics *m);
+
+/* Count PROTO_OP_LOAD, paused because read_queue exceeds
+ * its memory budget
+ */
+void
+metrics_load_paused (metrics *m);
+
+/* Count completed HTTP query, globally
+ */
+void
+metrics_http_complete (const http_query *q);
+
+/* Count TLS handshake
+ */
+void
+metrics_tls_handshake (bool ok);
+
+/* Format all counters as JSON and append to the string
+ *
+ * The output format is stable: fields may be added, but
+ * existing fields are never removed or renamed without
+ * incrementing the "version" field
+ */
+char*
+metrics_json (char *out);
+
+/* Save counters into the conf.metrics_file, if configured.
+ * File is written atomically, in background
+ */
+void
+metrics_save (void);
+
 /******************** Image decoding ********************/
 /* The window withing the image
  *
@@ -3477,6 +3969,12 @@ struct image_decoder {
 ID_FORMAT
 image_format_detect (const void *data, size_t size);
 
+/* Convert line of 24-bit RGB pixels into 8-bit grayscale, in place.
+ * The wid parameter is the line width, in pixels
+ */
+void
+image_resample_24_to_8 (uint8_t *line, int wid);
+
 /* Create JPEG image decoder
  */
 image_decoder*
@@ -3791,6 +4289,12 @@ log_ctx_free (log_ctx *log);
 trace*
 log_ctx_trace (log_ctx *log);
 
+/* Check if message, written to the logging context, will go
+ * anywhere, either to the log or to the protocol trace
+ */
+bool
+log_enabled (log_ctx *log, bool trace_only);
+
 /* Write a debug message.
  */
 void
@@ -3801,6 +4305,26 @@ log_debug (log_ctx *log, const char *fmt, ...);
 void
 log_trace (log_ctx *log, const char *fmt, ...);
 
+/* log_debug() and log_trace() are wrapped with macros, that check
+ * log_enabled() first, so if message will be dropped, neither its
+ * arguments are evaluated nor message is formatted
+ */
+#define log_debug(log,...)                                              \
+     do {                                                               \
+         log_ctx *log_debug_ctx__ = (log);                              \
+         if (log_enabled(log_debug_ctx__, false)) {                     \
+             (log_debug)(log_debug_ctx__, __VA_ARGS__);                 \
+         }                                                              \
+     } while (0)
+
+#define log_trace(log,...)                                              \
+     do {                                                               \
+         log_ctx *log_trace_ctx__ = (log);                              \
+         if (log_enabled(log_trace_ctx__, true)) {                      \
+             (log_trace)(log_trace_ctx__, __VA_ARGS__);                 \
+         }                                                              \
+     } while (0)
+
 /* Write a block of data into protocol trace
  */
 void
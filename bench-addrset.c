@@ -0,0 +1,201 @@
+/* ip_addrset microbenchmark
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * Output format is one line per measurement:
+ *   <operation> <set size> <nanoseconds per operation>
+ */
+
+#include "airscan.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Total count of operations per measurement, approximately
+ */
+#define BENCH_OPS       1000000
+
+static void
+fail (const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    putchar('\n');
+    exit(1);
+}
+
+/* Get monotonic time, in nanoseconds
+ */
+static uint64_t
+bench_now (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+/* Make i-th test address. Address space is split by seed,
+ * so sets made with different seeds don't intersect
+ */
+static ip_addr
+bench_addr (int seed, uint32_t i)
+{
+    uint8_t ip[16] = {0};
+
+    switch (i % 3) {
+    case 0:
+        ip[0] = 10;
+        ip[1] = (uint8_t) seed;
+        ip[2] = (uint8_t) (i >> 8);
+        ip[3] = (uint8_t) i;
+        return ip_addr_make(0, AF_INET, ip);
+
+    case 1:
+        ip[0] = 0x20;
+        ip[1] = 0x01;
+        ip[2] = 0x0d;
+        ip[3] = 0xb8;
+        ip[4] = (uint8_t) seed;
+        memcpy(ip + 12, &i, sizeof(i));
+        return ip_addr_make(0, AF_INET6, ip);
+    }
+
+    ip[0] = 0xfe;
+    ip[1] = 0x80;
+    ip[8] = (uint8_t) seed;
+    memcpy(ip + 12, &i, sizeof(i));
+    return ip_addr_make(2, AF_INET6, ip);
+}
+
+/* Make set of n addresses
+ */
+static ip_addrset*
+bench_set (int seed, uint32_t n)
+{
+    ip_addrset *set = ip_addrset_new();
+    uint32_t   i;
+
+    for (i = 0; i < n; i ++) {
+        ip_addrset_add(set, bench_addr(seed, i));
+    }
+
+    return set;
+}
+
+/* Report a measurement
+ */
+static void
+bench_report (const char *op, uint32_t n, uint64_t start, uint64_t ops)
+{
+    printf("%-16s %6u %10.1f\n", op, n, (double) (bench_now() - start) / ops);
+}
+
+/* Run all benchmarks for sets of n addresses
+ */
+static void
+bench_run (uint32_t n)
+{
+    uint32_t   reps = BENCH_OPS / n, r, i;
+    ip_addrset *set, *set2, *tmp;
+    uint64_t   start;
+
+    if (reps == 0) {
+        reps = 1;
+    }
+
+    /* ip_addrset_add() */
+    start = bench_now();
+    for (r = 0; r < reps; r ++) {
+        ip_addrset_free(bench_set(0, n));
+    }
+    bench_report("add", n, start, (uint64_t) reps * n);
+
+    /* ip_addrset_lookup(), hit and miss */
+    set = bench_set(0, n);
+
+    start = bench_now();
+    for (r = 0; r < reps; r ++) {
+        for (i = 0; i < n; i ++) {
+            if (!ip_addrset_lookup(set, bench_addr(0, i))) {
+                fail("lookup(%u): address %u not found", n, i);
+            }
+        }
+    }
+    bench_report("lookup-hit", n, start, (uint64_t) reps * n);
+
+    start = bench_now();
+    for (r = 0; r < reps; r ++) {
+        for (i = 0; i < n; i ++) {
+            if (ip_addrset_lookup(set, bench_addr(1, i))) {
+                fail("lookup(%u): address %u unexpectedly found", n, i);
+            }
+        }
+    }
+    bench_report("lookup-miss", n, start, (uint64_t) reps * n);
+
+    /* ip_addrset_is_intersect(), worst case (disjoint sets) and
+     * best case (intersection at the last address)
+     */
+    set2 = bench_set(1, n);
+
+    start = bench_now();
+    for (r = 0; r < reps; r ++) {
+        if (ip_addrset_is_intersect(set, set2)) {
+            fail("is_intersect(%u): disjoint sets intersect", n);
+        }
+    }
+    bench_report("intersect-none", n, start, reps);
+
+    ip_addrset_add(set2, bench_addr(0, n - 1));
+    start = bench_now();
+    for (r = 0; r < reps; r ++) {
+        if (!ip_addrset_is_intersect(set, set2)) {
+            fail("is_intersect(%u): intersection not found", n);
+        }
+    }
+    bench_report("intersect-one", n, start, reps);
+
+    /* ip_addrset_merge() */
+    start = bench_now();
+    for (r = 0; r < reps; r ++) {
+        tmp = bench_set(0, n);
+        ip_addrset_merge(tmp, set2);
+        ip_addrset_free(tmp);
+    }
+    bench_report("build+merge", n, start, reps);
+
+    /* ip_addrset_del() */
+    start = bench_now();
+    for (r = 0; r < reps; r ++) {
+        tmp = bench_set(0, n);
+        for (i = 0; i < n; i ++) {
+            ip_addrset_del(tmp, bench_addr(0, n - i - 1));
+        }
+        ip_addrset_free(tmp);
+    }
+    bench_report("build+del", n, start, (uint64_t) reps * n);
+
+    ip_addrset_free(set);
+    ip_addrset_free(set2);
+}
+
+/* The main function
+ */
+int
+main (void)
+{
+    static const uint32_t sizes[] = {1, 4, 8, 16, 64, 256, 1000, 10000};
+    size_t                i;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i ++) {
+        bench_run(sizes[i]);
+    }
+
+    return 0;
+}
+
+/* vim:ts=8:sw=4:et
+ */
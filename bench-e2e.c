@@ -0,0 +1,1108 @@
+/* End-to-end scanning benchmark
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * This benchmark runs a minimal scanner emulator, that speaks eSCL
+ * and WSD over the AF_UNIX and loopback TCP sockets, and scans from
+ * it via the public SANE API. So the whole pipeline (HTTP client,
+ * protocol handlers, image decoding and sane_read()) is measured
+ * at once, without any real device and without a network.
+ *
+ * The emulator runs in a child process, so CPU time, consumed by
+ * the backend, can be measured separately.
+ *
+ * Usage: bench-e2e [options]
+ *   -P escl|wsd        protocol to measure (default: both)
+ *   -t unix|tcp        transport to measure (default: both)
+ *   -f jpeg|png|bmp    image format (default: jpeg)
+ *   -p pages           pages per job, scanned from ADF (default: 10)
+ *   -j jobs            jobs per measurement (default: 1)
+ *   -s WxH             page size, pixels at 300 DPI (default: 2480x3508)
+ *   -l ms              latency, added before each response (default: 0)
+ *   -b KiB/s           emulator bandwidth limit (default: unlimited)
+ *   -e N               reply 503 to every Nth eSCL NextDocument request
+ *
+ * Note, unix:// device URLs are normally used with eSCL only; here
+ * WSD uses them too, to measure the protocol without the TCP stack.
+ *
+ * Output format is one line per measurement:
+ *   <proto> <transport> <format> <pages/s> <MB/s> <TTFB ms> <CPU ms/page>
+ *
+ * MB/s counts image bytes, returned by sane_read(). TTFB is a time
+ * from sane_start() to the first image byte of the job, averaged
+ * over jobs. CPU time is consumed by the benchmark process, i.e.,
+ * by the backend and its threads.
+ */
+
+#include "airscan.h"
+
+#include <errno.h>
+#include <jpeglib.h>
+#include <png.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/* Emulator parameters
+ */
+#define EMU_SOCK_NAME   "bench.sock"    /* AF_UNIX socket name */
+#define EMU_RQ_MAX      65536           /* Max request size */
+#define EMU_JOBS_MAX    256             /* Max simultaneous jobs */
+#define EMU_CHUNK       16384           /* Write chunk, when rate-limited */
+#define EMU_DPI         300             /* Emulated resolution */
+
+/* Benchmark configuration
+ */
+static const char *bench_proto;         /* NULL for both */
+static const char *bench_transport;     /* NULL for both */
+static const char *bench_format = "jpeg";
+static int        bench_pages = 10;
+static int        bench_jobs = 1;
+static int        bench_wid = 2480;
+static int        bench_hei = 3508;
+static int        bench_latency;        /* Milliseconds */
+static int        bench_bandwidth;      /* KiB/s, 0 = unlimited */
+static int        bench_fail_every;     /* 0 = don't inject 503 */
+
+/* Emulator state
+ */
+static pid_t           emu_pid = -1;
+static char            emu_dir[] = "/tmp/bench-e2e-XXXXXX";
+static int             emu_tcp_port;
+static char            *emu_image;
+static size_t          emu_image_len;
+static const char      *emu_image_mime;
+static const char      *emu_wsd_format;
+static pthread_mutex_t emu_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int    emu_job_last;
+static int             emu_job_pages[EMU_JOBS_MAX];
+static unsigned int    emu_load_count;
+
+/* Print error message and exit
+ */
+static void
+fail (const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    putchar('\n');
+
+    if (emu_pid > 0) {
+        kill(emu_pid, SIGKILL);
+    }
+
+    exit(1);
+}
+
+/* Get monotonic time, in nanoseconds
+ */
+static uint64_t
+bench_now (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+/* Get CPU time, consumed by the process, in nanoseconds
+ */
+static uint64_t
+bench_cpu (void)
+{
+    struct rusage ru;
+    uint64_t      t;
+
+    getrusage(RUSAGE_SELF, &ru);
+    t = (uint64_t) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000;
+    t += (uint64_t) (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000;
+
+    return t;
+}
+
+/* Sleep for the specified amount of nanoseconds
+ */
+static void
+bench_sleep (uint64_t ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = (time_t) (ns / 1000000000);
+    ts.tv_nsec = (long) (ns % 1000000000);
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+}
+
+/******************** Test image ********************/
+/* Render RGB pixel of the test page: a white sheet with some
+ * text-like lines and a gradient picture, so image compresses
+ * roughly like a real scanned document
+ */
+static void
+image_pixel (int x, int y, uint8_t rgb[3])
+{
+    int      wid = bench_wid, hei = bench_hei;
+    uint32_t noise = ((uint32_t) x * 2654435761u) ^ ((uint32_t) y * 40503u);
+
+    rgb[0] = rgb[1] = rgb[2] = 0xf8 + (noise >> 29);
+
+    if (x < wid / 10 || x >= wid - wid / 10 || y < hei / 12) {
+        return;
+    }
+
+    if (y < hei / 2) {
+        /* Text lines */
+        if ((y / 24) % 3 != 0 && (x / 16) % 7 != 0 && ((x ^ y) & 4) != 0) {
+            rgb[0] = rgb[1] = rgb[2] = 0x20 + (noise >> 27);
+        }
+    } else if (y < hei - hei / 12) {
+        /* Picture */
+        rgb[0] = (uint8_t) (x * 255 / wid);
+        rgb[1] = (uint8_t) (y * 255 / hei);
+        rgb[2] = (uint8_t) ((x + y) + (noise >> 28));
+    }
+}
+
+/* Render one row of the test page
+ */
+static void
+image_row (int y, uint8_t *row)
+{
+    int x;
+
+    for (x = 0; x < bench_wid; x ++) {
+        image_pixel(x, y, row + 3 * x);
+    }
+}
+
+/* Encode test page as JPEG
+ */
+static void
+image_make_jpeg (void)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr       jerr;
+    unsigned char               *out = NULL;
+    unsigned long               out_len = 0;
+    uint8_t                     *row = mem_new(uint8_t, 3 * bench_wid);
+    int                         y;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &out, &out_len);
+
+    cinfo.image_width = bench_wid;
+    cinfo.image_height = bench_hei;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 85, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    for (y = 0; y < bench_hei; y ++) {
+        JSAMPROW rows[1] = {row};
+        image_row(y, row);
+        jpeg_write_scanlines(&cinfo, rows, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    mem_free(row);
+
+    emu_image = malloc(out_len);
+    memcpy(emu_image, out, out_len);
+    emu_image_len = out_len;
+    free(out);
+}
+
+/* PNG write callback
+ */
+static void
+image_png_write (png_structp png, png_bytep data, png_size_t len)
+{
+    (void) png;
+    emu_image = realloc(emu_image, emu_image_len + len);
+    memcpy(emu_image + emu_image_len, data, len);
+    emu_image_len += len;
+}
+
+/* Encode test page as PNG
+ */
+static void
+image_make_png (void)
+{
+    png_structp png;
+    png_infop   info;
+    uint8_t     *row = mem_new(uint8_t, 3 * bench_wid);
+    int         y;
+
+    png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    info = png_create_info_struct(png);
+    if (png == NULL || info == NULL || setjmp(png_jmpbuf(png))) {
+        fail("PNG: can't encode test image");
+    }
+
+    png_set_write_fn(png, NULL, image_png_write, NULL);
+    png_set_IHDR(png, info, bench_wid, bench_hei, 8, PNG_COLOR_TYPE_RGB,
+        PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+        PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+
+    for (y = 0; y < bench_hei; y ++) {
+        image_row(y, row);
+        png_write_row(png, row);
+    }
+
+    png_write_end(png, NULL);
+    png_destroy_write_struct(&png, &info);
+    mem_free(row);
+}
+
+/* Store little-endian 16-bit and 32-bit values
+ */
+static uint8_t*
+image_le16 (uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t) v;
+    p[1] = (uint8_t) (v >> 8);
+    return p + 2;
+}
+
+static uint8_t*
+image_le32 (uint8_t *p, uint32_t v)
+{
+    p = image_le16(p, v & 0xffff);
+    return image_le16(p, v >> 16);
+}
+
+/* Encode test page as 24-bit bottom-up BMP
+ */
+static void
+image_make_bmp (void)
+{
+    size_t  stride = (3 * (size_t) bench_wid + 3) & ~(size_t) 3;
+    size_t  hdr_len = 14 + 40;
+    uint8_t *p;
+    int     x, y;
+
+    emu_image_len = hdr_len + stride * bench_hei;
+    emu_image = calloc(1, emu_image_len);
+
+    p = (uint8_t*) emu_image;
+    *p ++ = 'B';
+    *p ++ = 'M';
+    p = image_le32(p, emu_image_len);
+    p = image_le32(p, 0);
+    p = image_le32(p, hdr_len);
+
+    p = image_le32(p, 40);
+    p = image_le32(p, bench_wid);
+    p = image_le32(p, bench_hei);
+    p = image_le16(p, 1);
+    p = image_le16(p, 24);
+    p = image_le32(p, 0);
+    p = image_le32(p, stride * bench_hei);
+    p = image_le32(p, 11811);   /* 300 DPI, in pixels per meter */
+    p = image_le32(p, 11811);
+
+    for (y = 0; y < bench_hei; y ++) {
+        uint8_t *row = (uint8_t*) emu_image + hdr_len +
+                       stride * (bench_hei - y - 1);
+
+        image_row(y, row);
+        for (x = 0; x < bench_wid; x ++) {
+            uint8_t tmp = row[3 * x];
+            row[3 * x] = row[3 * x + 2];
+            row[3 * x + 2] = tmp;
+        }
+    }
+}
+
+/* Make the test image in the configured format
+ */
+static void
+image_make (void)
+{
+    if (!strcmp(bench_format, "jpeg")) {
+        image_make_jpeg();
+        emu_image_mime = "image/jpeg";
+        emu_wsd_format = "jfif";
+    } else if (!strcmp(bench_format, "png")) {
+        image_make_png();
+        emu_image_mime = "image/png";
+        emu_wsd_format = "png";
+    } else if (!strcmp(bench_format, "bmp")) {
+        image_make_bmp();
+        emu_image_mime = "application/bmp";
+        emu_wsd_format = "dib";
+    } else {
+        fail("%s: unknown image format", bench_format);
+    }
+}
+
+/******************** Emulator: HTTP ********************/
+/* emu_rq represents a parsed HTTP request
+ */
+typedef struct {
+    char       buf[EMU_RQ_MAX + 1]; /* Raw request */
+    const char *method;             /* Request method */
+    const char *path;               /* Request path */
+    const char *body;               /* Request body, NUL-terminated */
+} emu_rq;
+
+/* Write data to the socket, respecting the bandwidth limit
+ */
+static bool
+emu_write (int fd, const char *data, size_t len)
+{
+    uint64_t start = bench_now();
+    uint64_t rate = (uint64_t) bench_bandwidth * 1024;
+    size_t   sent = 0;
+
+    while (sent < len) {
+        size_t  sz = len - sent;
+        ssize_t rc;
+
+        if (rate != 0 && sz > EMU_CHUNK) {
+            sz = EMU_CHUNK;
+        }
+
+        rc = send(fd, data + sent, sz, MSG_NOSIGNAL);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        } else if (rc <= 0) {
+            return false;
+        }
+
+        sent += (size_t) rc;
+
+        if (rate != 0) {
+            uint64_t due = start + sent * 1000000000 / rate;
+            uint64_t now = bench_now();
+            if (due > now) {
+                bench_sleep(due - now);
+            }
+        }
+    }
+
+    return true;
+}
+
+/* Send HTTP response. Extra headers, if any, must be CRLF-terminated
+ */
+static void
+emu_respond (int fd, int status, const char *content_type,
+        const char *extra, const char *body, size_t len)
+{
+    char *hdr;
+
+    if (bench_latency > 0) {
+        bench_sleep((uint64_t) bench_latency * 1000000);
+    }
+
+    hdr = str_printf("HTTP/1.1 %d %s\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: close\r\n",
+            status, status < 300 ? "OK" : "Error", len);
+
+    if (content_type != NULL) {
+        hdr = str_append_printf(hdr, "Content-Type: %s\r\n", content_type);
+    }
+    if (extra != NULL) {
+        hdr = str_append(hdr, extra);
+    }
+    hdr = str_append(hdr, "\r\n");
+
+    if (emu_write(fd, hdr, strlen(hdr)) && len != 0) {
+        emu_write(fd, body, len);
+    }
+
+    mem_free(hdr);
+}
+
+/* Send XML response
+ */
+static void
+emu_respond_xml (int fd, int status, const char *content_type, char *xml)
+{
+    emu_respond(fd, status, content_type, NULL, xml, strlen(xml));
+    mem_free(xml);
+}
+
+/* Read and parse HTTP request. Only requests with Content-Length
+ * (spelled exactly this way) are supported, which is enough for
+ * our HTTP client
+ */
+static bool
+emu_read_request (int fd, emu_rq *rq)
+{
+    size_t     len = 0, need = 0;
+    char       *hdr_end = NULL, *s;
+    ssize_t    rc;
+
+    for (;;) {
+        if (hdr_end != NULL && len >= need) {
+            break;
+        }
+
+        if (len == EMU_RQ_MAX) {
+            return false;
+        }
+
+        rc = recv(fd, rq->buf + len, EMU_RQ_MAX - len, 0);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        } else if (rc <= 0) {
+            return false;
+        }
+
+        len += (size_t) rc;
+        rq->buf[len] = '\0';
+
+        if (hdr_end == NULL && (hdr_end = strstr(rq->buf, "\r\n\r\n"))) {
+            hdr_end += 4;
+            need = (size_t) (hdr_end - rq->buf);
+
+            s = strstr(rq->buf, "\r\nContent-Length:");
+            if (s != NULL && s < hdr_end) {
+                need += strtoul(s + 17, NULL, 10);
+            }
+        }
+    }
+
+    rq->buf[need] = '\0';
+    rq->body = hdr_end;
+
+    /* Split request line */
+    rq->method = rq->buf;
+    s = strchr(rq->buf, ' ');
+    if (s == NULL) {
+        return false;
+    }
+    *s ++ = '\0';
+
+    rq->path = s;
+    s = strchr(s, ' ');
+    if (s == NULL) {
+        return false;
+    }
+    *s = '\0';
+
+    return true;
+}
+
+/* Create new job, returns its ID
+ */
+static unsigned int
+emu_job_new (void)
+{
+    unsigned int id;
+
+    pthread_mutex_lock(&emu_lock);
+    id = ++ emu_job_last;
+    emu_job_pages[id % EMU_JOBS_MAX] = bench_pages;
+    pthread_mutex_unlock(&emu_lock);
+
+    return id;
+}
+
+/* Take next page of the job. Returns false, if there are no more pages
+ */
+static bool
+emu_job_take_page (unsigned int id)
+{
+    bool ok = false;
+
+    pthread_mutex_lock(&emu_lock);
+    if (id != 0 && id <= emu_job_last && emu_job_last - id < EMU_JOBS_MAX &&
+        emu_job_pages[id % EMU_JOBS_MAX] > 0) {
+        emu_job_pages[id % EMU_JOBS_MAX] --;
+        ok = true;
+    }
+    pthread_mutex_unlock(&emu_lock);
+
+    return ok;
+}
+
+/* Check if the next image load must fail with 503
+ */
+static bool
+emu_inject_failure (void)
+{
+    bool inject = false;
+
+    if (bench_fail_every > 0) {
+        pthread_mutex_lock(&emu_lock);
+        emu_load_count ++;
+        inject = (emu_load_count % bench_fail_every) == 0;
+        pthread_mutex_unlock(&emu_lock);
+    }
+
+    return inject;
+}
+
+/******************** Emulator: eSCL ********************/
+/* Handle eSCL request
+ */
+static void
+emu_escl (int fd, const emu_rq *rq, const char *path)
+{
+    unsigned int id;
+    int          off;
+
+    if (!strcmp(path, "ScannerCapabilities")) {
+        emu_respond_xml(fd, 200, "text/xml", str_printf(
+            "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+            "<scan:ScannerCapabilities"
+            " xmlns:pwg=\"http://www.pwg.org/schemas/2010/12/sm\""
+            " xmlns:scan=\"http://schemas.hp.com/imaging/escl/2011/05/03\">"
+            "<pwg:Version>2.63</pwg:Version>"
+            "<pwg:MakeAndModel>sane-airscan bench</pwg:MakeAndModel>"
+            "<scan:Manufacturer>sane-airscan</scan:Manufacturer>"
+            "<scan:Adf><scan:AdfSimplexInputCaps>"
+            "<scan:MinWidth>16</scan:MinWidth>"
+            "<scan:MaxWidth>%d</scan:MaxWidth>"
+            "<scan:MinHeight>16</scan:MinHeight>"
+            "<scan:MaxHeight>%d</scan:MaxHeight>"
+            "<scan:SettingProfiles><scan:SettingProfile>"
+            "<scan:ColorModes>"
+            "<scan:ColorMode>RGB24</scan:ColorMode>"
+            "<scan:ColorMode>Grayscale8</scan:ColorMode>"
+            "</scan:ColorModes>"
+            "<scan:DocumentFormats>"
+            "<pwg:DocumentFormat>%s</pwg:DocumentFormat>"
+            "</scan:DocumentFormats>"
+            "<scan:SupportedResolutions><scan:DiscreteResolutions>"
+            "<scan:DiscreteResolution>"
+            "<scan:XResolution>%d</scan:XResolution>"
+            "<scan:YResolution>%d</scan:YResolution>"
+            "</scan:DiscreteResolution>"
+            "</scan:DiscreteResolutions></scan:SupportedResolutions>"
+            "</scan:SettingProfile></scan:SettingProfiles>"
+            "</scan:AdfSimplexInputCaps></scan:Adf>"
+            "</scan:ScannerCapabilities>",
+            bench_wid * 300 / EMU_DPI, bench_hei * 300 / EMU_DPI,
+            emu_image_mime, EMU_DPI, EMU_DPI));
+    } else if (!strcmp(path, "ScannerStatus")) {
+        emu_respond_xml(fd, 200, "text/xml", str_dup(
+            "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+            "<scan:ScannerStatus"
+            " xmlns:pwg=\"http://www.pwg.org/schemas/2010/12/sm\""
+            " xmlns:scan=\"http://schemas.hp.com/imaging/escl/2011/05/03\">"
+            "<pwg:Version>2.63</pwg:Version>"
+            "<pwg:State>Idle</pwg:State>"
+            "<scan:AdfState>ScannerAdfLoaded</scan:AdfState>"
+            "</scan:ScannerStatus>"));
+    } else if (!strcmp(path, "ScanJobs") && !strcmp(rq->method, "POST")) {
+        char *loc = str_printf("Location: /eSCL/ScanJobs/%u\r\n",
+            emu_job_new());
+        emu_respond(fd, 201, NULL, loc, NULL, 0);
+        mem_free(loc);
+    } else if (sscanf(path, "ScanJobs/%u%n", &id, &off) == 1) {
+        path += off;
+        if (!strcmp(path, "/NextDocument")) {
+            if (emu_inject_failure()) {
+                emu_respond(fd, 503, NULL, NULL, NULL, 0);
+            } else if (emu_job_take_page(id)) {
+                emu_respond(fd, 200, emu_image_mime, NULL,
+                    emu_image, emu_image_len);
+            } else {
+                emu_respond(fd, 404, NULL, NULL, NULL, 0);
+            }
+        } else if (*path == '\0' && !strcmp(rq->method, "DELETE")) {
+            emu_respond(fd, 200, NULL, NULL, NULL, 0);
+        } else {
+            emu_respond(fd, 404, NULL, NULL, NULL, 0);
+        }
+    } else {
+        emu_respond(fd, 404, NULL, NULL, NULL, 0);
+    }
+}
+
+/******************** Emulator: WSD ********************/
+/* WSD SOAP envelope
+ */
+#define EMU_WSD_HEAD                                                    \
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"                        \
+    "<soap:Envelope"                                                    \
+    " xmlns:soap=\"http://www.w3.org/2003/05/soap-envelope\""           \
+    " xmlns:wsa=\"http://schemas.xmlsoap.org/ws/2004/08/addressing\""   \
+    " xmlns:sca=\"http://schemas.microsoft.com/windows/2006/08/wdp/scan\""\
+    " xmlns:xop=\"http://www.w3.org/2004/08/xop/include\">"             \
+    "<soap:Header><wsa:Action>"                                         \
+    "http://schemas.microsoft.com/windows/2006/08/wdp/scan/%s"          \
+    "</wsa:Action></soap:Header><soap:Body>"
+
+#define EMU_WSD_TAIL    "</soap:Body></soap:Envelope>"
+
+/* Extract text of the first XML element with the given name
+ */
+static unsigned int
+emu_wsd_uint (const char *body, const char *name)
+{
+    const char *s = strstr(body, name);
+
+    if (s != NULL) {
+        s = strchr(s, '>');
+    }
+
+    return s != NULL ? (unsigned int) strtoul(s + 1, NULL, 10) : 0;
+}
+
+/* Handle WSD RetrieveImage request
+ */
+static void
+emu_wsd_retrieve (int fd, const emu_rq *rq)
+{
+    static const char boundary[] = "bench-e2e-boundary";
+    char              *soap, *head, *tail, *ct, *body;
+    size_t            len;
+
+    if (!emu_job_take_page(emu_wsd_uint(rq->body, ":JobId"))) {
+        emu_respond_xml(fd, 400, "application/soap+xml", str_printf(
+            EMU_WSD_HEAD
+            "<soap:Fault><soap:Code><soap:Value>soap:Sender</soap:Value>"
+            "<soap:Subcode><soap:Value>sca:ClientErrorNoImagesAvailable"
+            "</soap:Value></soap:Subcode></soap:Code></soap:Fault>"
+            EMU_WSD_TAIL,
+            "Fault"));
+        return;
+    }
+
+    soap = str_printf(EMU_WSD_HEAD
+        "<sca:RetrieveImageResponse><sca:ScanData>"
+        "<xop:Include href=\"cid:image\"/>"
+        "</sca:ScanData></sca:RetrieveImageResponse>"
+        EMU_WSD_TAIL,
+        "RetrieveImageResponse");
+
+    head = str_printf("--%s\r\n"
+        "Content-Type: application/xop+xml; charset=UTF-8;"
+        " type=\"application/soap+xml\"\r\n"
+        "Content-ID: <soap>\r\n"
+        "\r\n"
+        "%s\r\n"
+        "--%s\r\n"
+        "Content-Type: %s\r\n"
+        "Content-ID: <image>\r\n"
+        "\r\n",
+        boundary, soap, boundary, emu_image_mime);
+    tail = str_printf("\r\n--%s--\r\n", boundary);
+    ct = str_printf("multipart/related; boundary=%s;"
+        " type=\"application/xop+xml\"; start=\"<soap>\";"
+        " start-info=\"application/soap+xml\"", boundary);
+
+    len = mem_len(head) + emu_image_len + mem_len(tail);
+    body = mem_new(char, len);
+    memcpy(body, head, mem_len(head));
+    memcpy(body + mem_len(head), emu_image, emu_image_len);
+    memcpy(body + mem_len(head) + emu_image_len, tail, mem_len(tail));
+
+    emu_respond(fd, 200, ct, NULL, body, len);
+
+    mem_free(body);
+    mem_free(ct);
+    mem_free(tail);
+    mem_free(head);
+    mem_free(soap);
+}
+
+/* Handle WSD request
+ */
+static void
+emu_wsd (int fd, const emu_rq *rq)
+{
+    const char *body = rq->body;
+    const char *ct = "application/soap+xml";
+
+    if (strstr(body, "wdp/scan/GetScannerElements") != NULL &&
+        strstr(body, "ScannerConfiguration") != NULL) {
+        int wid = bench_wid * 1000 / EMU_DPI;
+        int hei = bench_hei * 1000 / EMU_DPI;
+
+        emu_respond_xml(fd, 200, ct, str_printf(EMU_WSD_HEAD
+            "<sca:GetScannerElementsResponse><sca:ScannerElements>"
+            "<sca:ElementData Name=\"sca:ScannerConfiguration\" Valid=\"true\">"
+            "<sca:ScannerConfiguration>"
+            "<sca:DeviceSettings>"
+            "<sca:FormatsSupported>"
+            "<sca:FormatValue>%s</sca:FormatValue>"
+            "</sca:FormatsSupported>"
+            "<sca:ContentTypesSupported>"
+            "<sca:ContentTypeValue>Auto</sca:ContentTypeValue>"
+            "</sca:ContentTypesSupported>"
+            "</sca:DeviceSettings>"
+            "<sca:ADF>"
+            "<sca:ADFSupportsDuplex>false</sca:ADFSupportsDuplex>"
+            "<sca:ADFFront>"
+            "<sca:ADFMinimumSize><sca:Width>16</sca:Width>"
+            "<sca:Height>16</sca:Height></sca:ADFMinimumSize>"
+            "<sca:ADFMaximumSize><sca:Width>%d</sca:Width>"
+            "<sca:Height>%d</sca:Height></sca:ADFMaximumSize>"
+            "<sca:ADFResolutions>"
+            "<sca:Widths><sca:Width>%d</sca:Width></sca:Widths>"
+            "<sca:Heights><sca:Height>%d</sca:Height></sca:Heights>"
+            "</sca:ADFResolutions>"
+            "<sca:ADFColor>"
+            "<sca:ColorEntry>RGB24</sca:ColorEntry>"
+            "<sca:ColorEntry>Grayscale8</sca:ColorEntry>"
+            "</sca:ADFColor>"
+            "</sca:ADFFront>"
+            "</sca:ADF>"
+            "</sca:ScannerConfiguration>"
+            "</sca:ElementData>"
+            "</sca:ScannerElements></sca:GetScannerElementsResponse>"
+            EMU_WSD_TAIL,
+            "GetScannerElementsResponse",
+            emu_wsd_format, wid, hei, EMU_DPI, EMU_DPI));
+    } else if (strstr(body, "wdp/scan/GetScannerElements") != NULL) {
+        emu_respond_xml(fd, 200, ct, str_printf(EMU_WSD_HEAD
+            "<sca:GetScannerElementsResponse><sca:ScannerElements>"
+            "<sca:ElementData Name=\"sca:ScannerStatus\" Valid=\"true\">"
+            "<sca:ScannerStatus>"
+            "<sca:ScannerState>Idle</sca:ScannerState>"
+            "</sca:ScannerStatus>"
+            "</sca:ElementData>"
+            "</sca:ScannerElements></sca:GetScannerElementsResponse>"
+            EMU_WSD_TAIL,
+            "GetScannerElementsResponse"));
+    } else if (strstr(body, "wdp/scan/CreateScanJob") != NULL) {
+        unsigned int id = emu_job_new();
+
+        emu_respond_xml(fd, 200, ct, str_printf(EMU_WSD_HEAD
+            "<sca:CreateScanJobResponse>"
+            "<sca:JobId>%u</sca:JobId>"
+            "<sca:JobToken>token-%u</sca:JobToken>"
+            "</sca:CreateScanJobResponse>"
+            EMU_WSD_TAIL,
+            "CreateScanJobResponse", id, id));
+    } else if (strstr(body, "wdp/scan/RetrieveImage") != NULL) {
+        emu_wsd_retrieve(fd, rq);
+    } else if (strstr(body, "wdp/scan/CancelJob") != NULL) {
+        emu_respond_xml(fd, 200, ct, str_printf(EMU_WSD_HEAD
+            "<sca:CancelJobResponse/>"
+            EMU_WSD_TAIL,
+            "CancelJobResponse"));
+    } else {
+        emu_respond(fd, 400, NULL, NULL, NULL, 0);
+    }
+}
+
+/******************** Emulator: server ********************/
+/* Serve one connection. Our client always sends Connection: close,
+ * so there is exactly one request per connection
+ */
+static void*
+emu_conn (void *arg)
+{
+    int    fd = (int) (intptr_t) arg;
+    emu_rq *rq = mem_new(emu_rq, 1);
+
+    if (emu_read_request(fd, rq)) {
+        if (str_has_prefix(rq->path, "/eSCL/")) {
+            emu_escl(fd, rq, rq->path + 6);
+        } else if (!strcmp(rq->path, "/WSD") && !strcmp(rq->method, "POST")) {
+            emu_wsd(fd, rq);
+        } else {
+            emu_respond(fd, 404, NULL, NULL, NULL, 0);
+        }
+    }
+
+    mem_free(rq);
+    close(fd);
+
+    return NULL;
+}
+
+/* Emulator main loop. Never returns
+ */
+static void
+emu_run (int unix_fd, int tcp_fd)
+{
+    struct pollfd fds[2] = {{unix_fd, POLLIN, 0}, {tcp_fd, POLLIN, 0}};
+    int           i;
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            continue;
+        }
+
+        for (i = 0; i < 2; i ++) {
+            if ((fds[i].revents & POLLIN) != 0) {
+                int       fd = accept(fds[i].fd, NULL, NULL);
+                pthread_t tid;
+
+                if (fd >= 0 && pthread_create(&tid, NULL, emu_conn,
+                        (void*) (intptr_t) fd) == 0) {
+                    pthread_detach(tid);
+                } else if (fd >= 0) {
+                    close(fd);
+                }
+            }
+        }
+    }
+}
+
+/* Start the emulator process
+ */
+static void
+emu_start (void)
+{
+    struct sockaddr_un sun = {0};
+    struct sockaddr_in sin = {0};
+    socklen_t          sin_len = sizeof(sin);
+    int                unix_fd, tcp_fd;
+    char               *path;
+    FILE               *fp;
+
+    if (mkdtemp(emu_dir) == NULL) {
+        fail("mkdtemp(%s): %s", emu_dir, strerror(errno));
+    }
+
+    /* Create AF_UNIX listener */
+    unix_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sun.sun_family = AF_UNIX;
+    snprintf(sun.sun_path, sizeof(sun.sun_path), "%s/%s",
+        emu_dir, EMU_SOCK_NAME);
+    if (unix_fd < 0 || bind(unix_fd, (struct sockaddr*) &sun, sizeof(sun)) < 0
+        || listen(unix_fd, 128) < 0) {
+        fail("%s: %s", sun.sun_path, strerror(errno));
+    }
+
+    /* Create loopback TCP listener */
+    tcp_fd = socket(AF_INET, SOCK_STREAM, 0);
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (tcp_fd < 0 || bind(tcp_fd, (struct sockaddr*) &sin, sizeof(sin)) < 0
+        || listen(tcp_fd, 128) < 0
+        || getsockname(tcp_fd, (struct sockaddr*) &sin, &sin_len) < 0) {
+        fail("127.0.0.1: %s", strerror(errno));
+    }
+
+    emu_tcp_port = ntohs(sin.sin_port);
+
+    /* Write backend configuration */
+    path = str_printf("%s/%s", emu_dir, CONFIG_AIRSCAN_CONF);
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        fail("%s: %s", path, strerror(errno));
+    }
+
+    fprintf(fp, "[options]\ndiscovery = disable\nsocket_dir = %s\n", emu_dir);
+    fclose(fp);
+    mem_free(path);
+
+    setenv(CONFIG_PATH_ENV, emu_dir, 1);
+
+    /* Fork the emulator. Listeners are already created, so there
+     * is no need to wait until child is ready
+     */
+    emu_pid = fork();
+    if (emu_pid < 0) {
+        fail("fork(): %s", strerror(errno));
+    } else if (emu_pid == 0) {
+        emu_run(unix_fd, tcp_fd);
+    }
+
+    close(unix_fd);
+    close(tcp_fd);
+}
+
+/* Stop the emulator process and cleanup its files
+ */
+static void
+emu_stop (void)
+{
+    char *path;
+
+    kill(emu_pid, SIGKILL);
+    waitpid(emu_pid, NULL, 0);
+
+    path = str_printf("%s/%s", emu_dir, EMU_SOCK_NAME);
+    unlink(path);
+    mem_free(path);
+
+    path = str_printf("%s/%s", emu_dir, CONFIG_AIRSCAN_CONF);
+    unlink(path);
+    mem_free(path);
+
+    rmdir(emu_dir);
+}
+
+/******************** Benchmark ********************/
+/* Run one measurement
+ */
+static void
+bench_run (const char *proto, const char *transport)
+{
+    char        *ident;
+    SANE_Handle handle;
+    SANE_Status status;
+    static char buf[65536];
+    uint64_t    start, cpu, ttfb = 0, bytes = 0, pages = 0;
+    double      sec;
+    int         job;
+
+    if (!strcmp(transport, "unix")) {
+        ident = str_printf("%s:bench:unix://%s/%s", proto, EMU_SOCK_NAME,
+            strcmp(proto, "wsd") ? "eSCL/" : "WSD");
+    } else {
+        ident = str_printf("%s:bench:http://127.0.0.1:%d/%s", proto,
+            emu_tcp_port, strcmp(proto, "wsd") ? "eSCL/" : "WSD");
+    }
+
+    status = sane_open(ident, &handle);
+    if (status != SANE_STATUS_GOOD) {
+        fail("sane_open(%s): %s", ident, sane_strstatus(status));
+    }
+
+    start = bench_now();
+    cpu = bench_cpu();
+
+    for (job = 0; job < bench_jobs; job ++) {
+        uint64_t job_start = bench_now();
+        int      page;
+
+        for (page = 0; ; page ++) {
+            bool first = page == 0;
+
+            status = sane_start(handle);
+            if (status == SANE_STATUS_NO_DOCS && page != 0) {
+                break;
+            } else if (status != SANE_STATUS_GOOD) {
+                fail("%s: sane_start(): %s", ident, sane_strstatus(status));
+            }
+
+            for (;;) {
+                SANE_Int len;
+
+                status = sane_read(handle, (SANE_Byte*) buf, sizeof(buf),
+                    &len);
+                if (status == SANE_STATUS_EOF) {
+                    break;
+                } else if (status != SANE_STATUS_GOOD) {
+                    fail("%s: sane_read(): %s", ident,
+                        sane_strstatus(status));
+                }
+
+                if (first && len > 0) {
+                    ttfb += bench_now() - job_start;
+                    first = false;
+                }
+
+                bytes += (uint64_t) len;
+            }
+
+            pages ++;
+        }
+
+        sane_cancel(handle);
+    }
+
+    sec = (double) (bench_now() - start) / 1e9;
+    cpu = bench_cpu() - cpu;
+
+    printf("%s %s %s %.2f %.2f %.1f %.1f\n", proto, transport, bench_format,
+        pages / sec, bytes / sec / 1e6, ttfb / 1e6 / bench_jobs,
+        pages ? cpu / 1e6 / pages : 0.0);
+    fflush(stdout);
+
+    sane_close(handle);
+    mem_free(ident);
+}
+
+/* Print usage and exit
+ */
+static void
+usage (void)
+{
+    printf("usage: bench-e2e [-P escl|wsd] [-t unix|tcp] [-f jpeg|png|bmp]\n"
+           "                 [-p pages] [-j jobs] [-s WxH] [-l latency_ms]\n"
+           "                 [-b KiB/s] [-e fail_every_n]\n");
+    exit(1);
+}
+
+/* The main function
+ */
+int
+main (int argc, char **argv)
+{
+    static const char *protos[] = {"escl", "wsd"};
+    static const char *transports[] = {"unix", "tcp"};
+    SANE_Status       status;
+    size_t            i, j;
+    int               c;
+
+    while ((c = getopt(argc, argv, "P:t:f:p:j:s:l:b:e:")) != -1) {
+        switch (c) {
+        case 'P': bench_proto = optarg; break;
+        case 't': bench_transport = optarg; break;
+        case 'f': bench_format = optarg; break;
+        case 'p': bench_pages = atoi(optarg); break;
+        case 'j': bench_jobs = atoi(optarg); break;
+        case 'l': bench_latency = atoi(optarg); break;
+        case 'b': bench_bandwidth = atoi(optarg); break;
+        case 'e': bench_fail_every = atoi(optarg); break;
+
+        case 's':
+            if (sscanf(optarg, "%dx%d", &bench_wid, &bench_hei) != 2) {
+                usage();
+            }
+            break;
+
+        default:
+            usage();
+        }
+    }
+
+    if (optind != argc || bench_pages < 1 || bench_jobs < 1 ||
+        bench_wid < 16 || bench_hei < 16) {
+        usage();
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    image_make();
+    emu_start();
+
+    status = sane_init(NULL, NULL);
+    if (status != SANE_STATUS_GOOD) {
+        fail("sane_init(): %s", sane_strstatus(status));
+    }
+
+    for (i = 0; i < sizeof(protos) / sizeof(protos[0]); i ++) {
+        if (bench_proto != NULL && strcmp(bench_proto, protos[i])) {
+            continue;
+        }
+
+        for (j = 0; j < sizeof(transports) / sizeof(transports[0]); j ++) {
+            if (bench_transport != NULL &&
+                strcmp(bench_transport, transports[j])) {
+                continue;
+            }
+
+            bench_run(protos[i], transports[j]);
+        }
+    }
+
+    sane_exit();
+    emu_stop();
+    free(emu_image);
+
+    return 0;
+}
+
+/* vim:ts=8:sw=4:et
+ */
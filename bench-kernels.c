@@ -0,0 +1,964 @@
+/* Microbenchmarks for the backend's hot kernels
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * All inputs are synthetic and deterministic, and each measurement
+ * is repeated several times with the best result reported, so output
+ * can be compared between releases.
+ *
+ * Output format is one line per measurement:
+ *   <operation> <case> <nanoseconds per operation> <MB/s>
+ *
+ * MB/s is printed as "-" for operations that don't process a
+ * meaningful amount of bytes.
+ *
+ * ip_addrset operations are covered by bench-addrset.
+ */
+
+#include "airscan.h"
+
+#include <errno.h>
+#include <jpeglib.h>
+#include <png.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <tiffio.h>
+#include <unistd.h>
+
+/* Count of repetitions of each measurement. The best one is reported
+ */
+#define BENCH_REPEAT    5
+
+/* Test page size, pixels (A4 at 150 DPI)
+ */
+#define BENCH_WID       1240
+#define BENCH_HEI       1754
+
+static void
+fail (const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    putchar('\n');
+    exit(1);
+}
+
+/* Get monotonic time, in nanoseconds
+ */
+static uint64_t
+bench_now (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+/* Run fn(arg) ops times, BENCH_REPEAT times in a row, and report
+ * the best result. bytes is the amount of data, processed by
+ * a single call, or 0, if not applicable
+ */
+static void
+bench_measure (const char *op, const char *name, size_t bytes, uint64_t ops,
+        void (*fn) (void *arg), void *arg)
+{
+    uint64_t best = UINT64_MAX;
+    double   ns;
+    int      r;
+
+    for (r = 0; r < BENCH_REPEAT; r ++) {
+        uint64_t start = bench_now(), t;
+        uint64_t i;
+
+        for (i = 0; i < ops; i ++) {
+            fn(arg);
+        }
+
+        t = bench_now() - start;
+        if (t < best) {
+            best = t;
+        }
+    }
+
+    ns = (double) best / ops;
+    if (bytes != 0) {
+        printf("%s %s %.1f %.1f\n", op, name, ns, bytes * 1e3 / ns);
+    } else {
+        printf("%s %s %.1f -\n", op, name, ns);
+    }
+
+    fflush(stdout);
+}
+
+/******************** Test image ********************/
+/* Render one RGB row of the test page: a white sheet with
+ * text-like lines at the top and a gradient picture at the bottom
+ */
+static void
+image_row (int y, uint8_t *row)
+{
+    int x;
+
+    for (x = 0; x < BENCH_WID; x ++) {
+        uint8_t  *rgb = row + 3 * x;
+        uint32_t noise = ((uint32_t) x * 2654435761u) ^ ((uint32_t) y * 40503u);
+
+        rgb[0] = rgb[1] = rgb[2] = 0xf8 + (noise >> 29);
+
+        if (x < BENCH_WID / 10 || x >= BENCH_WID - BENCH_WID / 10 ||
+            y < BENCH_HEI / 12 || y >= BENCH_HEI - BENCH_HEI / 12) {
+            continue;
+        }
+
+        if (y < BENCH_HEI / 2) {
+            if ((y / 12) % 3 != 0 && (x / 8) % 7 != 0 && ((x ^ y) & 2) != 0) {
+                rgb[0] = rgb[1] = rgb[2] = 0x20 + (noise >> 27);
+            }
+        } else {
+            rgb[0] = (uint8_t) (x * 255 / BENCH_WID);
+            rgb[1] = (uint8_t) (y * 255 / BENCH_HEI);
+            rgb[2] = (uint8_t) ((x + y) + (noise >> 28));
+        }
+    }
+}
+
+/* Encoded test image
+ */
+typedef struct {
+    const char *name;           /* Format name */
+    char       *data;           /* Image data, malloc'ed */
+    size_t     size;            /* Image size */
+} bench_image;
+
+/* Encode test page as JPEG
+ */
+static void
+image_make_jpeg (bench_image *img)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr       jerr;
+    unsigned char               *out = NULL;
+    unsigned long               out_len = 0;
+    uint8_t                     row[3 * BENCH_WID];
+    int                         y;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &out, &out_len);
+
+    cinfo.image_width = BENCH_WID;
+    cinfo.image_height = BENCH_HEI;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 85, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    for (y = 0; y < BENCH_HEI; y ++) {
+        JSAMPROW rows[1] = {row};
+        image_row(y, row);
+        jpeg_write_scanlines(&cinfo, rows, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    img->data = (char*) out;
+    img->size = out_len;
+}
+
+/* PNG write callback
+ */
+static void
+image_png_write (png_structp png, png_bytep data, png_size_t len)
+{
+    bench_image *img = png_get_io_ptr(png);
+
+    img->data = realloc(img->data, img->size + len);
+    memcpy(img->data + img->size, data, len);
+    img->size += len;
+}
+
+/* Encode test page as PNG
+ */
+static void
+image_make_png (bench_image *img)
+{
+    png_structp png;
+    png_infop   info;
+    uint8_t     row[3 * BENCH_WID];
+    int         y;
+
+    png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    info = png_create_info_struct(png);
+    if (png == NULL || info == NULL || setjmp(png_jmpbuf(png))) {
+        fail("PNG: can't encode test image");
+    }
+
+    png_set_write_fn(png, img, image_png_write, NULL);
+    png_set_IHDR(png, info, BENCH_WID, BENCH_HEI, 8, PNG_COLOR_TYPE_RGB,
+        PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+        PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+
+    for (y = 0; y < BENCH_HEI; y ++) {
+        image_row(y, row);
+        png_write_row(png, row);
+    }
+
+    png_write_end(png, NULL);
+    png_destroy_write_struct(&png, &info);
+}
+
+/* Encode test page as LZW-compressed TIFF. libtiff wants a file,
+ * so image is written into the temporary one and loaded back.
+ * Note, TIFFClose() closes the file, so libtiff gets a dup of it
+ */
+static void
+image_make_tiff (bench_image *img)
+{
+    char    path[] = "/tmp/bench-kernels-XXXXXX";
+    int     fd = mkstemp(path);
+    TIFF    *tif;
+    uint8_t row[3 * BENCH_WID];
+    int     y;
+    off_t   size;
+
+    if (fd < 0) {
+        fail("%s: %s", path, strerror(errno));
+    }
+
+    tif = TIFFFdOpen(dup(fd), path, "w");
+    if (tif == NULL) {
+        fail("TIFF: can't encode test image");
+    }
+
+    TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, BENCH_WID);
+    TIFFSetField(tif, TIFFTAG_IMAGELENGTH, BENCH_HEI);
+    TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 3);
+    TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 8);
+    TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+    TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
+    TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, 16);
+
+    for (y = 0; y < BENCH_HEI; y ++) {
+        image_row(y, row);
+        TIFFWriteScanline(tif, row, y, 0);
+    }
+
+    TIFFClose(tif);
+
+    size = lseek(fd, 0, SEEK_END);
+    img->data = malloc(size);
+    img->size = (size_t) size;
+    if (pread(fd, img->data, img->size, 0) != size) {
+        fail("%s: read error", path);
+    }
+
+    close(fd);
+    unlink(path);
+}
+
+/* Encode test page as 24-bit bottom-up BMP
+ */
+static void
+image_make_bmp (bench_image *img)
+{
+    size_t  stride = (3 * BENCH_WID + 3) & ~3;
+    size_t  hdr_len = 14 + 40;
+    uint8_t *p;
+    int     x, y;
+    const uint32_t hdr[] = {
+        0,                      /* bfSize, set below */
+        0,                      /* bfReserved1, bfReserved2 */
+        14 + 40,                /* bfOffBits */
+        40,                     /* biSize */
+        BENCH_WID,              /* biWidth */
+        BENCH_HEI,              /* biHeight */
+        1 | (24 << 16),         /* biPlanes, biBitCount */
+        0,                      /* biCompression */
+        0,                      /* biSizeImage */
+        5906,                   /* biXPelsPerMeter, 150 DPI */
+        5906,                   /* biYPelsPerMeter */
+        0,                      /* biClrUsed */
+        0                       /* biClrImportant */
+    };
+
+    img->size = hdr_len + stride * BENCH_HEI;
+    img->data = calloc(1, img->size);
+
+    p = (uint8_t*) img->data;
+    p[0] = 'B';
+    p[1] = 'M';
+    for (x = 0; x < (int) (sizeof(hdr) / sizeof(hdr[0])); x ++) {
+        uint32_t v = x ? hdr[x] : (uint32_t) img->size;
+        p[2 + 4 * x] = (uint8_t) v;
+        p[3 + 4 * x] = (uint8_t) (v >> 8);
+        p[4 + 4 * x] = (uint8_t) (v >> 16);
+        p[5 + 4 * x] = (uint8_t) (v >> 24);
+    }
+
+    for (y = 0; y < BENCH_HEI; y ++) {
+        uint8_t *row = p + hdr_len + stride * (BENCH_HEI - y - 1);
+
+        image_row(y, row);
+        for (x = 0; x < BENCH_WID; x ++) {
+            uint8_t tmp = row[3 * x];
+            row[3 * x] = row[3 * x + 2];
+            row[3 * x + 2] = tmp;
+        }
+    }
+}
+
+/******************** Image kernels ********************/
+/* Context for image decoding benchmark
+ */
+typedef struct {
+    image_decoder *decoder;     /* Image decoder */
+    bench_image   *img;         /* Encoded image */
+    uint8_t       *line;        /* Line buffer */
+} bench_decode_ctx;
+
+/* Decode entire image
+ */
+static void
+bench_decode (void *arg)
+{
+    bench_decode_ctx *ctx = arg;
+    SANE_Parameters  params;
+    image_window     win;
+    error            err;
+    int              y;
+
+    err = image_decoder_begin(ctx->decoder, ctx->img->data, ctx->img->size);
+    if (err != NULL) {
+        fail("%s: %s", ctx->img->name, ESTRING(err));
+    }
+
+    image_decoder_get_params(ctx->decoder, &params);
+    win.x_off = win.y_off = 0;
+    win.wid = params.pixels_per_line;
+    win.hei = params.lines;
+
+    err = image_decoder_set_window(ctx->decoder, &win);
+    for (y = 0; err == NULL && y < win.hei; y ++) {
+        err = image_decoder_read_line(ctx->decoder, ctx->line);
+    }
+
+    if (err != NULL) {
+        fail("%s: %s", ctx->img->name, ESTRING(err));
+    }
+
+    image_decoder_reset(ctx->decoder);
+}
+
+/* Run image decoders benchmarks
+ */
+static void
+bench_image_decoders (void)
+{
+    static struct {
+        const char *name;
+        void       (*make) (bench_image *img);
+        image_decoder *(*decoder_new) (void);
+    } formats[] = {
+        {"bmp",  image_make_bmp,  image_decoder_bmp_new},
+        {"jpeg", image_make_jpeg, image_decoder_jpeg_new},
+        {"png",  image_make_png,  image_decoder_png_new},
+        {"tiff", image_make_tiff, image_decoder_tiff_new}
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i ++) {
+        bench_image      img = {formats[i].name, NULL, 0};
+        bench_decode_ctx ctx;
+
+        formats[i].make(&img);
+
+        ctx.decoder = formats[i].decoder_new();
+        ctx.img = &img;
+        ctx.line = mem_new(uint8_t, 3 * BENCH_WID);
+
+        bench_measure("image_decoder", formats[i].name,
+            3 * BENCH_WID * BENCH_HEI, 10, bench_decode, &ctx);
+
+        image_decoder_free(ctx.decoder);
+        mem_free(ctx.line);
+        free(img.data);
+    }
+}
+
+/* Context for line kernels
+ */
+typedef struct {
+    filter  *chain;             /* Filter chain */
+    uint8_t *src;               /* Source line */
+    uint8_t *line;              /* Line buffer */
+    size_t  size;               /* Line size, bytes */
+} bench_line_ctx;
+
+/* Apply filter chain to the line
+ */
+static void
+bench_filter (void *arg)
+{
+    bench_line_ctx *ctx = arg;
+    filter_chain_apply(ctx->chain, ctx->line, ctx->size);
+}
+
+/* Resample line from 24 to 8 bits. Source line is restored
+ * each time, as resampling is done in place
+ */
+static void
+bench_24_to_8 (void *arg)
+{
+    bench_line_ctx *ctx = arg;
+    memcpy(ctx->line, ctx->src, ctx->size);
+    image_resample_24_to_8(ctx->line, ctx->size / 3);
+}
+
+/* Run per-line kernels benchmarks
+ */
+static void
+bench_line_kernels (void)
+{
+    bench_line_ctx ctx;
+    devopt         opt;
+
+    memset(&opt, 0, sizeof(opt));
+    opt.brightness = SANE_FIX(10.0);
+    opt.contrast = SANE_FIX(20.0);
+    opt.shadow = SANE_FIX(5.0);
+    opt.highlight = SANE_FIX(95.0);
+    opt.gamma = SANE_FIX(1.8);
+
+    ctx.size = 3 * 2 * BENCH_WID;
+    ctx.src = mem_new(uint8_t, ctx.size);
+    ctx.line = mem_new(uint8_t, ctx.size);
+    image_row(BENCH_HEI / 3, ctx.src);
+    image_row(BENCH_HEI * 2 / 3, ctx.src + ctx.size / 2);
+    memcpy(ctx.line, ctx.src, ctx.size);
+
+    ctx.chain = filter_chain_push_xlat(NULL, &opt);
+    bench_measure("filter_xlat_apply", "a4-300dpi", ctx.size, 20000,
+        bench_filter, &ctx);
+    filter_chain_free(ctx.chain);
+
+    bench_measure("resample_24_to_8", "a4-300dpi", ctx.size, 20000,
+        bench_24_to_8, &ctx);
+
+    mem_free(ctx.src);
+    mem_free(ctx.line);
+}
+
+/******************** HTTP kernels ********************/
+/* Context for HTTP response decoding
+ */
+typedef struct {
+    http_client *client;        /* HTTP client */
+    char        *data;          /* Response */
+    size_t      size;           /* Response size */
+    int         parts;          /* Expected count of parts */
+} bench_http_ctx;
+
+/* Decode HTTP response
+ */
+static void
+bench_http_decode (void *arg)
+{
+    bench_http_ctx *ctx = arg;
+    http_uri       *uri = http_uri_new("http://localhost", false);
+    http_query     *q = http_query_new(ctx->client, uri, "GET", NULL, NULL);
+    error          err;
+
+    err = http_query_test_decode_response(q, ctx->data, ctx->size);
+    if (err != NULL) {
+        fail("http response: %s", ESTRING(err));
+    }
+
+    if (http_query_get_mp_response_count(q) != ctx->parts) {
+        fail("http response: %d parts decoded, %d expected",
+            http_query_get_mp_response_count(q), ctx->parts);
+    }
+
+    http_query_test_free(q);
+}
+
+/* Make HTTP response. If parts is not 0, the response is the
+ * WSD-style MTOM multipart, otherwise it is a plain image
+ */
+static void
+bench_http_make (bench_http_ctx *ctx, int parts, size_t image_size)
+{
+    static const char boundary[] = "uuid:2d4e0f3a-9c3b-4b3e-8d1e-5a5b5c5d5e5f";
+    char              *body = str_new();
+    char              *image = mem_new(char, image_size);
+    size_t            i;
+    int               part;
+
+    for (i = 0; i < image_size; i ++) {
+        image[i] = (char) (i * 2654435761u >> 24);
+    }
+
+    for (part = 0; part < parts; part ++) {
+        body = str_append_printf(body,
+            "--%s\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Transfer-Encoding: binary\r\n"
+            "Content-ID: <part%d@bench>\r\n"
+            "\r\n",
+            boundary,
+            part ? "application/binary" : "application/xop+xml;"
+                " charset=UTF-8; type=\"application/soap+xml\"",
+            part);
+
+        if (part == 0) {
+            body = str_append(body, "<soap:Envelope/>");
+        } else {
+            body = str_append_mem(body, image, image_size);
+        }
+
+        body = str_append(body, "\r\n");
+    }
+
+    if (parts != 0) {
+        body = str_append_printf(body, "--%s--\r\n", boundary);
+    } else {
+        body = str_append_mem(body, image, image_size);
+    }
+
+    ctx->data = str_printf(
+        "HTTP/1.1 200 OK\r\n"
+        "Server: bench\r\n"
+        "Date: Thu, 01 Jan 2026 00:00:00 GMT\r\n"
+        "Content-Type: %s%s%s\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n"
+        "\r\n",
+        parts ? "multipart/related; type=\"application/xop+xml\";"
+            " start=\"<part0@bench>\"; start-info=\"application/soap+xml\";"
+            " boundary=\"" : "image/jpeg",
+        parts ? boundary : "",
+        parts ? "\"" : "",
+        mem_len(body));
+
+    ctx->data = str_append_mem(ctx->data, body, mem_len(body));
+    ctx->size = mem_len(ctx->data);
+    ctx->parts = parts;
+
+    mem_free(body);
+    mem_free(image);
+}
+
+/* Parse HTTP header
+ */
+static void
+bench_http_hdr (void *arg)
+{
+    bench_http_ctx *ctx = arg;
+    error          err = http_hdr_test_parse(ctx->data, ctx->size);
+
+    if (err != NULL) {
+        fail("http header: %s", ESTRING(err));
+    }
+}
+
+/* Run HTTP benchmarks
+ */
+static void
+bench_http (void)
+{
+    static const size_t sizes[] = {4096, 1048576};
+    bench_http_ctx      ctx;
+    size_t              i;
+    char                name[64];
+
+    ctx.client = http_client_new(NULL, NULL);
+
+    /* Plain and multipart responses of the same size; the difference
+     * is the cost of http_multipart_parse()
+     */
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i ++) {
+        sprintf(name, "plain-%zu", sizes[i]);
+        bench_http_make(&ctx, 0, sizes[i]);
+        bench_measure("http_decode_response", name, ctx.size,
+            sizes[i] < 65536 ? 20000 : 500, bench_http_decode, &ctx);
+        mem_free(ctx.data);
+
+        sprintf(name, "multipart-%zu", sizes[i]);
+        bench_http_make(&ctx, 2, sizes[i]);
+        bench_measure("http_decode_response", name, ctx.size,
+            sizes[i] < 65536 ? 20000 : 500, bench_http_decode, &ctx);
+        mem_free(ctx.data);
+    }
+
+    /* Header block, typical for the eSCL response */
+    ctx.data = str_dup(
+        "Server: HP HTTP Server; HP Color LaserJet MFP M281fdw\r\n"
+        "Content-Type: text/xml\r\n"
+        "Content-Length: 5871\r\n"
+        "Cache-Control: must-revalidate, max-age=0\r\n"
+        "Pragma: no-cache\r\n"
+        "Location: http://192.168.1.10:8080/eSCL/ScanJobs/1234\r\n"
+        "Connection: close\r\n"
+        "\r\n");
+    ctx.size = mem_len(ctx.data);
+    bench_measure("http_hdr_parse", "escl", ctx.size, 100000,
+        bench_http_hdr, &ctx);
+    mem_free(ctx.data);
+
+    http_client_free(ctx.client);
+}
+
+/* URI parsing test cases
+ */
+static const char *bench_uris[][2] = {
+    {"ipv4",  "http://192.168.1.102:8080/eSCL/"},
+    {"ipv6",  "http://[fe80::1234:5678:9abc:def0%252]:80/WebServices/ScannerService"},
+    {"host",  "https://scanner.example.com/eSCL/ScannerCapabilities?x=1#frag"},
+    {"unix",  "unix://scanner.sock/eSCL/"}
+};
+
+/* Parse URI
+ */
+static void
+bench_uri_new (void *arg)
+{
+    http_uri *uri = http_uri_new(arg, true);
+
+    if (uri == NULL) {
+        fail("http_uri_new(%s): failed", (const char*) arg);
+    }
+
+    http_uri_free(uri);
+}
+
+/* Resolve relative URI
+ */
+static void
+bench_uri_new_relative (void *arg)
+{
+    http_uri **base = arg;
+    http_uri *uri = http_uri_new_relative(*base,
+        "/eSCL/ScanJobs/f1a3b5c7-0123-4567-89ab-cdef01234567", true, false);
+
+    if (uri == NULL) {
+        fail("http_uri_new_relative(): failed");
+    }
+
+    http_uri_free(uri);
+}
+
+/* Run URI benchmarks
+ */
+static void
+bench_uri (void)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(bench_uris) / sizeof(bench_uris[0]); i ++) {
+        http_uri *base = http_uri_new(bench_uris[i][1], true);
+
+        bench_measure("http_uri_new", bench_uris[i][0], 0, 100000,
+            bench_uri_new, (void*) bench_uris[i][1]);
+        bench_measure("http_uri_new_relative", bench_uris[i][0], 0, 100000,
+            bench_uri_new_relative, &base);
+
+        http_uri_free(base);
+    }
+}
+
+/******************** XML kernels ********************/
+/* eSCL ScannerCapabilities, modeled after a typical MFP
+ */
+static const char bench_escl_caps_head[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<scan:ScannerCapabilities"
+    " xmlns:pwg=\"http://www.pwg.org/schemas/2010/12/sm\""
+    " xmlns:scan=\"http://schemas.hp.com/imaging/escl/2011/05/03\">\n"
+    "  <pwg:Version>2.63</pwg:Version>\n"
+    "  <pwg:MakeAndModel>Bench MFP 1000</pwg:MakeAndModel>\n"
+    "  <pwg:SerialNumber>BENCH0001</pwg:SerialNumber>\n"
+    "  <scan:UUID>4509a320-00a0-008f-00b6-002507510eca</scan:UUID>\n"
+    "  <scan:AdminURI>http://192.168.1.10/</scan:AdminURI>\n"
+    "  <scan:Manufacturer>Bench</scan:Manufacturer>\n";
+
+static const char bench_escl_caps_source[] =
+    "      <scan:MinWidth>16</scan:MinWidth>\n"
+    "      <scan:MaxWidth>2550</scan:MaxWidth>\n"
+    "      <scan:MinHeight>16</scan:MinHeight>\n"
+    "      <scan:MaxHeight>3508</scan:MaxHeight>\n"
+    "      <scan:MaxScanRegions>1</scan:MaxScanRegions>\n"
+    "      <scan:SettingProfiles>\n"
+    "        <scan:SettingProfile>\n"
+    "          <scan:ColorModes>\n"
+    "            <scan:ColorMode>BlackAndWhite1</scan:ColorMode>\n"
+    "            <scan:ColorMode>Grayscale8</scan:ColorMode>\n"
+    "            <scan:ColorMode>RGB24</scan:ColorMode>\n"
+    "          </scan:ColorModes>\n"
+    "          <scan:DocumentFormats>\n"
+    "            <pwg:DocumentFormat>application/pdf</pwg:DocumentFormat>\n"
+    "            <pwg:DocumentFormat>image/jpeg</pwg:DocumentFormat>\n"
+    "            <pwg:DocumentFormat>image/png</pwg:DocumentFormat>\n"
+    "            <scan:DocumentFormatExt>application/pdf</scan:DocumentFormatExt>\n"
+    "            <scan:DocumentFormatExt>image/jpeg</scan:DocumentFormatExt>\n"
+    "            <scan:DocumentFormatExt>image/png</scan:DocumentFormatExt>\n"
+    "          </scan:DocumentFormats>\n"
+    "          <scan:SupportedResolutions>\n"
+    "            <scan:DiscreteResolutions>\n"
+    "              <scan:DiscreteResolution><scan:XResolution>75</scan:XResolution><scan:YResolution>75</scan:YResolution></scan:DiscreteResolution>\n"
+    "              <scan:DiscreteResolution><scan:XResolution>100</scan:XResolution><scan:YResolution>100</scan:YResolution></scan:DiscreteResolution>\n"
+    "              <scan:DiscreteResolution><scan:XResolution>150</scan:XResolution><scan:YResolution>150</scan:YResolution></scan:DiscreteResolution>\n"
+    "              <scan:DiscreteResolution><scan:XResolution>200</scan:XResolution><scan:YResolution>200</scan:YResolution></scan:DiscreteResolution>\n"
+    "              <scan:DiscreteResolution><scan:XResolution>300</scan:XResolution><scan:YResolution>300</scan:YResolution></scan:DiscreteResolution>\n"
+    "              <scan:DiscreteResolution><scan:XResolution>600</scan:XResolution><scan:YResolution>600</scan:YResolution></scan:DiscreteResolution>\n"
+    "            </scan:DiscreteResolutions>\n"
+    "          </scan:SupportedResolutions>\n"
+    "        </scan:SettingProfile>\n"
+    "      </scan:SettingProfiles>\n"
+    "      <scan:SupportedIntents>\n"
+    "        <scan:Intent>Document</scan:Intent>\n"
+    "        <scan:Intent>TextAndGraphic</scan:Intent>\n"
+    "        <scan:Intent>Photo</scan:Intent>\n"
+    "        <scan:Intent>Preview</scan:Intent>\n"
+    "      </scan:SupportedIntents>\n"
+    "      <scan:MaxOpticalXResolution>600</scan:MaxOpticalXResolution>\n"
+    "      <scan:MaxOpticalYResolution>600</scan:MaxOpticalYResolution>\n"
+    "      <scan:RiskyLeftMargin>0</scan:RiskyLeftMargin>\n"
+    "      <scan:RiskyRightMargin>0</scan:RiskyRightMargin>\n"
+    "      <scan:RiskyTopMargin>0</scan:RiskyTopMargin>\n"
+    "      <scan:RiskyBottomMargin>0</scan:RiskyBottomMargin>\n";
+
+static const char bench_escl_caps_tail[] =
+    "  <scan:CompressionFactorSupport>\n"
+    "    <scan:Min>0</scan:Min>\n"
+    "    <scan:Max>100</scan:Max>\n"
+    "    <scan:Normal>25</scan:Normal>\n"
+    "    <scan:Step>1</scan:Step>\n"
+    "  </scan:CompressionFactorSupport>\n"
+    "  <scan:BrightnessSupport><scan:Min>0</scan:Min><scan:Max>2000</scan:Max>"
+    "<scan:Normal>1000</scan:Normal><scan:Step>1</scan:Step></scan:BrightnessSupport>\n"
+    "</scan:ScannerCapabilities>\n";
+
+/* WSD ScannerConfiguration, modeled after a typical MFP
+ */
+static const char bench_wsd_caps_head[] =
+    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<soap:Envelope xmlns:soap=\"http://www.w3.org/2003/05/soap-envelope\""
+    " xmlns:wsa=\"http://schemas.xmlsoap.org/ws/2004/08/addressing\""
+    " xmlns:sca=\"http://schemas.microsoft.com/windows/2006/08/wdp/scan\">\n"
+    "<soap:Header>\n"
+    "  <wsa:To>http://schemas.xmlsoap.org/ws/2004/08/addressing/role/anonymous</wsa:To>\n"
+    "  <wsa:Action>http://schemas.microsoft.com/windows/2006/08/wdp/scan/GetScannerElementsResponse</wsa:Action>\n"
+    "  <wsa:MessageID>urn:uuid:5fd3c2a0-1b1e-4b2e-9e6e-000000000001</wsa:MessageID>\n"
+    "  <wsa:RelatesTo>urn:uuid:5fd3c2a0-1b1e-4b2e-9e6e-000000000000</wsa:RelatesTo>\n"
+    "</soap:Header>\n"
+    "<soap:Body><sca:GetScannerElementsResponse><sca:ScannerElements>\n"
+    "<sca:ElementData Name=\"sca:ScannerConfiguration\" Valid=\"true\">\n"
+    "<sca:ScannerConfiguration>\n"
+    "  <sca:DeviceSettings>\n"
+    "    <sca:FormatsSupported>\n"
+    "      <sca:FormatValue>jfif</sca:FormatValue>\n"
+    "      <sca:FormatValue>pdf-a</sca:FormatValue>\n"
+    "      <sca:FormatValue>png</sca:FormatValue>\n"
+    "      <sca:FormatValue>tiff-single-uncompressed</sca:FormatValue>\n"
+    "      <sca:FormatValue>dib</sca:FormatValue>\n"
+    "    </sca:FormatsSupported>\n"
+    "    <sca:CompressionQualityFactorSupported><sca:MinValue>1</sca:MinValue>"
+    "<sca:MaxValue>100</sca:MaxValue></sca:CompressionQualityFactorSupported>\n"
+    "    <sca:ContentTypesSupported>\n"
+    "      <sca:ContentTypeValue>Auto</sca:ContentTypeValue>\n"
+    "      <sca:ContentTypeValue>Text</sca:ContentTypeValue>\n"
+    "      <sca:ContentTypeValue>Photo</sca:ContentTypeValue>\n"
+    "      <sca:ContentTypeValue>Mixed</sca:ContentTypeValue>\n"
+    "    </sca:ContentTypesSupported>\n"
+    "    <sca:DocumentSizeAutoDetectSupported>false</sca:DocumentSizeAutoDetectSupported>\n"
+    "    <sca:AutoExposureSupported>false</sca:AutoExposureSupported>\n"
+    "    <sca:BrightnessSupported>true</sca:BrightnessSupported>\n"
+    "    <sca:ContrastSupported>true</sca:ContrastSupported>\n"
+    "    <sca:ScalingRangeSupported><sca:ScalingWidth><sca:MinValue>100</sca:MinValue>"
+    "<sca:MaxValue>100</sca:MaxValue></sca:ScalingWidth><sca:ScalingHeight>"
+    "<sca:MinValue>100</sca:MinValue><sca:MaxValue>100</sca:MaxValue>"
+    "</sca:ScalingHeight></sca:ScalingRangeSupported>\n"
+    "    <sca:RotationsSupported><sca:RotationValue>0</sca:RotationValue></sca:RotationsSupported>\n"
+    "  </sca:DeviceSettings>\n";
+
+static const char bench_wsd_caps_source[] =
+    "    <sca:%sOpticalResolution><sca:Width>600</sca:Width>"
+    "<sca:Height>600</sca:Height></sca:%sOpticalResolution>\n"
+    "    <sca:%sResolutions>\n"
+    "      <sca:Widths><sca:Width>75</sca:Width><sca:Width>100</sca:Width>"
+    "<sca:Width>150</sca:Width><sca:Width>200</sca:Width>"
+    "<sca:Width>300</sca:Width><sca:Width>600</sca:Width></sca:Widths>\n"
+    "      <sca:Heights><sca:Height>75</sca:Height><sca:Height>100</sca:Height>"
+    "<sca:Height>150</sca:Height><sca:Height>200</sca:Height>"
+    "<sca:Height>300</sca:Height><sca:Height>600</sca:Height></sca:Heights>\n"
+    "    </sca:%sResolutions>\n"
+    "    <sca:%sColor><sca:ColorEntry>BlackAndWhite1</sca:ColorEntry>"
+    "<sca:ColorEntry>Grayscale8</sca:ColorEntry>"
+    "<sca:ColorEntry>RGB24</sca:ColorEntry></sca:%sColor>\n"
+    "    <sca:%sMinimumSize><sca:Width>500</sca:Width>"
+    "<sca:Height>500</sca:Height></sca:%sMinimumSize>\n"
+    "    <sca:%sMaximumSize><sca:Width>8500</sca:Width>"
+    "<sca:Height>11690</sca:Height></sca:%sMaximumSize>\n";
+
+static const char bench_wsd_caps_tail[] =
+    "</sca:ScannerConfiguration>\n"
+    "</sca:ElementData>\n"
+    "</sca:ScannerElements></sca:GetScannerElementsResponse></soap:Body>\n"
+    "</soap:Envelope>\n";
+
+/* Build eSCL ScannerCapabilities document
+ */
+static char*
+bench_escl_caps (void)
+{
+    char *s = str_dup(bench_escl_caps_head);
+
+    s = str_append(s, "  <scan:Platen>\n    <scan:PlatenInputCaps>\n");
+    s = str_append(s, bench_escl_caps_source);
+    s = str_append(s, "    </scan:PlatenInputCaps>\n  </scan:Platen>\n");
+
+    s = str_append(s, "  <scan:Adf>\n    <scan:AdfSimplexInputCaps>\n");
+    s = str_append(s, bench_escl_caps_source);
+    s = str_append(s, "    </scan:AdfSimplexInputCaps>\n");
+    s = str_append(s, "    <scan:AdfDuplexInputCaps>\n");
+    s = str_append(s, bench_escl_caps_source);
+    s = str_append(s, "    </scan:AdfDuplexInputCaps>\n");
+    s = str_append(s, "    <scan:FeederCapacity>50</scan:FeederCapacity>\n");
+    s = str_append(s, "    <scan:Justification>\n"
+        "      <pwg:XImagePosition>Center</pwg:XImagePosition>\n"
+        "      <pwg:YImagePosition>Top</pwg:YImagePosition>\n"
+        "    </scan:Justification>\n");
+    s = str_append(s, "  </scan:Adf>\n");
+
+    return str_append(s, bench_escl_caps_tail);
+}
+
+/* Build WSD ScannerConfiguration document
+ */
+static char*
+bench_wsd_caps (void)
+{
+    char       *s = str_dup(bench_wsd_caps_head);
+    const char *p = "Platen", *a = "ADF";
+
+    s = str_append(s, "  <sca:Platen>\n");
+    s = str_append_printf(s, bench_wsd_caps_source,
+        p, p, p, p, p, p, p, p, p, p);
+    s = str_append(s, "  </sca:Platen>\n");
+
+    s = str_append(s, "  <sca:ADF>\n"
+        "    <sca:ADFSupportsDuplex>true</sca:ADFSupportsDuplex>\n"
+        "    <sca:ADFFront>\n");
+    s = str_append_printf(s, bench_wsd_caps_source,
+        a, a, a, a, a, a, a, a, a, a);
+    s = str_append(s, "    </sca:ADFFront>\n    <sca:ADFBack>\n");
+    s = str_append_printf(s, bench_wsd_caps_source,
+        a, a, a, a, a, a, a, a, a, a);
+    s = str_append(s, "    </sca:ADFBack>\n  </sca:ADF>\n");
+
+    return str_append(s, bench_wsd_caps_tail);
+}
+
+/* Context for XML benchmarks
+ */
+typedef struct {
+    const char    *name;        /* Document name */
+    char          *xml;         /* XML document */
+    proto_handler *proto;       /* Protocol handler */
+} bench_xml_ctx;
+
+/* Walk all XML nodes
+ */
+static void
+bench_xml_walk (void *arg)
+{
+    bench_xml_ctx *ctx = arg;
+    xml_rd        *xml;
+    error         err;
+    size_t        len = 0;
+
+    err = xml_rd_begin(&xml, ctx->xml, mem_len(ctx->xml), NULL);
+    if (err != NULL) {
+        fail("%s: %s", ctx->name, ESTRING(err));
+    }
+
+    while (!xml_rd_end(xml)) {
+        len += strlen(xml_rd_node_path(xml));
+        len += strlen(xml_rd_node_value(xml));
+        xml_rd_deep_next(xml, 0);
+    }
+
+    xml_rd_finish(&xml);
+
+    if (len == 0) {
+        fail("%s: empty document", ctx->name);
+    }
+}
+
+/* Decode device capabilities
+ */
+static void
+bench_xml_devcaps (void *arg)
+{
+    bench_xml_ctx *ctx = arg;
+    devcaps       caps;
+    error         err;
+
+    memset(&caps, 0, sizeof(caps));
+    devcaps_init(&caps);
+    err = ctx->proto->test_decode_devcaps(ctx->proto,
+        ctx->xml, mem_len(ctx->xml), &caps);
+    if (err != NULL) {
+        fail("%s: %s", ctx->name, ESTRING(err));
+    }
+
+    devcaps_cleanup(&caps);
+}
+
+/* Run XML benchmarks
+ */
+static void
+bench_xml (void)
+{
+    bench_xml_ctx docs[] = {
+        {"escl-caps", bench_escl_caps(), proto_handler_escl_new()},
+        {"wsd-caps",  bench_wsd_caps(),  proto_handler_wsd_new()}
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(docs) / sizeof(docs[0]); i ++) {
+        bench_measure("xml_rd_walk", docs[i].name, mem_len(docs[i].xml), 2000,
+            bench_xml_walk, &docs[i]);
+        bench_measure("devcaps_decode", docs[i].name, mem_len(docs[i].xml),
+            2000, bench_xml_devcaps, &docs[i]);
+
+        proto_handler_free(docs[i].proto);
+        mem_free(docs[i].xml);
+    }
+}
+
+/* The main function
+ */
+int
+main (void)
+{
+    log_init();
+    log_configure();
+
+    bench_line_kernels();
+    bench_image_decoders();
+    bench_http();
+    bench_uri();
+    bench_xml();
+
+    return 0;
+}
+
+/* vim:ts=8:sw=4:et
+ */
@@ -0,0 +1,853 @@
+/* Offline protocol replay benchmark
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * This benchmark loads protocol traces, written by airscan-trace.c
+ * (the .log file and the .tar archive of binary bodies next to it),
+ * and scans from the traced device via the public SANE API, while
+ * all HTTP queries are answered with the recorded responses via the
+ * test HTTP transport, without any network I/O.
+ *
+ * So the real protocol handlers, device state machine and image
+ * decoders run against captures from the real devices, as fast as
+ * the recorded session allows, and CPU time per page can be compared
+ * between builds.
+ *
+ * Usage: bench-replay [options] trace.log ...
+ *   -n runs            replay each trace N times (default: 1)
+ *   -P escl|wsd        protocol (default: guessed from the first query)
+ *   -u uri             device URI (default: taken from the first query)
+ *   -S source          scan source, SANE option value (default: device's)
+ *   -m mode            scan mode, SANE option value (default: device's)
+ *   -r dpi             resolution (default: device's)
+ *   -T dir             write protocol trace of the replay into dir
+ *
+ * Recorded responses are matched to queries by method, URI path and,
+ * for SOAP requests, by WS-Addressing Action. Responses with the same
+ * key are replayed in the recorded order; when they are exhausted, the
+ * last one is repeated (so extra status polls are answered). Queries,
+ * that have no recorded response at all, fail with transport error
+ * and are counted as unmatched.
+ *
+ * Scan parameters are not recovered from the trace, so use -S, -m
+ * and -r to match the recorded session. The scan continues until
+ * SANE_STATUS_NO_DOCS for ADF sources, flatbed scans are one page.
+ *
+ * Output format is one line per trace:
+ *   <trace> <pages> <MB/s> <wall ms/page> <CPU ms/page> <unmatched>
+ *
+ * Wall time includes pauses, the backend makes on its own (i.e.,
+ * retry delays), so CPU time is the better metric for comparison.
+ */
+
+#include "airscan.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+
+/* Recorded HTTP exchange
+ */
+typedef struct {
+    char *method;       /* Request method */
+    char *uri;          /* Request URI, as recorded */
+    char *path;         /* Request URI path, for matching */
+    char *action;       /* SOAP action or NULL, for matching */
+    char *err;          /* Transport error or NULL */
+    char *response;     /* Raw HTTP response, if err == NULL */
+    bool used;          /* Already replayed */
+} replay_exchange;
+
+/* Entry of the .tar archive
+ */
+typedef struct {
+    const char *name;   /* File name */
+    const char *data;   /* File data */
+    size_t     size;    /* File size */
+} replay_tar_entry;
+
+/* Loaded trace
+ */
+typedef struct {
+    char             *log;        /* Content of the .log file */
+    char             *tar;        /* Content of the .tar file */
+    replay_tar_entry *tar_files;  /* Files in the .tar */
+    replay_exchange  *exchanges;  /* Recorded exchanges */
+} replay_trace;
+
+/* Benchmark configuration
+ */
+static int        bench_runs = 1;
+static const char *bench_proto;
+static const char *bench_uri;
+static const char *bench_source;
+static const char *bench_mode;
+static int        bench_resolution;
+static const char *bench_trace_dir;
+
+/* Replay state
+ */
+static char                  bench_dir[] = "/tmp/bench-replay-XXXXXX";
+static replay_trace          *replay_current;
+static volatile unsigned int replay_unmatched;
+
+/* Print error message and exit
+ */
+static void
+fail (const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    putchar('\n');
+    exit(1);
+}
+
+/* Get monotonic time, in nanoseconds
+ */
+static uint64_t
+bench_now (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+/* Get CPU time, consumed by the process, in nanoseconds
+ */
+static uint64_t
+bench_cpu (void)
+{
+    struct rusage ru;
+    uint64_t      t;
+
+    getrusage(RUSAGE_SELF, &ru);
+    t = (uint64_t) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000;
+    t += (uint64_t) (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000;
+
+    return t;
+}
+
+/******************** Trace loading ********************/
+/* Load entire file into memory. Returns NULL on error
+ */
+static char*
+replay_load_file (const char *path)
+{
+    FILE   *fp = fopen(path, "rb");
+    char   *data, buf[65536];
+    size_t n;
+
+    if (fp == NULL) {
+        return NULL;
+    }
+
+    data = str_new();
+    while ((n = fread(buf, 1, sizeof(buf), fp)) != 0) {
+        data = str_append_mem(data, buf, n);
+    }
+
+    fclose(fp);
+
+    return data;
+}
+
+/* Parse the .tar archive
+ */
+static void
+replay_parse_tar (replay_trace *t)
+{
+    size_t off = 0, len = mem_len(t->tar);
+
+    t->tar_files = mem_new(replay_tar_entry, 0);
+
+    while (off + 512 <= len) {
+        char             *hdr = t->tar + off;
+        replay_tar_entry ent;
+        char             size[13];
+
+        if (hdr[0] == '\0') {
+            break; /* Footer */
+        }
+
+        memcpy(size, hdr + 124, 12);
+        size[12] = '\0';
+
+        hdr[99] = '\0';
+        ent.name = hdr;
+        ent.data = hdr + 512;
+        ent.size = (size_t) strtoul(size, NULL, 8);
+
+        if (off + 512 + ent.size > len) {
+            break; /* Truncated */
+        }
+
+        t->tar_files = mem_resize(t->tar_files,
+            mem_len(t->tar_files) + 1, 0);
+        t->tar_files[mem_len(t->tar_files) - 1] = ent;
+
+        off += 512 + ((ent.size + 511) & ~(size_t) 511);
+    }
+}
+
+/* Lookup file in the .tar archive
+ */
+static const replay_tar_entry*
+replay_tar_lookup (const replay_trace *t, const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < mem_len(t->tar_files); i ++) {
+        if (!strcmp(t->tar_files[i].name, name)) {
+            return &t->tar_files[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Extract WS-Addressing Action from the SOAP message.
+ * Returns NULL, if not found
+ */
+static char*
+replay_soap_action (const char *msg)
+{
+    const char *s = msg, *end;
+
+    while ((s = strstr(s, "Action")) != NULL) {
+        if (s != msg && (s[-1] == ':' || s[-1] == '<') &&
+            (s[6] == '>' || s[6] == ' ')) {
+            s = strchr(s, '>');
+            end = s ? strchr(s, '<') : NULL;
+            if (end != NULL) {
+                char *action = str_append_mem(str_new(), s + 1, end - s - 1);
+                str_trim(action);
+                return action;
+            }
+            return NULL;
+        }
+        s += 6;
+    }
+
+    return NULL;
+}
+
+/* Check if trace log line is not a part of the message body:
+ * a separator, log message, error note or a hex dump
+ */
+static bool
+replay_line_is_foreign (const char *line)
+{
+    unsigned int h, m, s, ms;
+    char         c;
+
+    if (str_has_prefix(line, "=====") || !strcmp(line, "---")) {
+        return true;
+    }
+
+    if (sscanf(line, "%2u:%2u:%2u.%3u%c", &h, &m, &s, &ms, &c) == 5 &&
+        c == ':') {
+        return true;
+    }
+
+    if ((line[0] == '<' || line[0] == '>') && line[1] == ' ' &&
+        sscanf(line + 2, "%4x%c", &h, &c) == 2 && c == ':') {
+        return true;
+    }
+
+    return false;
+}
+
+/* Join lines [beg, end) into the single string
+ */
+static char*
+replay_join_lines (char **lines, size_t beg, size_t end)
+{
+    char *s = str_new();
+
+    for (; beg < end; beg ++) {
+        s = str_append(s, lines[beg]);
+        s = str_append_c(s, '\n');
+    }
+
+    return s;
+}
+
+/* Parse one recorded exchange, starting after the separator line.
+ * Returns index of the next line to parse
+ */
+static size_t
+replay_parse_exchange (replay_trace *t, char **lines, size_t i)
+{
+    size_t          n = mem_len(lines), beg;
+    replay_exchange ex;
+    char            *s, *body;
+    http_uri        *uri;
+    int             status;
+
+    memset(&ex, 0, sizeof(ex));
+
+    /* Request line */
+    if (i == n || (s = strchr(lines[i], ' ')) == NULL) {
+        return i;
+    }
+
+    ex.method = str_append_mem(str_new(), lines[i], s - lines[i]);
+    ex.uri = str_dup(s + 1);
+    i ++;
+
+    /* Request header and body. We need only the SOAP action */
+    beg = i;
+    while (i < n && !str_has_prefix(lines[i], "Status: ") &&
+           !str_has_prefix(lines[i], "Error: ")) {
+        i ++;
+    }
+
+    if (i == n) {
+        goto DROP; /* Truncated trace */
+    }
+
+    body = replay_join_lines(lines, beg, i);
+    ex.action = replay_soap_action(body);
+    mem_free(body);
+
+    /* Transport error */
+    if (str_has_prefix(lines[i], "Error: ")) {
+        ex.err = str_dup(lines[i] + 7);
+        i ++;
+        goto DONE;
+    }
+
+    /* Status line */
+    status = atoi(lines[i] + 8);
+    s = strchr(lines[i] + 8, ' ');
+    ex.response = str_printf("HTTP/1.1 %d %s\r\n", status, s ? s + 1 : "");
+    i ++;
+
+    /* Response header. Message framing is replaced, because body
+     * is saved already decoded
+     */
+    for (; i < n && lines[i][0] != '\0'; i ++) {
+        if (!strncasecmp(lines[i], "Content-Length:", 15) ||
+            !strncasecmp(lines[i], "Transfer-Encoding:", 18) ||
+            !strncasecmp(lines[i], "Connection:", 11)) {
+            continue;
+        }
+
+        ex.response = str_append(ex.response, lines[i]);
+        ex.response = str_append(ex.response, "\r\n");
+    }
+
+    if (i < n) {
+        i ++;
+    }
+
+    /* Response body */
+    body = NULL;
+    if (i < n) {
+        unsigned long size;
+        char          name[101];
+
+        if (sscanf(lines[i], "%lu bytes of data saved as %100s",
+            &size, name) == 2) {
+            const replay_tar_entry *ent = replay_tar_lookup(t, name);
+
+            if (ent == NULL || ent->size != size) {
+                printf("%s: missing in the .tar, exchange skipped\n", name);
+                goto DROP;
+            }
+
+            body = str_append_mem(str_new(), ent->data, ent->size);
+            i ++;
+        } else if (!replay_line_is_foreign(lines[i])) {
+            /* Text body ends by the empty line, followed by
+             * something, that is not a part of the body
+             */
+            for (beg = i; i < n; i ++) {
+                if (lines[i][0] == '\0' &&
+                    (i + 1 == n || replay_line_is_foreign(lines[i + 1]))) {
+                    break;
+                }
+            }
+
+            body = replay_join_lines(lines, beg, i);
+        }
+    }
+
+    ex.response = str_append_printf(ex.response,
+        "Content-Length: %zu\r\n\r\n", body ? mem_len(body) : 0);
+    if (body != NULL) {
+        ex.response = str_append_mem(ex.response, body, mem_len(body));
+        mem_free(body);
+    }
+
+DONE:
+    uri = http_uri_new(ex.uri, true);
+    if (uri == NULL) {
+        goto DROP;
+    }
+
+    ex.path = str_dup(http_uri_get_path(uri));
+    http_uri_free(uri);
+
+    t->exchanges = mem_resize(t->exchanges, mem_len(t->exchanges) + 1, 0);
+    t->exchanges[mem_len(t->exchanges) - 1] = ex;
+
+    return i;
+
+DROP:
+    mem_free(ex.method);
+    mem_free(ex.uri);
+    mem_free(ex.action);
+    mem_free(ex.err);
+    mem_free(ex.response);
+
+    return i;
+}
+
+/* Load the trace
+ */
+static replay_trace*
+replay_load (const char *path)
+{
+    replay_trace *t = mem_new(replay_trace, 1);
+    char         *tar_path, **lines, *s, *next;
+    size_t       i;
+
+    /* Load files */
+    t->log = replay_load_file(path);
+    if (t->log == NULL) {
+        fail("%s: %s", path, strerror(errno));
+    }
+
+    tar_path = str_dup(path);
+    if (str_has_suffix(tar_path, ".log")) {
+        tar_path = str_resize(tar_path, mem_len(tar_path) - 4);
+    }
+    tar_path = str_append(tar_path, ".tar");
+
+    t->tar = replay_load_file(tar_path);
+    if (t->tar == NULL) {
+        t->tar = str_new(); /* Trace without binary data */
+    }
+
+    mem_free(tar_path);
+    replay_parse_tar(t);
+
+    /* Split log into lines */
+    lines = ptr_array_new(char*);
+    for (s = t->log; *s != '\0'; s = next) {
+        next = strchr(s, '\n');
+        if (next != NULL) {
+            *next ++ = '\0';
+        } else {
+            next = s + strlen(s);
+        }
+
+        lines = ptr_array_append(lines, s);
+    }
+
+    /* Parse exchanges */
+    t->exchanges = mem_new(replay_exchange, 0);
+    for (i = 0; i < mem_len(lines); ) {
+        if (!strcmp(lines[i], "==============================")) {
+            i = replay_parse_exchange(t, lines, i + 1);
+        } else {
+            i ++;
+        }
+    }
+
+    mem_free(lines);
+
+    if (mem_len(t->exchanges) == 0) {
+        fail("%s: no HTTP exchanges found", path);
+    }
+
+    return t;
+}
+
+/* Free the trace
+ */
+static void
+replay_free (replay_trace *t)
+{
+    size_t i;
+
+    for (i = 0; i < mem_len(t->exchanges); i ++) {
+        replay_exchange *ex = &t->exchanges[i];
+
+        mem_free(ex->method);
+        mem_free(ex->uri);
+        mem_free(ex->path);
+        mem_free(ex->action);
+        mem_free(ex->err);
+        mem_free(ex->response);
+    }
+
+    mem_free(t->exchanges);
+    mem_free(t->tar_files);
+    mem_free(t->tar);
+    mem_free(t->log);
+    mem_free(t);
+}
+
+/******************** Test transport ********************/
+/* Check if recorded exchange matches the query
+ */
+static bool
+replay_match (const replay_exchange *ex, const char *method,
+        const char *path, const char *action)
+{
+    if (strcmp(ex->method, method) || strcmp(ex->path, path)) {
+        return false;
+    }
+
+    if (ex->action == NULL || action == NULL) {
+        return ex->action == action;
+    }
+
+    return !strcmp(ex->action, action);
+}
+
+/* The test HTTP transport: answer query with the recorded response
+ */
+static error
+replay_transport (void *ptr, http_query *q, const void **data, size_t *size)
+{
+    replay_trace    *t = replay_current;
+    replay_exchange *found = NULL;
+    http_data       *rq = http_query_get_request_data(q);
+    const char      *method = http_query_method(q);
+    const char      *path = http_uri_get_path(http_query_uri(q));
+    char            *action = NULL;
+    size_t          i;
+
+    (void) ptr;
+
+    if (rq != NULL && rq->size != 0) {
+        char *body = str_append_mem(str_new(), rq->bytes, rq->size);
+        action = replay_soap_action(body);
+        mem_free(body);
+    }
+
+    /* First unused response with the same key, or the last one,
+     * if all are used
+     */
+    for (i = 0; i < mem_len(t->exchanges); i ++) {
+        replay_exchange *ex = &t->exchanges[i];
+
+        if (replay_match(ex, method, path, action)) {
+            found = ex;
+            if (!ex->used) {
+                break;
+            }
+        }
+    }
+
+    mem_free(action);
+
+    if (found == NULL) {
+        __sync_fetch_and_add(&replay_unmatched, 1);
+        return ERROR("replay: no recorded response");
+    }
+
+    found->used = true;
+    if (found->err != NULL) {
+        return ERROR(found->err);
+    }
+
+    *data = found->response;
+    *size = mem_len(found->response);
+
+    return NULL;
+}
+
+/******************** Benchmark ********************/
+/* Find option by name. Returns 0, if not found
+ */
+static SANE_Int
+bench_option_find (SANE_Handle handle, const char *name)
+{
+    const SANE_Option_Descriptor *desc;
+    SANE_Int                     i;
+
+    for (i = 1; (desc = sane_get_option_descriptor(handle, i)) != NULL; i ++) {
+        if (desc->name != NULL && !strcmp(desc->name, name)) {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+/* Set string option
+ */
+static void
+bench_option_set_string (SANE_Handle handle, const char *name,
+        const char *value)
+{
+    SANE_Int    opt = bench_option_find(handle, name);
+    char        buf[256] = {0};
+    SANE_Status status;
+
+    strncpy(buf, value, sizeof(buf) - 1);
+    status = sane_control_option(handle, opt, SANE_ACTION_SET_VALUE,
+        buf, NULL);
+    if (opt == 0 || status != SANE_STATUS_GOOD) {
+        fail("%s=%s: %s", name, value, sane_strstatus(status));
+    }
+}
+
+/* Set integer option
+ */
+static void
+bench_option_set_int (SANE_Handle handle, const char *name, SANE_Word value)
+{
+    SANE_Int    opt = bench_option_find(handle, name);
+    SANE_Status status;
+
+    status = sane_control_option(handle, opt, SANE_ACTION_SET_VALUE,
+        &value, NULL);
+    if (opt == 0 || status != SANE_STATUS_GOOD) {
+        fail("%s=%d: %s", name, value, sane_strstatus(status));
+    }
+}
+
+/* Check if current scan source is ADF
+ */
+static bool
+bench_source_is_adf (SANE_Handle handle)
+{
+    SANE_Int opt = bench_option_find(handle, SANE_NAME_SCAN_SOURCE);
+    char     buf[256] = {0};
+
+    sane_control_option(handle, opt, SANE_ACTION_GET_VALUE, buf, NULL);
+
+    return strstr(buf, "ADF") != NULL;
+}
+
+/* Make device ident from the trace
+ */
+static char*
+bench_ident (const replay_trace *t)
+{
+    const replay_exchange *ex = &t->exchanges[0];
+    const char            *proto = bench_proto;
+    char                  *uri, *ident;
+
+    if (proto == NULL) {
+        proto = strcmp(ex->method, "POST") ? "escl" : "wsd";
+    }
+
+    if (bench_uri != NULL) {
+        uri = str_dup(bench_uri);
+    } else if (!strcmp(proto, "escl")) {
+        /* Strip ScannerCapabilities from the devcaps query */
+        const char *s = strrchr(ex->uri, '/');
+        size_t     len = s ? (size_t) (s - ex->uri) + 1 : strlen(ex->uri);
+
+        uri = str_append_mem(str_new(), ex->uri, len);
+    } else {
+        uri = str_dup(ex->uri);
+    }
+
+    ident = str_printf("%s:replay:%s", proto, uri);
+    mem_free(uri);
+
+    return ident;
+}
+
+/* Replay one trace
+ */
+static void
+bench_run (const char *path)
+{
+    replay_trace *t = replay_load(path);
+    char         *ident = bench_ident(t);
+    static char  buf[65536];
+    uint64_t     start, cpu, bytes = 0, pages = 0;
+    double       sec;
+    int          run;
+
+    replay_current = t;
+    replay_unmatched = 0;
+
+    start = bench_now();
+    cpu = bench_cpu();
+
+    for (run = 0; run < bench_runs; run ++) {
+        SANE_Handle handle;
+        SANE_Status status;
+        size_t      i;
+        bool        adf;
+        int         page;
+
+        for (i = 0; i < mem_len(t->exchanges); i ++) {
+            t->exchanges[i].used = false;
+        }
+
+        status = sane_open(ident, &handle);
+        if (status != SANE_STATUS_GOOD) {
+            fail("sane_open(%s): %s", ident, sane_strstatus(status));
+        }
+
+        if (bench_source != NULL) {
+            bench_option_set_string(handle, SANE_NAME_SCAN_SOURCE,
+                bench_source);
+        }
+
+        if (bench_mode != NULL) {
+            bench_option_set_string(handle, SANE_NAME_SCAN_MODE, bench_mode);
+        }
+
+        if (bench_resolution != 0) {
+            bench_option_set_int(handle, SANE_NAME_SCAN_RESOLUTION,
+                bench_resolution);
+        }
+
+        adf = bench_source_is_adf(handle);
+
+        for (page = 0; page == 0 || adf; page ++) {
+            status = sane_start(handle);
+            if (status != SANE_STATUS_GOOD) {
+                if (status != SANE_STATUS_NO_DOCS || page == 0) {
+                    printf("%s: sane_start(): %s\n", path,
+                        sane_strstatus(status));
+                }
+                break;
+            }
+
+            do {
+                SANE_Int len = 0;
+
+                status = sane_read(handle, (SANE_Byte*) buf, sizeof(buf),
+                    &len);
+                bytes += (uint64_t) len;
+            } while (status == SANE_STATUS_GOOD);
+
+            if (status != SANE_STATUS_EOF) {
+                printf("%s: sane_read(): %s\n", path, sane_strstatus(status));
+                break;
+            }
+
+            pages ++;
+        }
+
+        sane_cancel(handle);
+        sane_close(handle);
+    }
+
+    sec = (double) (bench_now() - start) / 1e9;
+    cpu = bench_cpu() - cpu;
+
+    printf("%s %u %.2f %.1f %.1f %u\n", path, (unsigned int) pages,
+        bytes / sec / 1e6, pages ? sec * 1e3 / pages : 0.0,
+        pages ? cpu / 1e6 / pages : 0.0, replay_unmatched);
+    fflush(stdout);
+
+    replay_current = NULL;
+    replay_free(t);
+    mem_free(ident);
+}
+
+/* Write backend configuration
+ */
+static void
+bench_configure (void)
+{
+    char *path;
+    FILE *fp;
+
+    if (mkdtemp(bench_dir) == NULL) {
+        fail("mkdtemp(%s): %s", bench_dir, strerror(errno));
+    }
+
+    path = str_printf("%s/%s", bench_dir, CONFIG_AIRSCAN_CONF);
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        fail("%s: %s", path, strerror(errno));
+    }
+
+    fprintf(fp, "[options]\ndiscovery = disable\n");
+    if (bench_trace_dir != NULL) {
+        fprintf(fp, "[debug]\ntrace = %s\n", bench_trace_dir);
+    }
+
+    fclose(fp);
+    mem_free(path);
+
+    setenv(CONFIG_PATH_ENV, bench_dir, 1);
+}
+
+/* Cleanup backend configuration
+ */
+static void
+bench_unconfigure (void)
+{
+    char *path = str_printf("%s/%s", bench_dir, CONFIG_AIRSCAN_CONF);
+
+    unlink(path);
+    mem_free(path);
+    rmdir(bench_dir);
+}
+
+/* Print usage and exit
+ */
+static void
+usage (void)
+{
+    printf("usage: bench-replay [-n runs] [-P escl|wsd] [-u uri] [-S source]\n"
+           "                    [-m mode] [-r dpi] [-T trace_dir]"
+           " trace.log ...\n");
+    exit(1);
+}
+
+/* The main function
+ */
+int
+main (int argc, char **argv)
+{
+    SANE_Status status;
+    int         c;
+
+    while ((c = getopt(argc, argv, "n:P:u:S:m:r:T:")) != -1) {
+        switch (c) {
+        case 'n': bench_runs = atoi(optarg); break;
+        case 'P': bench_proto = optarg; break;
+        case 'u': bench_uri = optarg; break;
+        case 'S': bench_source = optarg; break;
+        case 'm': bench_mode = optarg; break;
+        case 'r': bench_resolution = atoi(optarg); break;
+        case 'T': bench_trace_dir = optarg; break;
+
+        default:
+            usage();
+        }
+    }
+
+    if (optind == argc || bench_runs < 1 || bench_resolution < 0) {
+        usage();
+    }
+
+    bench_configure();
+    http_test_transport_set(replay_transport, NULL);
+
+    status = sane_init(NULL, NULL);
+    if (status != SANE_STATUS_GOOD) {
+        fail("sane_init(): %s", sane_strstatus(status));
+    }
+
+    for (; optind < argc; optind ++) {
+        bench_run(argv[optind]);
+    }
+
+    sane_exit();
+    bench_unconfigure();
+
+    return 0;
+}
@@ -22,6 +22,9 @@ usage (char **argv)
     printf("Options are:\n");
     printf("    -test-fast  Fast discovery mode, for testing.\n");
     printf("    -test-auto  automatic protocol selection, for testing\n");
+    printf("    -stats      probe found devices and print performance\n");
+    printf("                counters in JSON, instead of configuration,\n");
+    printf("                together with counters saved by backend\n");
     printf("    -d          enable debug mode\n");
     printf("    -t          enable protocol trace\n");
     printf("    -h          print help page\n");
@@ -55,6 +58,72 @@ die (const char *format, ...)
     exit(1);
 }
 
+/* Open and close all found devices, then return performance
+ * counters, collected while doing so, in JSON
+ */
+static char*
+probe_stats (const SANE_Device **devices)
+{
+    int  i;
+    char *json;
+
+    eloop_mutex_lock();
+
+    for (i = 0; devices[i] != NULL; i ++) {
+        SANE_Status status;
+        device      *dev = device_open(devices[i]->name, &status);
+
+        if (dev != NULL) {
+            device_close(dev, NULL);
+        }
+    }
+
+    json = metrics_json(str_new());
+
+    eloop_mutex_unlock();
+
+    return json;
+}
+
+/* Load performance counters, saved by backend into the metrics
+ * file, configured in airscan.conf. Returns NULL, if not available
+ */
+static char*
+load_saved_stats (void)
+{
+    char   *path = conf_metrics_file_lookup(), *json = NULL;
+    FILE   *fp;
+    char   buf[4096];
+    size_t sz;
+
+    if (path == NULL) {
+        return NULL;
+    }
+
+    fp = fopen(path, "r");
+    if (fp != NULL) {
+        json = str_new();
+        while ((sz = fread(buf, 1, sizeof(buf), fp)) != 0) {
+            json = str_append_mem(json, buf, sz);
+        }
+        fclose(fp);
+    }
+
+    mem_free(path);
+
+    return json;
+}
+
+/* Print performance counters, collected by probe_stats(), and
+ * saved by backend, if any
+ */
+static void
+print_stats (char *probe, char *saved)
+{
+    printf("{\n\"probe\": %s,\n\"saved\": %s\n}\n",
+        str_trim(probe), saved ? str_trim(saved) : "null");
+}
+
 /* The main function
  */
 int
@@ -62,6 +131,8 @@ main (int argc, char **argv)
 {
     int               i;
     const SANE_Device **devices;
+    bool              stats = false;
+    char              *probe = NULL, *saved = NULL;
 
     /* Enforce some configuration parameters */
     conf.proto_auto = false;
@@ -77,6 +148,10 @@ main (int argc, char **argv)
             conf.proto_auto = true;
         } else if (!strcmp(argv[i], "--test-auto")) {
             conf.proto_auto = true;
+        } else if (!strcmp(argv[i], "-stats")) {
+            stats = true;
+        } else if (!strcmp(argv[i], "--stats")) {
+            stats = true;
         } else if (!strcmp(argv[i], "-d")) {
             conf.dbg_enabled = true;
         } else if (!strcmp(argv[i], "-t")) {
@@ -90,6 +165,9 @@ main (int argc, char **argv)
 
     /* Initialize airscan */
     airscan_init(AIRSCAN_INIT_NO_CONF, NULL);
+    if (stats) {
+        device_management_init();
+    }
 
     /* Get list of devices */
     eloop_mutex_lock();
@@ -97,8 +175,11 @@ main (int argc, char **argv)
     eloop_mutex_unlock();
 
     /* Print list of devices */
-    printf("[devices]\n");
-    for (i = 0; devices[i] != NULL; i ++) {
+    if (!stats) {
+        printf("[devices]\n");
+    }
+
+    for (i = 0; !stats && devices[i] != NULL; i ++) {
         const SANE_Device *dev = devices[i];
         zeroconf_devinfo  *devinfo;
         zeroconf_endpoint *endpoint;
@@ -116,9 +197,25 @@ main (int argc, char **argv)
         zeroconf_devinfo_free(devinfo);
     }
 
+    /* Collect statistics */
+    if (stats) {
+        probe = probe_stats(devices);
+    }
+
     zeroconf_device_list_free(devices);
 
     eloop_thread_stop();
+    if (stats) {
+        device_management_cleanup();
+        saved = load_saved_stats();
+    }
+
+    /* Print statistics */
+    if (stats) {
+        print_stats(probe, saved);
+        mem_free(probe);
+        mem_free(saved);
+    }
     airscan_cleanup(NULL);
 
     return 0;
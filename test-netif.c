@@ -0,0 +1,333 @@
+/* Network interfaces addresses test
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ */
+
+#include "airscan.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#ifdef OS_HAVE_RTNETLINK
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
+
+static void
+fail (const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    putchar('\n');
+    exit(1);
+}
+
+/* Parse address. Returns address family
+ */
+static int
+parse_addr (const char *s, uint8_t ip[16])
+{
+    if (inet_pton(AF_INET, s, ip) == 1) {
+        return AF_INET;
+    }
+
+    if (inet_pton(AF_INET6, s, ip) == 1) {
+        return AF_INET6;
+    }
+
+    fail("bad address: %s", s);
+    return AF_UNSPEC;
+}
+
+/* Add interface address
+ */
+static void
+add (int ifindex, const char *ifname, const char *s, int prefixlen)
+{
+    uint8_t ip[16];
+    int     af = parse_addr(s, ip);
+
+    netif_test_add(ifindex, ifname, af, ip, prefixlen);
+}
+
+/* Test netif_distance_get
+ */
+static void
+test_distance (const char *s, NETIF_DISTANCE expected)
+{
+    struct sockaddr_storage addr;
+    uint8_t                 ip[16];
+    int                     af = parse_addr(s, ip);
+    NETIF_DISTANCE          distance;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.ss_family = af;
+    if (af == AF_INET) {
+        memcpy(&((struct sockaddr_in*) &addr)->sin_addr, ip, 4);
+    } else {
+        memcpy(&((struct sockaddr_in6*) &addr)->sin6_addr, ip, 16);
+    }
+
+    distance = netif_distance_get((struct sockaddr*) &addr);
+    if (distance != expected) {
+        fail("netif_distance_get(%s): %d != %d", s, distance, expected);
+    }
+}
+
+/* Test netif_ifindex_for_addr
+ */
+static void
+test_ifindex (const char *s, int expected)
+{
+    uint8_t ip[16];
+    int     af = parse_addr(s, ip);
+    int     ifindex = netif_ifindex_for_addr(af, ip);
+
+    if (ifindex != expected) {
+        fail("netif_ifindex_for_addr(%s): %d != %d", s, ifindex, expected);
+    }
+}
+
+/* Test count of addresses, returned by netif_addr_list_get
+ */
+static void
+test_count (size_t expected)
+{
+    netif_addr *list = netif_addr_list_get(), *addr;
+    size_t     count = 0;
+
+    for (addr = list; addr != NULL; addr = addr->next) {
+        count ++;
+    }
+
+    netif_addr_list_free(list);
+
+    if (count != expected) {
+        fail("netif_addr_list_get(): %zu addresses, expected %zu",
+            count, expected);
+    }
+}
+
+/* Test the prefix trie
+ */
+static void
+test_trie (void)
+{
+    netif_test_reset();
+
+    test_distance("192.168.1.10", NETIF_DISTANCE_ROUTED);
+    test_ifindex("192.168.1.10", 0);
+    test_count(0);
+
+    add(2, "eth0", "192.168.1.10", 24);
+    add(2, "eth0", "fe80::10", 64);
+    add(3, "eth1", "10.0.0.1", 8);
+    add(3, "eth1", "10.1.0.1", 16);
+
+    test_count(4);
+
+    test_distance("192.168.1.10", NETIF_DISTANCE_LOOPBACK);
+    test_distance("192.168.1.77", NETIF_DISTANCE_DIRECT);
+    test_distance("192.168.2.77", NETIF_DISTANCE_ROUTED);
+    test_distance("10.1.0.1", NETIF_DISTANCE_LOOPBACK);
+    test_distance("10.1.2.3", NETIF_DISTANCE_DIRECT);
+    test_distance("10.2.2.3", NETIF_DISTANCE_DIRECT);
+    test_distance("11.0.0.1", NETIF_DISTANCE_ROUTED);
+    test_distance("fe80::10", NETIF_DISTANCE_LOOPBACK);
+    test_distance("fe80::1:2", NETIF_DISTANCE_DIRECT);
+    test_distance("2001:db8::1", NETIF_DISTANCE_ROUTED);
+
+    test_ifindex("192.168.1.77", 2);
+    test_ifindex("10.2.2.3", 3);
+    test_ifindex("8.8.8.8", 2);
+    test_ifindex("fe80::1:2", 2);
+    test_ifindex("2001:db8::1", 2);
+
+    if (!netif_has_non_link_local_addr(AF_INET, 2) ||
+        netif_has_non_link_local_addr(AF_INET6, 2)) {
+        fail("netif_has_non_link_local_addr() failed");
+    }
+}
+
+#ifdef OS_HAVE_RTNETLINK
+/* Append RTM_NEWADDR/RTM_DELADDR message to the buffer
+ *
+ * If peer is not NULL, it is passed as IFA_ADDRESS, and address
+ * as IFA_LOCAL, like for the point-to-point interfaces
+ */
+static char*
+msg_append (char *buf, int type, int ifindex, const char *s, int prefixlen,
+        const char *peer)
+{
+    size_t           off = mem_len(buf);
+    uint8_t          ip[16], peer_ip[16];
+    int              af = parse_addr(s, ip);
+    size_t           iplen = af == AF_INET ? 4 : 16;
+    size_t           len;
+    struct nlmsghdr  *p;
+    struct ifaddrmsg *ifa;
+    struct rtattr    *rta;
+
+    len = NLMSG_SPACE(sizeof(*ifa)) + 2 * RTA_SPACE(iplen);
+    buf = mem_resize(buf, off + len, 0);
+    memset(buf + off, 0, len);
+
+    p = (struct nlmsghdr*) (buf + off);
+    p->nlmsg_type = type;
+    p->nlmsg_len = NLMSG_LENGTH(sizeof(*ifa));
+
+    ifa = NLMSG_DATA(p);
+    ifa->ifa_family = af;
+    ifa->ifa_prefixlen = prefixlen;
+    ifa->ifa_index = ifindex;
+
+    rta = (struct rtattr*) (((char*) p) + NLMSG_ALIGN(p->nlmsg_len));
+    rta->rta_type = peer ? IFA_LOCAL : IFA_ADDRESS;
+    rta->rta_len = RTA_LENGTH(iplen);
+    memcpy(RTA_DATA(rta), ip, iplen);
+    p->nlmsg_len = NLMSG_ALIGN(p->nlmsg_len) + RTA_SPACE(iplen);
+
+    if (peer != NULL) {
+        parse_addr(peer, peer_ip);
+        rta = (struct rtattr*) (((char*) p) + NLMSG_ALIGN(p->nlmsg_len));
+        rta->rta_type = IFA_ADDRESS;
+        rta->rta_len = RTA_LENGTH(iplen);
+        memcpy(RTA_DATA(rta), peer_ip, iplen);
+        p->nlmsg_len = NLMSG_ALIGN(p->nlmsg_len) + RTA_SPACE(iplen);
+    }
+
+    mem_shrink(buf, off + p->nlmsg_len);
+
+    return buf;
+}
+
+/* Apply block of messages and check result
+ */
+static void
+apply (char *buf, int expected)
+{
+    int rc = netif_test_rtnetlink(buf, mem_len(buf));
+
+    if (rc != expected) {
+        fail("netif_test_rtnetlink(): %d != %d", rc, expected);
+    }
+
+    mem_free(buf);
+}
+
+/* Apply single message and check result
+ */
+static void
+apply1 (int type, int ifindex, const char *s, int prefixlen, int expected)
+{
+    apply(msg_append(NULL, type, ifindex, s, prefixlen, NULL), expected);
+}
+
+/* Test incremental updates from rtnetlink messages
+ */
+static void
+test_rtnetlink (void)
+{
+    char *buf;
+
+    netif_test_reset();
+    add(2, "eth0", "192.168.1.10", 24);
+
+    /* Insert */
+    apply1(RTM_NEWADDR, 2, "10.1.0.5", 16, 1);
+    test_count(2);
+    test_distance("10.1.0.5", NETIF_DISTANCE_LOOPBACK);
+    test_distance("10.1.200.1", NETIF_DISTANCE_DIRECT);
+    test_distance("10.2.0.1", NETIF_DISTANCE_ROUTED);
+    test_ifindex("10.1.200.1", 2);
+
+    /* Lifetime update: nothing changes */
+    apply1(RTM_NEWADDR, 2, "10.1.0.5", 16, 0);
+
+    /* Prefix change */
+    apply1(RTM_NEWADDR, 2, "10.1.0.5", 8, 1);
+    test_count(2);
+    test_distance("10.2.0.1", NETIF_DISTANCE_DIRECT);
+
+    /* Address on unknown interface requires reload */
+    apply1(RTM_NEWADDR, 5, "172.16.0.1", 12, -1);
+    test_distance("172.16.0.2", NETIF_DISTANCE_ROUTED);
+
+    /* Several messages in a block */
+    buf = msg_append(NULL, RTM_NEWADDR, 2, "2001:db8::5", 64, NULL);
+    buf = msg_append(buf, RTM_NEWADDR, 2, "fe80::5", 64, NULL);
+    apply(buf, 1);
+    test_count(4);
+    test_distance("2001:db8::1", NETIF_DISTANCE_DIRECT);
+    test_distance("2001:db8::5", NETIF_DISTANCE_LOOPBACK);
+    test_ifindex("2001:db8::1", 2);
+    if (!netif_has_non_link_local_addr(AF_INET6, 2)) {
+        fail("netif_has_non_link_local_addr(AF_INET6) failed");
+    }
+
+    /* Changes before the reload request are still applied */
+    buf = msg_append(NULL, RTM_DELADDR, 2, "fe80::5", 64, NULL);
+    buf = msg_append(buf, RTM_NEWADDR, 7, "fe80::7", 64, NULL);
+    apply(buf, -1);
+    test_count(3);
+    test_distance("fe80::5", NETIF_DISTANCE_ROUTED);
+
+    /* Point-to-point: IFA_LOCAL is our address, IFA_ADDRESS is peer */
+    buf = msg_append(NULL, RTM_NEWADDR, 2, "10.9.9.1", 32, "10.9.9.9");
+    apply(buf, 1);
+    test_distance("10.9.9.1", NETIF_DISTANCE_LOOPBACK);
+    buf = msg_append(NULL, RTM_DELADDR, 2, "10.9.9.1", 32, "10.9.9.9");
+    apply(buf, 1);
+    test_count(3);
+
+    /* Remove */
+    apply1(RTM_DELADDR, 2, "192.168.1.10", 24, 1);
+    apply1(RTM_DELADDR, 2, "192.168.1.10", 24, 0);
+    test_count(2);
+    test_distance("192.168.1.10", NETIF_DISTANCE_ROUTED);
+    test_distance("192.168.1.77", NETIF_DISTANCE_ROUTED);
+    test_ifindex("10.2.0.1", 2);
+
+    /* Remove the last addresses of interface */
+    apply1(RTM_DELADDR, 2, "10.1.0.5", 8, 1);
+    test_ifindex("10.2.0.1", 0);
+    test_distance("10.1.0.5", NETIF_DISTANCE_ROUTED);
+    test_ifindex("2001:db8::1", 2);
+
+    apply1(RTM_DELADDR, 2, "2001:db8::5", 64, 1);
+    test_count(0);
+    test_distance("2001:db8::5", NETIF_DISTANCE_ROUTED);
+    test_ifindex("2001:db8::1", 0);
+    if (netif_has_non_link_local_addr(AF_INET6, 2)) {
+        fail("netif_has_non_link_local_addr() must fail");
+    }
+
+    /* Interface is not known anymore */
+    apply1(RTM_NEWADDR, 2, "10.1.0.5", 16, -1);
+    test_count(0);
+}
+#endif
+
+/* The main function
+ */
+int
+main (void)
+{
+    log_init();
+
+    test_trie();
+#ifdef OS_HAVE_RTNETLINK
+    test_rtnetlink();
+#endif
+
+    netif_cleanup();
+
+    return 0;
+}
+
+/* vim:ts=8:sw=4:et
+ */
@@ -0,0 +1,426 @@
+/* sane-airscan WSD eventing test
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * This test runs a stand-in WSD device, that accepts subscription,
+ * sends notifications and accepts unsubscription, and checks that
+ * notifications are delivered to the subscriber.
+ */
+
+#define _GNU_SOURCE
+#include "airscan.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/* Stand-in device I/O timeout, seconds
+ */
+#define STANDIN_TIMEOUT  5
+
+/* Subscription identifier, returned by stand-in device
+ */
+#define STANDIN_IDENTIFIER       \
+        "urn:uuid:2b61ee8a-3f5e-4c4d-9b2b-4d6f7a2f0a11"
+
+/* SubscribeResponse template. Parameters are: port
+ */
+static const char *standin_subscribe_response =
+    "<?xml version=\"1.0\"?>"
+    "<soap:Envelope xmlns:soap=\"http://www.w3.org/2003/05/soap-envelope\" xmlns:wsa=\"http://schemas.xmlsoap.org/ws/2004/08/addressing\" xmlns:wse=\"http://schemas.xmlsoap.org/ws/2004/08/eventing\">"
+      "<soap:Header>"
+        "<wsa:Action>http://schemas.xmlsoap.org/ws/2004/08/eventing/SubscribeResponse</wsa:Action>"
+      "</soap:Header>"
+      "<soap:Body>"
+        "<wse:SubscribeResponse>"
+          "<wse:SubscriptionManager>"
+            "<wsa:Address>http://127.0.0.1:%d/WSDScanner</wsa:Address>"
+            "<wsa:ReferenceParameters>"
+              "<wse:Identifier>" STANDIN_IDENTIFIER "</wse:Identifier>"
+            "</wsa:ReferenceParameters>"
+          "</wse:SubscriptionManager>"
+          "<wse:Expires>PT1H</wse:Expires>"
+        "</wse:SubscribeResponse>"
+      "</soap:Body>"
+    "</soap:Envelope>";
+
+/* JobStatusEvent notification
+ */
+static const char *standin_job_status_event =
+    "<?xml version=\"1.0\"?>"
+    "<soap:Envelope xmlns:soap=\"http://www.w3.org/2003/05/soap-envelope\" xmlns:wsa=\"http://schemas.xmlsoap.org/ws/2004/08/addressing\" xmlns:wscn=\"http://schemas.microsoft.com/windows/2006/08/wdp/scan\">"
+      "<soap:Header>"
+        "<wsa:Action>http://schemas.microsoft.com/windows/2006/08/wdp/scan/JobStatusEvent</wsa:Action>"
+        "<wsa:MessageID>urn:uuid:5b1d8a3c-8f0e-4f5b-a3c8-0b5a6a6f3b21</wsa:MessageID>"
+      "</soap:Header>"
+      "<soap:Body>"
+        "<wscn:JobStatusEvent>"
+          "<wscn:JobStatus>"
+            "<wscn:JobId>1</wscn:JobId>"
+            "<wscn:JobState>Processing</wscn:JobState>"
+          "</wscn:JobStatus>"
+        "</wscn:JobStatusEvent>"
+      "</soap:Body>"
+    "</soap:Envelope>";
+
+/* Test state
+ */
+static int             standin_port;
+static int             standin_sock = -1;
+static char            *received_event;
+static pthread_cond_t  received_cond = PTHREAD_COND_INITIALIZER;
+static bool            unsubscribed;
+
+/* Print error message and exit
+ */
+void __attribute__((noreturn))
+die (const char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    vprintf(format, ap);
+    printf("\n");
+    va_end(ap);
+
+    exit(1);
+}
+
+/* Set socket I/O timeout
+ */
+static void
+sock_set_timeout (int fd)
+{
+    struct timeval tv = {STANDIN_TIMEOUT, 0};
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/* Receive HTTP message (request or response). Returns the
+ * whole message, including headers
+ */
+static char*
+http_recv (int fd)
+{
+    char       *msg = str_new();
+    char       buf[4096];
+    const char *hdr_end, *clen;
+    size_t     need = 0;
+    ssize_t    rc;
+
+    for (;;) {
+        hdr_end = strstr(msg, "\r\n\r\n");
+        if (hdr_end != NULL && need == 0) {
+            clen = strcasestr(msg, "Content-Length:");
+            need = (hdr_end - msg) + 4;
+            if (clen != NULL && clen < hdr_end) {
+                need += strtoul(clen + strlen("Content-Length:"), NULL, 10);
+            }
+        }
+
+        if (need != 0 && mem_len(msg) >= need) {
+            return msg;
+        }
+
+        rc = recv(fd, buf, sizeof(buf), 0);
+        if (rc <= 0) {
+            die("device: recv(): %s", rc < 0 ? strerror(errno) : "EOF");
+        }
+
+        msg = str_append_mem(msg, buf, rc);
+    }
+}
+
+/* Send HTTP message
+ */
+static void
+http_send (int fd, const char *msg)
+{
+    ssize_t rc = send(fd, msg, strlen(msg), MSG_NOSIGNAL);
+
+    if (rc != (ssize_t) strlen(msg)) {
+        die("device: send(): %s", strerror(errno));
+    }
+}
+
+/* Accept next request to the stand-in device
+ */
+static char*
+standin_accept (int *fd)
+{
+    *fd = accept(standin_sock, NULL, NULL);
+    if (*fd < 0) {
+        die("device: accept(): %s", strerror(errno));
+    }
+
+    sock_set_timeout(*fd);
+
+    return http_recv(*fd);
+}
+
+/* Send SOAP reply to the request
+ */
+static void
+standin_reply (int fd, const char *body)
+{
+    char *reply = str_printf("HTTP/1.1 200 OK\r\n"
+        "Content-Type: application/soap+xml\r\n"
+        "Content-Length: %d\r\n"
+        "Connection: close\r\n"
+        "\r\n%s", (int) strlen(body), body);
+
+    http_send(fd, reply);
+    mem_free(reply);
+    close(fd);
+}
+
+/* Send notification to the subscriber. Returns HTTP status
+ */
+static int
+standin_notify (int port, const char *path, const char *body)
+{
+    struct sockaddr_in addr;
+    int                fd, rc, status;
+    char               *msg;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("device: socket(): %s", strerror(errno));
+    }
+
+    sock_set_timeout(fd);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    rc = connect(fd, (struct sockaddr*) &addr, sizeof(addr));
+    if (rc < 0) {
+        die("device: connect(): %s", strerror(errno));
+    }
+
+    msg = str_printf("POST %s HTTP/1.1\r\n"
+        "Host: 127.0.0.1:%d\r\n"
+        "Content-Type: application/soap+xml\r\n"
+        "Content-Length: %d\r\n"
+        "\r\n%s", path, port, (int) strlen(body), body);
+    http_send(fd, msg);
+    mem_free(msg);
+
+    msg = http_recv(fd);
+    close(fd);
+
+    if (sscanf(msg, "HTTP/1.1 %d", &status) != 1) {
+        die("device: invalid response to notification");
+    }
+
+    mem_free(msg);
+
+    return status;
+}
+
+/* Stand-in WSD device thread
+ */
+static void*
+standin_thread (void *arg)
+{
+    char       *rq, *notify_to, *path;
+    const char *s;
+    int        fd, port, status;
+    char       *reply;
+
+    (void) arg;
+
+    /* Accept Subscribe request */
+    rq = standin_accept(&fd);
+    if (strstr(rq, "eventing/Subscribe<") == NULL) {
+        die("device: Subscribe expected, got:\n%s", rq);
+    }
+
+    if (strstr(rq, "JobStatusEvent") == NULL) {
+        die("device: JobStatusEvent not subscribed to");
+    }
+
+    /* Extract NotifyTo address */
+    s = strstr(rq, "NotifyTo>");
+    s = s ? strstr(s, "http://") : NULL;
+    if (s == NULL) {
+        die("device: missed NotifyTo");
+    }
+
+    notify_to = str_dup(s);
+    *strchr(notify_to, '<') = '\0';
+    mem_free(rq);
+
+    path = strchr(notify_to + strlen("http://"), '/');
+    s = strrchr(notify_to, ':');
+    if (path == NULL || s == NULL || sscanf(s, ":%d/", &port) != 1) {
+        die("device: invalid NotifyTo: %s", notify_to);
+    }
+
+    /* Reply with SubscribeResponse */
+    reply = str_printf(standin_subscribe_response, standin_port);
+    standin_reply(fd, reply);
+    mem_free(reply);
+
+    /* Notification to unknown path must be rejected */
+    status = standin_notify(port, "/unknown", standin_job_status_event);
+    if (status != 404) {
+        die("device: notification to unknown path: status %d", status);
+    }
+
+    /* Send JobStatusEvent */
+    status = standin_notify(port, path, standin_job_status_event);
+    if (status != 202) {
+        die("device: notification: status %d", status);
+    }
+
+    mem_free(notify_to);
+
+    /* Accept Unsubscribe request */
+    rq = standin_accept(&fd);
+    if (strstr(rq, "eventing/Unsubscribe<") == NULL) {
+        die("device: Unsubscribe expected, got:\n%s", rq);
+    }
+
+    if (strstr(rq, STANDIN_IDENTIFIER) == NULL) {
+        die("device: Unsubscribe: missed Identifier");
+    }
+
+    mem_free(rq);
+    standin_reply(fd, "");
+
+    unsubscribed = true;
+
+    return NULL;
+}
+
+/* Start stand-in device
+ */
+static pthread_t
+standin_start (void)
+{
+    struct sockaddr_in addr;
+    socklen_t          len = sizeof(addr);
+    pthread_t          thread;
+    int                rc;
+
+    standin_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (standin_sock < 0) {
+        die("device: socket(): %s", strerror(errno));
+    }
+
+    sock_set_timeout(standin_sock);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    rc = bind(standin_sock, (struct sockaddr*) &addr, sizeof(addr));
+    if (rc == 0) {
+        rc = listen(standin_sock, 4);
+    }
+    if (rc == 0) {
+        rc = getsockname(standin_sock, (struct sockaddr*) &addr, &len);
+    }
+    if (rc < 0) {
+        die("device: %s", strerror(errno));
+    }
+
+    standin_port = ntohs(addr.sin_port);
+
+    rc = pthread_create(&thread, NULL, standin_thread, NULL);
+    if (rc != 0) {
+        die("device: pthread_create(): %s", strerror(rc));
+    }
+
+    return thread;
+}
+
+/* Events callback
+ */
+static void
+event_callback (void *data, const char *event)
+{
+    (void) data;
+
+    mem_free(received_event);
+    received_event = str_dup(event);
+    pthread_cond_broadcast(&received_cond);
+}
+
+/* The main function
+ */
+int
+main (void)
+{
+    pthread_t         thread;
+    log_ctx           *log;
+    http_uri          *uri;
+    char              *uri_str;
+    wsde_subscription *sub;
+
+    conf.dbg_enabled = true;
+    conf.wsd_events = true;
+    conf.discovery = false;
+
+    airscan_init(AIRSCAN_INIT_NO_CONF, "=== test-wsde ===");
+    log = log_ctx_new("test", NULL);
+
+    thread = standin_start();
+
+    uri_str = str_printf("http://127.0.0.1:%d/WSDScanner", standin_port);
+    uri = http_uri_new(uri_str, true);
+    mem_free(uri_str);
+
+    /* Subscribe and wait for event */
+    eloop_mutex_lock();
+
+    sub = wsde_subscribe(log, uri, event_callback, NULL);
+    if (sub == NULL) {
+        die("wsde_subscribe() failed");
+    }
+
+    while (received_event == NULL) {
+        eloop_cond_wait(&received_cond);
+    }
+
+    if (strcmp(received_event, "JobStatusEvent")) {
+        die("unexpected event: %s", received_event);
+    }
+
+    wsde_unsubscribe(sub);
+
+    eloop_mutex_unlock();
+
+    /* Wait for stand-in device to finish */
+    pthread_join(thread, NULL);
+    if (!unsubscribed) {
+        die("device: not unsubscribed");
+    }
+
+    close(standin_sock);
+    http_uri_free(uri);
+    mem_free(received_event);
+
+    log_ctx_free(log);
+    eloop_thread_stop();
+    airscan_cleanup(NULL);
+
+    printf("OK\n");
+
+    return 0;
+}
+
+/* vim:ts=8:sw=4:et
+ */
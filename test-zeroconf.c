@@ -222,6 +222,7 @@ parse_zeroconf_method (const inifile_record *rec)
         {"USCAN_TCP",  ZEROCONF_USCAN_TCP},
         {"USCANS_TCP", ZEROCONF_USCANS_TCP},
         {"WSD",        ZEROCONF_WSD},
+        {"SWEEP",      ZEROCONF_SWEEP},
         {NULL, 0}
     };
     int  i;
@@ -369,6 +370,7 @@ test_section_add_del (inifile *ini, const inifile_record *rec, bool add)
             switch (method) {
                 case ZEROCONF_USCAN_TCP:
                 case ZEROCONF_USCANS_TCP:
+                case ZEROCONF_SWEEP:
                     proto = ID_PROTO_ESCL;
                     break;
                 case ZEROCONF_WSD:
@@ -425,11 +427,11 @@ test_section_add_del (inifile *ini, const inifile_record *rec, bool add)
         die("%s:%d: missed method", section_file, section_line);
     }
 
-    if (method != ZEROCONF_WSD && name == NULL) {
+    if (method != ZEROCONF_WSD && method != ZEROCONF_SWEEP && name == NULL) {
         die("%s:%d: missed name", section_file, section_line);
     }
 
-    if (method == ZEROCONF_WSD && name != NULL) {
+    if ((method == ZEROCONF_WSD || method == ZEROCONF_SWEEP) && name != NULL) {
         mem_free(name);
         name = NULL;
     }